@@ -4,6 +4,14 @@
 # Adds an IP to the ipsec drop list (if aix)
 # Requirements: Linux with iptables, Solaris/FreeBSD/NetBSD with ipfilter or AIX with IPSec
 # Expect: srcip
+#
+# Batch mode ("firewall-drop.sh batch"): reads a line per operation on its
+# standard input, "<add|delete> <username> <ip> ...". On linux they are
+# applied with a single ipset restore (sets ossec-drop and ossec-drop6,
+# matched from INPUT and FORWARD) or, without ipset, a single
+# iptables-restore per address family. Other systems run them one by one.
+# The addresses blocked in batch mode with ipset are only unblocked in
+# batch mode.
 # Author: Ahmet Ozturk (ipfilter and IPSec)
 # Author: Daniel B. Cid (iptables)
 # Author: cgzones 
@@ -13,8 +21,9 @@ UNAME=`uname`
 ECHO="/bin/echo"
 GREP="/bin/grep"
 IPTABLES=""
-IP4TABLES="/sbin/iptables"
-IP6TABLES="/sbin/ip6tables"
+IP4TABLES=${IP4TABLES:-"/sbin/iptables"}
+IP6TABLES=${IP6TABLES:-"/sbin/ip6tables"}
+IPSET=${IPSET:-"/sbin/ipset"}
 IPFILTER="/sbin/ipf"
 if [ "X$UNAME" = "XSunOS" ]; then
     IPFILTER="/usr/sbin/ipf"
@@ -36,6 +45,7 @@ LOCK_PID="${PWD}/fw-drop/pid"
 
 LOCAL=`dirname $0`;
 cd $LOCAL
+SCRIPT="`pwd`/`basename $0`"
 cd ../
 filename=$(basename "$0")
 
@@ -45,16 +55,18 @@ echo "`date` $0 $1 $2 $3 $4 $5" >> ${LOG_FILE}
 
 
 # Checking for an IP
-if [ "x${IP}" = "x" ]; then
-   echo "$0: <action> <username> <ip>" 
-   exit 1;
-fi
+if [ "x${ACTION}" != "xbatch" ]; then
+   if [ "x${IP}" = "x" ]; then
+      echo "$0: <action> <username> <ip>"
+      exit 1;
+   fi
 
-case "${IP}" in
-    *:* ) IPTABLES=$IP6TABLES;;
-    *.* ) IPTABLES=$IP4TABLES;;
-    * ) echo "`date` Unable to run active response (invalid IP: '${IP}')." >> ${LOG_FILE} && exit 1;;
-esac
+   case "${IP}" in
+       *:* ) IPTABLES=$IP6TABLES;;
+       *.* ) IPTABLES=$IP4TABLES;;
+       * ) echo "`date` Unable to run active response (invalid IP: '${IP}')." >> ${LOG_FILE} && exit 1;;
+   esac
+fi
 
 # This number should be more than enough (even if a hundred
 # instances of this script is ran together). If you have
@@ -128,6 +140,158 @@ unlock()
    rm -rf ${LOCK} 
 }
 
+NL='
+'
+
+# Find iptables (or ip6tables) in /sbin or /usr/sbin
+find_iptables()
+{
+   if [ -x $1 ]; then
+      echo $1
+   elif [ -x /usr$1 ]; then
+      echo /usr$1
+   fi
+}
+
+# Apply the operations of an address family with ipset:
+# <iptables> <set> <family> <operations>
+batch_ipset()
+{
+   if [ "x$4" = "x" ]; then
+      return 0;
+   fi
+
+   {
+      echo "create $2 hash:net family $3"
+      echo "$4" | while read B_OP B_IP; do
+         if [ "x${B_OP}" = "xadd" ]; then
+            echo "add $2 ${B_IP}"
+         else
+            echo "del $2 ${B_IP}"
+         fi
+      done
+   } | ${IPSET} restore -exist || return 1
+
+   for CHAIN in INPUT FORWARD; do
+      $1 -C ${CHAIN} -m set --match-set $2 src -j DROP > /dev/null 2>&1 ||
+         $1 -I ${CHAIN} -m set --match-set $2 src -j DROP || return 1
+   done
+
+   return 0;
+}
+
+# Apply the operations of an address family with iptables-restore. The
+# rules already there (from iptables-save) are not added again, and the
+# ones missing are not deleted: <iptables> <mask> <operations>
+batch_iptables()
+{
+   if [ "x$3" = "x" ]; then
+      return 0;
+   fi
+
+   RULES="${NL}`$1-save -t filter 2>/dev/null`${NL}"
+
+   {
+      echo "*filter"
+      echo "$3" | while read B_OP B_IP; do
+         case "${B_IP}" in
+            */* ) R_IP=${B_IP};;
+            * ) R_IP="${B_IP}/$2";;
+         esac
+
+         for CHAIN in INPUT FORWARD; do
+            RULE="-A ${CHAIN} -s ${R_IP} -j DROP"
+            case "${RULES}" in
+               *"${NL}${RULE}${NL}"* ) PRESENT=1;;
+               * ) PRESENT=0;;
+            esac
+
+            if [ "x${B_OP}" = "xadd" -a "${PRESENT}" = "0" ]; then
+               echo "-I ${CHAIN} -s ${B_IP} -j DROP"
+               RULES="${RULES}${RULE}${NL}"
+            elif [ "x${B_OP}" = "xdelete" -a "${PRESENT}" = "1" ]; then
+               echo "-D ${CHAIN} -s ${R_IP} -j DROP"
+               RULES="${RULES%%"${NL}${RULE}${NL}"*}${NL}${RULES#*"${NL}${RULE}${NL}"}"
+            fi
+         done
+      done
+      echo "COMMIT"
+   } | $1-restore --noflush
+}
+
+# Batch of operations
+batch()
+{
+   NOW=`date`
+   OPS4=""
+   OPS6=""
+   RES=0
+
+   while read B_ACTION B_USER B_IP B_REST; do
+      echo "${NOW} $0 ${B_ACTION} ${B_USER} ${B_IP} ${B_REST}" >> ${LOG_FILE}
+
+      if [ "x${B_ACTION}" != "xadd" -a "x${B_ACTION}" != "xdelete" ]; then
+         echo "${NOW} Unable to run active response (invalid action: '${B_ACTION}')." >> ${LOG_FILE}
+         continue;
+      fi
+
+      case "${B_IP}" in
+         ""|*[!0-9a-fA-F.:/]* ) B_FAMILY="";;
+         *:* ) B_FAMILY=6;;
+         *.* ) B_FAMILY=4;;
+         * ) B_FAMILY="";;
+      esac
+
+      if [ "x${B_FAMILY}" = "x" ]; then
+         echo "${NOW} Unable to run active response (invalid IP: '${B_IP}')." >> ${LOG_FILE}
+         continue;
+      fi
+
+      # Other systems: one by one
+      if [ "X${UNAME}" != "XLinux" ]; then
+         ${SCRIPT} ${B_ACTION} ${B_USER} ${B_IP} ${B_REST}
+      elif [ "${B_FAMILY}" = "4" ]; then
+         OPS4="${OPS4}${OPS4:+${NL}}${B_ACTION} ${B_IP}"
+      else
+         OPS6="${OPS6}${OPS6:+${NL}}${B_ACTION} ${B_IP}"
+      fi
+   done
+
+   if [ "X${UNAME}" != "XLinux" ]; then
+      return 0;
+   fi
+
+   IP4TABLES=`find_iptables ${IP4TABLES}`
+   IP6TABLES=`find_iptables ${IP6TABLES}`
+
+   lock;
+
+   if [ "x${OPS4}" != "x" -a "x${IP4TABLES}" = "x" ]; then
+      echo "$0: can not find iptables"
+   elif [ ! -x "${IPSET}" ] || ! batch_ipset ${IP4TABLES} ossec-drop inet "${OPS4}"; then
+      batch_iptables ${IP4TABLES} 32 "${OPS4}" || RES=1
+   fi
+
+   if [ "x${OPS6}" != "x" -a "x${IP6TABLES}" = "x" ]; then
+      echo "$0: can not find ip6tables"
+   elif [ ! -x "${IPSET}" ] || ! batch_ipset ${IP6TABLES} ossec-drop6 inet6 "${OPS6}"; then
+      batch_iptables ${IP6TABLES} 128 "${OPS6}" || RES=1
+   fi
+
+   unlock;
+
+   if [ "${RES}" != "0" ]; then
+      echo "${NOW} Unable to run the batch (iptables-restore failed)." >> ${LOG_FILE}
+   fi
+
+   return ${RES};
+}
+
+if [ "x${ACTION}" = "xbatch" ]; then
+   batch;
+   exit $?;
+fi
+
 
 
 # Blocking IP
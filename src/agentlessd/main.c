@@ -156,6 +156,9 @@ int main(int argc, char **argv)
         ErrorExit(PID_ERROR, ARGV0);
     }
 
+    /* Metrics (served on the control socket) */
+    OS_StartMetrics();
+
     /* Start up message */
     verbose(STARTUP_MSG, ARGV0, (int)getpid());
 
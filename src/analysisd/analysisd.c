@@ -48,6 +48,7 @@
 /** Prototypes **/
 void OS_ReadMSG(int m_queue);
 RuleInfo *OS_CheckIfRuleMatch(Eventinfo *lf, RuleNode *curr_node);
+static RuleInfo *_OS_CheckRule(Eventinfo *lf, RuleNode *curr_node);
 static void LoopRule(RuleNode *curr_node, FILE *flog);
 
 /* For decoders */
@@ -59,6 +60,10 @@ int DecodeHostinfo(Eventinfo *lf);
 /* For stats */
 static void DumpLogstats(void);
 
+/* For profiling */
+static void DumpProfile(void);
+static void ControlHandler(const char *command, FILE *reply);
+
 /** Global definitions **/
 int today;
 int thishour;
@@ -80,6 +85,25 @@ static int hourly_alerts;
 static int hourly_events;
 static int hourly_syscheck;
 static int hourly_firewall;
+static int hourly_suppressed;
+
+/* Rule/decoder profiling (one of every profile_sample events) */
+static int profile_sample;
+static unsigned int profile_counter;
+static volatile int profile_reset;
+
+/* Queue of events (socket and shared memory ring) */
+static int event_queue = -1;
+
+/* Metrics */
+static os_metric *metric_events;
+static os_metric *metric_alerts;
+static os_metric *metric_suppressed;
+static os_metric *metric_decode;
+static os_metric *metric_rules;
+static long MetricQueueMessages(void);
+static long MetricQueueLoad(void);
+static long MetricQueueDropped(void);
 
 
 /* Print help statement */
@@ -131,6 +155,7 @@ int main_analysisd(int argc, char **argv)
     hourly_events = 0;
     hourly_syscheck = 0;
     hourly_firewall = 0;
+    hourly_suppressed = 0;
 
     while ((c = getopt(argc, argv, "Vtdhfu:g:D:c:")) != -1) {
         switch (c) {
@@ -558,6 +583,53 @@ void OS_ReadMSG_analysisd(int m_queue)
         exit(1);
     }
 
+    /* Initialize the diff state cache */
+    if (!DoDiff_Init()) {
+        ErrorExit("%s: ERROR: Unable to initialize the diff cache.", ARGV0);
+    }
+
+    /* Diff state writer (on a timer and on exit) */
+    if (!DoDiff_Start()) {
+        ErrorExit(THREAD_ERROR, ARGV0);
+    }
+
+    /* Rule and decoder profiling */
+    profile_sample = getDefine_Int("analysisd", "profile_sample", 0, 1000000);
+    if (profile_sample) {
+        verbose("%s: INFO: Profiling one of every %d events.", ARGV0, profile_sample);
+    }
+
+    /* Shared memory ring for the local daemons (the socket is kept) */
+    i = getDefine_Int("analysisd", "shm_queue_size", 0, 1048576);
+    if (i > 0) {
+        if (MQ_ShmCreate(m_queue, DEFAULTQUEUE, (size_t)i * 1024) < 0) {
+            merror("%s: WARN: Unable to create the shared memory queue. "
+                   "Using the socket only.", ARGV0);
+        }
+    }
+    event_queue = m_queue;
+
+    /* Metrics (served on the control socket) */
+    metric_events = OS_MetricCounter("analysisd_events_total", "Events received.");
+    metric_alerts = OS_MetricCounter("analysisd_alerts_total", "Alerts logged.");
+    metric_suppressed = OS_MetricCounter("analysisd_suppressed_total",
+                                         "Duplicated syslog events suppressed.");
+    metric_decode = OS_MetricHistogram("analysisd_decode_microseconds",
+                                       "Time to decode an event.");
+    metric_rules = OS_MetricHistogram("analysisd_rules_microseconds",
+                                      "Time to match an event against the rules (alert output included).");
+    OS_MetricGauge("analysisd_queue_messages", "Events waiting in the shared memory queue.",
+                   MetricQueueMessages);
+    OS_MetricGauge("analysisd_queue_load_percent", "Shared memory queue in use.",
+                   MetricQueueLoad);
+    OS_MetricGauge("analysisd_queue_dropped", "Events lost by the writers of the shared memory queue.",
+                   MetricQueueDropped);
+
+    /* Answer the control requests */
+    if (OS_StartControl(CONTROL_DIR "/" ARGV0, ControlHandler) < 0) {
+        merror("%s: ERROR: Unable to start the control socket.", ARGV0);
+    }
+
     /* Start the active response queues */
     if (Config.ar) {
         /* Waiting the ARQ to settle */
@@ -667,8 +739,9 @@ void OS_ReadMSG_analysisd(int m_queue)
         DEBUG_MSG("%s: DEBUG: Waiting for msgs - %d ", ARGV0, (int)time(0));
 
         /* Receive message from queue */
-        if ((i = OS_RecvUnix(m_queue, OS_MAXSTR, msg))) {
+        if ((i = RecvMSG(m_queue, msg, OS_MAXSTR))) {
             RuleNode *rulenode_pt;
+            unsigned long started;
 
             /* Get the time we received the event */
             c_time = time(NULL);
@@ -707,6 +780,7 @@ void OS_ReadMSG_analysisd(int m_queue)
                  * of alerts that each one fired
                  */
                 DumpLogstats();
+                DumpProfile();
                 thishour = __crt_hour;
 
                 /* Check if the date has changed */
@@ -727,10 +801,24 @@ void OS_ReadMSG_analysisd(int m_queue)
             }
 
 
+            /* Write back the changed diff entries */
+            DoDiff_Flush(0);
+
+            /* Sample the event for profiling */
+            if (profile_reset) {
+                OS_ProfileReset();
+                profile_reset = 0;
+            }
+            if (profile_sample) {
+                profile_event = (++profile_counter % (unsigned int)profile_sample) == 0;
+            }
+
             /* Increment number of events received */
             hourly_events++;
+            OS_MetricAdd(metric_events, 1);
 
             /***  Run decoders ***/
+            started = OS_MetricNow();
 
             /* Integrity check from syscheck */
             if (msg[0] == SYSCHECK_MQ) {
@@ -771,6 +859,8 @@ void OS_ReadMSG_analysisd(int m_queue)
                 DecodeEvent(lf);
             }
 
+            OS_MetricObserve(metric_decode, OS_MetricNow() - started);
+
             /* Run accumulator */
             if ( lf->decoder_info->accumulate == 1 ) {
                 lf = Accumulate(lf);
@@ -789,15 +879,15 @@ void OS_ReadMSG_analysisd(int m_queue)
                 }
             }
 
-            /* We only check if the last message is
-             * duplicated on syslog
+            /* We only check if the message was recently
+             * seen (duplicated) on syslog
              */
             else if (lf->decoder_info->type == SYSLOG) {
                 /* Check if the message is duplicated */
-                if (LastMsg_Stats(lf->full_log) == 1) {
+                if (LastMsg_Stats(lf->full_log, lf->location) == 1) {
+                    hourly_suppressed++;
+                    OS_MetricAdd(metric_suppressed, 1);
                     goto CLMEM;
-                } else {
-                    LastMsg_Change(lf->full_log);
                 }
             }
 
@@ -839,6 +929,7 @@ void OS_ReadMSG_analysisd(int m_queue)
                       ARGV0, lf->decoder_info->type);
 
             /* Loop over all the rules */
+            started = OS_MetricNow();
             rulenode_pt = OS_GetFirstRule();
             if (!rulenode_pt) {
                 ErrorExit("%s: Rules in an inconsistent state. Exiting.",
@@ -906,6 +997,7 @@ void OS_ReadMSG_analysisd(int m_queue)
 
                 /* Log the alert if configured to */
                 if (currently_rule->alert_opts & DO_LOGALERT) {
+                    OS_MetricAdd(metric_alerts, 1);
                     __crt_ftell = ftell(_aflog);
 
                     if (Config.custom_alert_output) {
@@ -1012,6 +1104,8 @@ void OS_ReadMSG_analysisd(int m_queue)
 
             } while ((rulenode_pt = rulenode_pt->next) != NULL);
 
+            OS_MetricObserve(metric_rules, OS_MetricNow() - started);
+
             /* If configured to log all, do it */
             if (Config.logall) {
                 OS_Store(lf);
@@ -1035,6 +1129,33 @@ CLMEM:
 
 /* Checks if the current_rule matches the event information */
 RuleInfo *OS_CheckIfRuleMatch(Eventinfo *lf, RuleNode *curr_node)
+{
+    RuleInfo *rule;
+    u_int64_t start;
+    u_int64_t elapsed;
+    u_int64_t child_nsecs;
+
+    if (!profile_event || !curr_node->ruleinfo) {
+        return (_OS_CheckRule(lf, curr_node));
+    }
+
+    /* Time spent on the children is accounted to them */
+    child_nsecs = profile_child_nsecs;
+    profile_child_nsecs = 0;
+
+    start = OS_ProfileNow();
+    rule = _OS_CheckRule(lf, curr_node);
+    elapsed = OS_ProfileNow() - start;
+
+    curr_node->ruleinfo->profile.evals++;
+    curr_node->ruleinfo->profile.nsecs += elapsed - profile_child_nsecs;
+    profile_child_nsecs = child_nsecs + elapsed;
+
+    return (rule);
+}
+
+/* Evaluate the current_rule (and its children) against the event */
+static RuleInfo *_OS_CheckRule(Eventinfo *lf, RuleNode *curr_node)
 {
     /* We check for:
      * decoded_as,
@@ -1417,6 +1538,10 @@ RuleInfo *OS_CheckIfRuleMatch(Eventinfo *lf, RuleNode *curr_node)
     }
 #endif
 
+    if (profile_event) {
+        rule->profile.matches++;
+    }
+
     /* Search for dependent rules */
     if (curr_node->child) {
         RuleNode *child_node = curr_node->child;
@@ -1524,14 +1649,87 @@ static void DumpLogstats()
 
 
     /* Print total for the hour */
-    fprintf(flog, "%d--%d--%d--%d--%d\n\n",
+    fprintf(flog, "%d--%d--%d--%d--%d--%d\n\n",
             thishour,
-            hourly_alerts, hourly_events, hourly_syscheck, hourly_firewall);
+            hourly_alerts, hourly_events, hourly_syscheck, hourly_firewall,
+            hourly_suppressed);
     hourly_alerts = 0;
     hourly_events = 0;
     hourly_syscheck = 0;
     hourly_firewall = 0;
+    hourly_suppressed = 0;
 
     fclose(flog);
 }
 
+/* Write the cumulative profiling counters */
+static void DumpProfile()
+{
+    FILE *fp;
+
+    if (!profile_sample) {
+        return;
+    }
+
+    fp = fopen(STATPROFILE, "w");
+    if (!fp) {
+        merror(FOPEN_ERROR, ARGV0, STATPROFILE, errno, strerror(errno));
+        return;
+    }
+
+    fprintf(fp, "# %s profile at %s", ARGV0, ctime(&c_time));
+    fprintf(fp, "# One of every %d events sampled.\n", profile_sample);
+    OS_ProfileReport(fp, 0);
+    fclose(fp);
+}
+
+/* Control socket requests */
+/* Gauges of the shared memory queue */
+static long MetricQueueMessages()
+{
+    mq_shm_status status;
+
+    return (MQ_ShmStatus(event_queue, &status) < 0 ? 0 : (long)status.messages);
+}
+
+static long MetricQueueLoad()
+{
+    int load = MQ_ShmLoad(event_queue);
+
+    return (load < 0 ? 0 : load);
+}
+
+static long MetricQueueDropped()
+{
+    mq_shm_status status;
+
+    return (MQ_ShmStatus(event_queue, &status) < 0 ? 0 : (long)status.dropped);
+}
+
+static void ControlHandler(const char *command, FILE *reply)
+{
+    if (strcmp(command, "profile") == 0) {
+        if (!profile_sample) {
+            fprintf(reply, "Profiling disabled (analysisd.profile_sample).\n");
+            return;
+        }
+        fprintf(reply, "# One of every %d events sampled.\n", profile_sample);
+        OS_ProfileReport(reply, 0);
+    } else if (strcmp(command, "profile reset") == 0) {
+        profile_reset = 1;
+        fprintf(reply, "ok\n");
+    } else if (strcmp(command, "queue") == 0) {
+        mq_shm_status status;
+
+        if (MQ_ShmStatus(event_queue, &status) < 0) {
+            fprintf(reply, "Shared memory queue disabled (analysisd.shm_queue_size).\n");
+            return;
+        }
+        fprintf(reply, "size=%lu\nused=%lu\nload=%d%%\nmessages=%lu\ntotal=%lu\nfull=%lu\ndropped=%lu\n",
+                (unsigned long)status.size, (unsigned long)status.used,
+                MQ_ShmLoad(event_queue), status.messages,
+                status.total, status.full, status.dropped);
+    } else {
+        fprintf(reply, "ERROR: Unknown command '%s'.\n", command);
+    }
+}
@@ -14,10 +14,12 @@
 #include "decoder.h"
 
 
-/* Use the osdecoders to decode the received event */
-void DecodeEvent(Eventinfo *lf)
+/* Try one osdecoder (and its children) on the received event
+ * Returns 0 if it did not match and the next one should be tried,
+ * or 1 if the event was handled by it.
+ */
+static int _DecodeNode(Eventinfo *lf, OSDecoderNode *node)
 {
-    OSDecoderNode *node;
     OSDecoderNode *child_node;
     OSDecoderInfo *nnode;
 
@@ -26,196 +28,223 @@ void DecodeEvent(Eventinfo *lf)
     const char *cmatch = NULL;
     const char *regex_prev = NULL;
 
-    node = OS_GetFirstOSDecoder(lf->program_name);
-
-    if (!node) {
-        return;
-    }
+    nnode = node->osdecoder;
 
-#ifdef TESTRULE
-    if (!alert_only) {
-        print_out("\n**Phase 2: Completed decoding.");
+    /* First check program name */
+    if (lf->program_name) {
+        if (!OSMatch_Execute(lf->program_name, lf->p_name_size,
+                             nnode->program_name)) {
+            return (0);
+        }
+        pmatch = lf->log;
     }
-#endif
 
-    do {
-        nnode = node->osdecoder;
-
-        /* First check program name */
-        if (lf->program_name) {
-            if (!OSMatch_Execute(lf->program_name, lf->p_name_size,
-                                 nnode->program_name)) {
-                continue;
-            }
-            pmatch = lf->log;
+    /* If prematch fails, go to the next osdecoder in the list */
+    if (nnode->prematch) {
+        if (!(pmatch = OSRegex_Execute(lf->log, nnode->prematch))) {
+            return (0);
         }
 
-        /* If prematch fails, go to the next osdecoder in the list */
-        if (nnode->prematch) {
-            if (!(pmatch = OSRegex_Execute(lf->log, nnode->prematch))) {
-                continue;
-            }
-
-            /* Next character */
-            if (*pmatch != '\0') {
-                pmatch++;
-            }
+        /* Next character */
+        if (*pmatch != '\0') {
+            pmatch++;
         }
+    }
 
 #ifdef TESTRULE
-        if (!alert_only) {
-            print_out("       decoder: '%s'", nnode->name);
-        }
+    if (!alert_only) {
+        print_out("       decoder: '%s'", nnode->name);
+    }
 #endif
 
-        lf->decoder_info = nnode;
-        child_node = node->child;
+    lf->decoder_info = nnode;
+    child_node = node->child;
 
-        /* If no child node is set, set the child node
-         * as if it were the child (ugh)
-         */
-        if (!child_node) {
-            child_node = node;
-        }
-
-        else {
-            /* Check if we have any child osdecoder */
-            while (child_node) {
-                nnode = child_node->osdecoder;
+    /* If no child node is set, set the child node
+     * as if it were the child (ugh)
+     */
+    if (!child_node) {
+        child_node = node;
+    }
 
-                /* If we have a pre match and it matches, keep
-                 * going. If we don't have a prematch, stop
-                 * and go for the regexes.
-                 */
-                if (nnode->prematch) {
-                    const char *llog2;
+    else {
+        /* Check if we have any child osdecoder */
+        while (child_node) {
+            nnode = child_node->osdecoder;
+
+            /* If we have a pre match and it matches, keep
+             * going. If we don't have a prematch, stop
+             * and go for the regexes.
+             */
+            if (nnode->prematch) {
+                const char *llog2;
+
+                /* If we have an offset set, use it */
+                if (nnode->prematch_offset & AFTER_PARENT) {
+                    llog2 = pmatch;
+                } else {
+                    llog2 = lf->log;
+                }
 
-                    /* If we have an offset set, use it */
-                    if (nnode->prematch_offset & AFTER_PARENT) {
-                        llog2 = pmatch;
-                    } else {
-                        llog2 = lf->log;
+                if ((cmatch = OSRegex_Execute(llog2, nnode->prematch))) {
+                    if (*cmatch != '\0') {
+                        cmatch++;
                     }
 
-                    if ((cmatch = OSRegex_Execute(llog2, nnode->prematch))) {
-                        if (*cmatch != '\0') {
-                            cmatch++;
-                        }
+                    lf->decoder_info = nnode;
 
-                        lf->decoder_info = nnode;
-
-                        break;
-                    }
-                } else {
-                    cmatch = pmatch;
                     break;
                 }
+            } else {
+                cmatch = pmatch;
+                break;
+            }
 
-                /* If we have multiple regex-only childs,
-                 * do not attempt to go any further with them.
-                 */
-                if (child_node->osdecoder->get_next) {
-                    do {
-                        child_node = child_node->next;
-                    } while (child_node && child_node->osdecoder->get_next);
-
-                    if (!child_node) {
-                        return;
-                    }
-
-                    child_node = child_node->next;
-                    nnode = NULL;
-                } else {
+            /* If we have multiple regex-only childs,
+             * do not attempt to go any further with them.
+             */
+            if (child_node->osdecoder->get_next) {
+                do {
                     child_node = child_node->next;
-                    nnode = NULL;
+                } while (child_node && child_node->osdecoder->get_next);
+
+                if (!child_node) {
+                    return (1);
                 }
+
+                child_node = child_node->next;
+                nnode = NULL;
+            } else {
+                child_node = child_node->next;
+                nnode = NULL;
             }
         }
+    }
 
-        /* Nothing matched */
-        if (!nnode) {
-            return;
-        }
+    /* Nothing matched */
+    if (!nnode) {
+        return (1);
+    }
 
-        /* If we have an external decoder, execute it */
-        if (nnode->plugindecoder) {
-            nnode->plugindecoder(lf);
-            return;
-        }
+    /* If we have an external decoder, execute it */
+    if (nnode->plugindecoder) {
+        nnode->plugindecoder(lf);
+        return (1);
+    }
 
-        /* Get the regex */
-        while (child_node) {
-            if (nnode->regex) {
-                int i = 0;
-
-                /* With regex we have multiple options
-                 * regarding the offset:
-                 * after the prematch,
-                 * after the parent,
-                 * after some previous regex,
-                 * or any offset
-                 */
-                if (nnode->regex_offset) {
-                    if (nnode->regex_offset & AFTER_PARENT) {
-                        llog = pmatch;
-                    } else if (nnode->regex_offset & AFTER_PREMATCH) {
+    /* Get the regex */
+    while (child_node) {
+        if (nnode->regex) {
+            int i = 0;
+
+            /* With regex we have multiple options
+             * regarding the offset:
+             * after the prematch,
+             * after the parent,
+             * after some previous regex,
+             * or any offset
+             */
+            if (nnode->regex_offset) {
+                if (nnode->regex_offset & AFTER_PARENT) {
+                    llog = pmatch;
+                } else if (nnode->regex_offset & AFTER_PREMATCH) {
+                    llog = cmatch;
+                } else if (nnode->regex_offset & AFTER_PREVREGEX) {
+                    if (!regex_prev) {
                         llog = cmatch;
-                    } else if (nnode->regex_offset & AFTER_PREVREGEX) {
-                        if (!regex_prev) {
-                            llog = cmatch;
-                        } else {
-                            llog = regex_prev;
-                        }
-                    }
-                } else {
-                    llog = lf->log;
-                }
-
-                /* If Regex does not match, return */
-                if (!(regex_prev = OSRegex_Execute(llog, nnode->regex))) {
-                    if (nnode->get_next) {
-                        child_node = child_node->next;
-                        nnode = child_node->osdecoder;
-                        continue;
+                    } else {
+                        llog = regex_prev;
                     }
-                    return;
                 }
+            } else {
+                llog = lf->log;
+            }
 
-                /* Fix next pointer */
-                if (*regex_prev != '\0') {
-                    regex_prev++;
+            /* If Regex does not match, return */
+            if (!(regex_prev = OSRegex_Execute(llog, nnode->regex))) {
+                if (nnode->get_next) {
+                    child_node = child_node->next;
+                    nnode = child_node->osdecoder;
+                    continue;
                 }
+                return (1);
+            }
 
-                while (nnode->regex->sub_strings[i]) {
-                    if (nnode->order[i]) {
-                        nnode->order[i](lf, nnode->regex->sub_strings[i]);
-                        nnode->regex->sub_strings[i] = NULL;
-                        i++;
-                        continue;
-                    }
+            /* Fix next pointer */
+            if (*regex_prev != '\0') {
+                regex_prev++;
+            }
 
-                    /* We do not free any memory used above */
-                    os_free(nnode->regex->sub_strings[i]);
+            while (nnode->regex->sub_strings[i]) {
+                if (nnode->order[i]) {
+                    nnode->order[i](lf, nnode->regex->sub_strings[i]);
                     nnode->regex->sub_strings[i] = NULL;
                     i++;
-                }
-
-                /* If we have a next regex, try getting it */
-                if (nnode->get_next) {
-                    child_node = child_node->next;
-                    nnode = child_node->osdecoder;
                     continue;
                 }
 
-                break;
+                /* We do not free any memory used above */
+                os_free(nnode->regex->sub_strings[i]);
+                nnode->regex->sub_strings[i] = NULL;
+                i++;
             }
 
-            /* If we don't have a regex, we may leave now */
-            return;
+            /* If we have a next regex, try getting it */
+            if (nnode->get_next) {
+                child_node = child_node->next;
+                nnode = child_node->osdecoder;
+                continue;
+            }
+
+            break;
         }
 
-        /* ok to return  */
+        /* If we don't have a regex, we may leave now */
+        return (1);
+    }
+
+    /* ok to return  */
+    return (1);
+}
+
+/* Use the osdecoders to decode the received event */
+void DecodeEvent(Eventinfo *lf)
+{
+    OSDecoderNode *node;
+    OSDecoderInfo *nnode;
+    u_int64_t start = 0;
+    int done;
+
+    node = OS_GetFirstOSDecoder(lf->program_name);
+
+    if (!node) {
         return;
+    }
+
+#ifdef TESTRULE
+    if (!alert_only) {
+        print_out("\n**Phase 2: Completed decoding.");
+    }
+#endif
+
+    do {
+        nnode = node->osdecoder;
+
+        if (profile_event) {
+            start = OS_ProfileNow();
+        }
+
+        done = _DecodeNode(lf, node);
+
+        if (profile_event) {
+            nnode->profile.evals++;
+            nnode->profile.matches += (unsigned long)done;
+            nnode->profile.nsecs += OS_ProfileNow() - start;
+        }
+
+        if (done) {
+            return;
+        }
     } while ((node = node->next) != NULL);
 
 #ifdef TESTRULE
@@ -12,6 +12,7 @@
 
 #include "shared.h"
 #include "os_regex/os_regex.h"
+#include "profile.h"
 
 #define AFTER_PARENT    0x001   /* 1   */
 #define AFTER_PREMATCH  0x002   /* 2   */
@@ -40,6 +41,9 @@ typedef struct {
 
     void (*plugindecoder)(void *lf);
     void (**order)(void *lf, char *field);
+
+    /* Evaluation cost (not an user option) */
+    OSProfile profile;
 } OSDecoderInfo;
 
 /* List structure */
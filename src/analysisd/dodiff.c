@@ -7,9 +7,36 @@
  * Foundation.
  */
 
+#include <pthread.h>
+#include <signal.h>
+
 #include "dodiff.h"
 
 #include "shared.h"
+#include "analysisd.h"
+
+/* Last content seen for each (agent, rule), kept in memory and
+ * written back to DIFF_DIR in batches.
+ */
+typedef struct _DiffEntry {
+    char *file;
+    char *content;
+    char *prev;
+    size_t size;
+    u_int64_t digest;
+    int dirty;
+    struct _DiffEntry *next_dirty;
+} DiffEntry;
+
+static OSHash *diff_store = NULL;
+static DiffEntry *diff_dirty = NULL;
+static time_t diff_flush_ts = 0;
+static int diff_flush_interval = 0;
+
+/* The entries are written back by the event loop and by DoDiff_Thread */
+static pthread_mutex_t diff_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void *DoDiff_Thread(void *none) __attribute__((noreturn));
 
 static int _add2last(const char *str, size_t strsize, const char *file)
 {
@@ -66,16 +93,164 @@ static int _add2last(const char *str, size_t strsize, const char *file)
     return (1);
 }
 
+/* Start the diff state cache */
+int DoDiff_Init()
+{
+    diff_store = OSHash_Create();
+    if (!diff_store) {
+        merror(LIST_ERROR, ARGV0);
+        return (0);
+    }
+    if (!OSHash_setSize(diff_store, 2048)) {
+        merror(LIST_ERROR, ARGV0);
+        return (0);
+    }
+
+    /* Seconds between writes of the changed entries (0 to write at once) */
+    diff_flush_interval = getDefine_Int("analysisd",
+                                        "diff_flush_interval",
+                                        0, 3600);
+    diff_dirty = NULL;
+    diff_flush_ts = time(NULL);
+
+    debug1("%s: DEBUG: Diff cache Init completed.", ARGV0);
+    return (1);
+}
+
+/* Write the changed entries back to disk, if diff_flush_interval is
+ * over (or if force is set)
+ */
+void DoDiff_Flush(int force)
+{
+    DiffEntry *entry;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&diff_mutex);
+
+    if (!diff_dirty || (!force && (now - diff_flush_ts) < diff_flush_interval)) {
+        pthread_mutex_unlock(&diff_mutex);
+        return;
+    }
+    diff_flush_ts = now;
+
+    while (diff_dirty) {
+        entry = diff_dirty;
+        diff_dirty = entry->next_dirty;
+
+        entry->next_dirty = NULL;
+        entry->dirty = 0;
+
+        if (!_add2last(entry->content, entry->size, entry->file)) {
+            merror("%s: ERROR: unable to create last file: %s", ARGV0, entry->file);
+        }
+    }
+
+    pthread_mutex_unlock(&diff_mutex);
+}
+
+/* Write the entries back when the events stop, and before exiting on
+ * a signal. It is the only thread taking the termination signals.
+ */
+static void *DoDiff_Thread(__attribute__((unused)) void *none)
+{
+    sigset_t signals;
+    struct timespec wait;
+    int sig;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGQUIT);
+    sigaddset(&signals, SIGTERM);
+
+    wait.tv_sec = diff_flush_interval > 0 ? diff_flush_interval : 1;
+    wait.tv_nsec = 0;
+
+    while (1) {
+        if ((sig = sigtimedwait(&signals, NULL, &wait)) > 0) {
+            DoDiff_Flush(1);
+            HandleSIG(sig);
+        }
+
+        DoDiff_Flush(0);
+    }
+}
+
+/* Start the writer thread. The termination signals are blocked in the
+ * calling thread (and in the threads it starts later), so it must be
+ * called before any other thread is started.
+ */
+int DoDiff_Start()
+{
+    sigset_t signals;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGQUIT);
+    sigaddset(&signals, SIGTERM);
+
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) {
+        return (0);
+    }
+
+    if (CreateThread(DoDiff_Thread, (void *)NULL) != 0) {
+        pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+        return (0);
+    }
+
+    return (1);
+}
+
+/* Read the last content saved on disk (only on the first lookup) */
+static DiffEntry *_loadlast(const char *file)
+{
+    DiffEntry *entry;
+    FILE *fp;
+    char flastcontent[OS_SIZE_8192 + 1];
+    size_t n = 0;
+
+    os_calloc(1, sizeof(DiffEntry), entry);
+    os_strdup(file, entry->file);
+
+    if (File_DateofChange(file) > 0) {
+        fp = fopen(file, "r");
+        if (!fp) {
+            merror(FOPEN_ERROR, ARGV0, file, errno, strerror(errno));
+        } else {
+            n = fread(flastcontent, 1, OS_SIZE_8192, fp);
+            if (n == 0) {
+                merror("%s: ERROR: read error on %s", ARGV0, file);
+            }
+            fclose(fp);
+        }
+    }
+
+    if (n > 0) {
+        flastcontent[n] = '\0';
+        n = strlen(flastcontent);
+        os_strdup(flastcontent, entry->content);
+        entry->size = n;
+        entry->digest = OSHash_Hash64(entry->content, n, OS_HASH64_INIT);
+    }
+
+    if (OSHash_Add(diff_store, entry->file, entry) != 2) {
+        merror(LIST_ADD_ERROR, ARGV0);
+        free(entry->content);
+        free(entry->file);
+        free(entry);
+        return (NULL);
+    }
+
+    return (entry);
+}
+
 int doDiff(RuleInfo *rule, const Eventinfo *lf)
 {
-    time_t date_of_change;
+    DiffEntry *entry;
+    u_int64_t digest;
     char *htpt = NULL;
     char flastfile[OS_SIZE_2048 + 1];
-    char flastcontent[OS_SIZE_8192 + 1];
 
     /* Clean up global */
-    flastcontent[0] = '\0';
-    flastcontent[OS_SIZE_8192] = '\0';
     rule->last_events[0] = NULL;
 
     if (lf->hostname[0] == '(') {
@@ -101,45 +276,50 @@ int doDiff(RuleInfo *rule, const Eventinfo *lf)
         return (0);
     }
 
-    /* Check if last diff exists */
-    date_of_change = File_DateofChange(flastfile);
-    if (date_of_change <= 0) {
-        if (!_add2last(lf->log, lf->size, flastfile)) {
-            merror("%s: ERROR: unable to create last file: %s", ARGV0, flastfile);
-            return (0);
-        }
-        return (0);
-    } else {
-        FILE *fp;
-        size_t n;
-        fp = fopen(flastfile, "r");
-        if (!fp) {
-            merror(FOPEN_ERROR, ARGV0, flastfile, errno, strerror(errno));
-            return (0);
-        }
+    digest = OSHash_Hash64(lf->log, (size_t)lf->size, OS_HASH64_INIT);
 
-        n = fread(flastcontent, 1, OS_SIZE_8192, fp);
-        if (n > 0) {
-            flastcontent[n] = '\0';
-        } else {
-            merror("%s: ERROR: read error on %s", ARGV0, flastfile);
-            fclose(fp);
+    pthread_mutex_lock(&diff_mutex);
+
+    /* Get the last content, from disk if not seen since we started */
+    entry = (DiffEntry *)OSHash_Get(diff_store, flastfile);
+    if (!entry) {
+        entry = _loadlast(flastfile);
+        if (!entry) {
+            pthread_mutex_unlock(&diff_mutex);
             return (0);
         }
-        fclose(fp);
     }
 
     /* Nothing changed */
-    if (strcmp(flastcontent, lf->log) == 0) {
+    if (entry->content &&
+            entry->size == (size_t)lf->size &&
+            entry->digest == digest &&
+            strcmp(entry->content, lf->log) == 0) {
+        pthread_mutex_unlock(&diff_mutex);
         return (0);
     }
 
-    if (!_add2last(lf->log, lf->size, flastfile)) {
-        merror("%s: ERROR: unable to create last file: %s", ARGV0, flastfile);
+    /* Keep the previous output around for the alert */
+    free(entry->prev);
+    entry->prev = entry->content;
+    os_strdup(lf->log, entry->content);
+    entry->size = (size_t)lf->size;
+    entry->digest = digest;
+
+    if (!entry->dirty) {
+        entry->dirty = 1;
+        entry->next_dirty = diff_dirty;
+        diff_dirty = entry;
+    }
+
+    pthread_mutex_unlock(&diff_mutex);
+
+    /* First time seen, only save it */
+    if (!entry->prev) {
+        return (0);
     }
 
     rule->last_events[0] = "Previous output:";
-    rule->last_events[1] = flastcontent;
+    rule->last_events[1] = entry->prev;
     return (1);
 }
-
@@ -13,6 +13,9 @@
 #include "rules.h"
 #include "eventinfo.h"
 
+int DoDiff_Init(void);
+int DoDiff_Start(void);
+void DoDiff_Flush(int force);
 int doDiff(RuleInfo *rule, const Eventinfo *lf);
 
 
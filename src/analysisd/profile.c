@@ -0,0 +1,196 @@
+/* Copyright (C) 2015 Trend Micro Inc.
+ * All rights reserved.
+ *
+ * This program is a free software; you can redistribute it
+ * and/or modify it under the terms of the GNU General Public
+ * License (version 2) as published by the FSF - Free Software
+ * Foundation.
+ */
+
+/* Rule and decoder cost profiling */
+
+#include "shared.h"
+#include "profile.h"
+#include "rules.h"
+#include "decoders/decoder.h"
+
+int profile_event = 0;
+u_int64_t profile_child_nsecs = 0;
+
+
+/* Get the current monotonic time (in nanoseconds) */
+u_int64_t OS_ProfileNow()
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        return ((u_int64_t)ts.tv_sec * 1000000000ULL + (u_int64_t)ts.tv_nsec);
+    }
+#endif
+    {
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return ((u_int64_t)tv.tv_sec * 1000000000ULL + (u_int64_t)tv.tv_usec * 1000ULL);
+    }
+}
+
+/* Sort helpers (most expensive first) */
+static int _profile_cmprule(const void *a, const void *b)
+{
+    u_int64_t ta = (*(RuleInfo * const *)a)->profile.nsecs;
+    u_int64_t tb = (*(RuleInfo * const *)b)->profile.nsecs;
+
+    return ((ta < tb) - (ta > tb));
+}
+
+static int _profile_cmpdecoder(const void *a, const void *b)
+{
+    u_int64_t ta = (*(OSDecoderInfo * const *)a)->profile.nsecs;
+    u_int64_t tb = (*(OSDecoderInfo * const *)b)->profile.nsecs;
+
+    return ((ta < tb) - (ta > tb));
+}
+
+/* Collect every rule (and its children). If "evaluated" is set,
+ * only the ones with samples are returned.
+ */
+static void _profile_rules(RuleNode *node, int evaluated, RuleInfo ***rules, size_t *count, size_t *size)
+{
+    while (node) {
+        if (node->ruleinfo && (!evaluated || node->ruleinfo->profile.evals)) {
+            if (*count == *size) {
+                *size = *size ? *size * 2 : 256;
+                os_realloc(*rules, *size * sizeof(RuleInfo *), *rules);
+            }
+            (*rules)[(*count)++] = node->ruleinfo;
+        }
+
+        if (node->child) {
+            _profile_rules(node->child, evaluated, rules, count, size);
+        }
+        node = node->next;
+    }
+}
+
+/* Collect every decoder */
+static void _profile_decoders(OSDecoderNode *node, int evaluated, OSDecoderInfo ***decoders, size_t *count, size_t *size)
+{
+    for (; node; node = node->next) {
+        if (evaluated && !node->osdecoder->profile.evals) {
+            continue;
+        }
+
+        if (*count == *size) {
+            *size = *size ? *size * 2 : 64;
+            os_realloc(*decoders, *size * sizeof(OSDecoderInfo *), *decoders);
+        }
+        (*decoders)[(*count)++] = node->osdecoder;
+    }
+}
+
+/* Rules and decoders may be reached from more than one node
+ * (if_matched_* rules, decoders in both lists). Remove the
+ * duplicated pointers, returning the new count.
+ */
+static int _profile_cmpptr(const void *a, const void *b)
+{
+    const void *pa = *(const void * const *)a;
+    const void *pb = *(const void * const *)b;
+
+    return ((pa > pb) - (pa < pb));
+}
+
+static size_t _profile_unique(void **list, size_t count)
+{
+    size_t i;
+    size_t j = 0;
+
+    if (count == 0) {
+        return (0);
+    }
+
+    qsort(list, count, sizeof(void *), _profile_cmpptr);
+    for (i = 1; i < count; i++) {
+        if (list[i] != list[j]) {
+            list[++j] = list[i];
+        }
+    }
+
+    return (j + 1);
+}
+
+void OS_ProfileReport(FILE *fp, size_t top)
+{
+    size_t i;
+    size_t count = 0;
+    size_t size = 0;
+    RuleInfo **rules = NULL;
+    OSDecoderInfo **decoders = NULL;
+
+    /* Rules */
+    _profile_rules(OS_GetFirstRule(), 1, &rules, &count, &size);
+    count = _profile_unique((void **)rules, count);
+    if (count) {
+        qsort(rules, count, sizeof(RuleInfo *), _profile_cmprule);
+    }
+
+    fprintf(fp, "%-8s %-24s %12s %12s %12s %10s\n",
+            "type", "name", "evaluations", "matches", "total (ms)", "ns/eval");
+    for (i = 0; i < count && (!top || i < top); i++) {
+        fprintf(fp, "%-8s %-24d %12lu %12lu %12.3f %10.0f\n",
+                "rule",
+                rules[i]->sigid,
+                rules[i]->profile.evals,
+                rules[i]->profile.matches,
+                (double)rules[i]->profile.nsecs / 1e6,
+                (double)rules[i]->profile.nsecs / (double)rules[i]->profile.evals);
+    }
+    free(rules);
+
+    /* Decoders */
+    count = 0;
+    size = 0;
+    _profile_decoders(OS_GetFirstOSDecoder(NULL), 1, &decoders, &count, &size);
+    _profile_decoders(OS_GetFirstOSDecoder(""), 1, &decoders, &count, &size);
+    count = _profile_unique((void **)decoders, count);
+    if (count) {
+        qsort(decoders, count, sizeof(OSDecoderInfo *), _profile_cmpdecoder);
+    }
+
+    for (i = 0; i < count && (!top || i < top); i++) {
+        fprintf(fp, "%-8s %-24.24s %12lu %12lu %12.3f %10.0f\n",
+                "decoder",
+                decoders[i]->name,
+                decoders[i]->profile.evals,
+                decoders[i]->profile.matches,
+                (double)decoders[i]->profile.nsecs / 1e6,
+                (double)decoders[i]->profile.nsecs / (double)decoders[i]->profile.evals);
+    }
+    free(decoders);
+}
+
+void OS_ProfileReset()
+{
+    size_t i;
+    size_t count = 0;
+    size_t size = 0;
+    RuleInfo **rules = NULL;
+    OSDecoderInfo **decoders = NULL;
+
+    _profile_rules(OS_GetFirstRule(), 0, &rules, &count, &size);
+    for (i = 0; i < count; i++) {
+        memset(&rules[i]->profile, 0, sizeof(OSProfile));
+    }
+    free(rules);
+
+    count = 0;
+    size = 0;
+    _profile_decoders(OS_GetFirstOSDecoder(NULL), 0, &decoders, &count, &size);
+    _profile_decoders(OS_GetFirstOSDecoder(""), 0, &decoders, &count, &size);
+    for (i = 0; i < count; i++) {
+        memset(&decoders[i]->profile, 0, sizeof(OSProfile));
+    }
+    free(decoders);
+}
@@ -0,0 +1,39 @@
+/* Copyright (C) 2015 Trend Micro Inc.
+ * All rights reserved.
+ *
+ * This program is a free software; you can redistribute it
+ * and/or modify it under the terms of the GNU General Public
+ * License (version 2) as published by the FSF - Free Software
+ * Foundation.
+ */
+
+#ifndef _PROFILE__H
+#define _PROFILE__H
+
+#include "shared.h"
+
+/* Evaluation cost of a rule or decoder */
+typedef struct _OSProfile {
+    unsigned long evals;    /* Times it was evaluated */
+    unsigned long matches;  /* Times its own conditions matched */
+    u_int64_t nsecs;        /* Time spent on it, children excluded */
+} OSProfile;
+
+/* Set while the current event is being profiled */
+extern int profile_event;
+
+/* Time spent by the rule children being evaluated */
+extern u_int64_t profile_child_nsecs;
+
+/* Monotonic clock in nanoseconds */
+u_int64_t OS_ProfileNow(void);
+
+/* Write the evaluated rules and decoders, most expensive first.
+ * Only the first "top" entries of each are written (0 for all).
+ */
+void OS_ProfileReport(FILE *fp, size_t top) __attribute__((nonnull));
+
+/* Clear the counters of every rule and decoder */
+void OS_ProfileReset(void);
+
+#endif /* _PROFILE__H */
@@ -28,7 +28,7 @@ static int getattributes(char **attributes,
                   int *maxsize, int *timeframe,
                   int *frequency, int *accuracy,
                   int *noalert, int *ignore_time, int *overwrite);
-static int doesRuleExist(int sid, RuleNode *r_node);
+static int doesRuleExist(int sid);
 static void Rule_AddAR(RuleInfo *config_rule);
 static char *loadmemory(char *at, const char *str);
 static void printRuleinfo(const RuleInfo *rule, int node);
@@ -259,7 +259,7 @@ int Rules_OP_ReadRules(const char *rulefile)
                     return (-1);
                 }
 
-                if (overwrite != 1 && doesRuleExist(id, NULL)) {
+                if (overwrite != 1 && doesRuleExist(id)) {
                     merror("%s: Duplicate rule ID:%d", ARGV0, id);
                     OS_ClearXML(&xml);
                     return (-1);
@@ -1734,31 +1734,7 @@ int _setlevels(RuleNode *node, int nnode)
 /* Test if a rule id exists
  * return 1 if exists, otherwise 0
  */
-static int doesRuleExist(int sid, RuleNode *r_node)
+static int doesRuleExist(int sid)
 {
-    /* Start from the beginning of the list by default */
-    if (!r_node) {
-        r_node = OS_GetFirstRule();
-    }
-
-    while (r_node) {
-        /* Check if the sigid matches */
-        if (r_node->ruleinfo->sigid == sid) {
-            return (1);
-        }
-
-        /* Check if the rule has a child */
-        if (r_node->child) {
-            /* Check recursively */
-            if (doesRuleExist(sid, r_node->child)) {
-                return (1);
-            }
-        }
-
-        /* Go to the next rule */
-        r_node = r_node->next;
-    }
-
-    return (0);
+    return (OS_GetRuleNode(sid) != NULL);
 }
-
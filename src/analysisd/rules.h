@@ -15,6 +15,7 @@
 #include "shared.h"
 #include "active-response.h"
 #include "lists.h"
+#include "profile.h"
 
 /* Event context  - stored on a uint8 */
 #define SAME_USER       0x001 /* 1   */
@@ -156,6 +157,9 @@ typedef struct _RuleInfo {
     void *(*compiled_rule)(void *lf);
     active_response **ar;
 
+    /* Evaluation cost (not an user option) */
+    OSProfile profile;
+
 } RuleInfo;
 
 
@@ -205,6 +209,9 @@ int OS_MarkID(RuleNode *r_node, RuleInfo *orig_rule);
 /* Get first rule */
 RuleNode *OS_GetFirstRule(void);
 
+/* Get a node of the rule "sid" (NULL if not loaded) */
+RuleNode *OS_GetRuleNode(int sid);
+
 void Rules_OP_CreateRules(void);
 
 int Rules_OP_ReadRules(const char *rulefile);
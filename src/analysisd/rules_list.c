@@ -13,6 +13,20 @@
 /* Rulenode local  */
 static RuleNode *rulenode;
 
+/* Nodes of each rule (by sigid). A rule that is a child of more
+ * than one parent (if_group, if_level) has one node per parent.
+ */
+typedef struct _RuleIndex {
+    size_t count;
+    RuleNode **nodes;
+} RuleIndex;
+
+static OSHash *rule_index;
+
+static void _OS_IndexRule(RuleNode *node);
+static RuleIndex *_OS_GetRuleIndex(int sid);
+static void _OS_MarkRuleID(RuleInfo *rule, RuleInfo *orig_rule);
+
 /* _OS_Addrule: Internal AddRule */
 static RuleNode *_OS_AddRule(RuleNode *_rulenode, RuleInfo *read_rule);
 static int _AddtoRule(int sid, int level, int none, const char *group,
@@ -23,9 +37,53 @@ static int _AddtoRule(int sid, int level, int none, const char *group,
 void OS_CreateRuleList()
 {
     rulenode = NULL;
+
+    rule_index = OSHash_Create();
+    if (!rule_index || !OSHash_setSize(rule_index, 16384)) {
+        ErrorExit(MEM_ERROR, ARGV0, errno, strerror(errno));
+    }
+
     return;
 }
 
+/* Remember the node of a rule, so the links between rules
+ * can be resolved without walking the whole tree
+ */
+static void _OS_IndexRule(RuleNode *node)
+{
+    char sid[16];
+    RuleIndex *index;
+
+    snprintf(sid, sizeof(sid), "%d", node->ruleinfo->sigid);
+
+    index = (RuleIndex *)OSHash_Get(rule_index, sid);
+    if (!index) {
+        os_calloc(1, sizeof(RuleIndex), index);
+        if (OSHash_Add(rule_index, sid, index) != 2) {
+            ErrorExit(MEM_ERROR, ARGV0, errno, strerror(errno));
+        }
+    }
+
+    os_realloc(index->nodes, (index->count + 1) * sizeof(RuleNode *), index->nodes);
+    index->nodes[index->count++] = node;
+}
+
+static RuleIndex *_OS_GetRuleIndex(int sid)
+{
+    char key[16];
+
+    snprintf(key, sizeof(key), "%d", sid);
+    return ((RuleIndex *)OSHash_Get(rule_index, key));
+}
+
+/* Get a node of the rule "sid" (NULL if not loaded) */
+RuleNode *OS_GetRuleNode(int sid)
+{
+    RuleIndex *index = _OS_GetRuleIndex(sid);
+
+    return (index ? index->nodes[0] : NULL);
+}
+
 /* Get first node from rule */
 RuleNode *OS_GetFirstRule()
 {
@@ -43,6 +101,28 @@ static int _AddtoRule(int sid, int level, int none, const char *group,
      * the beginning of the list
      */
     if (!r_node) {
+        /* A rule with a single node is found directly. Otherwise
+         * the tree is walked, as the first node found is used.
+         */
+        if (sid && !group && !level) {
+            RuleIndex *index = _OS_GetRuleIndex(sid);
+
+            if (!index) {
+                return (0);
+            }
+            if (index->count == 1) {
+                r_node = index->nodes[0];
+
+                read_rule->category = r_node->ruleinfo->category;
+                if (!read_rule->last_events && r_node->ruleinfo->last_events) {
+                    read_rule->last_events = r_node->ruleinfo->last_events;
+                }
+
+                r_node->child = _OS_AddRule(r_node->child, read_rule);
+                return (1);
+            }
+        }
+
         r_node = OS_GetFirstRule();
     }
 
@@ -242,6 +322,8 @@ static RuleNode *_OS_AddRule(RuleNode *_rulenode, RuleInfo *read_rule)
             prev_rulenode->next->next = NULL;
             prev_rulenode->next->child = NULL;
         }
+
+        _OS_IndexRule(new_rulenode);
     } else {
         _rulenode = (RuleNode *)calloc(1, sizeof(RuleNode));
         if (_rulenode == NULL) {
@@ -251,6 +333,8 @@ static RuleNode *_OS_AddRule(RuleNode *_rulenode, RuleInfo *read_rule)
         _rulenode->ruleinfo = read_rule;
         _rulenode->next = NULL;
         _rulenode->child = NULL;
+
+        _OS_IndexRule(_rulenode);
     }
 
     return (_rulenode);
@@ -267,15 +351,19 @@ int OS_AddRule(RuleInfo *read_rule)
 /* Update rule info for overwritten ones */
 int OS_AddRuleInfo(RuleNode *r_node, RuleInfo *newrule, int sid)
 {
-    /* If no r_node is given, get first node */
-    if (r_node == NULL) {
-        r_node = OS_GetFirstRule();
-    }
-
     if (sid == 0) {
         return (0);
     }
 
+    /* If no r_node is given, go to the rule (all its nodes
+     * share the same information)
+     */
+    if (r_node == NULL) {
+        if (!(r_node = OS_GetRuleNode(sid))) {
+            return (0);
+        }
+    }
+
     while (r_node) {
         /* Check if the sigid matches */
         if (r_node->ruleinfo->sigid == sid) {
@@ -335,26 +423,37 @@ int OS_AddRuleInfo(RuleNode *r_node, RuleInfo *newrule, int sid)
     return (0);
 }
 
+/* Link orig_rule to the previous matches of rule */
+static void _OS_MarkRuleID(RuleInfo *rule, RuleInfo *orig_rule)
+{
+    /* If child does not have a list, create one */
+    if (!rule->sid_prev_matched) {
+        rule->sid_prev_matched = OSList_Create();
+        if (!rule->sid_prev_matched) {
+            ErrorExit(MEM_ERROR, ARGV0, errno, strerror(errno));
+        }
+    }
+
+    /* Assign the parent pointer to it */
+    orig_rule->sid_search = rule->sid_prev_matched;
+}
+
 /* Mark rules that match specific id (for if_matched_sid) */
 int OS_MarkID(RuleNode *r_node, RuleInfo *orig_rule)
 {
-    /* If no r_node is given, get first node */
+    /* If no r_node is given, go to the rule (all its nodes
+     * share the same information)
+     */
     if (r_node == NULL) {
-        r_node = OS_GetFirstRule();
+        if ((r_node = OS_GetRuleNode(orig_rule->if_matched_sid))) {
+            _OS_MarkRuleID(r_node->ruleinfo, orig_rule);
+        }
+        return (0);
     }
 
     while (r_node) {
         if (r_node->ruleinfo->sigid == orig_rule->if_matched_sid) {
-            /* If child does not have a list, create one */
-            if (!r_node->ruleinfo->sid_prev_matched) {
-                r_node->ruleinfo->sid_prev_matched = OSList_Create();
-                if (!r_node->ruleinfo->sid_prev_matched) {
-                    ErrorExit(MEM_ERROR, ARGV0, errno, strerror(errno));
-                }
-            }
-
-            /* Assign the parent pointer to it */
-            orig_rule->sid_search = r_node->ruleinfo->sid_prev_matched;
+            _OS_MarkRuleID(r_node->ruleinfo, orig_rule);
         }
 
         /* Check if the child has a rule */
@@ -43,11 +43,24 @@ static int maxdiff = 0;
 static int mindiff = 0;
 static int percent_diff = 20;
 
-/* Last msgs, to avoid floods */
-static char *_lastmsg;
-static char *_prevlast;
-static char *_pprevlast;
-
+/* Duplicate suppression window, to avoid floods.
+ * Each entry keeps the 64-bit hash of a recent message and when it
+ * was seen. Entries are stored in a ring (oldest evicted first) and
+ * chained by bucket for the lookups.
+ */
+typedef struct _LastMsg_Entry {
+    u_int64_t hash;
+    time_t seen;
+    int next;
+} LastMsg_Entry;
+
+static LastMsg_Entry *_lastmsg_ring;
+static int *_lastmsg_buckets;
+static unsigned int _lastmsg_size = 0;
+static unsigned int _lastmsg_mask = 0;
+static unsigned int _lastmsg_head = 0;
+static int _lastmsg_timeout = 0;
+static int _lastmsg_per_location = 0;
 
 static void print_totals(void)
 {
@@ -323,18 +336,13 @@ int Start_Hour()
                                  "stats_percent_diff",
                                  5, 999);
 
-    /* Last three messages
-     * They are used to keep track of the last
-     * messages received to avoid floods
+    /* Duplicate suppression window
+     * Used to keep track of the last messages
+     * received to avoid floods
      */
-    _lastmsg = NULL;
-    _prevlast = NULL;
-    _pprevlast = NULL;
-
-    /* They should not be null */
-    os_strdup(" ", _lastmsg);
-    os_strdup(" ", _prevlast);
-    os_strdup(" ", _pprevlast);
+    if (LastMsg_Init() < 0) {
+        return (-1);
+    }
 
     /* Create the stat queue directories */
     if (IsDir(STATWQUEUE) == -1) {
@@ -427,39 +435,120 @@ int Start_Hour()
     return (0);
 }
 
-/* Check if the message received is repeated to avoid
- * floods of the same message
- */
-int LastMsg_Stats(const char *log)
+/* Allocate the duplicate suppression window */
+int LastMsg_Init()
 {
-    if (strcmp(log, _lastmsg) == 0) {
-        return (1);
+    unsigned int i;
+    unsigned int size;
+
+    /* Maximum number of messages kept */
+    size = (unsigned int) getDefine_Int("analysisd",
+                                        "dedup_window_size",
+                                        1, 65536);
+
+    /* Seconds a message is kept (0 to keep it until evicted) */
+    _lastmsg_timeout = getDefine_Int("analysisd",
+                                     "dedup_window_timeout",
+                                     0, 86400);
+
+    /* Only suppress duplicates coming from the same location */
+    _lastmsg_per_location = getDefine_Int("analysisd",
+                                          "dedup_per_location",
+                                          0, 1);
+
+    /* Bucket count is a power of two, at least twice the window */
+    _lastmsg_mask = 1;
+    while (_lastmsg_mask < (size * 2)) {
+        _lastmsg_mask <<= 1;
     }
 
-    else if (strcmp(log, _prevlast) == 0) {
-        return (1);
-    }
+    os_calloc(size, sizeof(LastMsg_Entry), _lastmsg_ring);
+    os_calloc(_lastmsg_mask, sizeof(int), _lastmsg_buckets);
+    _lastmsg_mask--;
 
-    else if (strcmp(log, _pprevlast) == 0) {
-        return (1);
+    for (i = 0; i <= _lastmsg_mask; i++) {
+        _lastmsg_buckets[i] = -1;
     }
+    for (i = 0; i < size; i++) {
+        _lastmsg_ring[i].next = -1;
+    }
+
+    _lastmsg_size = size;
+    _lastmsg_head = 0;
 
     return (0);
 }
 
-/* If the message is not repeated, rearrange the last
- * received messages
+/* Remove the oldest entry of the ring from its bucket */
+static void _lastmsg_evict(unsigned int slot)
+{
+    int *pt;
+
+    if (_lastmsg_ring[slot].seen == 0) {
+        return;
+    }
+
+    pt = &_lastmsg_buckets[_lastmsg_ring[slot].hash & _lastmsg_mask];
+    while (*pt != -1) {
+        if (*pt == (int)slot) {
+            *pt = _lastmsg_ring[slot].next;
+            break;
+        }
+        pt = &_lastmsg_ring[*pt].next;
+    }
+
+    _lastmsg_ring[slot].next = -1;
+    _lastmsg_ring[slot].seen = 0;
+}
+
+/* Check if the message received is repeated to avoid
+ * floods of the same message. If it is not, it is
+ * added to the window.
+ * Returns 1 if the message is duplicated, 0 otherwise.
  */
-void LastMsg_Change(const char *log)
+int LastMsg_Stats(const char *log, const char *location)
 {
-    /* Remove the last one */
-    free(_pprevlast);
+    u_int64_t hash = OS_HASH64_INIT;
+    unsigned int slot;
+    int bucket;
+    int i;
+
+    if (_lastmsg_size == 0) {
+        return (0);
+    }
 
-    /* Move the second to third and the last to second */
-    _pprevlast = _prevlast;
-    _prevlast = _lastmsg;
+    if (_lastmsg_per_location && location) {
+        /* Include the trailing '\0' to separate it from the log */
+        hash = OSHash_Hash64(location, strlen(location) + 1, hash);
+    }
+    hash = OSHash_Hash64(log, strlen(log), hash);
 
-    os_strdup(log, _lastmsg);
-    return;
+    bucket = (int)(hash & _lastmsg_mask);
+
+    for (i = _lastmsg_buckets[bucket]; i != -1; i = _lastmsg_ring[i].next) {
+        if (_lastmsg_ring[i].hash != hash) {
+            continue;
+        }
+
+        /* Expired entries are left for the ring to evict */
+        if (_lastmsg_timeout && (c_time - _lastmsg_ring[i].seen) > _lastmsg_timeout) {
+            break;
+        }
+
+        return (1);
+    }
+
+    /* Not repeated, replace the oldest message */
+    slot = _lastmsg_head;
+    _lastmsg_head = (_lastmsg_head + 1) % _lastmsg_size;
+
+    _lastmsg_evict(slot);
+
+    _lastmsg_ring[slot].hash = hash;
+    _lastmsg_ring[slot].seen = c_time ? c_time : 1;
+    _lastmsg_ring[slot].next = _lastmsg_buckets[bucket];
+    _lastmsg_buckets[bucket] = (int)slot;
+
+    return (0);
 }
 
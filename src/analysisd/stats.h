@@ -10,8 +10,8 @@
 #ifndef _STAT__H
 #define _STAT__H
 
-void LastMsg_Change(const char *log);
-int LastMsg_Stats(const char *log);
+int LastMsg_Init(void);
+int LastMsg_Stats(const char *log, const char *location);
 
 extern char __stats_comment[192];
 
@@ -27,9 +27,22 @@
 #include "analysisd.h"
 #include "fts.h"
 #include "cleanevent.h"
+#include "dodiff.h"
 
 /** Internal Functions **/
 void OS_ReadMSG(char *ut_str);
+static void OS_BenchReport(void);
+
+/* Benchmark (batch) mode */
+#define BENCH_TOP 20
+
+static const char *bench_file = NULL;
+static FILE *bench_fp = NULL;
+static int bench_output = 0;
+static u_int64_t *bench_times = NULL;
+static size_t bench_events = 0;
+static size_t bench_size = 0;
+static u_int64_t bench_total = 0;
 
 /* Analysisd function */
 RuleInfo *OS_CheckIfRuleMatch(Eventinfo *lf, RuleNode *curr_node);
@@ -41,7 +54,7 @@ __attribute__((noreturn))
 static void help_logtest(void)
 {
     print_header();
-    print_out("  %s: -[Vhdtva] [-c config] [-D dir] [-U rule:alert:decoder]", ARGV0);
+    print_out("  %s: -[Vhdtva] [-c config] [-D dir] [-U rule:alert:decoder] [-b file]", ARGV0);
     print_out("    -V          Version and license message");
     print_out("    -h          This help message");
     print_out("    -d          Execute in debug mode. This parameter");
@@ -53,6 +66,9 @@ static void help_logtest(void)
     print_out("    -c <config> Configuration file to use (default: %s)", DEFAULTCPATH);
     print_out("    -D <dir>    Directory to chroot into (default: %s)", DEFAULTDIR);
     print_out("    -U <rule:alert:decoder>  Unit test. Refer to contrib/ossec-testing/runtests.py");
+    print_out("    -b <file>   Benchmark: replay the events (id:location:message) from file");
+    print_out("                and report the throughput and the most expensive");
+    print_out("                rules and decoders. Alerts are only printed with -a");
     print_out(" ");
     exit(1);
 }
@@ -77,7 +93,7 @@ int main(int argc, char **argv)
     active_responses = NULL;
     memset(prev_month, '\0', 4);
 
-    while ((c = getopt(argc, argv, "VatvdhU:D:c:")) != -1) {
+    while ((c = getopt(argc, argv, "VatvdhU:D:c:b:")) != -1) {
         switch (c) {
             case 'V':
                 print_version();
@@ -115,12 +131,26 @@ int main(int argc, char **argv)
             case 'v':
                 full_output = 1;
                 break;
+            case 'b':
+                if (!optarg) {
+                    ErrorExit("%s: -b needs an argument", ARGV0);
+                }
+                bench_file = optarg;
+                break;
             default:
                 help_logtest();
                 break;
         }
     }
 
+    /* The benchmark only prints the alerts, if asked to */
+    if (bench_file) {
+        bench_output = alert_only;
+        alert_only = 1;
+        full_output = 0;
+        ut_str = NULL;
+    }
+
     /* Read configuration file */
     if (GlobalConf(cfg) < 0) {
         ErrorExit(CONFIG_ERROR, ARGV0, cfg);
@@ -142,6 +172,14 @@ int main(int argc, char **argv)
         }
     }
 
+    /* Open the events file before leaving the current directory */
+    if (bench_file) {
+        bench_fp = fopen(bench_file, "r");
+        if (!bench_fp) {
+            ErrorExit(FOPEN_ERROR, ARGV0, bench_file, errno, strerror(errno));
+        }
+    }
+
     if (chdir(dir) != 0) {
         ErrorExit(CHROOT_ERROR, ARGV0, dir, errno, strerror(errno));
     }
@@ -329,6 +367,11 @@ void OS_ReadMSG(char *ut_str)
         exit(1);
     }
 
+    /* Initialize the diff state cache */
+    if (!DoDiff_Init()) {
+        ErrorExit("%s: ERROR: Unable to initialize the diff cache.", ARGV0);
+    }
+
     __crt_ftell = 1;
 
     /* Get current time before starting */
@@ -341,6 +384,11 @@ void OS_ReadMSG(char *ut_str)
         print_out("%s: Type one log per line.\n", ARGV0);
     }
 
+    /* Every event is profiled while benchmarking */
+    if (bench_fp) {
+        profile_event = 1;
+    }
+
     /* Daemon loop */
     while (1) {
         lf = (Eventinfo *)calloc(1, sizeof(Eventinfo));
@@ -353,13 +401,19 @@ void OS_ReadMSG(char *ut_str)
         /* Fix the msg */
         snprintf(msg, 15, "1:stdin:");
 
-        /* Receive message from queue */
-        if (fgets(msg + 8, OS_MAXSTR - 8, stdin)) {
+        /* Receive message from queue (or the benchmark file) */
+        if (bench_fp ? fgets(msg, OS_MAXSTR, bench_fp) != NULL :
+                fgets(msg + 8, OS_MAXSTR - 8, stdin) != NULL) {
             RuleNode *rulenode_pt;
+            u_int64_t bench_start = 0;
 
             /* Get the time we received the event */
             c_time = time(NULL);
 
+            if (bench_fp) {
+                bench_start = OS_ProfileNow();
+            }
+
             /* Remov newline */
             if (msg[strlen(msg) - 1] == '\n') {
                 msg[strlen(msg) - 1] = '\0';
@@ -367,6 +421,7 @@ void OS_ReadMSG(char *ut_str)
 
             /* Make sure we ignore blank lines */
             if (strlen(msg) < 10) {
+                free(lf);
                 continue;
             }
 
@@ -489,7 +544,9 @@ void OS_ReadMSG(char *ut_str)
 
                 /* Log the alert if configured to */
                 if (currently_rule->alert_opts & DO_LOGALERT) {
-                    if (alert_only) {
+                    if (bench_fp && !bench_output) {
+                        /* Alerts disabled while benchmarking */
+                    } else if (alert_only) {
                         OS_LogOutput(lf);
                         __crt_ftell++;
                     } else {
@@ -565,10 +622,58 @@ void OS_ReadMSG(char *ut_str)
                 Free_Eventinfo(lf);
             }
 
+            /* Save the time it took to process the event */
+            if (bench_fp) {
+                u_int64_t elapsed = OS_ProfileNow() - bench_start;
+
+                if (bench_events == bench_size) {
+                    bench_size = bench_size ? bench_size * 2 : 4096;
+                    os_realloc(bench_times, bench_size * sizeof(u_int64_t), bench_times);
+                }
+                bench_times[bench_events++] = elapsed;
+                bench_total += elapsed;
+            }
+
         } else {
+            if (bench_fp) {
+                OS_BenchReport();
+            }
             exit(exit_code);
         }
     }
     exit(exit_code);
 }
 
+
+/* Sort helper for the benchmark latencies */
+static int _bench_cmptime(const void *a, const void *b)
+{
+    u_int64_t ta = *(const u_int64_t *)a;
+    u_int64_t tb = *(const u_int64_t *)b;
+
+    return ((ta > tb) - (ta < tb));
+}
+
+/* Print the benchmark results */
+static void OS_BenchReport()
+{
+    print_out("\n%s: Benchmark of '%s'", ARGV0, bench_file);
+
+    if (bench_events == 0 || bench_total == 0) {
+        print_out("    No events processed.");
+        return;
+    }
+
+    qsort(bench_times, bench_events, sizeof(u_int64_t), _bench_cmptime);
+
+    print_out("    Events:          %lu", (unsigned long)bench_events);
+    print_out("    Total time:      %.3f s", (double)bench_total / 1e9);
+    print_out("    Events/sec:      %.0f", (double)bench_events * 1e9 / (double)bench_total);
+    print_out("    Latency p50:     %.2f us", (double)bench_times[(bench_events - 1) / 2] / 1e3);
+    print_out("    Latency p99:     %.2f us", (double)bench_times[((bench_events - 1) * 99) / 100] / 1e3);
+    print_out("    Latency max:     %.2f us", (double)bench_times[bench_events - 1] / 1e3);
+
+    /* Rules and decoders */
+    print_out("\n    Top rules and decoders by CPU time:");
+    OS_ProfileReport(stderr, BENCH_TOP);
+}
@@ -17,6 +17,9 @@ void AgentdStart(const char *dir, int uid, int gid, const char *user, const char
 {
     int rc = 0;
     int maxfd = 0;
+    long batch_wait;
+    long flow_wait;
+    long spool_wait;
     fd_set fdset;
     struct timeval fdtimeout;
 
@@ -46,6 +49,10 @@ void AgentdStart(const char *dir, int uid, int gid, const char *user, const char
         ErrorExit(SETUID_ERROR, ARGV0, user, errno, strerror(errno));
     }
 
+    /* Metrics (served on the control socket) */
+    send_msg_init();
+    OS_StartMetrics();
+
     /* Create the queue and read from it. Exit if fails. */
     if ((agt->m_queue = StartMQ(DEFAULTQUEUE, READ)) < 0) {
         ErrorExit(QUEUE_ERROR, ARGV0, DEFAULTQUEUE, strerror(errno));
@@ -54,6 +61,12 @@ void AgentdStart(const char *dir, int uid, int gid, const char *user, const char
     maxfd = agt->m_queue;
     agt->sock = -1;
 
+    /* Open the spool of the events that can not be sent */
+    if (spool_init(agt->spool_size) < 0) {
+        merror("%s: WARN: Agent spool disabled.", ARGV0);
+        agt->spool_size = 0;
+    }
+
     /* Create PID file */
     if (CreatePID(ARGV0, getpid()) < 0) {
         merror(PID_ERROR, ARGV0);
@@ -121,11 +134,35 @@ void AgentdStart(const char *dir, int uid, int gid, const char *user, const char
         /* Monitor all available sockets from here */
         FD_ZERO(&fdset);
         FD_SET(agt->sock, &fdset);
-        FD_SET(agt->m_queue, &fdset);
 
         fdtimeout.tv_sec = 1;
         fdtimeout.tv_usec = 0;
 
+        /* Leave the events in the queue while slowed down (unless
+         * they can be spooled)
+         */
+        if ((flow_wait = forward_wait()) > 0) {
+            fdtimeout.tv_sec = 0;
+            fdtimeout.tv_usec = flow_wait * 1000;
+        }
+        if (flow_wait == 0 || spool_room()) {
+            FD_SET(agt->m_queue, &fdset);
+        }
+
+        /* Wake up in time to send the spooled events */
+        if ((spool_wait = forward_spool_wait()) >= 0 &&
+                spool_wait * 1000 < fdtimeout.tv_sec * 1000000 + fdtimeout.tv_usec) {
+            fdtimeout.tv_sec = 0;
+            fdtimeout.tv_usec = spool_wait * 1000;
+        }
+
+        /* Wake up in time to send the open batch frame */
+        if ((batch_wait = send_batch_timeout()) >= 0 && batch_wait < 1000 &&
+                batch_wait * 1000 < fdtimeout.tv_sec * 1000000 + fdtimeout.tv_usec) {
+            fdtimeout.tv_sec = 0;
+            fdtimeout.tv_usec = batch_wait * 1000;
+        }
+
         /* Continuously send notifications */
         run_notify();
 
@@ -133,7 +170,16 @@ void AgentdStart(const char *dir, int uid, int gid, const char *user, const char
         rc = select(maxfd, &fdset, NULL, NULL, &fdtimeout);
         if (rc == -1) {
             ErrorExit(SELECT_ERROR, ARGV0, errno, strerror(errno));
-        } else if (rc == 0) {
+        }
+
+        /* Send the spooled events and the batch frame if its latency
+         * budget is spent
+         */
+        forward_spool();
+        send_batch_flush(0);
+        send_msg_flush();
+
+        if (rc == 0) {
             continue;
         }
 
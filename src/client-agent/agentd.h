@@ -34,8 +34,46 @@ void *receiver_thread(void *none);
 int intcheck_file(const char *file_name, const char *dir);
 
 /* Send message to server */
+void send_msg_init(void);
 int send_msg(int agentid, const char *msg);
 
+#ifndef WIN32
+/* Queue a message to the server / send the queued ones */
+int send_msg_queue(int agentid, const char *msg);
+int send_msg_flush(void);
+
+/* Pack events into batch frames (when the server accepts them) */
+int send_batch_add(const char *msg);
+int send_batch_flush(int force);
+long send_batch_timeout(void);
+
+/* Check if the messages to the server are failing */
+int send_msg_failing(void);
+void send_msg_refused(void);
+
+/* Flow control asked by the manager (HC_SLOWDOWN) */
+void forward_slowdown(const char *msg);
+long forward_wait(void);
+
+/* Send the spooled events (at the rate of the spool) */
+void forward_spool(void);
+long forward_spool_wait(void);
+
+/* Disk spool of the events that can not be sent */
+int spool_init(int size);
+int spool_enabled(void);
+int spool_pending(void);
+int spool_room(void);
+int spool_add(const char *msg);
+const char *spool_get(void);
+void spool_next(void);
+void spool_commit(void);
+void spool_rewind(void);
+
+/* Send the notification on the next run_notify */
+void notify_now(void);
+#endif
+
 /* Extract the shared files */
 char *getsharedfiles(void);
 
@@ -12,24 +12,218 @@
 #include "os_net/os_net.h"
 #include "sec.h"
 
+/* Seconds between the checks of the server while the messages fail */
+#define SPOOL_RETRY 5
 
-/* Receive a message locally on the agent and forward it to the manager */
+/* Flow control asked by the manager: up to flow_rate events per
+ * second until flow_until. The events held back are spooled (or wait
+ * in the queue, without the spool).
+ */
+static mq_bucket flow_bucket;
+static unsigned int flow_rate = 0;
+static time_t flow_until = 0;
+
+/* Events sent from the spool (agt->spool_eps per second) */
+static mq_bucket spool_bucket;
+static time_t spool_check = 0;
+static unsigned int spooled = 0;
+
+static int forward_take(time_t now);
+
+
+/* Slow down the forwarding ("<events per second> <seconds>") */
+void forward_slowdown(const char *msg)
+{
+    unsigned int rate;
+    int seconds;
+    time_t now = time(0);
+
+    if (sscanf(msg, "%u %d", &rate, &seconds) != 2 || rate == 0 || seconds <= 0) {
+        merror("%s: WARN: Invalid slow down request from the manager: '%s'.",
+               ARGV0, msg);
+        return;
+    }
+
+    if (flow_until < now) {
+        verbose("%s: INFO: Manager queue congested. Forwarding up to %u "
+                "events per second.", ARGV0, rate);
+    }
+
+    flow_rate = rate;
+    flow_until = now + seconds;
+}
+
+/* Milliseconds to wait before forwarding more events (0 if not slowed
+ * down or if the events of this second were not sent yet)
+ */
+long forward_wait()
+{
+    struct timeval tv;
+
+    if (flow_until == 0) {
+        return (0);
+    }
+
+    gettimeofday(&tv, NULL);
+
+    if (tv.tv_sec > flow_until) {
+        verbose("%s: INFO: Forwarding events at full rate again.", ARGV0);
+        flow_until = 0;
+        return (0);
+    }
+
+    if (flow_bucket.second != tv.tv_sec || flow_bucket.tokens > 0) {
+        return (0);
+    }
+
+    return (1000 - tv.tv_usec / 1000);
+}
+
+
+/* Check if an event can be sent now (under the flow control) */
+static int forward_take(time_t now)
+{
+    return (flow_until < now || MQ_BucketTake(&flow_bucket, flow_rate, now));
+}
+
+/* Send the spooled events, in order, at the rate of the spool. While
+ * the messages fail, the server is asked for an answer (a notification)
+ * every SPOOL_RETRY seconds instead.
+ */
+void forward_spool()
+{
+    const char *msg;
+    unsigned int sent = 0;
+    time_t now = time(0);
+
+    if (send_msg_failing()) {
+        if (spooled && now - spool_check >= SPOOL_RETRY) {
+            spool_check = now;
+            notify_now();
+        }
+        return;
+    }
+
+    if (!spool_pending()) {
+        return;
+    }
+
+    while (sent < OS_DGRAM_BATCH && (msg = spool_get()) != NULL &&
+            MQ_BucketTake(&spool_bucket, (unsigned int)agt->spool_eps, now) &&
+            forward_take(now)) {
+        if (send_batch_add(msg) < 0) {
+            break;
+        }
+        spool_next();
+        sent++;
+    }
+
+    /* The events leave the spool once they are sent */
+    if (send_batch_flush(1) == 0 && send_msg_flush() == 0 && !send_msg_failing()) {
+        spool_commit();
+    } else {
+        spool_rewind();
+    }
+
+    if (!spool_pending()) {
+        verbose("%s: INFO: All the spooled events were sent.", ARGV0);
+        spooled = 0;
+    }
+}
+
+/* Milliseconds until forward_spool can send more events (-1 if there
+ * is nothing to send)
+ */
+long forward_spool_wait()
+{
+    struct timeval tv;
+    long wait;
+
+    if (!spool_pending() || send_msg_failing()) {
+        return (-1);
+    }
+
+    if ((wait = forward_wait()) > 0) {
+        return (wait);
+    }
+
+    gettimeofday(&tv, NULL);
+
+    if (spool_bucket.second == tv.tv_sec && spool_bucket.tokens == 0) {
+        return (1000 - tv.tv_usec / 1000);
+    }
+
+    return (0);
+}
+
+/* Receive the messages queued locally on the agent and forward them
+ * to the manager, a batch (one system call) at a time. The events are
+ * packed into batch frames if the manager accepts them. The events
+ * that can not be sent now (the messages fail or the manager asked to
+ * slow down) are spooled, and so are the ones after them while there
+ * are events in the spool. Without the spool, they are left in the
+ * queue (and the senders wait on it).
+ */
 void *EventForward()
 {
     ssize_t recv_b;
+    unsigned int queued;
+    time_t now;
+    int spool;
     char msg[OS_MAXSTR + 1];
 
     /* Initialize variables */
     msg[0] = '\0';
     msg[OS_MAXSTR] = '\0';
 
-    while ((recv_b = recv(agt->m_queue, msg, OS_MAXSTR, MSG_DONTWAIT)) > 0) {
-        msg[recv_b] = '\0';
+    do {
+        queued = 0;
+        now = time(0);
 
-        send_msg(0, msg);
+        while (queued < OS_DGRAM_BATCH) {
+            if (spool_enabled() && (spool_pending() || send_msg_failing())) {
+                spool = 1;
+            } else if (forward_take(now)) {
+                spool = 0;
+            } else if (spool_enabled()) {
+                spool = 1;
+            } else {
+                break;
+            }
+
+            /* Spool full: the events wait in the queue */
+            if (spool && !spool_room()) {
+                break;
+            }
+
+            if ((recv_b = recv(agt->m_queue, msg, OS_MAXSTR, MSG_DONTWAIT)) <= 0) {
+                break;
+            }
+            msg[recv_b] = '\0';
+
+            if (!spool) {
+                if (send_batch_add(msg) == 0) {
+                    queued++;
+                }
+                continue;
+            }
+
+            if (spooled++ == 0) {
+                verbose("%s: INFO: Spooling the events (%s).", ARGV0,
+                        send_msg_failing() ? "server not available" : "slowed down");
+                spool_check = now;
+            }
+
+            if (spool_add(msg) == 0) {
+                queued++;
+            }
+        }
+
+        send_batch_flush(0);
+        send_msg_flush();
 
         run_notify();
-    }
+    } while (queued == OS_DGRAM_BATCH);
 
     return (NULL);
 }
@@ -126,6 +126,14 @@ int main(int argc, char **argv)
         }
     }
 
+    /* Batch frames (several events in one message) */
+    agt->batch_bytes = getDefine_Int("agent", "batch_bytes", 0, OS_MAXSTR / 2);
+    agt->batch_msecs = getDefine_Int("agent", "batch_msecs", 0, 1000);
+
+    /* Disk spool for the events that can not be sent */
+    agt->spool_size = getDefine_Int("agent", "spool_size", 0, 65536);
+    agt->spool_eps = getDefine_Int("agent", "spool_eps", 1, 1000000);
+
     /* Read config */
     if (ClientConf(cfg) < 0) {
         ErrorExit(CLIENT_ERROR, ARGV0);
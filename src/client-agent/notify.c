@@ -58,6 +58,12 @@ char *getsharedfiles()
 
 #ifndef WIN32
 
+/* Send the notification on the next run_notify */
+void notify_now()
+{
+    g_saved_time = 0;
+}
+
 /* Periodically send notification to server */
 void run_notify()
 {
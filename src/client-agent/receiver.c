@@ -15,12 +15,46 @@
 #include "os_net/os_net.h"
 #include "agentd.h"
 
+/* File built from the merged file we have (delta updates) */
+#define DELTA_FILE  SHAREDCFG_FILE ".tmp"
+
+/* Prototypes */
+static void copy_file_block(const char *msg);
+
 /* Global variables */
 static FILE *fp = NULL;
+static FILE *delta_fp = NULL;
 static char file_sum[34] = "";
 static char file[OS_SIZE_1024 + 1] = "";
 
 
+/* Copy a piece of the merged file we have ("<offset> <length>") to the
+ * file being written
+ */
+static void copy_file_block(const char *msg)
+{
+    char buf[OS_SIZE_4096];
+    unsigned long offset;
+    unsigned long len;
+    size_t n;
+
+    if (!fp || !delta_fp || sscanf(msg, "%lu %lu", &offset, &len) != 2) {
+        return;
+    }
+
+    /* A missing piece is caught by the checksum */
+    if (fseek(delta_fp, (long)offset, SEEK_SET) < 0) {
+        return;
+    }
+
+    while (len > 0 &&
+            (n = fread(buf, 1, len < sizeof(buf) ? len : sizeof(buf), delta_fp)) > 0) {
+        fwrite(buf, 1, n, fp);
+        len -= n;
+    }
+}
+
+
 /* Receive events from the server */
 void *receive_msg()
 {
@@ -80,7 +114,21 @@ void *receive_msg()
             }
 
             /* Ack from server */
-            else if (strcmp(tmp_msg, HC_ACK) == 0) {
+            else if (strncmp(tmp_msg, HC_ACK, strlen(HC_ACK)) == 0) {
+                continue;
+            }
+
+            /* The manager queue is congested */
+            else if (strncmp(tmp_msg, HC_SLOWDOWN, strlen(HC_SLOWDOWN)) == 0) {
+#ifndef WIN32
+                forward_slowdown(tmp_msg + strlen(HC_SLOWDOWN));
+#endif
+                continue;
+            }
+
+            /* Piece of the merged file we have */
+            else if (strncmp(tmp_msg, FILE_COPY_HEADER, strlen(FILE_COPY_HEADER)) == 0) {
+                copy_file_block(tmp_msg + strlen(FILE_COPY_HEADER));
                 continue;
             }
 
@@ -89,6 +137,10 @@ void *receive_msg()
                 fclose(fp);
                 fp = NULL;
             }
+            if (delta_fp) {
+                fclose(delta_fp);
+                delta_fp = NULL;
+            }
 
             /* File update message */
             if (strncmp(tmp_msg, FILE_UPDATE_HEADER,
@@ -134,6 +186,35 @@ void *receive_msg()
                 }
             }
 
+            /* Merged file update from the version we have:
+             * "<sum> <sum we have> <name>"
+             */
+            else if (strncmp(tmp_msg, FILE_DELTA_HEADER,
+                             strlen(FILE_DELTA_HEADER)) == 0) {
+                char base_sum[34];
+                os_md5 currently_md5;
+
+                file[0] = '\0';
+
+                if (sscanf(tmp_msg + strlen(FILE_DELTA_HEADER), "%32s %32s",
+                           file_sum, base_sum) != 2) {
+                    continue;
+                }
+
+                /* If it is not the version we have, the checksum fails */
+                if (OS_MD5_File(SHAREDCFG_FILE, currently_md5) == 0 &&
+                        strcmp(currently_md5, base_sum) == 0) {
+                    delta_fp = fopen(SHAREDCFG_FILE, "r");
+                }
+
+                strncpy(file, DELTA_FILE, OS_SIZE_1024);
+
+                fp = fopen(file, "w");
+                if (!fp) {
+                    merror(FOPEN_ERROR, ARGV0, file, errno, strerror(errno));
+                }
+            }
+
             else if (strncmp(tmp_msg, FILE_CLOSE_HEADER,
                              strlen(FILE_CLOSE_HEADER)) == 0) {
                 /* No error */
@@ -161,6 +242,16 @@ void *receive_msg()
                     } else {
                         char *final_file;
 
+                        /* Replace the merged file we had */
+                        if (strcmp(file, DELTA_FILE) == 0) {
+                            if (rename(file, SHAREDCFG_FILE) < 0) {
+                                merror(RENAME_ERROR, ARGV0, file, SHAREDCFG_FILE,
+                                       errno, strerror(errno));
+                                unlink(file);
+                            }
+                            strncpy(file, SHAREDCFG_FILE, OS_SIZE_1024);
+                        }
+
                         /* Rename the file to its original name */
                         final_file = strrchr(file, '/');
                         if (final_file) {
@@ -193,6 +284,13 @@ void *receive_msg()
         }
     }
 
+#ifndef WIN32
+    /* The server is not listening (the error of the messages sent) */
+    if (recv_b < 0 && errno == ECONNREFUSED) {
+        send_msg_refused();
+    }
+#endif
+
     return (NULL);
 }
 
@@ -11,6 +11,56 @@
 #include "agentd.h"
 #include "os_net/os_net.h"
 
+/* Metrics */
+static os_metric *metric_messages;
+static os_metric *metric_bytes;
+static os_metric *metric_errors;
+static os_metric *metric_events;
+static os_metric *metric_encrypt;
+
+static size_t send_encrypt(int agentid, const char *msg, char *crypt_msg);
+
+#ifndef WIN32
+/* Messages queued by send_msg_queue, waiting for send_msg_flush */
+static OSDgram queued_msgs[OS_DGRAM_BATCH];
+static unsigned int queued_count = 0;
+
+/* Batch frame being filled by send_batch_add */
+static char batch_frame[OS_MAXSTR + 1];
+static size_t batch_len = 0;
+static unsigned int batch_events = 0;
+static struct timeval batch_start;
+
+static long batch_elapsed(void);
+
+/* Last time a message could not be sent */
+static time_t send_failed = 0;
+#endif
+
+
+/* Register the metrics of the messages to the server */
+void send_msg_init()
+{
+    metric_messages = OS_MetricCounter("agentd_messages_total", "Messages sent to the server.");
+    metric_bytes = OS_MetricCounter("agentd_bytes_total", "Bytes sent to the server.");
+    metric_errors = OS_MetricCounter("agentd_send_errors_total",
+                                     "Messages that could not be sent.");
+    metric_events = OS_MetricCounter("agentd_events_total", "Events forwarded to the server.");
+    metric_encrypt = OS_MetricHistogram("agentd_encrypt_microseconds",
+                                        "Time to compress and encrypt a message.");
+}
+
+/* Encrypt a message (timed) */
+static size_t send_encrypt(int agentid, const char *msg, char *crypt_msg)
+{
+    unsigned long started = OS_MetricNow();
+    size_t msg_size;
+
+    msg_size = CreateSecMSG(&keys, msg, crypt_msg, agentid);
+    OS_MetricObserve(metric_encrypt, OS_MetricNow() - started);
+
+    return (msg_size);
+}
 
 /* Send a message to the server */
 int send_msg(int agentid, const char *msg)
@@ -18,7 +68,12 @@ int send_msg(int agentid, const char *msg)
     size_t msg_size;
     char crypt_msg[OS_MAXSTR + 1];
 
-    msg_size = CreateSecMSG(&keys, msg, crypt_msg, agentid);
+#ifndef WIN32
+    /* Keep the messages in order (the server checks the counters) */
+    send_msg_flush();
+#endif
+
+    msg_size = send_encrypt(agentid, msg, crypt_msg);
     if (msg_size == 0) {
         merror(SEC_ERROR, ARGV0);
         return (-1);
@@ -27,10 +82,183 @@ int send_msg(int agentid, const char *msg)
     /* Send msg_size of crypt_msg */
     if (OS_SendUDPbySize(agt->sock, msg_size, crypt_msg) < 0) {
         merror(SEND_ERROR, ARGV0, "server");
+        OS_MetricAdd(metric_errors, 1);
+#ifndef WIN32
+        send_failed = time(0);
+#endif
+        sleep(1);
+        return (-1);
+    }
+
+    OS_MetricAdd(metric_messages, 1);
+    OS_MetricAdd(metric_bytes, msg_size);
+    return (0);
+}
+
+
+#ifndef WIN32
+/* Encrypt a message and queue it for the server.
+ * The queue is sent when full or by send_msg_flush.
+ */
+int send_msg_queue(int agentid, const char *msg)
+{
+    OSDgram *dgram;
+
+    if (queued_count == OS_DGRAM_BATCH && send_msg_flush() < 0) {
+        return (-1);
+    }
+
+    dgram = &queued_msgs[queued_count];
+    if (!dgram->buf) {
+        os_calloc(OS_MAXSTR + 1, sizeof(char), dgram->buf);
+        dgram->size = OS_MAXSTR + 1;
+    }
+
+    dgram->len = send_encrypt(agentid, msg, dgram->buf);
+    if (dgram->len == 0) {
+        merror(SEC_ERROR, ARGV0);
+        return (-1);
+    }
+
+    queued_count++;
+    return (0);
+}
+
+/* Send the queued messages to the server */
+int send_msg_flush()
+{
+    unsigned int count = queued_count;
+    unsigned long bytes = 0;
+    unsigned int i;
+    int sent;
+
+    if (count == 0) {
+        return (0);
+    }
+
+    queued_count = 0;
+
+    for (i = 0; i < count; i++) {
+        bytes += queued_msgs[i].len;
+    }
+
+    if ((sent = OS_SendUDPBatch(agt->sock, queued_msgs, count)) < (int)count) {
+        merror(SEND_ERROR, ARGV0, "server");
+        OS_MetricAdd(metric_errors, count - (unsigned int)(sent > 0 ? sent : 0));
+        send_failed = time(0);
         sleep(1);
         return (-1);
     }
 
+    OS_MetricAdd(metric_messages, count);
+    OS_MetricAdd(metric_bytes, bytes);
     return (0);
 }
 
+/* The server refused the messages sent (its port is closed) */
+void send_msg_refused()
+{
+    if (!send_msg_failing()) {
+        merror(SEND_ERROR, ARGV0, "server");
+    }
+    send_failed = time(0);
+}
+
+/* Check if the messages are failing: a send failed and the server has
+ * not answered since then
+ */
+int send_msg_failing()
+{
+    return (send_failed != 0 && send_failed >= available_server);
+}
+#endif
+
+#ifndef WIN32
+/* Milliseconds since the batch frame was opened */
+static long batch_elapsed()
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return ((now.tv_sec - batch_start.tv_sec) * 1000 +
+            (now.tv_usec - batch_start.tv_usec) / 1000);
+}
+
+/* Add an event to the batch frame, or queue it alone if the server
+ * does not accept batch frames
+ */
+int send_batch_add(const char *msg)
+{
+    size_t len;
+
+    OS_MetricAdd(metric_events, 1);
+
+    if (!agt->batch) {
+        return (send_msg_queue(0, msg));
+    }
+
+    len = AppendSecBatch(batch_frame, batch_len, (size_t)agt->batch_bytes, msg);
+
+    /* Full: send the frame and start a new one */
+    if (len == 0 && batch_len > 0) {
+        send_batch_flush(1);
+        len = AppendSecBatch(batch_frame, 0, (size_t)agt->batch_bytes, msg);
+    }
+
+    /* Larger than a frame */
+    if (len == 0) {
+        return (send_msg_queue(0, msg));
+    }
+
+    if (batch_len == 0) {
+        gettimeofday(&batch_start, NULL);
+    }
+
+    batch_len = len;
+    batch_events++;
+
+    return (0);
+}
+
+/* Queue the batch frame, if its latency budget is spent or forced */
+int send_batch_flush(int force)
+{
+    int ret;
+
+    if (batch_len == 0) {
+        return (0);
+    }
+
+    if (!force && batch_elapsed() < agt->batch_msecs) {
+        return (0);
+    }
+
+    /* A single event goes in the plain format */
+    if (batch_events == 1) {
+        char *event = batch_frame + strlen(BATCH_HEADER);
+        char *frame_end = batch_frame + batch_len;
+
+        ret = send_msg_queue(0, ReadSecBatch(&event, frame_end));
+    } else {
+        ret = send_msg_queue(0, batch_frame);
+    }
+
+    batch_len = 0;
+    batch_events = 0;
+
+    return (ret);
+}
+
+/* Milliseconds until the batch frame must be sent (-1 if there is none) */
+long send_batch_timeout()
+{
+    long left;
+
+    if (batch_len == 0) {
+        return (-1);
+    }
+
+    left = agt->batch_msecs - batch_elapsed();
+    return (left > 0 ? left : 0);
+}
+#endif
@@ -0,0 +1,394 @@
+/* Copyright (C) 2009 Trend Micro Inc.
+ * All rights reserved.
+ *
+ * This program is a free software; you can redistribute it
+ * and/or modify it under the terms of the GNU General Public
+ * License (version 2) as published by the FSF - Free Software
+ * Foundation
+ */
+
+/* Disk spool of the agent events
+ *
+ * The events that can not be sent to the manager (it is unreachable or
+ * asked to slow down) are appended to a spool in SPOOL_DIR. The spool is
+ * made of segment files of SPOOL_SEGMENT bytes, numbered in order. Each
+ * segment is mapped and keeps its own append and read cursors, so the
+ * events survive a restart of the agent. A segment is removed once it
+ * has been read.
+ *
+ * The events read are only removed (the read cursor moves) once they
+ * have been sent: spool_get and spool_next go through them, and
+ * spool_commit or spool_rewind end the round.
+ */
+
+#include "shared.h"
+#include "agentd.h"
+
+#ifndef WIN32
+
+#include <sys/mman.h>
+#include <dirent.h>
+
+#define SPOOL_DIR       "/queue/spool"
+#define SPOOL_SEGMENT   (1024 * 1024)
+#define SPOOL_MAGIC     0x4c4f5053
+
+/* Header of a segment, followed by the records: the length of the
+ * event (with its '\0') and the event, aligned to 4 bytes
+ */
+typedef struct _spool_header {
+    unsigned int magic;
+    unsigned int size;          /* Bytes in the file */
+    unsigned int write;         /* Append cursor */
+    unsigned int read;          /* Read cursor */
+} spool_header;
+
+#define SPOOL_RECORD(len) ((sizeof(unsigned int) + (len) + 3) & ~3U)
+
+/* Segments read and written (they may be the same one) */
+static spool_header *read_seg = NULL;
+static spool_header *write_seg = NULL;
+static unsigned int read_id = 0;
+static unsigned int write_id = 0;
+
+/* Next event to read in read_seg (the ones before it wait for a commit) */
+static unsigned int read_next = 0;
+
+static unsigned int max_segments = 0;
+static unsigned int events_lost = 0;
+
+static void spool_path(unsigned int id, char *path, size_t size);
+static spool_header *spool_map(unsigned int id, int create);
+static void spool_check(spool_header *seg, const char *path);
+static void spool_unmap(spool_header *seg);
+
+
+static void spool_path(unsigned int id, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%010u", SPOOL_DIR, id);
+}
+
+/* Map a segment, creating it if asked. Returns NULL on error */
+static spool_header *spool_map(unsigned int id, int create)
+{
+    char path[OS_FLSIZE + 1];
+    spool_header *seg;
+    int fd;
+
+    spool_path(id, path, sizeof(path));
+
+    if ((fd = open(path, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0640)) < 0) {
+        merror(FOPEN_ERROR, ARGV0, path, errno, strerror(errno));
+        return (NULL);
+    }
+
+    if (create && ftruncate(fd, SPOOL_SEGMENT) < 0) {
+        merror("%s: ERROR: Unable to extend '%s': %s", ARGV0, path, strerror(errno));
+        close(fd);
+        unlink(path);
+        return (NULL);
+    }
+
+    seg = (spool_header *) mmap(NULL, SPOOL_SEGMENT, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (seg == MAP_FAILED) {
+        merror("%s: ERROR: Unable to map '%s': %s", ARGV0, path, strerror(errno));
+        return (NULL);
+    }
+
+    if (create) {
+        seg->magic = SPOOL_MAGIC;
+        seg->size = SPOOL_SEGMENT;
+        seg->write = sizeof(spool_header);
+        seg->read = sizeof(spool_header);
+    } else if (seg->magic != SPOOL_MAGIC || seg->size != SPOOL_SEGMENT ||
+               seg->read > seg->write || seg->write > SPOOL_SEGMENT) {
+        merror("%s: WARN: Invalid spool segment '%s' ignored.", ARGV0, path);
+        munmap(seg, SPOOL_SEGMENT);
+        return (NULL);
+    } else {
+        spool_check(seg, path);
+    }
+
+    return (seg);
+}
+
+/* Check the records of a segment left on disk. A crash may have saved
+ * the header without the records, so the segment is cut at the first
+ * record that does not fit before the append cursor or is not a string.
+ */
+static void spool_check(spool_header *seg, const char *path)
+{
+    unsigned int offset = seg->read;
+    unsigned int len;
+    const char *event;
+
+    while (offset < seg->write) {
+        if (seg->write - offset < sizeof(len)) {
+            break;
+        }
+
+        memcpy(&len, (char *)seg + offset, sizeof(len));
+        event = (char *)seg + offset + sizeof(len);
+
+        if (len == 0 || len > OS_MAXSTR + 1 ||
+                SPOOL_RECORD(len) > seg->write - offset ||
+                memchr(event, '\0', len) != event + len - 1) {
+            break;
+        }
+
+        offset += SPOOL_RECORD(len);
+    }
+
+    if (offset < seg->write) {
+        merror("%s: WARN: Invalid event in the spool segment '%s'. "
+               "%u bytes discarded.", ARGV0, path, seg->write - offset);
+        seg->write = offset;
+    }
+}
+
+static void spool_unmap(spool_header *seg)
+{
+    if (seg) {
+        munmap(seg, SPOOL_SEGMENT);
+    }
+}
+
+/* Open the spool (size in MB, 0 disables it), with the events left by
+ * a previous run
+ */
+int spool_init(int size)
+{
+    DIR *dp;
+    struct dirent *entry;
+    unsigned int id;
+    char *end;
+
+    if (size <= 0) {
+        return (0);
+    }
+
+    if (mkdir(SPOOL_DIR, 0750) < 0 && errno != EEXIST) {
+        merror(MKDIR_ERROR, ARGV0, SPOOL_DIR, errno, strerror(errno));
+        return (-1);
+    }
+
+    if ((dp = opendir(SPOOL_DIR)) == NULL) {
+        merror("%s: ERROR: Unable to open directory '%s': %s", ARGV0,
+               SPOOL_DIR, strerror(errno));
+        return (-1);
+    }
+
+    /* Segments left: from the lowest to the highest number */
+    while ((entry = readdir(dp)) != NULL) {
+        if (!isdigit((int)entry->d_name[0])) {
+            continue;
+        }
+
+        id = (unsigned int) strtoul(entry->d_name, &end, 10);
+        if (*end != '\0' || id == 0) {
+            continue;
+        }
+
+        if (read_id == 0 || id < read_id) {
+            read_id = id;
+        }
+        if (id > write_id) {
+            write_id = id;
+        }
+    }
+
+    closedir(dp);
+
+    max_segments = (unsigned int)size;
+
+    if (read_id == 0) {
+        return (0);
+    }
+
+    /* Skip the segments that can not be used */
+    while (read_id <= write_id && (read_seg = spool_map(read_id, 0)) == NULL) {
+        read_id++;
+    }
+
+    if (read_seg == NULL) {
+        read_id = write_id = 0;
+        return (0);
+    }
+
+    read_next = read_seg->read;
+
+    /* If the last segment can not be used, a new one follows it */
+    if (read_id == write_id) {
+        write_seg = read_seg;
+    } else {
+        write_seg = spool_map(write_id, 0);
+    }
+
+    verbose("%s: INFO: Sending the events spooled by a previous run "
+            "(%u segments).", ARGV0, write_id - read_id + 1);
+
+    return (0);
+}
+
+/* Check if the spool is in use */
+int spool_enabled()
+{
+    return (max_segments > 0);
+}
+
+/* Check if there are events in the spool */
+int spool_pending()
+{
+    return (read_seg && (read_id != write_id || read_seg->read < read_seg->write));
+}
+
+/* Check if an event of any size can be added to the spool */
+int spool_room()
+{
+    if (!max_segments) {
+        return (0);
+    }
+
+    return (!write_seg || write_id - read_id + 1 < max_segments ||
+            write_seg->size - write_seg->write >= SPOOL_RECORD(OS_MAXSTR + 1));
+}
+
+/* Append an event to the spool. Returns 0 on success */
+int spool_add(const char *msg)
+{
+    unsigned int len = (unsigned int)strlen(msg) + 1;
+    unsigned int record = SPOOL_RECORD(len);
+    unsigned int next_id;
+    spool_header *seg;
+
+    if (!max_segments) {
+        return (-1);
+    }
+
+    /* Start a new segment if there is none or it is full */
+    if (!write_seg || write_seg->size - write_seg->write < record) {
+        next_id = write_id + 1;
+
+        if (write_seg && next_id - read_id + 1 > max_segments) {
+            if (events_lost++ == 0) {
+                merror("%s: WARN: Agent spool full (%u MB). Events lost.",
+                       ARGV0, max_segments);
+            }
+            return (-1);
+        }
+
+        if ((seg = spool_map(next_id, 1)) == NULL) {
+            events_lost++;
+            return (-1);
+        }
+
+        if (write_seg != read_seg) {
+            spool_unmap(write_seg);
+        }
+
+        if (!read_seg) {
+            read_seg = seg;
+            read_id = next_id;
+            read_next = seg->read;
+        }
+
+        write_seg = seg;
+        write_id = next_id;
+    }
+
+    memcpy((char *)write_seg + write_seg->write, &len, sizeof(len));
+    memcpy((char *)write_seg + write_seg->write + sizeof(len), msg, len);
+
+    /* The cursor moves once the event is written */
+    write_seg->write += record;
+
+    return (0);
+}
+
+/* Get the next event of the spool (NULL if there is none). It stays
+ * in the spool until spool_commit
+ */
+const char *spool_get()
+{
+    char path[OS_FLSIZE + 1];
+
+    if (!read_seg) {
+        return (NULL);
+    }
+
+    /* Done with this segment: remove it and go to the next one */
+    while (read_next >= read_seg->write) {
+        /* Events read from it are not sent yet */
+        if (read_seg->read < read_next || read_id == write_id) {
+            return (NULL);
+        }
+
+        spool_unmap(read_seg);
+        spool_path(read_id, path, sizeof(path));
+        unlink(path);
+
+        /* The segments that can not be used are skipped */
+        while ((read_seg = ++read_id == write_id ? write_seg : spool_map(read_id, 0)) == NULL) {
+            if (read_id == write_id) {
+                read_id = write_id = 0;
+                return (NULL);
+            }
+
+            spool_path(read_id, path, sizeof(path));
+            unlink(path);
+        }
+
+        read_next = read_seg->read;
+    }
+
+    return ((char *)read_seg + read_next + sizeof(unsigned int));
+}
+
+/* Move past the event returned by spool_get */
+void spool_next()
+{
+    unsigned int len;
+
+    if (!read_seg || read_next >= read_seg->write) {
+        return;
+    }
+
+    memcpy(&len, (char *)read_seg + read_next, sizeof(len));
+    read_next += SPOOL_RECORD(len);
+}
+
+/* Remove the events read (they were sent) */
+void spool_commit()
+{
+    if (!read_seg) {
+        return;
+    }
+
+    read_seg->read = read_next;
+
+    /* Reuse the last segment once it has been read */
+    if (read_id == write_id && read_seg->read >= read_seg->write) {
+        read_seg->write = sizeof(spool_header);
+        read_seg->read = sizeof(spool_header);
+        read_next = read_seg->read;
+
+        if (events_lost) {
+            merror("%s: WARN: %u events lost with the agent spool full.",
+                   ARGV0, events_lost);
+            events_lost = 0;
+        }
+    }
+}
+
+/* Read again the events not committed (they could not be sent) */
+void spool_rewind()
+{
+    if (read_seg) {
+        read_next = read_seg->read;
+    }
+}
+
+#endif /* !WIN32 */
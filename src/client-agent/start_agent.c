@@ -143,7 +143,25 @@ void start_agent(int is_startup)
     memset(buffer, '\0', OS_MAXSTR + 1);
     memset(cleartext, '\0', OS_MAXSTR + 1);
     memset(fmsg, '\0', OS_MAXSTR + 1);
-    snprintf(msg, OS_MAXSTR, "%s%s", CONTROL_HEADER, HC_STARTUP);
+    /* Ask for batch frames (if enabled) and the compression dictionary.
+     * The ACK says what the server accepted. Delta updates of the shared
+     * files are not acknowledged.
+     */
+#ifndef WIN32
+    snprintf(msg, OS_MAXSTR, "%s%s%s%s %s", CONTROL_HEADER, HC_STARTUP,
+             agt->batch_bytes > 0 ? HC_BATCH " " : "", HC_ZDICT, HC_DELTA);
+#else
+    snprintf(msg, OS_MAXSTR, "%s%s%s%s", CONTROL_HEADER, HC_STARTUP,
+             agt->batch_bytes > 0 ? HC_BATCH " " : "", HC_ZDICT);
+#endif
+
+#ifndef WIN32
+    /* Send what is pending in the current format */
+    send_batch_flush(1);
+    send_msg_flush();
+#endif
+    agt->batch = 0;
+    OS_SecDictionary(0);
 
 #ifdef ONEWAY_ENABLED
     return;
@@ -182,8 +200,11 @@ void start_agent(int is_startup)
             /* Check for commands */
             if (IsValidHeader(tmp_msg)) {
                 /* If it is an ack reply */
-                if (strcmp(tmp_msg, HC_ACK) == 0) {
+                if (strncmp(tmp_msg, HC_ACK, strlen(HC_ACK)) == 0) {
                     available_server = time(0);
+                    tmp_msg += strlen(HC_ACK);
+                    agt->batch = agt->batch_bytes > 0 && os_hasword(tmp_msg, HC_BATCH);
+                    OS_SecDictionary(os_hasword(tmp_msg, HC_ZDICT));
 
                     verbose(AG_CONNECTED, ARGV0, agt->rip[agt->rip_id],
                             agt->port);
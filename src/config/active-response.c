@@ -267,10 +267,11 @@ int ReadActiveResponses(XML_NODE node, void *d1, void *d2)
              tmp_ar->timeout);
 
     /* Add to shared file */
-    fprintf(fp, "%s - %s - %d\n",
+    fprintf(fp, "%s - %s - %d%s\n",
             tmp_ar->name,
             tmp_ar->ar_cmd->executable,
-            tmp_ar->timeout);
+            tmp_ar->timeout,
+            tmp_ar->ar_cmd->batch ? " - batch" : "");
 
     /* Set the configs to start the right queues */
     if (tmp_ar->location & AS_ONLY) {
@@ -321,6 +322,7 @@ int ReadActiveCommands(XML_NODE node, void *d1, __attribute__((unused)) void *d2
     const char *command_expect = "expect";
     const char *command_executable = "executable";
     const char *timeout_allowed = "timeout_allowed";
+    const char *command_batch = "batch";
 
     ar_command *tmp_command;
 
@@ -335,6 +337,7 @@ int ReadActiveCommands(XML_NODE node, void *d1, __attribute__((unused)) void *d2
     tmp_command->expect = 0;
     tmp_command->executable = NULL;
     tmp_command->timeout_allowed = 0;
+    tmp_command->batch = 0;
 
     /* Search for the commands */
     while (node[i]) {
@@ -367,6 +370,17 @@ int ReadActiveCommands(XML_NODE node, void *d1, __attribute__((unused)) void *d2
                 free(tmp_command);
                 return (OS_INVALID);
             }
+        } else if (strcmp(node[i]->element, command_batch) == 0) {
+            if (strcmp(node[i]->content, "yes") == 0) {
+                tmp_command->batch = 1;
+            } else if (strcmp(node[i]->content, "no") == 0) {
+                tmp_command->batch = 0;
+            } else {
+                merror(XML_VALUEERR, __local_name, node[i]->element, node[i]->content);
+                free(tmp_str);
+                free(tmp_command);
+                return (OS_INVALID);
+            }
         } else {
             merror(XML_INVELEM, __local_name, node[i]->element);
             free(tmp_str);
@@ -14,6 +14,7 @@
 typedef struct _ar_command {
     int expect;
     int timeout_allowed;
+    int batch;              /* Takes its operations in batches */
 
     char *name;
     char *executable;
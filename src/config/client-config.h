@@ -22,6 +22,11 @@ typedef struct _agent {
     int notify_time;
     int max_time_reconnect_try;
     char *profile;
+    int batch_bytes;    /* Size budget of a batch frame (0 to disable) */
+    int batch_msecs;    /* Latency budget of a batch frame */
+    int batch;          /* The server accepts batch frames */
+    int spool_size;     /* Size of the disk spool in MB (0 to disable) */
+    int spool_eps;      /* Events per second sent from the spool */
 } agent;
 
 #endif /* __CAGENTD_H */
@@ -31,6 +31,10 @@ typedef struct _remoted {
     int m_queue;
     int sock;
     socklen_t peer_size;
+
+    /* Secure receiver sockets, one per thread (recv_socks[0] is sock) */
+    int *recv_socks;
+    int recv_threads;
 } remoted;
 
 #endif /* __CLOGREMOTE_H */
@@ -0,0 +1,45 @@
+/* Copyright (C) 2009 Trend Micro Inc.
+ * All rights reserved.
+ *
+ * This program is a free software; you can redistribute it
+ * and/or modify it under the terms of the GNU General Public
+ * License (version 2) as published by the FSF - Free Software
+ * Foundation.
+ */
+
+/* Local control sockets
+ * A daemon serves one text command per connection on a Unix
+ * stream socket and writes a plain text reply back. The "metrics"
+ * command is served by every daemon (see metrics_op.h).
+ */
+
+#ifndef _CONTROL_OP_H
+#define _CONTROL_OP_H
+
+#ifndef WIN32
+
+#define OS_CONTROL_MAXCMD   1024
+
+/* Called from the control thread with the received command
+ * (without the trailing newline). The reply is written to "reply".
+ */
+typedef void (*OSControl_Handler)(const char *command, FILE *reply);
+
+/* Start serving "path" from a new thread
+ * Returns 0 on success or -1 on error
+ */
+int OS_StartControl(const char *path, OSControl_Handler handler) __attribute__((nonnull));
+
+/* Send "command" to the control socket at "path" and copy the
+ * reply to "out". Returns 0 on success or -1 on error
+ */
+int OS_ControlRequest(const char *path, const char *command, FILE *out) __attribute__((nonnull));
+
+/* Send "command" to the control socket at "path"
+ * Returns the reply to be read (and closed) or NULL on error
+ */
+FILE *OS_ControlOpen(const char *path, const char *command) __attribute__((nonnull));
+
+#endif /* !WIN32 */
+
+#endif /* _CONTROL_OP_H */
@@ -111,6 +111,9 @@ http://www.ossec.net/main/license/\n"
 /* Agent information location */
 #define AGENTINFO_DIR    "/queue/agent-info"
 
+/* Snapshot of the agent status kept by remoted */
+#define AGENTSTATUS_FILE AGENTINFO_DIR "/.status"
+
 /* Syscheck directory */
 #define SYSCHECK_DIR    "/queue/syscheck"
 
@@ -182,6 +185,7 @@ http://www.ossec.net/main/license/\n"
 #define STATWQUEUE  "/stats/weekly-average"
 #define STATQUEUE   "/stats/hourly-average"
 #define STATSAVED   "/stats/totals"
+#define STATPROFILE "/stats/profile.log"
 
 /* Authentication keys file */
 #ifndef WIN32
@@ -241,6 +245,10 @@ http://www.ossec.net/main/license/\n"
 
 #define WAIT_FILE_PATH  DEFAULTDIR WAIT_FILE
 
+/* Control sockets (one per daemon, named after it) */
+#define CONTROL_DIR         "/queue/control"
+#define CONTROL_DIR_PATH    DEFAULTDIR CONTROL_DIR
+
 #define TMP_DIR "tmp"
 
 /* Windows COMSPEC */
@@ -62,5 +62,12 @@ void *OSHash_Get(const OSHash *self, const char *key) __attribute__((nonnull));
 
 int OSHash_setSize(OSHash *self, unsigned int new_size) __attribute__((nonnull));
 
+/* 64-bit FNV-1a hash of size bytes of data.
+ * Start with OS_HASH64_INIT, or chain from a previous value
+ * to hash more than one buffer.
+ */
+#define OS_HASH64_INIT 0xcbf29ce484222325ULL
+u_int64_t OSHash_Hash64(const void *data, size_t size, u_int64_t hash) __attribute__((nonnull));
+
 #endif
 
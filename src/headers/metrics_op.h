@@ -0,0 +1,79 @@
+/* Copyright (C) 2009 Trend Micro Inc.
+ * All rights reserved.
+ *
+ * This program is a free software; you can redistribute it
+ * and/or modify it under the terms of the GNU General Public
+ * License (version 2) as published by the FSF - Free Software
+ * Foundation.
+ */
+
+/* Daemon metrics
+ * Counters, gauges and histograms registered by a daemon at start up
+ * and updated from any thread without locks: each thread adds to its
+ * own cell, and the cells are summed when the metrics are read. They
+ * are served in text ("<name> <value>" lines with # HELP and # TYPE
+ * comments) by the "metrics" command of the control socket.
+ */
+
+#ifndef _METRICS_OP_H
+#define _METRICS_OP_H
+
+/* Threads with a cell of their own (the rest share the last one) */
+#define OS_METRIC_THREADS   64
+
+/* Histogram buckets: up to 1, 2, 4 ... 2^22 and the rest */
+#define OS_METRIC_BUCKETS   24
+
+#define OS_METRIC_MAX       128
+
+typedef enum _os_metric_type {
+    OS_METRIC_COUNTER,
+    OS_METRIC_GAUGE,
+    OS_METRIC_HISTOGRAM
+} os_metric_type;
+
+/* Value of a gauge, read when the metrics are served */
+typedef long (*OSMetric_Read)(void);
+
+typedef struct _os_metric {
+    char *name;
+    char *help;
+    os_metric_type type;
+    OSMetric_Read read;         /* Gauges read when served */
+    size_t cell_size;           /* Bytes per thread (cache line aligned) */
+    char *cells;
+} os_metric;
+
+/* Register a metric. The name gets the "ossec_" prefix.
+ * Returns NULL on error (the updates do nothing then)
+ */
+os_metric *OS_MetricCounter(const char *name, const char *help) __attribute__((nonnull));
+os_metric *OS_MetricGauge(const char *name, const char *help, OSMetric_Read read) __attribute__((nonnull(1, 2)));
+os_metric *OS_MetricHistogram(const char *name, const char *help) __attribute__((nonnull));
+
+/* Add to a counter */
+void OS_MetricAdd(os_metric *metric, unsigned long value);
+
+/* Add a value to a histogram */
+void OS_MetricObserve(os_metric *metric, unsigned long value);
+
+/* Monotonic time in microseconds, to measure latencies */
+unsigned long OS_MetricNow(void);
+
+/* Print every metric, and the CPU and memory use of the process */
+void OS_MetricsPrint(FILE *fp) __attribute__((nonnull));
+
+#ifndef WIN32
+
+/* Control handler serving only "metrics" */
+void OS_MetricsControl(const char *command, FILE *reply) __attribute__((nonnull));
+
+/* Serve the metrics on the control socket of the daemon
+ * (CONTROL_DIR/<name>, inside the chroot if there is one), for the
+ * daemons that do not start one. Returns 0 on success or -1 on error
+ */
+int OS_StartMetrics(void);
+
+#endif /* !WIN32 */
+
+#endif /* _METRICS_OP_H */
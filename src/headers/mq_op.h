@@ -26,5 +26,63 @@ int StartMQ(const char *key, short int type) __attribute__((nonnull));
 
 int SendMSG(int queue, const char *message, const char *locmsg, char loc) __attribute__((nonnull));
 
+/* Non-blocking SendMSG (not for SECURE_MQ). 1 means the queue is full */
+int TrySendMSG(int queue, const char *message, const char *locmsg, char loc) __attribute__((nonnull));
+
+/* Shared memory transport (see shared/mq_shm.c) */
+#ifdef __linux__
+#define MQ_SHM_ENABLED
+#endif
+
+typedef struct _mq_shm_status {
+    size_t size;                /* Bytes in the ring */
+    size_t used;                /* Bytes in use */
+    unsigned long messages;     /* Messages waiting */
+    unsigned long total;        /* Messages written */
+    unsigned long full;         /* Times a writer found it full */
+    unsigned long dropped;      /* Messages lost after waiting for room */
+} mq_shm_status;
+
+struct iovec;
+
+/* Create the ring of a queue (reader side). Returns 0 on success */
+int MQ_ShmCreate(int queue, const char *path, size_t size) __attribute__((nonnull));
+
+/* Attach to the ring of a queue, if it has one (StartMQ does it) */
+int MQ_ShmAttach(int queue, const char *path) __attribute__((nonnull));
+
+void MQ_ShmDetach(int queue);
+
+int MQ_ShmAttached(int queue);
+
+/* Write a message to the ring: 0 on success, 1 if full, -1 if no ring */
+int MQ_ShmSend(int queue, const struct iovec *iov, int iovcnt, int block) __attribute__((nonnull));
+
+/* Wait up to msecs for room in the ring. Returns -1 if no ring */
+int MQ_ShmWait(int queue, int msecs);
+
+/* Receive a message from a queue, from its ring or its socket */
+int RecvMSG(int queue, char *buffer, int size) __attribute__((nonnull));
+
+/* State of the ring of a queue. Returns -1 if it has no ring */
+int MQ_ShmStatus(int queue, mq_shm_status *status) __attribute__((nonnull));
+
+/* Percentage of the ring in use. Returns -1 if it has no ring */
+int MQ_ShmLoad(int queue);
+
+/* Flow control. While the queue is congested (its ring is more than
+ * a given percentage full), each source may send up to a rate of
+ * messages per second, counted by a token bucket.
+ */
+typedef struct _mq_bucket {
+    time_t second;              /* Last refill */
+    unsigned int tokens;        /* Messages left */
+} mq_bucket;
+
+/* Take a token from a bucket of rate messages per second.
+ * Returns 1 if the message can be sent, 0 if the bucket is empty.
+ */
+int MQ_BucketTake(mq_bucket *bucket, unsigned int rate, time_t now) __attribute__((nonnull));
+
 #endif
 
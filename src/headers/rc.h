@@ -15,6 +15,9 @@
 /* Global headers */
 #define CONTROL_HEADER      "#!-"
 
+/* Several events packed in one message (see AppendSecBatch) */
+#define BATCH_HEADER        "#!+"
+
 #define IsValidHeader(str)  ((str[0] == '#') && \
                              (str[1] == '!') && \
                              (str[2] == '-') && \
@@ -23,8 +26,14 @@
 #define EXECD_HEADER        "execd "
 #define FILE_UPDATE_HEADER  "up file "
 #define FILE_CLOSE_HEADER   "close file "
+#define FILE_DELTA_HEADER   "up delta "
+#define FILE_COPY_HEADER    "copy file "
 #define HC_STARTUP          "agent startup "
 #define HC_ACK              "agent ack "
+#define HC_BATCH            "batch"
+#define HC_ZDICT            "zdict"
+#define HC_DELTA            "delta"
+#define HC_SLOWDOWN         "slow down "
 #define HC_SK_DB_COMPLETED  "syscheck-db-completed"
 #define HC_SK_RESTART       "syscheck restart"
 
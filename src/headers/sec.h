@@ -22,10 +22,15 @@ typedef struct _keyentry {
     char *id;
     char *key;
     char *name;
+    struct _OS_BF_KEY *bf_key;  /* Key schedule of key */
 
     os_ip *ip;
     struct sockaddr_in peer_info;
+#ifndef WIN32
+    int slot;                   /* Entry in the counters table */
+#else
     FILE *fp;
+#endif
 } keyentry;
 
 /* Key storage */
@@ -33,9 +38,10 @@ typedef struct _keystore {
     /* Array with all the keys */
     keyentry **keyentries;
 
-    /* Hashes, based on the ID/IP to look up the keys */
+    /* Hashes, based on the ID/IP/name to look up the keys */
     OSHash *keyhash_id;
     OSHash *keyhash_ip;
+    OSHash *keyhash_name;
 
     /* Total key size */
     unsigned int keysize;
@@ -61,12 +67,51 @@ int OS_CheckUpdateKeys(const keystore *keys) __attribute((nonnull));
 /* Update the keys if they changed on the system */
 int OS_UpdateKeys(keystore *keys) __attribute((nonnull));
 
+/* Read the keys again into update, sharing the entries that did not change.
+ * Returns the number of changes or -1 on error
+ */
+int OS_DiffKeys(const keystore *keys, keystore *update) __attribute((nonnull));
+
+/* Publish the keys read by OS_DiffKeys (keys must not be in use).
+ * update gets the previous keys
+ */
+void OS_SwapKeys(keystore *keys, keystore *update) __attribute((nonnull));
+
+/* Free the previous keys after OS_SwapKeys */
+void OS_ReleaseKeys(const keystore *keys, keystore *previous) __attribute((nonnull));
+
 /* Start counter for all agents */
 void OS_StartCounter(keystore *keys) __attribute((nonnull));
 
+/* Start the counters of new agents */
+void OS_AddCounter(keyentry **entries, unsigned int count) __attribute((nonnull));
+
 /* Remove counter for id */
 void OS_RemoveCounter(const char *id) __attribute((nonnull));
 
+#ifndef WIN32
+/* Use another counters table file (RIDS_TABLE by default) */
+void OS_RidsFile(const char *path, int interval) __attribute((nonnull));
+
+/* Map the counters table. Returns -1 on error */
+int OS_RidsOpen(void);
+
+/* Assign an entry of the counters table to each key and read the counters */
+int OS_RidsLoad(keystore *keys) __attribute((nonnull));
+
+/* Assign an entry of the counters table to new keys and read the counters */
+int OS_RidsAssign(keyentry **entries, unsigned int count) __attribute((nonnull));
+
+/* Store the counters of an entry of the table */
+void OS_RidsStore(int slot, unsigned int global, unsigned int local);
+
+/* Write the counters table to the disk */
+void OS_RidsSync(void);
+
+/* Free the entry of an agent in the counters table */
+void OS_RidsRemove(const char *id) __attribute((nonnull));
+#endif
+
 
 /** Function prototypes -- agent authorization **/
 
@@ -89,9 +134,23 @@ int OS_IsAllowedDynamicID(keystore *keys, const char *id, const char *srcip) __a
 char *ReadSecMSG(keystore *keys, char *buffer, char *cleartext,
                  int id, unsigned int buffer_size) __attribute((nonnull));
 
+/* Use the preset compression dictionary in CreateSecMSG */
+void OS_SecDictionary(int enable);
+
 /* Create an OSSEC message (encrypt and compress) */
 size_t CreateSecMSG(const keystore *keys, const char *msg, char *msg_encrypted, unsigned int id) __attribute((nonnull));
 
+/* Append an event to a batch frame of at most size bytes.
+ * Returns the new frame length, or 0 if the event does not fit.
+ */
+size_t AppendSecBatch(char *frame, size_t frame_len, size_t size, const char *msg) __attribute((nonnull));
+
+/* Get the next event of a batch frame (cursor starts after BATCH_HEADER,
+ * frame_end points to the end of the frame). The event is terminated in
+ * place. Returns NULL at the end of the frame.
+ */
+char *ReadSecBatch(char **cursor, const char *frame_end) __attribute((nonnull));
+
 
 /** Remote IDs directories and internal definitions */
 #ifndef WIN32
@@ -101,6 +160,7 @@ size_t CreateSecMSG(const keystore *keys, const char *msg, char *msg_encrypted,
 #endif
 
 #define SENDER_COUNTER  "sender_counter"
+#define RIDS_TABLE      RIDS_DIR "/counters"
 #define KEYSIZE         128
 
 #endif /* __SEC_H */
@@ -96,6 +96,7 @@
 
 #ifdef SOLARIS
 #include <limits.h>
+typedef uint64_t u_int64_t;
 typedef uint32_t u_int32_t;
 typedef uint16_t u_int16_t;
 typedef uint8_t u_int8_t;
@@ -108,6 +109,7 @@ typedef uint8_t u_int8_t;
 
 #if defined HPUX
 #include <limits.h>
+typedef uint64_t u_int64_t;
 typedef uint32_t u_int32_t;
 typedef uint16_t u_int16_t;
 typedef uint8_t u_int8_t;
@@ -133,6 +135,7 @@ typedef int sock2len_t;
 	#define lstat(x,y) stat(x,y)
 	#define CloseSocket(x) closesocket(x)
 	void WinSetError();
+	typedef unsigned long long u_int64_t;
 	typedef unsigned short int u_int16_t;
 	typedef unsigned char u_int8_t;
 
@@ -182,6 +185,8 @@ extern const char *__local_name;
 #include "mq_op.h"
 #include "privsep_op.h"
 #include "pthreads_op.h"
+#include "control_op.h"
+#include "metrics_op.h"
 #include "regex_op.h"
 #include "sig_op.h"
 #include "list_op.h"
@@ -22,5 +22,8 @@ char *os_strip_char(const char *source, char remove) __attribute__((nonnull));
 /* Escape a list of characters with a backslash */
 char *os_shell_escape(const char *src);
 
+/* Check if word is one of the space-separated words of str */
+int os_hasword(const char *str, const char *word) __attribute__((nonnull));
+
 #endif
 
@@ -34,6 +34,21 @@ int OS_IPFound(const char *ip_address, const os_ip *that_ip) __attribute__((nonn
  */
 int OS_IPFoundList(const char *ip_address, os_ip **list_of_ips) __attribute__((nonnull));
 
+/* Compiled list of IPs (prefix tree) */
+typedef struct _os_iptree os_iptree;
+
+/* Compile a NULL terminated list of IPs for OS_IPTreeFound
+ * Returns NULL if the list has a netmask that is not a prefix
+ */
+os_iptree *OS_IPTreeCompile(os_ip **list_of_ips) __attribute__((nonnull));
+
+/* Same as OS_IPFoundList, but for a compiled list and an IPv4 address
+ * in network byte order
+ */
+int OS_IPTreeFound(const os_iptree *tree, unsigned int ip_address) __attribute__((nonnull));
+
+void OS_IPTreeFree(os_iptree *tree);
+
 /* Validate if an IP address is in the right format
  * Returns 0 if doesn't match or 1 if it does (or 2 if it has a CIDR)
  * WARNING: On success this function may modify the value of IP_address
@@ -17,9 +17,19 @@ int update_fname(int i);
 int loop_timeout;
 int logr_queue;
 int open_file_attempts;
+int flow_high;
+unsigned int flow_rate;
 logreader *logff;
 static int _cday = 0;
 
+/* Lines sent by each file while the queue is congested */
+static mq_bucket *flow_buckets = NULL;
+
+/* Metrics */
+static os_metric *metric_reads;
+static os_metric *metric_read_time;
+static os_metric *metric_throttled;
+
 
 static char *rand_keepalive_str(char *dst, int size)
 {
@@ -44,6 +54,7 @@ void LogCollectorStart()
     int max_file = 0;
     int f_check = 0;
     time_t curr_time = 0;
+    unsigned long started;
     char keepalive[1024];
 
     /* To check for inode changes */
@@ -236,6 +247,15 @@ void LogCollectorStart()
         max_file = 0;
     }
 
+    os_calloc((size_t)max_file + 1, sizeof(mq_bucket), flow_buckets);
+
+    metric_reads = OS_MetricCounter("logcollector_reads_total",
+                                    "Reads of the files with new lines (and commands run).");
+    metric_read_time = OS_MetricHistogram("logcollector_read_microseconds",
+                                          "Time to read and send the new lines of a file.");
+    metric_throttled = OS_MetricCounter("logcollector_throttled_total",
+                                        "Reads stopped while the queue is congested (lines left for later).");
+
     /* Daemon loop */
     while (1) {
 #ifndef WIN32
@@ -272,6 +292,7 @@ void LogCollectorStart()
                     if ((curr_time - logff[i].size) >= logff[i].ign) {
                         logff[i].size = curr_time;
                         logff[i].read(i, &r, 0);
+                        OS_MetricAdd(metric_reads, 1);
                     }
                 }
                 continue;
@@ -296,7 +317,10 @@ void LogCollectorStart()
 #endif
 
             /* Finally, send to the function pointer to read it */
+            started = OS_MetricNow();
             logff[i].read(i, &r, 0);
+            OS_MetricAdd(metric_reads, 1);
+            OS_MetricObserve(metric_read_time, OS_MetricNow() - started);
 
             /* Check for error */
             if (!ferror(logff[i].fp)) {
@@ -534,6 +558,30 @@ void LogCollectorStart()
     }
 }
 
+/* Check if another line of a file can be read and sent now. While the
+ * queue is congested each file may send up to flow_rate lines per
+ * second, and the rest are left in the file for later.
+ */
+int can_read(int pos)
+{
+#ifndef WIN32
+    if (flow_high == 0 || !flow_buckets ||
+            MQ_ShmLoad(logr_queue) < flow_high) {
+        return (1);
+    }
+
+    if (MQ_BucketTake(&flow_buckets[pos], flow_rate, time(0))) {
+        return (1);
+    }
+
+    OS_MetricAdd(metric_throttled, 1);
+    return (0);
+#else
+    (void)pos;
+    return (1);
+#endif
+}
+
 int update_fname(int i)
 {
     struct tm *p;
@@ -29,6 +29,9 @@ void LogCollectorStart(void) __attribute__((noreturn));
 /* Handle files */
 int handle_file(int i, int do_fseek, int do_log);
 
+/* Flow control: check if a line of a file can be read now */
+int can_read(int pos);
+
 /* Read syslog file */
 void *read_syslog(int pos, int *rc, int drop_it);
 
@@ -74,6 +77,8 @@ void win_format_event_string(char *string);
 extern int loop_timeout;
 extern int logr_queue;
 extern int open_file_attempts;
+extern int flow_high;
+extern unsigned int flow_rate;
 extern logreader *logff;
 
 #endif /* __LOGREADER_H */
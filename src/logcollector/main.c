@@ -118,6 +118,10 @@ int main(int argc, char **argv)
     open_file_attempts = getDefine_Int("logcollector", "open_attempts",
                                        2, 998);
 
+    /* Flow control towards analysisd */
+    flow_high = getDefine_Int("logcollector", "flow_high", 0, 100);
+    flow_rate = (unsigned int) getDefine_Int("logcollector", "flow_rate", 1, 1000000);
+
     /* Exit if test config */
     if (test_config) {
         exit(0);
@@ -150,6 +154,9 @@ int main(int argc, char **argv)
         merror(PID_ERROR, ARGV0);
     }
 
+    /* Metrics (served on the control socket) */
+    OS_StartMetrics();
+
     /* Wait 6 seconds for the analysisd/agentd to settle */
     debug1("%s: DEBUG: Waiting main daemons to settle.", ARGV0);
     sleep(6);
@@ -27,7 +27,9 @@ void *read_syslog(int pos, int *rc, int drop_it)
     /* Get initial file location */
     fgetpos(logff[pos].fp, &fp_pos);
 
-    while (fgets(str, OS_MAXSTR - OS_LOG_HEADER, logff[pos].fp) != NULL) {
+    /* The lines over the flow control rate are left in the file */
+    while (can_read(pos) &&
+            fgets(str, OS_MAXSTR - OS_LOG_HEADER, logff[pos].fp) != NULL) {
         /* Get the last occurence of \n */
         if ((p = strrchr(str, '\n')) != NULL) {
             *p = '\0';
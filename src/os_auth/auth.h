@@ -53,6 +53,13 @@ int load_cert_and_key(SSL_CTX *ctx, const char *cert, const char *key);
 int load_ca_cert(SSL_CTX *ctx, const char *ca_cert);
 int verify_callback(int ok, X509_STORE_CTX *store);
 
+/* Keys of the server (auth_keys.c) */
+#define AUTH_DUPLICATED -2      /* Name in use (and its variants) */
+#define AUTH_FULL       -3      /* No more agents or ids */
+
+int AuthKeys_Init(void);
+int AuthKeys_Add(const char *name, const char *ip, char *key, size_t size) __attribute__((nonnull(1, 3)));
+
 #endif /* LIBOPENSSL_ENABLED */
 #endif /* _AUTHD_H */
 
@@ -0,0 +1,454 @@
+/* Copyright (C) 2010 Trend Micro Inc.
+ * All rights reserved.
+ *
+ * This program is a free software; you can redistribute it
+ * and/or modify it under the terms of the GNU General Public
+ * License (version 2) as published by the FSF - Free Software
+ * Foundation
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ */
+
+/* Keys of ossec-authd
+ *
+ * The agent ids and names of client.keys are kept in memory, so a new
+ * agent is checked and given an id without reading the file. The new
+ * keys are queued for a writer thread, which writes the whole file
+ * (to a temporary file, renamed over client.keys) with all the keys
+ * queued meanwhile, and then wakes up their requests. If the file was
+ * changed by someone else (manage_agents), it is read again first.
+ */
+
+#ifdef LIBOPENSSL_ENABLED
+
+#include <pthread.h>
+
+#include "shared.h"
+#include "auth.h"
+#include "os_crypto/md5/md5_op.h"
+
+/* Highest agent id given */
+#define AUTH_MAX_ID     99999
+
+/* A key waiting to be written */
+typedef struct _auth_entry {
+    char line[OS_SIZE_2048 + 1];
+    char id[16];
+    char name[OS_SIZE_256 + 1];
+    int status;                 /* 0 queued, 1 written, -1 failed */
+    struct _auth_entry *next;
+} auth_entry;
+
+/* Prototypes */
+static void auth_index(const char *line);
+static void auth_unindex(const auth_entry *entry);
+static int auth_load(const char *data, size_t len);
+static char *auth_read(size_t *len);
+static int auth_write(const auth_entry *list);
+static void *auth_writer(void *none) __attribute__((noreturn));
+
+/* Global vars */
+static pthread_mutex_t auth_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t auth_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t auth_done = PTHREAD_COND_INITIALIZER;
+
+static OSHash *auth_ids = NULL;         /* Ids in use (removed agents too) */
+static OSHash *auth_names = NULL;       /* Names of the agents */
+static unsigned int auth_agents = 0;
+static unsigned int auth_next_id = 1024;
+
+static char *auth_data = NULL;          /* client.keys as last read/written */
+static size_t auth_len = 0;
+
+static auth_entry *auth_pending = NULL;
+static auth_entry **auth_last = &auth_pending;
+
+static char *auth_uname = NULL;
+
+
+/* Add a line of client.keys to the indexes */
+static void auth_index(const char *line)
+{
+    char buf[OS_SIZE_2048 + 1];
+    char *name;
+    char *end;
+
+    if (line[0] == '#' || line[0] == ' ' || line[0] == '\0') {
+        return;
+    }
+
+    strncpy(buf, line, OS_SIZE_2048);
+    buf[OS_SIZE_2048] = '\0';
+
+    if ((name = strchr(buf, ' ')) == NULL) {
+        return;
+    }
+    *name++ = '\0';
+
+    /* The ids of the removed agents are not given again */
+    OSHash_Add(auth_ids, buf, (void *)1);
+
+    if (*name == '#' || (end = strchr(name, ' ')) == NULL) {
+        return;
+    }
+    *end = '\0';
+
+    OSHash_Add(auth_names, name, (void *)1);
+    auth_agents++;
+}
+
+/* Remove a key that could not be written from the indexes */
+static void auth_unindex(const auth_entry *entry)
+{
+    OSHash_Delete(auth_ids, entry->id);
+    OSHash_Delete(auth_names, entry->name);
+    auth_agents--;
+}
+
+/* Index the contents of client.keys (the mutex must be locked).
+ * The queued keys that now conflict with the file are failed.
+ * Returns 0 on success or -1 on error
+ */
+static int auth_load(const char *data, size_t len)
+{
+    auth_entry **entry;
+    const char *line;
+    const char *end;
+    char buf[OS_SIZE_2048 + 1];
+    size_t n;
+
+    if (auth_ids) {
+        OSHash_Free(auth_ids);
+    }
+    if (auth_names) {
+        OSHash_Free(auth_names);
+    }
+
+    auth_ids = OSHash_Create();
+    auth_names = OSHash_Create();
+    if (!auth_ids || !auth_names ||
+            !OSHash_setSize(auth_ids, (unsigned int)(len / 32) + 1) ||
+            !OSHash_setSize(auth_names, (unsigned int)(len / 32) + 1)) {
+        merror(MEM_ERROR, ARGV0, errno, strerror(errno));
+        return (-1);
+    }
+
+    auth_agents = 0;
+
+    for (line = data; line < data + len; line = end + 1) {
+        if ((end = memchr(line, '\n', (size_t)(data + len - line))) == NULL) {
+            end = data + len;
+        }
+
+        n = (size_t)(end - line) < OS_SIZE_2048 ? (size_t)(end - line) : OS_SIZE_2048;
+        memcpy(buf, line, n);
+        buf[n] = '\0';
+
+        auth_index(buf);
+    }
+
+    for (entry = &auth_pending; *entry;) {
+        if (OSHash_Get(auth_ids, (*entry)->id) ||
+                OSHash_Get(auth_names, (*entry)->name)) {
+            merror("%s: WARN: Agent '%s' (%s) was added to '%s' meanwhile.",
+                   ARGV0, (*entry)->name, (*entry)->id, KEYSFILE_PATH);
+            (*entry)->status = -1;
+            *entry = (*entry)->next;
+            continue;
+        }
+
+        auth_index((*entry)->line);
+        entry = &(*entry)->next;
+    }
+
+    for (auth_last = &auth_pending; *auth_last; auth_last = &(*auth_last)->next);
+
+    if (auth_data != data) {
+        free(auth_data);
+    }
+    auth_data = (char *)data;
+    auth_len = len;
+
+    return (0);
+}
+
+/* Read client.keys. Returns NULL on error */
+static char *auth_read(size_t *len)
+{
+    struct stat st;
+    char *data;
+    FILE *fp;
+
+    if ((fp = fopen(KEYSFILE_PATH, "r")) == NULL) {
+        merror(FOPEN_ERROR, ARGV0, KEYSFILE_PATH, errno, strerror(errno));
+        return (NULL);
+    }
+
+    if (fstat(fileno(fp), &st) < 0) {
+        fclose(fp);
+        return (NULL);
+    }
+
+    os_calloc((size_t)st.st_size + 1, sizeof(char), data);
+    *len = fread(data, 1, (size_t)st.st_size, fp);
+    fclose(fp);
+
+    return (data);
+}
+
+/* Write client.keys with the keys of list appended, to a temporary
+ * file renamed over it. Returns 0 on success or -1 on error
+ */
+static int auth_write(const auth_entry *list)
+{
+    char tmp_path[OS_FLSIZE + 1];
+    struct stat st;
+    FILE *fp;
+    int fd;
+
+    snprintf(tmp_path, OS_FLSIZE, "%s.tmp", KEYSFILE_PATH);
+
+    if (stat(KEYSFILE_PATH, &st) < 0) {
+        st.st_mode = 0440;
+        st.st_uid = getuid();
+        st.st_gid = getgid();
+    }
+
+    if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777)) < 0 ||
+            (fp = fdopen(fd, "w")) == NULL) {
+        merror(FOPEN_ERROR, ARGV0, tmp_path, errno, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return (-1);
+    }
+
+    if (fchown(fd, st.st_uid, st.st_gid) < 0) {
+        debug1("%s: DEBUG: Unable to set the owner of '%s'.", ARGV0, tmp_path);
+    }
+
+    fwrite(auth_data, 1, auth_len, fp);
+    for (; list; list = list->next) {
+        fprintf(fp, "%s\n", list->line);
+    }
+
+    if (fflush(fp) != 0 || fsync(fd) < 0) {
+        merror("%s: ERROR: Unable to write '%s': %s", ARGV0, tmp_path, strerror(errno));
+        fclose(fp);
+        unlink(tmp_path);
+        return (-1);
+    }
+
+    fclose(fp);
+
+    if (rename(tmp_path, KEYSFILE_PATH) < 0) {
+        merror(RENAME_ERROR, ARGV0, tmp_path, KEYSFILE_PATH, errno, strerror(errno));
+        unlink(tmp_path);
+        return (-1);
+    }
+
+    return (0);
+}
+
+/* Write the keys queued, all of them at once */
+static void *auth_writer(__attribute__((unused)) void *none)
+{
+    auth_entry *list;
+    auth_entry *entry;
+    char *data;
+    size_t len;
+    size_t size;
+    int ret;
+
+    pthread_mutex_lock(&auth_mutex);
+
+    while (1) {
+        while (!auth_pending) {
+            pthread_cond_wait(&auth_queued, &auth_mutex);
+        }
+
+        /* Changed by someone else */
+        if ((data = auth_read(&len)) != NULL) {
+            if (len != auth_len || memcmp(data, auth_data, len) != 0) {
+                verbose("%s: INFO: '%s' changed. Reading it again.", ARGV0, KEYSFILE_PATH);
+                auth_load(data, len);
+                pthread_cond_broadcast(&auth_done);
+            } else {
+                free(data);
+            }
+        }
+
+        if ((list = auth_pending) == NULL) {
+            continue;
+        }
+
+        auth_pending = NULL;
+        auth_last = &auth_pending;
+
+        /* auth_data is only changed by this thread */
+        pthread_mutex_unlock(&auth_mutex);
+        ret = auth_write(list);
+        pthread_mutex_lock(&auth_mutex);
+
+        for (entry = list, size = 0; entry; entry = entry->next) {
+            size += strlen(entry->line) + 1;
+        }
+
+        if (ret == 0) {
+            os_realloc(auth_data, auth_len + size + 1, auth_data);
+        }
+
+        for (entry = list; entry; entry = entry->next) {
+            if (ret == 0) {
+                len = strlen(entry->line);
+                memcpy(auth_data + auth_len, entry->line, len);
+                auth_data[auth_len + len] = '\n';
+                auth_len += len + 1;
+            } else {
+                auth_unindex(entry);
+            }
+        }
+
+        /* The requests free their entries once woken up */
+        for (entry = list; entry; entry = list) {
+            list = entry->next;
+            entry->status = ret == 0 ? 1 : -1;
+        }
+
+        debug1("%s: DEBUG: Keys written to '%s' (%lu bytes).", ARGV0,
+               KEYSFILE_PATH, (unsigned long)size);
+
+        pthread_cond_broadcast(&auth_done);
+    }
+}
+
+/* Read client.keys and start the writer
+ * Returns 0 on success or -1 on error
+ */
+int AuthKeys_Init()
+{
+    char *data;
+    size_t len;
+
+    if ((data = auth_read(&len)) == NULL) {
+        return (-1);
+    }
+
+    srandom_init();
+    auth_uname = getuname();
+
+    pthread_mutex_lock(&auth_mutex);
+    if (auth_load(data, len) < 0) {
+        pthread_mutex_unlock(&auth_mutex);
+        return (-1);
+    }
+    pthread_mutex_unlock(&auth_mutex);
+
+    verbose("%s: INFO: %u agents in '%s'.", ARGV0, auth_agents, KEYSFILE_PATH);
+
+    if (CreateThread(auth_writer, NULL) != 0) {
+        return (-1);
+    }
+
+    return (0);
+}
+
+/* Add an agent, renamed as name2, name3... if the name is in use
+ * (ip may be NULL for "any"). Waits until the key is written, and
+ * then copies it (the whole line) to key.
+ * Returns 0 on success, AUTH_DUPLICATED, AUTH_FULL or -1 on error
+ */
+int AuthKeys_Add(const char *name, const char *ip, char *key, size_t size)
+{
+    auth_entry *entry;
+    os_md5 md1;
+    os_md5 md2;
+    char str1[OS_SIZE_1024 + 1];
+    char str2[OS_SIZE_1024 + 1];
+    int acount = 2;
+    int ret;
+
+    os_calloc(1, sizeof(auth_entry), entry);
+    strncpy(entry->name, name, OS_SIZE_256);
+
+    pthread_mutex_lock(&auth_mutex);
+
+    /* Check for duplicate names */
+    while (OSHash_Get(auth_names, entry->name)) {
+        snprintf(entry->name, OS_SIZE_256, "%s%d", name, acount);
+        if (++acount > 256) {
+            pthread_mutex_unlock(&auth_mutex);
+            free(entry);
+            return (AUTH_DUPLICATED);
+        }
+    }
+
+    if (auth_agents >= MAX_AGENTS - 2) {
+        pthread_mutex_unlock(&auth_mutex);
+        free(entry);
+        return (AUTH_FULL);
+    }
+
+    /* Next free id */
+    for (; auth_next_id <= AUTH_MAX_ID; auth_next_id++) {
+        snprintf(entry->id, sizeof(entry->id), "%u", auth_next_id);
+        if (!OSHash_Get(auth_ids, entry->id)) {
+            break;
+        }
+    }
+
+    if (auth_next_id > AUTH_MAX_ID) {
+        pthread_mutex_unlock(&auth_mutex);
+        free(entry);
+        return (AUTH_FULL);
+    }
+    auth_next_id++;
+
+    /* Same key as OS_AddNewAgent */
+    snprintf(str1, sizeof(str1), "%d%s%d%s", (int)time(0), entry->name,
+             (int)random(), auth_uname ? auth_uname : "");
+    snprintf(str2, sizeof(str2), "%s%s%ld", ip ? ip : "(null)", entry->id,
+             (long int)random());
+    OS_MD5_Str(str1, md1);
+    OS_MD5_Str(str2, md2);
+
+    snprintf(entry->line, OS_SIZE_2048, "%s %s %s %s%s", entry->id,
+             entry->name, ip ? ip : "any", md1, md2);
+
+    auth_index(entry->line);
+
+    *auth_last = entry;
+    auth_last = &entry->next;
+    pthread_cond_signal(&auth_queued);
+
+    while (entry->status == 0) {
+        pthread_cond_wait(&auth_done, &auth_mutex);
+    }
+
+    pthread_mutex_unlock(&auth_mutex);
+
+    if ((ret = entry->status > 0 ? 0 : -1) == 0) {
+        strncpy(key, entry->line, size - 1);
+        key[size - 1] = '\0';
+    }
+
+    memset_secure(entry->line, '\0', sizeof(entry->line));
+    free(entry);
+
+    return (ret);
+}
+
+#endif /* LIBOPENSSL_ENABLED */
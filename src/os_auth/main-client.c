@@ -36,15 +36,43 @@ int main()
 #else
 
 #include <openssl/ssl.h>
+#ifndef WIN32
+#include <pthread.h>
+#endif
 #include "auth.h"
 
+/* Default connections at once of the load test */
+#define LOAD_CONCURRENCY 10
+
+#ifndef WIN32
+/* Load test: enroll count agents, named after the agent name */
+typedef struct _load_test {
+    SSL_CTX *ctx;
+    const char *ipaddress;
+    const char *agentname;
+    int port;
+    unsigned int count;
+    unsigned int next;          /* Next agent to enroll */
+    unsigned int enrolled;
+    unsigned int failed;
+    unsigned int refused;       /* Closed before the handshake (rate limit) */
+    pthread_mutex_t mutex;
+} load_test;
+#endif
+
 static void help_agent_auth(void) __attribute__((noreturn));
+static SSL *auth_connect(SSL_CTX *ctx, const char *ipaddress, int port, int *sock);
+#ifndef WIN32
+static int load_enroll(load_test *test, const char *name);
+static void *load_worker(void *arg);
+static void load_run(load_test *test, int concurrency) __attribute__((noreturn));
+#endif
 
 /* Print help statement */
 static void help_agent_auth()
 {
     print_header();
-    print_out("  %s: -[Vhdt] [-g group] [-D dir] [-m IP address] [-p port] [-A name] [-v path] [-x path] [-k path]", ARGV0);
+    print_out("  %s: -[Vhdt] [-g group] [-D dir] [-m IP address] [-p port] [-A name] [-v path] [-x path] [-k path] [-L count] [-c num]", ARGV0);
     print_out("    -V          Version and license message");
     print_out("    -h          This help message");
     print_out("    -d          Execute in debug mode. This parameter");
@@ -59,10 +87,165 @@ static void help_agent_auth()
     print_out("    -v <path>   Full path to CA certificate used to verify the server");
     print_out("    -x <path>   Full path to agent certificate");
     print_out("    -k <path>   Full path to agent key");
+    print_out("    -L <count>  Load test: enroll count agents (name-1, name-2...)");
+    print_out("                and print the enrollments per second. From a single");
+    print_out("                host, run ossec-authd with -r 0 (no rate limit)");
+    print_out("    -c <num>    Connections at once of the load test (default: %d)", LOAD_CONCURRENCY);
     print_out(" ");
     exit(1);
 }
 
+/* Connect to the manager. Returns NULL on error */
+static SSL *auth_connect(SSL_CTX *ctx, const char *ipaddress, int port, int *sock)
+{
+    SSL *ssl;
+    BIO *sbio;
+    int ret;
+
+    /* Connect via TCP */
+    *sock = OS_ConnectTCP((u_int16_t)port, ipaddress, 0);
+    if (*sock <= 0) {
+        merror("%s: Unable to connect to %s:%d", ARGV0, ipaddress, port);
+        return (NULL);
+    }
+
+    /* Connect the SSL socket */
+    ssl = SSL_new(ctx);
+    sbio = BIO_new_socket(*sock, BIO_NOCLOSE);
+    SSL_set_bio(ssl, sbio, sbio);
+
+    ret = SSL_connect(ssl);
+    if (ret <= 0) {
+        ERR_print_errors_fp(stderr);
+        merror("%s: ERROR: SSL error (%d).", ARGV0, ret);
+        SSL_free(ssl);
+        close(*sock);
+        return (NULL);
+    }
+
+    return (ssl);
+}
+
+#ifndef WIN32
+/* Enroll an agent of the load test. Returns 0 on success, 1 if the
+ * server closed the connection before the handshake (its rate limit
+ * per address) or -1 on error
+ */
+static int load_enroll(load_test *test, const char *name)
+{
+    char buf[2048 + 1];
+    SSL *ssl;
+    int sock;
+    int ret;
+    int enrolled = -1;
+
+    if ((ssl = auth_connect(test->ctx, test->ipaddress, test->port, &sock)) == NULL) {
+        /* Connected (sock is set), but the handshake failed */
+        return (sock > 0 ? 1 : -1);
+    }
+
+    snprintf(buf, 2048, "OSSEC A:'%s'\n", name);
+    if (SSL_write(ssl, buf, (int)strlen(buf)) > 0) {
+        while ((ret = SSL_read(ssl, buf, sizeof(buf) - 1)) > 0) {
+            buf[ret] = '\0';
+            if (strncmp(buf, "OSSEC K:'", 9) == 0) {
+                enrolled = 0;
+                break;
+            } else if (strncmp(buf, "ERROR", 5) == 0) {
+                debug1("%s: DEBUG: %s: %s", ARGV0, name, buf);
+                break;
+            }
+        }
+    }
+
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(sock);
+
+    return (enrolled);
+}
+
+static void *load_worker(void *arg)
+{
+    load_test *test = (load_test *)arg;
+    char name[512 + 1];
+    unsigned int n;
+    int ret;
+
+    while (1) {
+        pthread_mutex_lock(&test->mutex);
+        n = ++test->next;
+        pthread_mutex_unlock(&test->mutex);
+
+        if (n > test->count) {
+            break;
+        }
+
+        snprintf(name, 512, "%s-%u", test->agentname, n);
+        ret = load_enroll(test, name);
+
+        pthread_mutex_lock(&test->mutex);
+        if (ret == 0) {
+            test->enrolled++;
+        } else if (ret == 1) {
+            test->refused++;
+        } else {
+            test->failed++;
+        }
+        pthread_mutex_unlock(&test->mutex);
+    }
+
+    return (NULL);
+}
+
+/* Run the load test and print the results */
+static void load_run(load_test *test, int concurrency)
+{
+    pthread_t *threads;
+    struct timeval start;
+    struct timeval end;
+    double secs;
+    int i;
+
+    os_calloc((size_t)concurrency, sizeof(pthread_t), threads);
+    pthread_mutex_init(&test->mutex, NULL);
+
+    printf("INFO: Enrolling %u agents (%s-1...) with %d connections at once.\n",
+           test->count, test->agentname, concurrency);
+
+    gettimeofday(&start, NULL);
+
+    for (i = 0; i < concurrency; i++) {
+        if (pthread_create(&threads[i], NULL, load_worker, test) != 0) {
+            ErrorExit(THREAD_ERROR, ARGV0);
+        }
+    }
+
+    for (i = 0; i < concurrency; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    gettimeofday(&end, NULL);
+    secs = (double)(end.tv_sec - start.tv_sec) +
+           (double)(end.tv_usec - start.tv_usec) / 1000000.0;
+
+    printf("INFO: %u agents enrolled, %u failed in %.2f seconds: "
+           "%.1f enrollments/sec.\n", test->enrolled, test->failed, secs,
+           secs > 0 ? (double)test->enrolled / secs : 0.0);
+
+    if (test->refused) {
+        printf("WARN: %u connections closed by the server before the handshake. "
+               "Its rate limit per address is on: run ossec-authd with -r 0 "
+               "for the load test.\n", test->refused);
+    }
+
+    free(threads);
+    SSL_CTX_free(test->ctx);
+
+    exit(test->failed || test->refused ? 1 : 0);
+}
+#endif /* !WIN32 */
+
 int main(int argc, char **argv)
 {
     int c;
@@ -72,6 +255,8 @@ int main(int argc, char **argv)
 #endif
 
     int sock = 0, port = DEFAULT_PORT, ret = 0;
+    int load_count = 0;
+    int concurrency = LOAD_CONCURRENCY;
     const char *dir = DEFAULTDIR;
     const char *group = GROUPGLOBAL;
     const char *manager = NULL;
@@ -84,7 +269,6 @@ int main(int argc, char **argv)
     char buf[2048 + 1];
     SSL_CTX *ctx;
     SSL *ssl;
-    BIO *sbio;
     bio_err = 0;
     buf[2048] = '\0';
 
@@ -95,7 +279,7 @@ int main(int argc, char **argv)
     /* Set the name */
     OS_SetName(ARGV0);
 
-    while ((c = getopt(argc, argv, "Vdhtg:m:p:A:v:x:k:")) != -1) {
+    while ((c = getopt(argc, argv, "Vdhtg:m:p:A:v:x:k:L:c:")) != -1) {
         switch (c) {
             case 'V':
                 print_version();
@@ -160,6 +344,24 @@ int main(int argc, char **argv)
                 }
                 agent_key = optarg;
                 break;
+            case 'L':
+                if (!optarg) {
+                    ErrorExit("%s: -%c needs an argument", ARGV0, c);
+                }
+                load_count = atoi(optarg);
+                if (load_count <= 0) {
+                    ErrorExit("%s: Invalid count: %s", ARGV0, optarg);
+                }
+                break;
+            case 'c':
+                if (!optarg) {
+                    ErrorExit("%s: -%c needs an argument", ARGV0, c);
+                }
+                concurrency = atoi(optarg);
+                if (concurrency <= 0 || concurrency > 1024) {
+                    ErrorExit("%s: Invalid number of connections: %s", ARGV0, optarg);
+                }
+                break;
             default:
                 help_agent_auth();
                 break;
@@ -233,22 +435,26 @@ int main(int argc, char **argv)
         exit(1);
     }
 
-    /* Connect via TCP */
-    sock = OS_ConnectTCP(port, ipaddress, 0);
-    if (sock <= 0) {
-        merror("%s: Unable to connect to %s:%d", ARGV0, ipaddress, port);
+    if (load_count > 0) {
+#ifndef WIN32
+        load_test test;
+
+        memset(&test, 0, sizeof(test));
+        test.ctx = ctx;
+        test.ipaddress = ipaddress;
+        test.agentname = agentname;
+        test.port = port;
+        test.count = (unsigned int)load_count;
+        load_run(&test, concurrency);
+#else
+        merror("%s: ERROR: Load test not available on Windows.", ARGV0);
         exit(1);
+#endif
     }
 
-    /* Connect the SSL socket */
-    ssl = SSL_new(ctx);
-    sbio = BIO_new_socket(sock, BIO_NOCLOSE);
-    SSL_set_bio(ssl, sbio, sbio);
-
-    ret = SSL_connect(ssl);
-    if (ret <= 0) {
-        ERR_print_errors_fp(stderr);
-        merror("%s: ERROR: SSL error (%d). Exiting.", ARGV0, ret);
+    /* Connect to the manager */
+    if ((ssl = auth_connect(ctx, ipaddress, port, &sock)) == NULL) {
+        merror("%s: ERROR: Unable to connect to the manager. Exiting.", ARGV0);
         exit(1);
     }
 
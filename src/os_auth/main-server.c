@@ -34,23 +34,67 @@ int main()
 
 #else
 
-#include <sys/wait.h>
+#include <pthread.h>
+#include <poll.h>
 #include "auth.h"
 
-/* TODO: Pulled this value out of the sky, may or may not be sane */
-#define POOL_SIZE 512
+/* Connections accepted and waiting for a worker */
+#define AUTH_QUEUE 1024
+
+/* Default number of workers */
+#define AUTH_THREADS 16
+
+/* Seconds a client has to complete its request */
+#define AUTH_TIMEOUT 30
+
+/* Sources tracked by the rate limit (by address) */
+#define AUTH_SOURCES 4096
+
+/* Seconds between the reports of a source over the rate */
+#define AUTH_REPORT 60
+
+/* Connection waiting for a worker */
+typedef struct _auth_conn {
+    int sock;
+    char srcip[IPSIZE + 1];
+} auth_conn;
+
+/* Rate limit of a source */
+typedef struct _auth_source {
+    struct in_addr addr;
+    mq_bucket bucket;
+    time_t reported;
+    unsigned int rejected;      /* Connections rejected since the report */
+} auth_source;
 
 /* Prototypes */
 static void help_authd(void) __attribute((noreturn));
-static int ssl_error(const SSL *ssl, int ret);
-static void clean_exit(SSL_CTX *ctx, int sock) __attribute__((noreturn));
+static int ssl_error(const SSL *ssl, int ret, time_t deadline);
+static int ssl_write(SSL *ssl, const char *msg, time_t deadline);
+static void send_error(SSL *ssl, const char *error, time_t deadline);
+static int rate_check(struct in_addr addr, unsigned int rate);
+static int queue_push(int sock, const char *srcip);
+static void handle_client(int sock, const char *srcip);
+static void *auth_worker(void *none) __attribute__((noreturn));
+
+/* Global vars */
+static SSL_CTX *ctx;
+static int use_ip_address = 0;
+
+static auth_conn conn_queue[AUTH_QUEUE];
+static unsigned int conn_first = 0;
+static unsigned int conn_count = 0;
+static pthread_mutex_t conn_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conn_available = PTHREAD_COND_INITIALIZER;
+
+static auth_source sources[AUTH_SOURCES];
 
 
 /* Print help statement */
 static void help_authd()
 {
     print_header();
-    print_out("  %s: -[Vhdti] [-g group] [-D dir] [-p port] [-v path] [-x path] [-k path]", ARGV0);
+    print_out("  %s: -[Vhdti] [-g group] [-D dir] [-p port] [-n threads] [-r rate] [-v path] [-x path] [-k path]", ARGV0);
     print_out("    -V          Version and license message");
     print_out("    -h          This help message");
     print_out("    -d          Execute in debug mode. This parameter");
@@ -61,6 +105,8 @@ static void help_authd()
     print_out("    -g <group>  Group to run as (default: %s)", GROUPGLOBAL);
     print_out("    -D <dir>    Directory to chroot into (default: %s)", DEFAULTDIR);
     print_out("    -p <port>   Manager port (default: %d)", DEFAULT_PORT);
+    print_out("    -n <num>    Requests handled at once (default: %d)", AUTH_THREADS);
+    print_out("    -r <rate>   Requests per second from an address (default: 10, 0 for no limit)");
     print_out("    -v <path>   Full path to CA certificate used to verify clients");
     print_out("    -x <path>   Full path to server certificate");
     print_out("    -k <path>   Full path to server key");
@@ -69,15 +115,28 @@ static void help_authd()
 }
 
 /* Function to use with SSL on non blocking socket,
- * to know if SSL operation failed for good
+ * to know if SSL operation failed for good. It waits for the socket
+ * until the deadline of the whole request, so a client sending a few
+ * bytes at a time can not hold a worker longer.
  */
-static int ssl_error(const SSL *ssl, int ret)
+static int ssl_error(const SSL *ssl, int ret, time_t deadline)
 {
+    struct pollfd pfd;
+    int err;
+
     if (ret <= 0) {
-        switch (SSL_get_error(ssl, ret)) {
+        switch (err = SSL_get_error(ssl, ret)) {
             case SSL_ERROR_WANT_READ:
             case SSL_ERROR_WANT_WRITE:
-                usleep(100 * 1000);
+                pfd.fd = SSL_get_fd(ssl);
+                pfd.events = err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT;
+                pfd.revents = 0;
+
+                if (deadline <= time(0) ||
+                        (poll(&pfd, 1, (int)(deadline - time(0)) * 1000) == 0)) {
+                    merror("%s: ERROR: Timeout waiting for the client.", ARGV0);
+                    return (1);
+                }
                 return (0);
             default:
                 merror("%s: ERROR: SSL Error (%d)", ARGV0, ret);
@@ -89,43 +148,242 @@ static int ssl_error(const SSL *ssl, int ret)
     return (0);
 }
 
-static void clean_exit(SSL_CTX *ctx, int sock)
+/* Write a message to the client (non blocking socket).
+ * Returns -1 on error
+ */
+static int ssl_write(SSL *ssl, const char *msg, time_t deadline)
 {
-    SSL_CTX_free(ctx);
-    close(sock);
-    exit(0);
+    int ret;
+
+    do {
+        ret = SSL_write(ssl, msg, (int)strlen(msg));
+
+        if (ssl_error(ssl, ret, deadline)) {
+            return (-1);
+        }
+    } while (ret <= 0);
+
+    return (0);
+}
+
+/* Tell the client that its agent was not added */
+static void send_error(SSL *ssl, const char *error, time_t deadline)
+{
+    char response[2048 + 1];
+
+    snprintf(response, 2048, "ERROR: %s\n\n", error);
+    if (ssl_write(ssl, response, deadline) == 0) {
+        ssl_write(ssl, "ERROR: Unable to add agent.\n\n", deadline);
+    }
+}
+
+/* Rate limit of each source address (only used by the main thread)
+ * Returns 1 if the connection is allowed
+ */
+static int rate_check(struct in_addr addr, unsigned int rate)
+{
+    auth_source *source = &sources[ntohl(addr.s_addr) % AUTH_SOURCES];
+    time_t now = time(0);
+
+    if (rate == 0) {
+        return (1);
+    }
+
+    /* Slot taken by another address */
+    if (source->addr.s_addr != addr.s_addr) {
+        memset(source, 0, sizeof(auth_source));
+        source->addr = addr;
+    }
+
+    if (MQ_BucketTake(&source->bucket, rate, now)) {
+        return (1);
+    }
+
+    source->rejected++;
+
+    if (now - source->reported >= AUTH_REPORT) {
+        merror("%s: WARN: Too many requests from %s. %u connections over "
+               "%u per second rejected.", ARGV0, inet_ntoa(addr),
+               source->rejected, rate);
+        source->reported = now;
+        source->rejected = 0;
+    }
+
+    return (0);
+}
+
+/* Queue a connection for the workers. Returns -1 if the queue is full */
+static int queue_push(int sock, const char *srcip)
+{
+    auth_conn *conn;
+
+    pthread_mutex_lock(&conn_mutex);
+
+    if (conn_count == AUTH_QUEUE) {
+        pthread_mutex_unlock(&conn_mutex);
+        return (-1);
+    }
+
+    conn = &conn_queue[(conn_first + conn_count) % AUTH_QUEUE];
+    conn->sock = sock;
+    snprintf(conn->srcip, sizeof(conn->srcip), "%s", srcip);
+    conn_count++;
+
+    pthread_cond_signal(&conn_available);
+    pthread_mutex_unlock(&conn_mutex);
+
+    return (0);
+}
+
+/* Handle the request of a client */
+static void handle_client(int sock, const char *srcip)
+{
+    char buf[4096 + 1];
+    char fname[2048 + 1];
+    char response[2048 + 1];
+    char finalkey[2048 + 1];
+    char *agentname = NULL;
+    char *tmpstr;
+    time_t deadline = time(0) + AUTH_TIMEOUT;
+    SSL *ssl;
+    int ret;
+
+    ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, sock);
+
+    do {
+        ret = SSL_accept(ssl);
+
+        if (ssl_error(ssl, ret, deadline)) {
+            SSL_free(ssl);
+            return;
+        }
+
+    } while (ret <= 0);
+
+    verbose("%s: INFO: New connection from %s", ARGV0, srcip);
+
+    do {
+        ret = SSL_read(ssl, buf, sizeof(buf) - 1);
+
+        if (ssl_error(ssl, ret, deadline)) {
+            SSL_free(ssl);
+            return;
+        }
+
+    } while (ret <= 0);
+
+    buf[ret] = '\0';
+
+    if (strncmp(buf, "OSSEC A:'", 9) == 0) {
+        agentname = buf + 9;
+
+        if ((tmpstr = strchr(agentname, '\'')) != NULL) {
+            *tmpstr = '\0';
+            verbose("%s: INFO: Received request for a new agent (%s) from: %s", ARGV0, agentname, srcip);
+        } else {
+            agentname = NULL;
+        }
+    }
+
+    if (agentname == NULL) {
+        merror("%s: ERROR: Invalid request for new agent from: %s", ARGV0, srcip);
+    }
+
+    else if (!OS_IsValidName(agentname)) {
+        merror("%s: ERROR: Invalid agent name: %s from %s", ARGV0, agentname, srcip);
+        snprintf(response, 2048, "Invalid agent name: %s", agentname);
+        send_error(ssl, response, deadline);
+    }
+
+    /* Add the new agent */
+    else if ((ret = AuthKeys_Add(agentname, use_ip_address ? srcip : NULL,
+                                 finalkey, sizeof(finalkey))) != 0) {
+        if (ret == AUTH_DUPLICATED) {
+            merror("%s: ERROR: Invalid agent name %s (duplicated)", ARGV0, agentname);
+            snprintf(response, 2048, "Invalid agent name: %s", agentname);
+        } else if (ret == AUTH_FULL) {
+            merror(AG_MAX_ERROR, ARGV0, MAX_AGENTS - 2);
+            snprintf(response, 2048, "Maximum number of agents reached: %s", agentname);
+        } else {
+            merror("%s: ERROR: Unable to add agent: %s (internal error)", ARGV0, agentname);
+            snprintf(response, 2048, "Internal manager error adding agent: %s", agentname);
+        }
+        send_error(ssl, response, deadline);
+    }
+
+    else {
+        /* The name given to the agent (it may have been renamed) */
+        strncpy(fname, strchr(finalkey, ' ') + 1, 2048);
+        fname[2048] = '\0';
+        if ((tmpstr = strchr(fname, ' ')) != NULL) {
+            *tmpstr = '\0';
+        }
+
+        snprintf(response, 2048, "OSSEC K:'%s'\n\n", finalkey);
+        verbose("%s: INFO: Agent key generated for %s (requested by %s)", ARGV0, fname, srcip);
+        if (ssl_write(ssl, response, deadline) < 0) {
+            merror("%s: ERROR: Agen key not saved for %s", ARGV0, fname);
+        } else {
+            verbose("%s: INFO: Agent key created for %s (requested by %s)", ARGV0, fname, srcip);
+        }
+
+        memset_secure(response, '\0', sizeof(response));
+        memset_secure(finalkey, '\0', sizeof(finalkey));
+    }
+
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+}
+
+/* Handle the connections queued, one at a time */
+static void *auth_worker(__attribute__((unused)) void *none)
+{
+    auth_conn conn;
+
+    while (1) {
+        pthread_mutex_lock(&conn_mutex);
+
+        while (conn_count == 0) {
+            pthread_cond_wait(&conn_available, &conn_mutex);
+        }
+
+        conn = conn_queue[conn_first];
+        conn_first = (conn_first + 1) % AUTH_QUEUE;
+        conn_count--;
+
+        pthread_mutex_unlock(&conn_mutex);
+
+        handle_client(conn.sock, conn.srcip);
+        close(conn.sock);
+    }
 }
 
 int main(int argc, char **argv)
 {
     FILE *fp;
-    /* Bucket to keep pids in */
-    int process_pool[POOL_SIZE];
-    /* Count of pids we are wait()ing on */
-    int c = 0, test_config = 0, use_ip_address = 0, pid = 0, status, i = 0, active_processes = 0;
+    int c = 0, test_config = 0, i = 0;
+    int threads = AUTH_THREADS;
+    int rate = 10;
     gid_t gid;
-    int client_sock = 0, sock = 0, port = DEFAULT_PORT, ret = 0;
+    int client_sock = 0, sock = 0, port = DEFAULT_PORT;
     const char *dir  = DEFAULTDIR;
     const char *group = GROUPGLOBAL;
     const char *server_cert = NULL;
     const char *server_key = NULL;
     const char *ca_cert = NULL;
-    char buf[4096 + 1];
-    SSL_CTX *ctx;
-    SSL *ssl;
     char srcip[IPSIZE + 1];
     struct sockaddr_in _nc;
     socklen_t _ncl;
 
     /* Initialize some variables */
     memset(srcip, '\0', IPSIZE + 1);
-    memset(process_pool, 0x0, POOL_SIZE * sizeof(*process_pool));
     bio_err = 0;
 
     /* Set the name */
     OS_SetName(ARGV0);
 
-    while ((c = getopt(argc, argv, "Vdhtig:D:m:p:v:x:k:")) != -1) {
+    while ((c = getopt(argc, argv, "Vdhtig:D:m:p:n:r:v:x:k:")) != -1) {
         switch (c) {
             case 'V':
                 print_version();
@@ -163,6 +421,24 @@ int main(int argc, char **argv)
                     ErrorExit("%s: Invalid port: %s", ARGV0, optarg);
                 }
                 break;
+            case 'n':
+                if (!optarg) {
+                    ErrorExit("%s: -%c needs an argument", ARGV0, c);
+                }
+                threads = atoi(optarg);
+                if (threads <= 0 || threads > AUTH_QUEUE) {
+                    ErrorExit("%s: Invalid number of requests: %s", ARGV0, optarg);
+                }
+                break;
+            case 'r':
+                if (!optarg) {
+                    ErrorExit("%s: -%c needs an argument", ARGV0, c);
+                }
+                rate = atoi(optarg);
+                if (rate < 0) {
+                    ErrorExit("%s: Invalid rate: %s", ARGV0, optarg);
+                }
+                break;
             case 'v':
                 if (!optarg) {
                     ErrorExit("%s: -%c needs an argument", ARGV0, c);
@@ -221,6 +497,9 @@ int main(int argc, char **argv)
         ErrorExit(PID_ERROR, ARGV0);
     }
 
+    /* Metrics (served on the control socket) */
+    OS_StartMetrics();
+
     /* Start up message */
     verbose(STARTUP_MSG, ARGV0, (int)getpid());
 
@@ -231,6 +510,12 @@ int main(int argc, char **argv)
     }
     fclose(fp);
 
+    /* Keys in memory (and their writer) */
+    if (AuthKeys_Init() < 0) {
+        merror("%s: ERROR: Unable to read %s (key file)", ARGV0, KEYSFILE_PATH);
+        exit(1);
+    }
+
     /* Start SSL */
     ctx = os_ssl_keys(1, dir, server_cert, server_key, ca_cert);
     if (!ctx) {
@@ -244,158 +529,47 @@ int main(int argc, char **argv)
         merror("%s: Unable to bind to port %d", ARGV0, port);
         exit(1);
     }
-    fcntl(sock, F_SETFL, O_NONBLOCK);
+
+    /* Workers */
+    for (i = 0; i < threads; i++) {
+        if (CreateThread(auth_worker, NULL) != 0) {
+            ErrorExit(THREAD_ERROR, ARGV0);
+        }
+    }
 
     debug1("%s: DEBUG: Going into listening mode.", ARGV0);
     while (1) {
-        /* No need to completely pin the cpu, 100ms should be fast enough */
-        usleep(100 * 1000);
-
-        /* Only check process-pool if we have active processes */
-        if (active_processes > 0) {
-            for (i = 0; i < POOL_SIZE; i++) {
-                int rv = 0;
-                status = 0;
-                if (process_pool[i]) {
-                    rv = waitpid(process_pool[i], &status, WNOHANG);
-                    if (rv != 0) {
-                        debug1("%s: DEBUG: Process %d exited", ARGV0, process_pool[i]);
-                        process_pool[i] = 0;
-                        active_processes = active_processes - 1;
-                    }
-                }
-            }
-        }
         memset(&_nc, 0, sizeof(_nc));
         _ncl = sizeof(_nc);
 
-        if ((client_sock = accept(sock, (struct sockaddr *) &_nc, &_ncl)) > 0) {
-            if (active_processes >= POOL_SIZE) {
-                merror("%s: Error: Max concurrency reached. Unable to fork", ARGV0);
-                break;
+        if ((client_sock = accept(sock, (struct sockaddr *) &_nc, &_ncl)) < 0) {
+            if (errno != EINTR) {
+                merror("%s: ERROR: accept() failed: %s", ARGV0, strerror(errno));
+                usleep(100 * 1000);
             }
-            pid = fork();
-            if (pid) {
-                active_processes = active_processes + 1;
-                close(client_sock);
-                for (i = 0; i < POOL_SIZE; i++) {
-                    if (! process_pool[i]) {
-                        process_pool[i] = pid;
-                        break;
-                    }
-                }
-            } else {
-                strncpy(srcip, inet_ntoa(_nc.sin_addr), IPSIZE - 1);
-                char *agentname = NULL;
-                ssl = SSL_new(ctx);
-                SSL_set_fd(ssl, client_sock);
-
-                do {
-                    ret = SSL_accept(ssl);
-
-                    if (ssl_error(ssl, ret)) {
-                        clean_exit(ctx, client_sock);
-                    }
-
-                } while (ret <= 0);
-
-                verbose("%s: INFO: New connection from %s", ARGV0, srcip);
-
-                do {
-                    ret = SSL_read(ssl, buf, sizeof(buf));
-
-                    if (ssl_error(ssl, ret)) {
-                        clean_exit(ctx, client_sock);
-                    }
-
-                } while (ret <= 0);
-
-                int parseok = 0;
-                if (strncmp(buf, "OSSEC A:'", 9) == 0) {
-                    char *tmpstr = buf;
-                    agentname = tmpstr + 9;
-                    tmpstr += 9;
-                    while (*tmpstr != '\0') {
-                        if (*tmpstr == '\'') {
-                            *tmpstr = '\0';
-                            verbose("%s: INFO: Received request for a new agent (%s) from: %s", ARGV0, agentname, srcip);
-                            parseok = 1;
-                            break;
-                        }
-                        tmpstr++;
-                    }
-                }
-                if (parseok == 0) {
-                    merror("%s: ERROR: Invalid request for new agent from: %s", ARGV0, srcip);
-                } else {
-                    int acount = 2;
-                    char fname[2048 + 1];
-                    char response[2048 + 1];
-                    char *finalkey = NULL;
-                    response[2048] = '\0';
-                    fname[2048] = '\0';
-                    if (!OS_IsValidName(agentname)) {
-                        merror("%s: ERROR: Invalid agent name: %s from %s", ARGV0, agentname, srcip);
-                        snprintf(response, 2048, "ERROR: Invalid agent name: %s\n\n", agentname);
-                        SSL_write(ssl, response, strlen(response));
-                        snprintf(response, 2048, "ERROR: Unable to add agent.\n\n");
-                        SSL_write(ssl, response, strlen(response));
-                        sleep(1);
-                        exit(0);
-                    }
-
-                    /* Check for duplicate names */
-                    strncpy(fname, agentname, 2048);
-                    while (NameExist(fname)) {
-                        snprintf(fname, 2048, "%s%d", agentname, acount);
-                        acount++;
-                        if (acount > 256) {
-                            merror("%s: ERROR: Invalid agent name %s (duplicated)", ARGV0, agentname);
-                            snprintf(response, 2048, "ERROR: Invalid agent name: %s\n\n", agentname);
-                            SSL_write(ssl, response, strlen(response));
-                            snprintf(response, 2048, "ERROR: Unable to add agent.\n\n");
-                            SSL_write(ssl, response, strlen(response));
-                            sleep(1);
-                            exit(0);
-                        }
-                    }
-                    agentname = fname;
-
-                    /* Add the new agent */
-                    if (use_ip_address) {
-                        finalkey = OS_AddNewAgent(agentname, srcip, NULL);
-                    } else {
-                        finalkey = OS_AddNewAgent(agentname, NULL, NULL);
-                    }
-                    if (!finalkey) {
-                        merror("%s: ERROR: Unable to add agent: %s (internal error)", ARGV0, agentname);
-                        snprintf(response, 2048, "ERROR: Internal manager error adding agent: %s\n\n", agentname);
-                        SSL_write(ssl, response, strlen(response));
-                        snprintf(response, 2048, "ERROR: Unable to add agent.\n\n");
-                        SSL_write(ssl, response, strlen(response));
-                        sleep(1);
-                        exit(0);
-                    }
-
-                    snprintf(response, 2048, "OSSEC K:'%s'\n\n", finalkey);
-                    verbose("%s: INFO: Agent key generated for %s (requested by %s)", ARGV0, agentname, srcip);
-                    ret = SSL_write(ssl, response, strlen(response));
-                    if (ret < 0) {
-                        merror("%s: ERROR: SSL write error (%d)", ARGV0, ret);
-                        merror("%s: ERROR: Agen key not saved for %s", ARGV0, agentname);
-                        ERR_print_errors_fp(stderr);
-                    } else {
-                        verbose("%s: INFO: Agent key created for %s (requested by %s)", ARGV0, agentname, srcip);
-                    }
-                }
+            continue;
+        }
 
-                clean_exit(ctx, client_sock);
-            }
+        if (!rate_check(_nc.sin_addr, (unsigned int)rate)) {
+            close(client_sock);
+            continue;
+        }
+
+        strncpy(srcip, inet_ntoa(_nc.sin_addr), IPSIZE - 1);
+
+        /* The workers wait on it with poll (up to AUTH_TIMEOUT) */
+        fcntl(client_sock, F_SETFL, fcntl(client_sock, F_GETFL, 0) | O_NONBLOCK);
+
+        if (queue_push(client_sock, srcip) < 0) {
+            merror("%s: WARN: Too many requests waiting (%d). Rejecting %s.",
+                   ARGV0, AUTH_QUEUE, srcip);
+            close(client_sock);
         }
     }
 
     /* Shut down the socket */
-    clean_exit(ctx, sock);
+    SSL_CTX_free(ctx);
+    close(sock);
 
     return (0);
 }
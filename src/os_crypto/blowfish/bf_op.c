@@ -21,11 +21,18 @@
 typedef unsigned char uchar;
 
 
+/* Key schedule of a key, derived once and used for every message */
+struct _OS_BF_KEY {
+    BF_KEY key;
+};
+
+static const unsigned char cbc_iv[8] = {0xfe, 0xdc, 0xba, 0x98, 0x76, 0x54, 0x32, 0x10};
+
+
 int OS_BF_Str(const char *input, char *output, const char *charkey,
               long size, short int action)
 {
     BF_KEY key;
-    static unsigned char cbc_iv [8] = {0xfe, 0xdc, 0xba, 0x98, 0x76, 0x54, 0x32, 0x10};
     unsigned char iv[8];
 
     memcpy(iv, cbc_iv, sizeof(iv));
@@ -38,3 +45,36 @@ int OS_BF_Str(const char *input, char *output, const char *charkey,
     return (1);
 }
 
+OS_BF_KEY *OS_BF_KeyInit(const char *charkey)
+{
+    OS_BF_KEY *key;
+
+    if ((key = (OS_BF_KEY *)malloc(sizeof(OS_BF_KEY))) == NULL) {
+        return (NULL);
+    }
+
+    BF_set_key(&key->key, (int)strlen(charkey), (const uchar *)charkey);
+
+    return (key);
+}
+
+void OS_BF_KeyFree(OS_BF_KEY *key)
+{
+    if (key) {
+        memset(key, 0, sizeof(OS_BF_KEY));
+        free(key);
+    }
+}
+
+int OS_BF_StrKey(const char *input, char *output, const OS_BF_KEY *key,
+                 long size, short int action)
+{
+    unsigned char iv[8];
+
+    memcpy(iv, cbc_iv, sizeof(iv));
+
+    BF_cbc_encrypt((const uchar *)input, (uchar *)output, (long)size,
+                   &key->key, iv, action);
+
+    return (1);
+}
@@ -20,5 +20,16 @@
 int OS_BF_Str(const char *input, char *output, const char *charkey,
               long size, short int action) __attribute((nonnull));
 
+/* Key schedule prepared once per key: deriving it costs more than
+ * encrypting a message, so keep it for the keys used repeatedly.
+ */
+typedef struct _OS_BF_KEY OS_BF_KEY;
+
+OS_BF_KEY *OS_BF_KeyInit(const char *charkey) __attribute((nonnull));
+void OS_BF_KeyFree(OS_BF_KEY *key);
+
+int OS_BF_StrKey(const char *input, char *output, const OS_BF_KEY *key,
+                 long size, short int action) __attribute((nonnull));
+
 #endif
 
@@ -92,6 +92,16 @@ void MD5Update(struct MD5Context *ctx, unsigned char const *buf, unsigned len)
     }
 
     /* Process data in 64-byte chunks */
+#ifndef HIGHFIRST
+    /* Little endian: aligned data can be used in place */
+    if (((unsigned long) buf & 3) == 0) {
+        while (len >= 64) {
+            MD5Transform(ctx->buf, (uint32 const *)(const void *) buf);
+            buf += 64;
+            len -= 64;
+        }
+    }
+#endif
     while (len >= 64) {
         memcpy(ctx->in, buf, 64);
         byteReverse(ctx->in, 16);
@@ -164,6 +174,12 @@ void MD5Final(unsigned char digest[16], struct MD5Context *ctx)
 #define MD5STEP(f, w, x, y, z, data, s) \
     ( w += f(x, y, z) + data,  w = w<<s | w>>(32-s),  w += x )
 
+/* Second round step: (x & z) and (y & ~z) have no bits in common, so
+ * they can be added separately, shortening the dependency chain on w
+ */
+#define MD5STEP2(w, x, y, z, data, s) \
+    ( w += data + (y & ~z),  w += (x & z),  w = w<<s | w>>(32-s),  w += x )
+
 /*
  * The core of the MD5 algorithm, this alters an existing MD5 hash to
  * reflect the addition of 16 longwords of new data.  MD5Update blocks
@@ -195,22 +211,22 @@ void MD5Transform(uint32 buf[4], uint32 const in[16])
     MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
     MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
 
-    MD5STEP(F2, a, b, c, d, in[1] + 0xf61e2562, 5);
-    MD5STEP(F2, d, a, b, c, in[6] + 0xc040b340, 9);
-    MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
-    MD5STEP(F2, b, c, d, a, in[0] + 0xe9b6c7aa, 20);
-    MD5STEP(F2, a, b, c, d, in[5] + 0xd62f105d, 5);
-    MD5STEP(F2, d, a, b, c, in[10] + 0x02441453, 9);
-    MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
-    MD5STEP(F2, b, c, d, a, in[4] + 0xe7d3fbc8, 20);
-    MD5STEP(F2, a, b, c, d, in[9] + 0x21e1cde6, 5);
-    MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6, 9);
-    MD5STEP(F2, c, d, a, b, in[3] + 0xf4d50d87, 14);
-    MD5STEP(F2, b, c, d, a, in[8] + 0x455a14ed, 20);
-    MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905, 5);
-    MD5STEP(F2, d, a, b, c, in[2] + 0xfcefa3f8, 9);
-    MD5STEP(F2, c, d, a, b, in[7] + 0x676f02d9, 14);
-    MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
+    MD5STEP2(a, b, c, d, in[1] + 0xf61e2562, 5);
+    MD5STEP2(d, a, b, c, in[6] + 0xc040b340, 9);
+    MD5STEP2(c, d, a, b, in[11] + 0x265e5a51, 14);
+    MD5STEP2(b, c, d, a, in[0] + 0xe9b6c7aa, 20);
+    MD5STEP2(a, b, c, d, in[5] + 0xd62f105d, 5);
+    MD5STEP2(d, a, b, c, in[10] + 0x02441453, 9);
+    MD5STEP2(c, d, a, b, in[15] + 0xd8a1e681, 14);
+    MD5STEP2(b, c, d, a, in[4] + 0xe7d3fbc8, 20);
+    MD5STEP2(a, b, c, d, in[9] + 0x21e1cde6, 5);
+    MD5STEP2(d, a, b, c, in[14] + 0xc33707d6, 9);
+    MD5STEP2(c, d, a, b, in[3] + 0xf4d50d87, 14);
+    MD5STEP2(b, c, d, a, in[8] + 0x455a14ed, 20);
+    MD5STEP2(a, b, c, d, in[13] + 0xa9e3e905, 5);
+    MD5STEP2(d, a, b, c, in[2] + 0xfcefa3f8, 9);
+    MD5STEP2(c, d, a, b, in[7] + 0x676f02d9, 14);
+    MD5STEP2(b, c, d, a, in[12] + 0x8d2a4c8a, 20);
 
     MD5STEP(F3, a, b, c, d, in[5] + 0xfffa3942, 4);
     MD5STEP(F3, d, a, b, c, in[8] + 0x8771f681, 11);
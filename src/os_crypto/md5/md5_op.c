@@ -18,6 +18,22 @@
 #include "md5.h"
 #include "../shared/prefilter.h"
 
+static void md5_hex(const unsigned char digest[16], os_md5 output);
+
+
+/* Write a digest in hex (a lookup is much cheaper than snprintf) */
+static void md5_hex(const unsigned char digest[16], os_md5 output)
+{
+    static const char hex[] = "0123456789abcdef";
+    int n;
+
+    for (n = 0; n < 16; n++) {
+        output[n * 2] = hex[digest[n] >> 4];
+        output[n * 2 + 1] = hex[digest[n] & 0x0f];
+    }
+    output[32] = '\0';
+}
+
 int OS_MD5_Stream(FILE *fp, os_md5 output)
 {
     MD5_CTX ctx;
@@ -36,10 +52,7 @@ int OS_MD5_Stream(FILE *fp, os_md5 output)
 
     MD5Final(digest, &ctx);
 
-    for (n = 0; n < 16; n++) {
-        snprintf(output, 3, "%02x", digest[n]);
-        output += 2;
-    }
+    md5_hex(digest, output);
 
     return (0);
 }
@@ -48,18 +61,12 @@ int OS_MD5_Str(const char *str, os_md5 output)
 {
     unsigned char digest[16];
 
-    int n;
-
     MD5_CTX ctx;
     MD5Init(&ctx);
     MD5Update(&ctx, (const unsigned char *)str, (unsigned)strlen(str));
     MD5Final(digest, &ctx);
 
-    output[32] = '\0';
-    for (n = 0; n < 16; n++) {
-        snprintf(output, 3, "%02x", digest[n]);
-        output += 2;
-    }
+    md5_hex(digest, output);
 
     return (0);
 }
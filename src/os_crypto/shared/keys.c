@@ -14,6 +14,13 @@
 
 /* Prototypes */
 static void __memclear(char *id, char *name, char *ip, char *key, size_t size) __attribute((nonnull));
+static int __keyline(char *buffer, char *id, char *name, char *ip, char *key) __attribute((nonnull));
+static void __keyhash(const char *id, const char *name, const char *key, char *finalkey) __attribute((nonnull));
+static int __keyaddress(const char *ip, os_ip *address) __attribute((nonnull));
+static keyentry *__keyentry(const char *id, const char *name, const char *ip, const char *key) __attribute((nonnull));
+static int __keysame(const keyentry *entry, const char *name, const char *ip, const char *key) __attribute((nonnull));
+static void __keyfree(keyentry *entry) __attribute((nonnull));
+static int __keyindex(keystore *keys, keyentry *entry) __attribute((nonnull));
 static void __chash(keystore *keys, const char *id, const char *name, char *ip, const char *key) __attribute((nonnull));
 
 
@@ -26,79 +33,258 @@ static void __memclear(char *id, char *name, char *ip, char *key, size_t size)
     memset(ip, '\0', size);
 }
 
-/* Create the final key */
-static void __chash(keystore *keys, const char *id, const char *name, char *ip, const char *key)
+/* Split a line of the keys file. Lines are divided as "id name ip key".
+ * Returns 1 for a key, 0 for a line to skip or -1 if it is invalid
+ */
+static int __keyline(char *buffer, char *id, char *name, char *ip, char *key)
 {
-    os_md5 filesum1;
-    os_md5 filesum2;
-
     char *tmp_str;
-    char _finalstr[KEYSIZE];
+    char *valid_str;
 
-    /* Allocate for the whole structure */
-    keys->keyentries = (keyentry **)realloc(keys->keyentries,
-                                            (keys->keysize + 2) * sizeof(keyentry *));
-    if (!keys->keyentries) {
-        ErrorExit(MEM_ERROR, __local_name, errno, strerror(errno));
+    if ((buffer[0] == '#') || (buffer[0] == ' ')) {
+        return (0);
+    }
+
+    /* Get ID */
+    valid_str = buffer;
+    tmp_str = strchr(buffer, ' ');
+    if (!tmp_str) {
+        merror(INVALID_KEY, __local_name, buffer);
+        return (-1);
     }
-    os_calloc(1, sizeof(keyentry), keys->keyentries[keys->keysize]);
 
-    /* Set configured values for id */
-    os_strdup(id, keys->keyentries[keys->keysize]->id);
-    OSHash_Add(keys->keyhash_id,
-               keys->keyentries[keys->keysize]->id,
-               keys->keyentries[keys->keysize]);
+    *tmp_str = '\0';
+    tmp_str++;
+    strncpy(id, valid_str, KEYSIZE - 1);
 
-    /* Agent IP */
-    os_calloc(1, sizeof(os_ip), keys->keyentries[keys->keysize]->ip);
-    if (OS_IsValidIP(ip, keys->keyentries[keys->keysize]->ip) == 0) {
-        ErrorExit(INVALID_IP, __local_name, ip);
+    /* Removed entry */
+    if (*tmp_str == '#') {
+        return (0);
     }
 
-    /* We need to remove the "/" from the CIDR */
-    if ((tmp_str = strchr(keys->keyentries[keys->keysize]->ip->ip, '/')) != NULL) {
+    /* Get name */
+    valid_str = tmp_str;
+    tmp_str = strchr(tmp_str, ' ');
+    if (!tmp_str) {
+        merror(INVALID_KEY, __local_name, buffer);
+        return (-1);
+    }
+
+    *tmp_str = '\0';
+    tmp_str++;
+    strncpy(name, valid_str, KEYSIZE - 1);
+
+    /* Get IP address */
+    valid_str = tmp_str;
+    tmp_str = strchr(tmp_str, ' ');
+    if (!tmp_str) {
+        merror(INVALID_KEY, __local_name, buffer);
+        return (-1);
+    }
+
+    *tmp_str = '\0';
+    tmp_str++;
+    strncpy(ip, valid_str, KEYSIZE - 1);
+
+    /* Get key */
+    valid_str = tmp_str;
+    tmp_str = strchr(tmp_str, '\n');
+    if (tmp_str) {
         *tmp_str = '\0';
     }
-    OSHash_Add(keys->keyhash_ip,
-               keys->keyentries[keys->keysize]->ip->ip,
-               keys->keyentries[keys->keysize]);
 
-    /* Agent name */
-    os_strdup(name, keys->keyentries[keys->keysize]->name);
+    strncpy(key, valid_str, KEYSIZE - 1);
 
-    /* Initialize the variables */
-    keys->keyentries[keys->keysize]->rcvd = 0;
-    keys->keyentries[keys->keysize]->local = 0;
-    keys->keyentries[keys->keysize]->keyid = keys->keysize;
-    keys->keyentries[keys->keysize]->global = 0;
-    keys->keyentries[keys->keysize]->fp = NULL;
+    return (1);
+}
 
-    /** Generate final symmetric key **/
+/* Generate the final symmetric key (finalkey must hold KEYSIZE bytes) */
+static void __keyhash(const char *id, const char *name, const char *key, char *finalkey)
+{
+    os_md5 filesum1;
+    os_md5 filesum2;
 
     /* MD5 from name, id and key */
     OS_MD5_Str(name, filesum1);
     OS_MD5_Str(id,  filesum2);
 
     /* Generate new filesum1 */
-    snprintf(_finalstr, sizeof(_finalstr) - 1, "%s%s", filesum1, filesum2);
+    snprintf(finalkey, KEYSIZE - 1, "%s%s", filesum1, filesum2);
 
     /* Use just half of the first MD5 (name/id) */
-    OS_MD5_Str(_finalstr, filesum1);
+    OS_MD5_Str(finalkey, filesum1);
     filesum1[15] = '\0';
     filesum1[16] = '\0';
 
     /* Second md is just the key */
     OS_MD5_Str(key, filesum2);
 
-    /* Generate final key */
-    snprintf(_finalstr, 49, "%s%s", filesum2, filesum1);
+    /* Generate final key. Final key is 48 * 4 = 192bits */
+    snprintf(finalkey, 49, "%s%s", filesum2, filesum1);
+}
+
+/* Parse the address of an agent. Returns 0 if it is invalid */
+static int __keyaddress(const char *ip, os_ip *address)
+{
+    char *tmp_str;
+
+    if (OS_IsValidIP(ip, address) == 0) {
+        return (0);
+    }
+
+    /* We need to remove the "/" from the CIDR */
+    if ((tmp_str = strchr(address->ip, '/')) != NULL) {
+        *tmp_str = '\0';
+    }
+
+    return (1);
+}
+
+/* Create the entry of a key. Returns NULL if the address is invalid */
+static keyentry *__keyentry(const char *id, const char *name, const char *ip, const char *key)
+{
+    keyentry *entry;
+    char _finalstr[KEYSIZE];
+
+    os_calloc(1, sizeof(keyentry), entry);
+
+    /* Agent IP */
+    os_calloc(1, sizeof(os_ip), entry->ip);
+    if (!__keyaddress(ip, entry->ip)) {
+        free(entry->ip->ip);
+        free(entry->ip);
+        free(entry);
+        return (NULL);
+    }
+
+    /* Set configured values for id and name */
+    os_strdup(id, entry->id);
+    os_strdup(name, entry->name);
+
+    /* Initialize the variables */
+    entry->rcvd = 0;
+    entry->local = 0;
+    entry->global = 0;
+#ifndef WIN32
+    entry->slot = -1;
+#else
+    entry->fp = NULL;
+#endif
+
+    /** Generate final symmetric key **/
+    __keyhash(id, name, key, _finalstr);
 
-    /* Final key is 48 * 4 = 192bits */
-    os_strdup(_finalstr, keys->keyentries[keys->keysize]->key);
+    os_strdup(_finalstr, entry->key);
+    entry->bf_key = OS_BF_KeyInit(_finalstr);
 
     /* Clean final string from memory */
     memset_secure(_finalstr, '\0', sizeof(_finalstr));
 
+    return (entry);
+}
+
+/* Check if an entry matches a line of the keys file (same id) */
+static int __keysame(const keyentry *entry, const char *name, const char *ip, const char *key)
+{
+    os_ip address;
+    char _finalstr[KEYSIZE];
+    int same;
+
+    if (strcmp(entry->name, name) != 0) {
+        return (0);
+    }
+
+    memset(&address, 0, sizeof(os_ip));
+    same = __keyaddress(ip, &address) &&
+           strcmp(entry->ip->ip, address.ip) == 0 &&
+           entry->ip->netmask == address.netmask;
+    free(address.ip);
+
+    if (!same) {
+        return (0);
+    }
+
+    __keyhash(entry->id, name, key, _finalstr);
+    same = strcmp(entry->key, _finalstr) == 0;
+    memset_secure(_finalstr, '\0', sizeof(_finalstr));
+
+    return (same);
+}
+
+/* Free an entry */
+static void __keyfree(keyentry *entry)
+{
+    if (entry->ip) {
+        free(entry->ip->ip);
+        free(entry->ip);
+    }
+
+    if (entry->id) {
+        free(entry->id);
+    }
+
+    if (entry->key) {
+        free(entry->key);
+    }
+
+    OS_BF_KeyFree(entry->bf_key);
+
+    if (entry->name) {
+        free(entry->name);
+    }
+
+#ifdef WIN32
+    /* Close counter */
+    if (entry->fp) {
+        fclose(entry->fp);
+    }
+#endif
+
+    free(entry);
+}
+
+/* Add an entry to the hashes (by id, IP and name). The first one
+ * wins for IP addresses and names.
+ * Returns 0 if the id is duplicated
+ */
+static int __keyindex(keystore *keys, keyentry *entry)
+{
+    if (OSHash_Add(keys->keyhash_id, entry->id, entry) != 2) {
+        return (0);
+    }
+
+    OSHash_Add(keys->keyhash_ip, entry->ip->ip, entry);
+    OSHash_Add(keys->keyhash_name, entry->name, entry);
+
+    return (1);
+}
+
+/* Create the final key */
+static void __chash(keystore *keys, const char *id, const char *name, char *ip, const char *key)
+{
+    keyentry *entry;
+
+    if ((entry = __keyentry(id, name, ip, key)) == NULL) {
+        ErrorExit(INVALID_IP, __local_name, ip);
+    }
+
+    /* Allocate for the whole structure */
+    keys->keyentries = (keyentry **)realloc(keys->keyentries,
+                                            (keys->keysize + 2) * sizeof(keyentry *));
+    if (!keys->keyentries) {
+        ErrorExit(MEM_ERROR, __local_name, errno, strerror(errno));
+    }
+
+    if (!__keyindex(keys, entry)) {
+        merror("%s: WARN: Duplicated agent id '%s' in '%s'.", __local_name,
+               id, KEYS_FILE);
+        __keyfree(entry);
+        return;
+    }
+
+    entry->keyid = keys->keysize;
+    keys->keyentries[keys->keysize] = entry;
+
     /* Ready for next */
     keys->keysize++;
 
@@ -158,7 +344,8 @@ void OS_ReadKeys(keystore *keys)
     /* Initialize hashes */
     keys->keyhash_id = OSHash_Create();
     keys->keyhash_ip = OSHash_Create();
-    if (!keys->keyhash_id || !keys->keyhash_ip) {
+    keys->keyhash_name = OSHash_Create();
+    if (!keys->keyhash_id || !keys->keyhash_ip || !keys->keyhash_name) {
         ErrorExit(MEM_ERROR, __local_name, errno, strerror(errno));
     }
 
@@ -172,63 +359,11 @@ void OS_ReadKeys(keystore *keys)
 
     /* Read each line. Lines are divided as "id name ip key" */
     while (fgets(buffer, OS_BUFFER_SIZE, fp) != NULL) {
-        char *tmp_str;
-        char *valid_str;
-
-        if ((buffer[0] == '#') || (buffer[0] == ' ')) {
-            continue;
-        }
-
-        /* Get ID */
-        valid_str = buffer;
-        tmp_str = strchr(buffer, ' ');
-        if (!tmp_str) {
-            merror(INVALID_KEY, __local_name, buffer);
+        if (__keyline(buffer, id, name, ip, key) <= 0) {
+            __memclear(id, name, ip, key, KEYSIZE + 1);
             continue;
         }
 
-        *tmp_str = '\0';
-        tmp_str++;
-        strncpy(id, valid_str, KEYSIZE - 1);
-
-        /* Removed entry */
-        if (*tmp_str == '#') {
-            continue;
-        }
-
-        /* Get name */
-        valid_str = tmp_str;
-        tmp_str = strchr(tmp_str, ' ');
-        if (!tmp_str) {
-            merror(INVALID_KEY, __local_name, buffer);
-            continue;
-        }
-
-        *tmp_str = '\0';
-        tmp_str++;
-        strncpy(name, valid_str, KEYSIZE - 1);
-
-        /* Get IP address */
-        valid_str = tmp_str;
-        tmp_str = strchr(tmp_str, ' ');
-        if (!tmp_str) {
-            merror(INVALID_KEY, __local_name, buffer);
-            continue;
-        }
-
-        *tmp_str = '\0';
-        tmp_str++;
-        strncpy(ip, valid_str, KEYSIZE - 1);
-
-        /* Get key */
-        valid_str = tmp_str;
-        tmp_str = strchr(tmp_str, '\n');
-        if (tmp_str) {
-            *tmp_str = '\0';
-        }
-
-        strncpy(key, valid_str, KEYSIZE - 1);
-
         /* Generate the key hash */
         __chash(keys, id, name, ip, key);
 
@@ -268,15 +403,18 @@ void OS_FreeKeys(keystore *keys)
     unsigned int _keysize = 0;
     OSHash *hashid;
     OSHash *haship;
+    OSHash *hashname;
 
     _keysize = keys->keysize;
     hashid = keys->keyhash_id;
     haship = keys->keyhash_ip;
+    hashname = keys->keyhash_name;
 
     /* Zero the entries */
     keys->keysize = 0;
     keys->keyhash_id = NULL;
     keys->keyhash_ip = NULL;
+    keys->keyhash_name = NULL;
 
     /* Sleep to give time to other threads to stop using them */
     sleep(1);
@@ -284,40 +422,232 @@ void OS_FreeKeys(keystore *keys)
     /* Free the hashes */
     OSHash_Free(hashid);
     OSHash_Free(haship);
+    OSHash_Free(hashname);
 
     for (i = 0; i <= _keysize; i++) {
         if (keys->keyentries[i]) {
-            if (keys->keyentries[i]->ip) {
-                free(keys->keyentries[i]->ip->ip);
-                free(keys->keyentries[i]->ip);
-            }
+            __keyfree(keys->keyentries[i]);
+            keys->keyentries[i] = NULL;
+        }
+    }
 
-            if (keys->keyentries[i]->id) {
-                free(keys->keyentries[i]->id);
-            }
+    /* Free structure */
+    free(keys->keyentries);
+    keys->keyentries = NULL;
+    keys->keysize = 0;
+}
 
-            if (keys->keyentries[i]->key) {
-                free(keys->keyentries[i]->key);
-            }
+/* Read the keys file again into update. The entries of keys that did
+ * not change are shared (not copied) and keep their position; the new
+ * agents take the positions left free. keys is only read, so it can be
+ * used by other threads meanwhile. Nothing is kept in update if there
+ * are no changes or on error, but the date of the file.
+ * Returns the number of entries added, changed or removed, or -1 on error
+ */
+int OS_DiffKeys(const keystore *keys, keystore *update)
+{
+    FILE *fp;
+    char buffer[OS_BUFFER_SIZE + 1];
+    char name[KEYSIZE + 1];
+    char ip[KEYSIZE + 1];
+    char id[KEYSIZE + 1];
+    char key[KEYSIZE + 1];
+    keyentry **entries = NULL;
+    keyentry *entry;
+    keyentry *prev;
+    unsigned int count = 0;
+    unsigned int reused = 0;
+    unsigned int next;
+    unsigned int i;
+    int changes = -1;
 
-            if (keys->keyentries[i]->name) {
-                free(keys->keyentries[i]->name);
+    memset(update, 0, sizeof(keystore));
+
+    if ((update->file_change = File_DateofChange(KEYS_FILE)) < 0) {
+        merror(NO_AUTHFILE, __local_name, KEYS_FILE);
+        return (-1);
+    }
+
+    if ((fp = fopen(KEYS_FILE, "r")) == NULL) {
+        merror(FOPEN_ERROR, __local_name, KEYS_FILE, errno, strerror(errno));
+        return (-1);
+    }
+
+    update->keyhash_id = OSHash_Create();
+    update->keyhash_ip = OSHash_Create();
+    update->keyhash_name = OSHash_Create();
+    if (!update->keyhash_id || !update->keyhash_ip || !update->keyhash_name ||
+            !OSHash_setSize(update->keyhash_id, keys->keysize * 2) ||
+            !OSHash_setSize(update->keyhash_ip, keys->keysize * 2) ||
+            !OSHash_setSize(update->keyhash_name, keys->keysize * 2)) {
+        ErrorExit(MEM_ERROR, __local_name, errno, strerror(errno));
+    }
+
+    os_calloc(MAX_AGENTS, sizeof(keyentry *), entries);
+
+    __memclear(id, name, ip, key, KEYSIZE + 1);
+    memset(buffer, '\0', OS_BUFFER_SIZE + 1);
+
+    /* Entries in the order of the file */
+    while (fgets(buffer, OS_BUFFER_SIZE, fp) != NULL) {
+        if (__keyline(buffer, id, name, ip, key) <= 0) {
+            __memclear(id, name, ip, key, KEYSIZE + 1);
+            continue;
+        }
+
+        if (count >= (MAX_AGENTS - 2)) {
+            merror(AG_MAX_ERROR, __local_name, MAX_AGENTS - 2);
+            goto cleanup;
+        }
+
+        prev = (keyentry *) OSHash_Get(keys->keyhash_id, id);
+        if (prev && __keysame(prev, name, ip, key)) {
+            entry = prev;
+        } else if ((entry = __keyentry(id, name, ip, key)) == NULL) {
+            merror(INVALID_IP, __local_name, ip);
+            __memclear(id, name, ip, key, KEYSIZE + 1);
+            continue;
+        }
+
+        __memclear(id, name, ip, key, KEYSIZE + 1);
+
+        if (!__keyindex(update, entry)) {
+            merror("%s: WARN: Duplicated agent id '%s' in '%s'.", __local_name,
+                   entry->id, KEYS_FILE);
+            if (entry != prev) {
+                __keyfree(entry);
             }
+            continue;
+        }
+
+        reused += entry == prev;
+        entries[count++] = entry;
+    }
 
-            /* Close counter */
-            if (keys->keyentries[i]->fp) {
-                fclose(keys->keyentries[i]->fp);
+    changes = (int)((count - reused) + (keys->keysize - reused));
+    if (changes == 0) {
+        goto cleanup;
+    }
+
+    if (count == 0) {
+        merror(NO_REM_CONN, __local_name);
+    }
+
+    /* The agents kept stay where they were */
+    os_calloc(count + 1, sizeof(keyentry *), update->keyentries);
+
+    for (i = 0; i < count; i++) {
+        prev = (keyentry *) OSHash_Get(keys->keyhash_id, entries[i]->id);
+        if (prev && prev->keyid < count) {
+            update->keyentries[prev->keyid] = entries[i];
+            entries[i] = NULL;
+        }
+    }
+
+    /* The others fill the free positions */
+    for (i = 0, next = 0; i < count; i++) {
+        if (entries[i]) {
+            while (update->keyentries[next]) {
+                next++;
             }
+            update->keyentries[next] = entries[i];
+        }
+    }
 
-            free(keys->keyentries[i]);
-            keys->keyentries[i] = NULL;
+    /* The sender counter is kept */
+    update->keyentries[count] = keys->keyentries[keys->keysize];
+    update->keysize = count;
+
+    fclose(fp);
+    free(entries);
+
+    return (changes);
+
+cleanup:
+    fclose(fp);
+    __memclear(id, name, ip, key, KEYSIZE + 1);
+
+    for (i = 0; i < count; i++) {
+        if (OSHash_Get(keys->keyhash_id, entries[i]->id) != entries[i]) {
+            __keyfree(entries[i]);
         }
     }
+    free(entries);
 
-    /* Free structure */
-    free(keys->keyentries);
-    keys->keyentries = NULL;
-    keys->keysize = 0;
+    OSHash_Free(update->keyhash_id);
+    OSHash_Free(update->keyhash_ip);
+    OSHash_Free(update->keyhash_name);
+    update->keyhash_id = NULL;
+    update->keyhash_ip = NULL;
+    update->keyhash_name = NULL;
+
+    return (changes);
+}
+
+/* Publish the keys read by OS_DiffKeys. No other thread may be using
+ * keys (it is only a swap of pointers, plus the counters of the new
+ * agents). update gets the previous keys, for OS_ReleaseKeys.
+ */
+void OS_SwapKeys(keystore *keys, keystore *update)
+{
+    keystore previous = *keys;
+    keyentry **added;
+    keyentry *entry;
+    keyentry *prev;
+    unsigned int n_added = 0;
+    unsigned int i;
+
+    os_calloc(update->keysize + 1, sizeof(keyentry *), added);
+
+    for (i = 0; i < update->keysize; i++) {
+        entry = update->keyentries[i];
+        entry->keyid = i;
+
+        if ((prev = (keyentry *) OSHash_Get(previous.keyhash_id, entry->id)) == entry) {
+            continue;
+        }
+
+        if (!prev) {
+            added[n_added++] = entry;
+            continue;
+        }
+
+        /* Same agent with a new key or address: keep its counters */
+        entry->global = prev->global;
+        entry->local = prev->local;
+#ifndef WIN32
+        entry->slot = prev->slot;
+#else
+        entry->fp = prev->fp;
+        prev->fp = NULL;
+#endif
+    }
+
+    OS_AddCounter(added, n_added);
+    free(added);
+
+    *keys = *update;
+    *update = previous;
+}
+
+/* Free the keys replaced by OS_SwapKeys (but the entries still in keys) */
+void OS_ReleaseKeys(const keystore *keys, keystore *previous)
+{
+    unsigned int i;
+
+    OSHash_Free(previous->keyhash_id);
+    OSHash_Free(previous->keyhash_ip);
+    OSHash_Free(previous->keyhash_name);
+
+    for (i = 0; i < previous->keysize; i++) {
+        if (OSHash_Get(keys->keyhash_id, previous->keyentries[i]->id) !=
+                previous->keyentries[i]) {
+            __keyfree(previous->keyentries[i]);
+        }
+    }
+
+    free(previous->keyentries);
+    memset(previous, 0, sizeof(keystore));
 }
 
 /* Check if key changed */
@@ -329,28 +659,27 @@ int OS_CheckUpdateKeys(const keystore *keys)
     return (0);
 }
 
-/* Update the keys if changed */
+/* Update the keys if changed (only the entries that changed) */
 int OS_UpdateKeys(keystore *keys)
 {
-    if (keys->file_change !=  File_DateofChange(KEYS_FILE)) {
-        merror(ENCFILE_CHANGED, __local_name);
-        debug1("%s: DEBUG: Freekeys", __local_name);
+    keystore update;
 
-        OS_FreeKeys(keys);
-        debug1("%s: DEBUG: OS_ReadKeys", __local_name);
+    if (keys->file_change == File_DateofChange(KEYS_FILE)) {
+        return (0);
+    }
 
-        /* Read keys */
-        verbose(ENC_READ, __local_name);
+    merror(ENCFILE_CHANGED, __local_name);
 
-        OS_ReadKeys(keys);
-        debug1("%s: DEBUG: OS_StartCounter", __local_name);
+    if (OS_DiffKeys(keys, &update) <= 0) {
+        keys->file_change = update.file_change;
+        return (0);
+    }
 
-        OS_StartCounter(keys);
-        debug1("%s: DEBUG: OS_UpdateKeys completed", __local_name);
+    OS_SwapKeys(keys, &update);
+    OS_ReleaseKeys(keys, &update);
+    debug1("%s: DEBUG: OS_UpdateKeys completed", __local_name);
 
-        return (1);
-    }
-    return (0);
+    return (1);
 }
 
 /* Check if an IP address is allowed to connect */
@@ -373,12 +702,11 @@ int OS_IsAllowedIP(keystore *keys, const char *srcip)
 /* Check if the agent name is valid */
 int OS_IsAllowedName(const keystore *keys, const char *name)
 {
-    unsigned int i = 0;
+    keyentry *entry;
 
-    for (i = 0; i < keys->keysize; i++) {
-        if (strcmp(keys->keyentries[i]->name, name) == 0) {
-            return ((int)i);
-        }
+    entry = (keyentry *) OSHash_Get(keys->keyhash_name, name);
+    if (entry) {
+        return ((int)entry->keyid);
     }
 
     return (-1);
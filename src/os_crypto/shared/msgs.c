@@ -17,6 +17,9 @@
 static void StoreSenderCounter(const keystore *keys, unsigned int global, unsigned int local) __attribute((nonnull));
 static void StoreCounter(const keystore *keys, int id, unsigned int global, unsigned int local) __attribute((nonnull));
 static char *CheckSum(char *msg) __attribute((nonnull));
+static int SecBF(const keyentry *entry, const char *input, char *output,
+                 long size, short int action) __attribute((nonnull));
+static unsigned int SecCounter(const char *str, size_t digits) __attribute((nonnull));
 
 /* Sending counts */
 static unsigned int global_count = 0;
@@ -24,7 +27,9 @@ static unsigned int local_count  = 0;
 
 /* Average compression rates */
 static unsigned int evt_count = 0;
+#ifdef WIN32
 static unsigned int rcv_count = 0;
+#endif
 static size_t c_orig_size = 0;
 static size_t c_comp_size = 0;
 
@@ -34,17 +39,70 @@ static unsigned int _s_recv_flush = 0;
 
 static int _s_verify_counter = 1;
 
+/* Preset compression dictionary: text common to most agent messages.
+ * zlib matches the end of the dictionary at a lower cost, so the most
+ * frequent strings go last. Changing it breaks the compatibility with
+ * the agents using it (see HC_ZDICT).
+ */
+static const char sec_zdict[] =
+    "Jan Feb Mar Apr May Jun Jul Aug Sep Oct Nov Dec Mon Tue Wed Thu Fri Sat Sun "
+    "error warning critical notice info debug denied refused failed failure "
+    "kernel: audit: type=SYSCALL msg=audit( success=yes exit=0 "
+    "postfix/smtpd[ connect from disconnect from NOQUEUE: reject: RCPT from "
+    "httpd[ GET /index.html HTTP/1.1\" 200 \"Mozilla/5.0 (compatible; "
+    "named[ client query: dhcpd: DHCPREQUEST for DHCPACK on "
+    "su: pam_unix(su:session): session opened for user root by "
+    "sudo: pam_unix(sudo:session): session closed for user root "
+    "sudo:  TTY=pts/0 ; PWD=/root ; USER=root ; COMMAND=/bin/ "
+    "CRON[ pam_unix(cron:session): session opened for user root by (uid=0) "
+    "(root) CMD ( run-parts /etc/cron.hourly) "
+    "ossec: output: 'df -P': ossec: output: 'netstat -tan |grep LISTEN' "
+    "1:ossec:ossec: Agent started: "
+    "9:rootcheck:System Audit: 9:rootcheck:Starting rootcheck scan. "
+    "8:syscheck:Starting syscheck scan. 8:syscheck:Ending syscheck scan. "
+    "8:syscheck:0:0:0:0:xxx:xxx 8:syscheck:33188:0:0:/etc/ /usr/bin/ /usr/sbin/ /bin/ /sbin/ "
+    "1:WinEvtLog: Security: AUDIT_SUCCESS(4624): Microsoft-Windows-Security-Auditing: "
+    "1:/var/log/syslog: 1:/var/log/auth.log: 1:/var/log/maillog: "
+    "1:/var/log/messages: 1:/var/log/secure: "
+    "pam_unix(sshd:session): session opened for user root by (uid=0) "
+    "Received disconnect from Connection closed by Invalid user "
+    "Failed password for invalid user Failed password for root from "
+    "sshd[ Accepted publickey for Accepted password for port ssh2 ";
+
 
 /* Read counters for each agent */
 void OS_StartCounter(keystore *keys)
 {
     unsigned int i;
+#ifdef WIN32
     char rids_file[OS_FLSIZE + 1];
 
     rids_file[OS_FLSIZE] = '\0';
+#endif
 
     debug1("%s: OS_StartCounter: keysize: %u", __local_name, keys->keysize);
 
+#ifndef WIN32
+    /* All the counters are in one table */
+    if (OS_RidsLoad(keys) < 0) {
+        ErrorExit("%s: ERROR: Unable to load the counters table '%s'.",
+                  __local_name, RIDS_TABLE);
+    }
+
+    for (i = 0; i <= keys->keysize; i++) {
+        if (i == keys->keysize) {
+            verbose("%s: INFO: Assigning sender counter: %u:%u",
+                    __local_name, keys->keyentries[i]->global,
+                    keys->keyentries[i]->local);
+            global_count = keys->keyentries[i]->global;
+            local_count = keys->keyentries[i]->local;
+        } else {
+            debug1("%s: DEBUG: Assigning counter for agent %s: '%u:%u'.",
+                   __local_name, keys->keyentries[i]->name,
+                   keys->keyentries[i]->global, keys->keyentries[i]->local);
+        }
+    }
+#else
     /* Start receiving counter */
     for (i = 0; i <= keys->keysize; i++) {
         /* On i == keysize, we deal with the sender counter */
@@ -109,6 +167,8 @@ void OS_StartCounter(keystore *keys)
         }
     }
 
+#endif
+
     debug2("%s: DEBUG: Stored counter.", __local_name);
 
     /* Get counter values */
@@ -127,12 +187,64 @@ void OS_StartCounter(keystore *keys)
 
 
     _s_verify_counter = getDefine_Int("remoted", "verify_msg_id" , 0, 1);
+
+    /* Compression level, and the dictionary for the messages using it */
+    os_zlib_setlevel(getDefine_Int("remoted", "comp_level", 1, 9));
+    os_zlib_setdict(sec_zdict, sizeof(sec_zdict) - 1, 0);
+}
+
+/* Start the counters of the agents added on a key reload */
+void OS_AddCounter(keyentry **entries, unsigned int count)
+{
+    unsigned int i;
+#ifndef WIN32
+    if (OS_RidsAssign(entries, count) < 0) {
+        merror("%s: ERROR: Unable to assign the counters of the new agents.",
+               __local_name);
+    }
+#else
+    char rids_file[OS_FLSIZE + 1];
+
+    for (i = 0; i < count; i++) {
+        snprintf(rids_file, OS_FLSIZE, "%s/%s", RIDS_DIR, entries[i]->id);
+
+        if ((entries[i]->fp = fopen(rids_file, "r+")) != NULL) {
+            if (fscanf(entries[i]->fp, "%u:%u", &entries[i]->global,
+                       &entries[i]->local) != 2) {
+                entries[i]->global = 0;
+                entries[i]->local = 0;
+            }
+        } else if ((entries[i]->fp = fopen(rids_file, "w")) == NULL) {
+            ErrorExit(FOPEN_ERROR, __local_name, rids_file, errno, strerror(errno));
+        }
+    }
+#endif
+
+    for (i = 0; i < count; i++) {
+        debug1("%s: DEBUG: Assigning counter for agent %s: '%u:%u'.",
+               __local_name, entries[i]->name,
+               entries[i]->global, entries[i]->local);
+    }
+}
+
+/* Compress the messages we create with the preset dictionary or not.
+ * The other end must have accepted it (HC_ZDICT).
+ */
+void OS_SecDictionary(int enable)
+{
+    os_zlib_setdict(sec_zdict, sizeof(sec_zdict) - 1, enable);
 }
 
 /* Remove the ID counter */
 void OS_RemoveCounter(const char *id)
 {
     char rids_file[OS_FLSIZE + 1];
+
+#ifndef WIN32
+    OS_RidsRemove(id);
+#endif
+
+    /* File of older versions */
     snprintf(rids_file, OS_FLSIZE, "%s/%s", RIDS_DIR, id);
     unlink(rids_file);
 }
@@ -140,17 +252,57 @@ void OS_RemoveCounter(const char *id)
 /* Store sender counter */
 static void StoreSenderCounter(const keystore *keys, unsigned int global, unsigned int local)
 {
+#ifndef WIN32
+    OS_RidsStore(keys->keyentries[keys->keysize]->slot, global, local);
+#else
     /* Write to the beginning of the file */
     fseek(keys->keyentries[keys->keysize]->fp, 0, SEEK_SET);
     fprintf(keys->keyentries[keys->keysize]->fp, "%u:%u:", global, local);
+#endif
 }
 
-/* Store the global and local count of events */
+/* Store the global and local count of events. The table is written on
+ * each message, the files every recv_counter_flush messages.
+ */
 static void StoreCounter(const keystore *keys, int id, unsigned int global, unsigned int local)
 {
+#ifndef WIN32
+    OS_RidsStore(keys->keyentries[id]->slot, global, local);
+#else
+    if (rcv_count++ < _s_recv_flush) {
+        return;
+    }
+    rcv_count = 0;
+
     /* Write to the beginning of the file */
     fseek(keys->keyentries[id]->fp, 0, SEEK_SET);
     fprintf(keys->keyentries[id]->fp, "%u:%u:", global, local);
+#endif
+}
+
+/* Encrypt or decrypt with the key of an agent */
+static int SecBF(const keyentry *entry, const char *input, char *output,
+                 long size, short int action)
+{
+    if (entry->bf_key) {
+        return (OS_BF_StrKey(input, output, entry->bf_key, size, action));
+    }
+
+    return (OS_BF_Str(input, output, entry->key, size, action));
+}
+
+/* Read a fixed-width message counter (like atoi, but no more than
+ * digits characters and no locale or sign handling)
+ */
+static unsigned int SecCounter(const char *str, size_t digits)
+{
+    unsigned int value = 0;
+
+    while (digits-- && *str >= '0' && *str <= '9') {
+        value = (value * 10) + (unsigned int)(*str++ - '0');
+    }
+
+    return (value);
 }
 
 /* Verify the checksum of the message
@@ -190,8 +342,8 @@ char *ReadSecMSG(keystore *keys, char *buffer, char *cleartext,
     }
 
     /* Decrypt message */
-    if (!OS_BF_Str(buffer, cleartext, keys->keyentries[id]->key,
-                   buffer_size, OS_DECRYPT)) {
+    if (!SecBF(keys->keyentries[id], buffer, cleartext,
+               buffer_size, OS_DECRYPT)) {
         merror(ENCKEY_ERROR, __local_name, keys->keyentries[id]->ip->ip);
         return (NULL);
     }
@@ -225,7 +377,7 @@ char *ReadSecMSG(keystore *keys, char *buffer, char *cleartext,
         f_msg += 5;
 
         /* Check count -- protect against replay attacks */
-        msg_global = (unsigned int) atoi(f_msg);
+        msg_global = SecCounter(f_msg, 10);
         f_msg += 10;
 
         /* Check for the right message format */
@@ -235,7 +387,7 @@ char *ReadSecMSG(keystore *keys, char *buffer, char *cleartext,
         }
         f_msg++;
 
-        msg_local = (unsigned int) atoi(f_msg);
+        msg_local = SecCounter(f_msg, 4);
         f_msg += 5;
 
         /* Return the message if we don't need to verify the counter */
@@ -243,11 +395,7 @@ char *ReadSecMSG(keystore *keys, char *buffer, char *cleartext,
             /* Update current counts */
             keys->keyentries[id]->global = msg_global;
             keys->keyentries[id]->local = msg_local;
-            if (rcv_count >= _s_recv_flush) {
-                StoreCounter(keys, id, msg_global, msg_local);
-                rcv_count = 0;
-            }
-            rcv_count++;
+            StoreCounter(keys, id, msg_global, msg_local);
             return (f_msg);
         }
 
@@ -259,11 +407,7 @@ char *ReadSecMSG(keystore *keys, char *buffer, char *cleartext,
             keys->keyentries[id]->global = msg_global;
             keys->keyentries[id]->local = msg_local;
 
-            if (rcv_count >= _s_recv_flush) {
-                StoreCounter(keys, id, msg_global, msg_local);
-                rcv_count = 0;
-            }
-            rcv_count++;
+            StoreCounter(keys, id, msg_global, msg_local);
             return (f_msg);
         }
 
@@ -302,10 +446,10 @@ char *ReadSecMSG(keystore *keys, char *buffer, char *cleartext,
         }
 
         /* Check time -- protect against replay attacks */
-        msg_time = (unsigned int) atoi(f_msg);
+        msg_time = SecCounter(f_msg, 10);
         f_msg += 11;
 
-        msg_count = (unsigned int) atoi(f_msg);
+        msg_count = SecCounter(f_msg, 4);
         f_msg += 5;
 
 
@@ -366,6 +510,65 @@ char *ReadSecMSG(keystore *keys, char *buffer, char *cleartext,
     return (NULL);
 }
 
+/* Append an event to a batch frame. The frame is BATCH_HEADER
+ * followed by one "<size>:<event>\n" entry per event.
+ */
+size_t AppendSecBatch(char *frame, size_t frame_len, size_t size, const char *msg)
+{
+    size_t msg_size = strlen(msg);
+    int entry_size;
+
+    if (frame_len == 0) {
+        if (size <= strlen(BATCH_HEADER)) {
+            return (0);
+        }
+
+        strcpy(frame, BATCH_HEADER);
+        frame_len = strlen(BATCH_HEADER);
+    }
+
+    /* The size prefix takes at most 11 bytes */
+    if (frame_len + msg_size + 12 >= size) {
+        return (0);
+    }
+
+    entry_size = snprintf(frame + frame_len, size - frame_len, "%lu:%s\n",
+                          (unsigned long)msg_size, msg);
+    if (entry_size < 0 || frame_len + (size_t)entry_size >= size) {
+        return (0);
+    }
+
+    return (frame_len + (size_t)entry_size);
+}
+
+/* Get the next event of a batch frame (ending at frame_end) */
+char *ReadSecBatch(char **cursor, const char *frame_end)
+{
+    char *msg;
+    char *end;
+    unsigned long msg_size;
+
+    if (*cursor >= frame_end) {
+        return (NULL);
+    }
+
+    msg_size = strtoul(*cursor, &end, 10);
+    if (end == *cursor || *end != ':') {
+        return (NULL);
+    }
+    msg = end + 1;
+
+    /* The entry must be complete */
+    if (msg_size >= (unsigned long)(frame_end - msg) || msg[msg_size] != '\n') {
+        return (NULL);
+    }
+
+    msg[msg_size] = '\0';
+    *cursor = msg + msg_size + 1;
+
+    return (msg);
+}
+
 /* Create an encrypted message
  * Returns the size
  */
@@ -442,7 +645,7 @@ size_t CreateSecMSG(const keystore *keys, const char *msg, char *msg_encrypted,
     /* Get average sizes */
     c_orig_size += msg_size;
     c_comp_size += cmp_size;
-    if (evt_count > _s_comp_print) {
+    if (_s_comp_print && evt_count > _s_comp_print) {
         verbose("%s: INFO: Event count after '%u': %lu->%lu (%lu%%)", __local_name,
                 evt_count,
                 (unsigned long)c_orig_size,
@@ -469,10 +672,9 @@ size_t CreateSecMSG(const keystore *keys, const char *msg, char *msg_encrypted,
      */
 
     /* Encrypt everything */
-    OS_BF_Str(_tmpmsg + (7 - bfsize), msg_encrypted + msg_size,
-              keys->keyentries[id]->key,
-              (long) cmp_size,
-              OS_ENCRYPT);
+    SecBF(keys->keyentries[id], _tmpmsg + (7 - bfsize), msg_encrypted + msg_size,
+          (long) cmp_size,
+          OS_ENCRYPT);
 
     /* Store before leaving */
     StoreSenderCounter(keys, global_count, local_count);
@@ -0,0 +1,453 @@
+/* Copyright (C) 2009 Trend Micro Inc.
+ * All rights reserved.
+ *
+ * This program is a free software; you can redistribute it
+ * and/or modify it under the terms of the GNU General Public
+ * License (version 2) as published by the FSF - Free Software
+ * Foundation.
+ */
+
+/* Table of the message counters
+ *
+ * The counters of all the agents (and the sender counter) are kept in a
+ * single file, RIDS_TABLE, mapped in memory. Each entry holds the id of
+ * the agent and two copies of its counters with a checksum: an update
+ * goes to the oldest copy, so an update interrupted by a crash leaves
+ * the previous one valid. The table is synced to the disk every
+ * rids_sync_interval seconds. The per-agent files of RIDS_DIR used by
+ * older versions are imported the first time an agent is seen.
+ */
+
+#include "shared.h"
+#include "headers/sec.h"
+
+#ifndef WIN32
+
+#include <sys/mman.h>
+
+#define RIDS_MAGIC      0x53444952
+#define RIDS_VERSION    1
+#define RIDS_IDSIZE     16
+#define RIDS_MIN_SLOTS  64
+
+typedef struct _rids_header {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int slots;         /* Entries in the file */
+    unsigned int reserved;
+} rids_header;
+
+/* Copy of the counters of an entry */
+typedef struct _rids_value {
+    unsigned int global;
+    unsigned int local;
+    unsigned int seq;           /* The highest valid copy is the current one */
+    unsigned int sum;
+} rids_value;
+
+/* Entry of an agent (a free entry has an empty id) */
+typedef struct _rids_slot {
+    char id[RIDS_IDSIZE];
+    rids_value value[2];
+} rids_slot;
+
+#define RIDS_SIZE(slots) (sizeof(rids_header) + (size_t)(slots) * sizeof(rids_slot))
+#define RIDS_SLOT(table, i) ((rids_slot *)((char *)(table) + sizeof(rids_header)) + (i))
+
+
+/* Prototypes */
+static unsigned int rids_sum(const rids_slot *slot, const volatile rids_value *value);
+static int rids_current(const rids_slot *slot);
+static void rids_write(rids_slot *slot, unsigned int global, unsigned int local);
+static rids_header *rids_map(int fd, size_t size);
+static int rids_grow(void);
+static void rids_import(const char *id, unsigned int *global, unsigned int *local);
+static OSHash *rids_index(void);
+static int rids_assign(keyentry *entry, const char *id, OSHash *index, unsigned int *free_slot);
+
+/* Global vars */
+static const char *rids_path = RIDS_TABLE;
+static rids_header *rids_table = NULL;
+static size_t rids_size = 0;
+static int rids_fd = -1;
+static int rids_interval = 0;
+static time_t rids_synced = 0;
+
+
+/* Checksum of a copy of the counters (FNV-1a) */
+static unsigned int rids_sum(const rids_slot *slot, const volatile rids_value *value)
+{
+    unsigned int fields[3];
+    unsigned int sum = 2166136261U;
+    const unsigned char *p;
+    size_t i;
+
+    fields[0] = value->global;
+    fields[1] = value->local;
+    fields[2] = value->seq;
+
+    for (i = 0; i < RIDS_IDSIZE && slot->id[i]; i++) {
+        sum = (sum ^ (unsigned char)slot->id[i]) * 16777619U;
+    }
+
+    for (p = (const unsigned char *)fields, i = 0; i < sizeof(fields); i++) {
+        sum = (sum ^ p[i]) * 16777619U;
+    }
+
+    return (sum);
+}
+
+/* Get the current copy of an entry. Returns -1 if none is valid */
+static int rids_current(const rids_slot *slot)
+{
+    int valid0 = slot->value[0].sum == rids_sum(slot, &slot->value[0]);
+    int valid1 = slot->value[1].sum == rids_sum(slot, &slot->value[1]);
+
+    if (valid0 && valid1) {
+        return (slot->value[1].seq > slot->value[0].seq ? 1 : 0);
+    }
+
+    return (valid0 ? 0 : valid1 ? 1 : -1);
+}
+
+/* Write the counters over the oldest copy. The checksum goes last */
+static void rids_write(rids_slot *slot, unsigned int global, unsigned int local)
+{
+    int current = rids_current(slot);
+    volatile rids_value *value = &slot->value[current == 0 ? 1 : 0];
+    unsigned int seq = current < 0 ? 1 : slot->value[current].seq + 1;
+
+    value->sum = 0;
+    value->global = global;
+    value->local = local;
+    value->seq = seq;
+    value->sum = rids_sum(slot, value);
+}
+
+static rids_header *rids_map(int fd, size_t size)
+{
+    void *table = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    return (table == MAP_FAILED ? NULL : (rids_header *)table);
+}
+
+/* Double the size of the table. Returns -1 on error */
+static int rids_grow()
+{
+    unsigned int slots = rids_table->slots * 2;
+    rids_header *table;
+
+    if (ftruncate(rids_fd, (off_t)RIDS_SIZE(slots)) < 0 ||
+            (table = rids_map(rids_fd, RIDS_SIZE(slots))) == NULL) {
+        merror("%s: ERROR: Unable to extend '%s': %s", __local_name,
+               rids_path, strerror(errno));
+        return (-1);
+    }
+
+    munmap(rids_table, rids_size);
+    rids_table = table;
+    rids_table->slots = slots;
+    rids_size = RIDS_SIZE(slots);
+
+    return (0);
+}
+
+/* Read the counters of an agent from the file of older versions */
+static void rids_import(const char *id, unsigned int *global, unsigned int *local)
+{
+    char rids_file[OS_FLSIZE + 1];
+    FILE *fp;
+
+    snprintf(rids_file, OS_FLSIZE, "%s/%s", RIDS_DIR, id);
+
+    if ((fp = fopen(rids_file, "r")) == NULL) {
+        return;
+    }
+
+    if (fscanf(fp, "%u:%u", global, local) != 2) {
+        *global = 0;
+        *local = 0;
+    }
+
+    fclose(fp);
+    unlink(rids_file);
+}
+
+/* Use another table file, synced every interval seconds (instead of
+ * rids_sync_interval). The table mapped is closed.
+ */
+void OS_RidsFile(const char *path, int interval)
+{
+    if (rids_table) {
+        munmap(rids_table, rids_size);
+        close(rids_fd);
+        rids_table = NULL;
+        rids_size = 0;
+        rids_fd = -1;
+    }
+
+    rids_path = path;
+    rids_interval = interval;
+}
+
+/* Map the table, creating it if needed. Returns -1 on error */
+int OS_RidsOpen()
+{
+    struct stat st;
+    rids_header *table = NULL;
+    size_t size;
+    int fd;
+
+    if (rids_table) {
+        return (0);
+    }
+
+    if (!rids_interval) {
+        rids_interval = getDefine_Int("remoted", "rids_sync_interval", 1, 3600);
+    }
+
+    if ((fd = open(rids_path, O_RDWR | O_CREAT, 0640)) < 0) {
+        merror(FOPEN_ERROR, __local_name, rids_path, errno, strerror(errno));
+        return (-1);
+    }
+
+    if (fstat(fd, &st) < 0) {
+        merror("%s: ERROR: Unable to stat '%s': %s", __local_name, rids_path,
+               strerror(errno));
+        close(fd);
+        return (-1);
+    }
+
+    size = (size_t)st.st_size;
+
+    if (size >= RIDS_SIZE(0) && (table = rids_map(fd, size)) != NULL &&
+            (table->magic != RIDS_MAGIC || table->version != RIDS_VERSION ||
+             table->slots == 0 || RIDS_SIZE(table->slots) != size)) {
+        merror("%s: WARN: Invalid counters table '%s'. Starting a new one.",
+               __local_name, rids_path);
+        munmap(table, size);
+        table = NULL;
+    }
+
+    /* A new table */
+    if (!table) {
+        size = RIDS_SIZE(RIDS_MIN_SLOTS);
+
+        if (ftruncate(fd, 0) < 0 || ftruncate(fd, (off_t)size) < 0 ||
+                (table = rids_map(fd, size)) == NULL) {
+            merror("%s: ERROR: Unable to create '%s': %s", __local_name,
+                   rids_path, strerror(errno));
+            close(fd);
+            return (-1);
+        }
+
+        table->magic = RIDS_MAGIC;
+        table->version = RIDS_VERSION;
+        table->slots = RIDS_MIN_SLOTS;
+    }
+
+    rids_table = table;
+    rids_size = size;
+    rids_fd = fd;
+    rids_synced = time(0);
+
+    return (0);
+}
+
+/* Index the entries of the table by id (the position is stored plus one).
+ * Returns NULL on error
+ */
+static OSHash *rids_index()
+{
+    OSHash *index;
+    rids_slot *slot;
+    unsigned int i;
+
+    index = OSHash_Create();
+    if (!index || !OSHash_setSize(index, rids_table->slots * 2)) {
+        merror(MEM_ERROR, __local_name, errno, strerror(errno));
+        return (NULL);
+    }
+
+    for (i = 0; i < rids_table->slots; i++) {
+        slot = RIDS_SLOT(rids_table, i);
+
+        if (slot->id[0] && slot->id[RIDS_IDSIZE - 1] == '\0') {
+            OSHash_Add(index, slot->id, (void *)((size_t)i + 1));
+        }
+    }
+
+    return (index);
+}
+
+/* Assign the entry of id to a key and read its counters, taking a free
+ * entry (from free_slot on) the first time. Returns -1 on error
+ */
+static int rids_assign(keyentry *entry, const char *id, OSHash *index, unsigned int *free_slot)
+{
+    rids_slot *slot;
+    unsigned int global = 0;
+    unsigned int local = 0;
+    int current;
+
+    if (strlen(id) >= RIDS_IDSIZE) {
+        merror("%s: WARN: Agent id '%s' too long for the counters table.",
+               __local_name, id);
+        entry->slot = -1;
+        return (0);
+    }
+
+    if ((entry->slot = (int)(size_t)OSHash_Get(index, id) - 1) >= 0) {
+        slot = RIDS_SLOT(rids_table, entry->slot);
+
+        if ((current = rids_current(slot)) >= 0) {
+            global = slot->value[current].global;
+            local = slot->value[current].local;
+        } else {
+            merror("%s: WARN: Invalid counters for '%s' in '%s'.",
+                   __local_name, id, rids_path);
+        }
+    } else {
+        /* First time seen: take a free entry */
+        while (*free_slot < rids_table->slots &&
+                RIDS_SLOT(rids_table, *free_slot)->id[0]) {
+            (*free_slot)++;
+        }
+
+        if (*free_slot == rids_table->slots && rids_grow() < 0) {
+            return (-1);
+        }
+
+        entry->slot = (int)*free_slot;
+        slot = RIDS_SLOT(rids_table, *free_slot);
+        memset(slot, 0, sizeof(rids_slot));
+        strncpy(slot->id, id, RIDS_IDSIZE - 1);
+
+        rids_import(id, &global, &local);
+        rids_write(slot, global, local);
+    }
+
+    entry->global = global;
+    entry->local = local;
+
+    return (0);
+}
+
+/* Assign an entry of the table to each key (and to the sender counter,
+ * at keysize) and read its counters. Returns -1 on error
+ */
+int OS_RidsLoad(keystore *keys)
+{
+    OSHash *index;
+    unsigned int free_slot = 0;
+    unsigned int i;
+
+    if (OS_RidsOpen() < 0 || (index = rids_index()) == NULL) {
+        return (-1);
+    }
+
+    for (i = 0; i <= keys->keysize; i++) {
+        if (rids_assign(keys->keyentries[i],
+                        i == keys->keysize ? SENDER_COUNTER : keys->keyentries[i]->id,
+                        index, &free_slot) < 0) {
+            OSHash_Free(index);
+            return (-1);
+        }
+    }
+
+    OSHash_Free(index);
+    OS_RidsSync();
+
+    return (0);
+}
+
+/* Assign an entry of the table to the keys added on a reload.
+ * Returns -1 on error
+ */
+int OS_RidsAssign(keyentry **entries, unsigned int count)
+{
+    OSHash *index;
+    unsigned int free_slot = 0;
+    unsigned int i;
+
+    if (count == 0) {
+        return (0);
+    }
+
+    if (OS_RidsOpen() < 0 || (index = rids_index()) == NULL) {
+        return (-1);
+    }
+
+    for (i = 0; i < count; i++) {
+        if (rids_assign(entries[i], entries[i]->id, index, &free_slot) < 0) {
+            OSHash_Free(index);
+            return (-1);
+        }
+    }
+
+    OSHash_Free(index);
+    OS_RidsSync();
+
+    return (0);
+}
+
+/* Store the counters of an entry */
+void OS_RidsStore(int slot, unsigned int global, unsigned int local)
+{
+    time_t now;
+
+    if (!rids_table || slot < 0 || (unsigned int)slot >= rids_table->slots) {
+        return;
+    }
+
+    rids_write(RIDS_SLOT(rids_table, slot), global, local);
+
+    if ((now = time(0)) - rids_synced >= rids_interval) {
+        rids_synced = now;
+        OS_RidsSync();
+    }
+}
+
+/* Write the table to the disk */
+void OS_RidsSync()
+{
+    if (rids_table && msync(rids_table, rids_size, MS_SYNC) < 0) {
+        merror("%s: ERROR: Unable to sync '%s': %s", __local_name,
+               rids_path, strerror(errno));
+    }
+}
+
+/* Free the entry of an agent (from any process) */
+void OS_RidsRemove(const char *id)
+{
+    rids_header *table;
+    rids_slot *slot;
+    struct stat st;
+    unsigned int i;
+    int fd;
+
+    if ((fd = open(rids_path, O_RDWR)) < 0) {
+        return;
+    }
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < RIDS_SIZE(0) ||
+            (table = rids_map(fd, (size_t)st.st_size)) == NULL) {
+        close(fd);
+        return;
+    }
+
+    if (table->magic == RIDS_MAGIC && RIDS_SIZE(table->slots) <= (size_t)st.st_size) {
+        for (i = 0; i < table->slots; i++) {
+            slot = RIDS_SLOT(table, i);
+
+            if (strncmp(slot->id, id, RIDS_IDSIZE) == 0) {
+                memset(slot, 0, sizeof(rids_slot));
+            }
+        }
+    }
+
+    munmap(table, (size_t)st.st_size);
+    close(fd);
+}
+
+#endif /* !WIN32 */
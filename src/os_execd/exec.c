@@ -14,13 +14,14 @@
 static char exec_names[MAX_AR + 1][OS_FLSIZE + 1];
 static char exec_cmd[MAX_AR + 1][OS_FLSIZE + 1];
 static int  exec_timeout[MAX_AR + 1];
+static int  exec_batch[MAX_AR + 1];
 static int  exec_size = 0;
 static int  f_time_reading = 1;
 
 
 /* Read the shared exec config
  * Returns 1 on success or 0 on failure
- * Format of the file is 'name - command - timeout'
+ * Format of the file is 'name - command - timeout[ - batch]'
  */
 int ReadExecConfig()
 {
@@ -34,6 +35,7 @@ int ReadExecConfig()
         memset(exec_names[i], '\0', OS_FLSIZE + 1);
         memset(exec_cmd[i], '\0', OS_FLSIZE + 1);
         exec_timeout[i] = 0;
+        exec_batch[i] = 0;
     }
     exec_size = 0;
 
@@ -117,6 +119,10 @@ int ReadExecConfig()
         /* Get the exec timeout */
         exec_timeout[exec_size] = atoi(str_pt);
 
+        /* The command takes its operations in batches */
+        tmp_str = strchr(str_pt, ' ');
+        exec_batch[exec_size] = tmp_str && strcmp(tmp_str, " - batch") == 0;
+
         /* Check if name is duplicated */
         dup_entry = 0;
         for (j = 0; j < exec_size; j++) {
@@ -124,6 +130,7 @@ int ReadExecConfig()
                 if (exec_cmd[j][0] == '\0') {
                     strncpy(exec_cmd[j], exec_cmd[exec_size], OS_FLSIZE);
                     exec_cmd[j][OS_FLSIZE] = '\0';
+                    exec_batch[j] = exec_batch[exec_size];
                     dup_entry = 1;
                     break;
                 } else if (exec_cmd[exec_size][0] == '\0') {
@@ -136,6 +143,7 @@ int ReadExecConfig()
             exec_cmd[exec_size][0] = '\0';
             exec_names[exec_size][0] = '\0';
             exec_timeout[exec_size] = 0;
+            exec_batch[exec_size] = 0;
         } else {
             exec_size++;
         }
@@ -166,6 +174,20 @@ char *GetCommandbyName(const char *name, int *timeout)
     return (NULL);
 }
 
+/* Returns 1 if the command (full path) takes its operations in batches */
+int GetCommandBatch(const char *command)
+{
+    int i = 0;
+
+    for (; i < exec_size; i++) {
+        if (strcmp(command, exec_cmd[i]) == 0) {
+            return (exec_batch[i]);
+        }
+    }
+
+    return (0);
+}
+
 #ifndef WIN32
 
 /* Execute command given. Must be a argv** NULL terminated.
@@ -8,7 +8,6 @@
  */
 
 #include "shared.h"
-#include "list_op.h"
 #include "os_regex/os_regex.h"
 #include "os_net/os_net.h"
 #include "execd.h"
@@ -21,12 +20,53 @@ int repeated_offenders_timeout[] = {0, 0, 0, 0, 0, 0, 0};
 static void help_execd(void) __attribute__((noreturn));
 static void execd_shutdown(int sig) __attribute__((noreturn));
 static void ExecdStart(int q) __attribute__((noreturn));
+static void timeout_key(char *key, size_t size, char *const *command);
+static void timeout_up(unsigned int i);
+static void timeout_down(unsigned int i);
+static int timeout_add(timeout_data *entry);
+static void timeout_update(timeout_data *entry);
+static timeout_data *timeout_pop(void);
+static int repeated_timeout(const char *rkey, int timeout);
+static int exec_run(char *const *cmd, time_t now);
+static void batch_queue(char *const *cmd, time_t now);
+static int batch_flush(time_t now, int force);
+static time_t batch_next(void);
+static long metric_timeouts(void);
 
 /* Global variables */
-static OSList *timeout_list;
-static OSListNode *timeout_node;
+
+/* Pending timeouts: a min-heap on their expiration, and a hash on
+ * "<command> <source ip>" to find the repeated ones
+ */
+static timeout_data **timeout_heap;
+static unsigned int timeout_size;
+static unsigned int timeout_max;
+static OSHash *timeout_hash;
 static OSHash *repeated_hash;
 
+/* Operations queued for a command taking them in batches: it is run as
+ * "<command> batch" with a line per operation on its standard input,
+ * "<add|delete> <arguments>", after batch_window seconds or batch_max
+ * operations.
+ */
+typedef struct _exec_batch {
+    char command[OS_FLSIZE + 1];
+    FILE *fp;
+    unsigned int count;
+    time_t first;               /* First operation queued */
+} exec_batch;
+
+static exec_batch batches[MAX_AR + 1];
+static unsigned int batch_size;
+static int batch_window;
+static int batch_max;
+
+/* Metrics */
+static os_metric *metric_requests;
+static os_metric *metric_commands;
+static os_metric *metric_batched;
+static os_metric *metric_batches;
+
 
 /* Print help statement */
 static void help_execd()
@@ -52,19 +92,12 @@ static void execd_shutdown(int sig)
     /* Remove pending active responses */
     merror(EXEC_SHUTDOWN, ARGV0);
 
-    timeout_node = OSList_GetFirstNode(timeout_list);
-    while (timeout_node) {
-        timeout_data *list_entry;
-
-        list_entry = (timeout_data *)timeout_node->data;
-
-        ExecCmd(list_entry->command);
-
-        /* Delete current node - already sets the pointer to next */
-        OSList_DeleteCurrentlyNode(timeout_list);
-        timeout_node = OSList_GetCurrentlyNode(timeout_list);
+    while (timeout_size > 0) {
+        exec_run(timeout_pop()->command, time(0));
     }
 
+    batch_flush(time(0), 1);
+
     HandleSIG(sig);
 }
 
@@ -157,6 +190,18 @@ int main(int argc, char **argv)
         merror(PID_ERROR, ARGV0);
     }
 
+    /* Batches of operations (0 disables them) */
+    batch_window = getDefine_Int("execd", "batch_window", 0, 60);
+    batch_max = getDefine_Int("execd", "batch_max", 1, 100000);
+
+    /* Metrics (served on the control socket) */
+    metric_requests = OS_MetricCounter("execd_requests_total", "Active responses received.");
+    metric_commands = OS_MetricCounter("execd_commands_total", "Commands run (one operation each).");
+    metric_batched = OS_MetricCounter("execd_batched_total", "Operations queued in batches.");
+    metric_batches = OS_MetricCounter("execd_batches_total", "Batches of operations run.");
+    OS_MetricGauge("execd_timeouts", "Commands waiting for their timeout.", metric_timeouts);
+    OS_StartMetrics();
+
     /* Start exec queue */
     if ((m_queue = StartMQ(EXECQUEUEPATH, READ)) < 0) {
         ErrorExit(QUEUE_ERROR, ARGV0, EXECQUEUEPATH, strerror(errno));
@@ -202,6 +247,272 @@ void FreeTimeoutEntry(timeout_data *timeout_entry)
 
 #ifndef WIN32
 
+/* Key of a timeout in the hash: "<command> <source ip>" */
+static void timeout_key(char *key, size_t size, char *const *command)
+{
+    snprintf(key, size, "%s %s", command[0], command[3]);
+}
+
+/* Move an entry of the heap up to its place */
+static void timeout_up(unsigned int i)
+{
+    timeout_data *entry = timeout_heap[i];
+    unsigned int parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (TIMEOUT_EXPIRY(timeout_heap[parent]) <= TIMEOUT_EXPIRY(entry)) {
+            break;
+        }
+
+        timeout_heap[i] = timeout_heap[parent];
+        timeout_heap[i]->heap_index = i;
+        i = parent;
+    }
+
+    timeout_heap[i] = entry;
+    entry->heap_index = i;
+}
+
+/* Move an entry of the heap down to its place */
+static void timeout_down(unsigned int i)
+{
+    timeout_data *entry = timeout_heap[i];
+    unsigned int child;
+
+    while ((child = 2 * i + 1) < timeout_size) {
+        if (child + 1 < timeout_size &&
+                TIMEOUT_EXPIRY(timeout_heap[child + 1]) < TIMEOUT_EXPIRY(timeout_heap[child])) {
+            child++;
+        }
+        if (TIMEOUT_EXPIRY(entry) <= TIMEOUT_EXPIRY(timeout_heap[child])) {
+            break;
+        }
+
+        timeout_heap[i] = timeout_heap[child];
+        timeout_heap[i]->heap_index = i;
+        i = child;
+    }
+
+    timeout_heap[i] = entry;
+    entry->heap_index = i;
+}
+
+/* Add a timeout. Returns -1 on error */
+static int timeout_add(timeout_data *entry)
+{
+    char key[OS_FLSIZE + 1];
+
+    timeout_key(key, OS_FLSIZE, entry->command);
+    if (OSHash_Add(timeout_hash, key, entry) != 2) {
+        return (-1);
+    }
+
+    if (timeout_size == timeout_max) {
+        timeout_max = timeout_max ? timeout_max * 2 : 256;
+        os_realloc(timeout_heap, timeout_max * sizeof(timeout_data *), timeout_heap);
+    }
+
+    timeout_heap[timeout_size] = entry;
+    timeout_up(timeout_size++);
+
+    return (0);
+}
+
+/* Reorder a timeout after its expiration changed */
+static void timeout_update(timeout_data *entry)
+{
+    timeout_up(entry->heap_index);
+    timeout_down(entry->heap_index);
+}
+
+/* Remove the timeout expiring first. The heap must not be empty. */
+static timeout_data *timeout_pop()
+{
+    timeout_data *entry = timeout_heap[0];
+    char key[OS_FLSIZE + 1];
+
+    if (--timeout_size > 0) {
+        timeout_heap[0] = timeout_heap[timeout_size];
+        timeout_down(0);
+    }
+
+    timeout_key(key, OS_FLSIZE, entry->command);
+    OSHash_Delete(timeout_hash, key);
+
+    return (entry);
+}
+
+/* Timeout of a repeated offender: the next of repeated_offenders_timeout
+ * each time (the last one from then on). The first time it is counted and
+ * the timeout is kept.
+ */
+static int repeated_timeout(const char *rkey, int timeout)
+{
+    char *ntimes;
+    int ntimes_int;
+    int i = 0;
+
+    if ((ntimes = (char *) OSHash_Get(repeated_hash, rkey)) == NULL) {
+        OSHash_Add(repeated_hash, rkey, strdup("0"));
+        return (timeout);
+    }
+
+    ntimes_int = atoi(ntimes);
+    while (repeated_offenders_timeout[i] != 0) {
+        i++;
+    }
+
+    if (ntimes_int >= i) {
+        return (repeated_offenders_timeout[i - 1] * 60);
+    }
+
+    timeout = repeated_offenders_timeout[ntimes_int] * 60;
+
+    /* In hash_op.c, data belongs to caller */
+    free(ntimes);
+    os_calloc(10, sizeof(char), ntimes);
+    snprintf(ntimes, 9, "%d", ntimes_int + 1);
+    OSHash_Update(repeated_hash, rkey, ntimes);
+
+    return (timeout);
+}
+
+/* Commands in the timeout heap */
+static long metric_timeouts()
+{
+    return ((long)timeout_size);
+}
+
+/* Run a command, or queue it if it takes its operations in batches.
+ * Returns the number of processes started.
+ */
+static int exec_run(char *const *cmd, time_t now)
+{
+    if (batch_window > 0 && GetCommandBatch(cmd[0])) {
+        batch_queue(cmd, now);
+        return (0);
+    }
+
+    ExecCmd(cmd);
+    OS_MetricAdd(metric_commands, 1);
+    return (1);
+}
+
+/* Queue an operation for its command */
+static void batch_queue(char *const *cmd, time_t now)
+{
+    exec_batch *batch = NULL;
+    unsigned int i;
+
+    for (i = 0; i < batch_size; i++) {
+        if (strcmp(batches[i].command, cmd[0]) == 0) {
+            batch = &batches[i];
+            break;
+        }
+    }
+
+    if (!batch) {
+        if (batch_size > MAX_AR) {
+            ExecCmd(cmd);
+            OS_MetricAdd(metric_commands, 1);
+            return;
+        }
+
+        batch = &batches[batch_size++];
+        strncpy(batch->command, cmd[0], OS_FLSIZE);
+    }
+
+    if (!batch->fp && (batch->fp = tmpfile()) == NULL) {
+        merror(FOPEN_ERROR, ARGV0, "tmpfile", errno, strerror(errno));
+        ExecCmd(cmd);
+        OS_MetricAdd(metric_commands, 1);
+        return;
+    }
+
+    for (i = 1; cmd[i]; i++) {
+        fprintf(batch->fp, i > 1 ? " %s" : "%s", cmd[i]);
+    }
+    fputc('\n', batch->fp);
+
+    if (batch->count++ == 0) {
+        batch->first = now;
+    }
+    OS_MetricAdd(metric_batched, 1);
+}
+
+/* Run the commands whose batch is due (or all of them if force is set)
+ * Returns the number of processes started.
+ */
+static int batch_flush(time_t now, int force)
+{
+    exec_batch *batch;
+    unsigned int i;
+    int started = 0;
+    pid_t pid;
+
+    /* The children must not inherit operations still in the buffers:
+     * they would be written again to the files (shared with them)
+     */
+    for (i = 0; i < batch_size; i++) {
+        if (batches[i].fp) {
+            fflush(batches[i].fp);
+        }
+    }
+
+    for (i = 0; i < batch_size; i++) {
+        batch = &batches[i];
+
+        if (batch->count == 0 || (!force && batch->count < (unsigned int)batch_max &&
+                                  now - batch->first < batch_window)) {
+            continue;
+        }
+
+        rewind(batch->fp);
+
+        pid = fork();
+        if (pid == 0) {
+            char *const args[] = {batch->command, BATCH_ENTRY, NULL};
+
+            if (dup2(fileno(batch->fp), STDIN_FILENO) < 0 ||
+                    execv(batch->command, args) < 0) {
+                merror(EXEC_CMDERROR, ARGV0, batch->command, strerror(errno));
+                _exit(1);
+            }
+
+            _exit(0);
+        } else if (pid < 0) {
+            merror(FORK_ERROR, ARGV0, errno, strerror(errno));
+        } else {
+            debug1("%s: DEBUG: Running %s with %u operations.", ARGV0,
+                   batch->command, batch->count);
+            OS_MetricAdd(metric_batches, 1);
+            started++;
+        }
+
+        fclose(batch->fp);
+        batch->fp = NULL;
+        batch->count = 0;
+    }
+
+    return (started);
+}
+
+/* Time when the next batch is due, or 0 if none is queued */
+static time_t batch_next()
+{
+    time_t next = 0;
+    unsigned int i;
+
+    for (i = 0; i < batch_size; i++) {
+        if (batches[i].count > 0 && (next == 0 || batches[i].first + batch_window < next)) {
+            next = batches[i].first + batch_window;
+        }
+    }
+
+    return (next);
+}
+
 /* Main function on the execd. Does all the data receiving, etc. */
 static void ExecdStart(int q)
 {
@@ -226,10 +537,10 @@ static void ExecdStart(int q)
         cmd_args[i] = NULL;
     }
 
-    /* Create list for timeout */
-    timeout_list = OSList_Create();
-    if (!timeout_list) {
-        ErrorExit(LIST_ERROR, ARGV0);
+    /* Create the hash for the timeouts */
+    timeout_hash = OSHash_Create();
+    if (!timeout_hash || !OSHash_setSize(timeout_hash, 4096)) {
+        ErrorExit(MEM_ERROR, ARGV0, errno, strerror(errno));
     }
 
     if (repeated_offenders_timeout[0] != 0) {
@@ -241,9 +552,10 @@ static void ExecdStart(int q)
     /* Main loop */
     while (1) {
         int timeout_value;
-        int added_before = 0;
         char **timeout_args;
         timeout_data *timeout_entry;
+        time_t next;
+        char rkey[256];
 
         /* Clean up any children */
         while (childcount) {
@@ -267,34 +579,28 @@ static void ExecdStart(int q)
         /* Get current time */
         curr_time = time(0);
 
-        /* Check if there is any timed out command to execute */
-        timeout_node = OSList_GetFirstNode(timeout_list);
-        while (timeout_node) {
-            timeout_data *list_entry;
-
-            list_entry = (timeout_data *)timeout_node->data;
-
-            /* Timed out */
-            if ((curr_time - list_entry->time_of_addition) >
-                    list_entry->time_to_block) {
-                ExecCmd(list_entry->command);
+        /* Execute the timed out commands */
+        while (timeout_size > 0 && TIMEOUT_EXPIRY(timeout_heap[0]) < curr_time) {
+            timeout_entry = timeout_pop();
+            childcount += exec_run(timeout_entry->command, curr_time);
+            FreeTimeoutEntry(timeout_entry);
+        }
 
-                /* Delete current node - already sets the pointer to next */
-                OSList_DeleteCurrentlyNode(timeout_list);
-                timeout_node = OSList_GetCurrentlyNode(timeout_list);
+        /* Run the batches due */
+        childcount += batch_flush(curr_time, 0);
 
-                /* Clear the memory */
-                FreeTimeoutEntry(list_entry);
+        /* Wait up to EXECD_TIMEOUT, or until the next timeout or batch */
+        socket_timeout.tv_sec = EXECD_TIMEOUT;
+        socket_timeout.tv_usec = 0;
 
-                childcount++;
-            } else {
-                timeout_node = OSList_GetNextNode(timeout_list);
-            }
+        if (timeout_size > 0 &&
+                TIMEOUT_EXPIRY(timeout_heap[0]) - curr_time + 1 < socket_timeout.tv_sec) {
+            socket_timeout.tv_sec = TIMEOUT_EXPIRY(timeout_heap[0]) - curr_time + 1;
         }
 
-        /* Set timeout to EXECD_TIMEOUT */
-        socket_timeout.tv_sec = EXECD_TIMEOUT;
-        socket_timeout.tv_usec = 0;
+        if ((next = batch_next()) > 0 && next - curr_time < socket_timeout.tv_sec) {
+            socket_timeout.tv_sec = next > curr_time ? next - curr_time : 0;
+        }
 
         /* Set FD values */
         FD_ZERO(&fdset);
@@ -317,6 +623,7 @@ static void ExecdStart(int q)
             merror(QUEUE_ERROR, ARGV0, EXECQUEUEPATH, strerror(errno));
             continue;
         }
+        OS_MetricAdd(metric_requests, 1);
 
         /* Current time */
         curr_time = time(0);
@@ -382,105 +689,47 @@ static void ExecdStart(int q)
             i++;
         }
 
-        /* Check if this command was already executed */
-        timeout_node = OSList_GetFirstNode(timeout_list);
-        added_before = 0;
+        timeout_entry = NULL;
 
         /* Check for the username and IP argument */
         if (!timeout_args[2] || !timeout_args[3]) {
-            added_before = 1;
             merror("%s: Invalid number of arguments.", ARGV0);
         }
 
-        while (timeout_node) {
-            timeout_data *list_entry;
+        /* Check if this command was already executed */
+        else {
+            char key[OS_FLSIZE + 1];
 
-            list_entry = (timeout_data *)timeout_node->data;
-            if ((strcmp(list_entry->command[3], timeout_args[3]) == 0) &&
-                    (strcmp(list_entry->command[0], timeout_args[0]) == 0)) {
+            rkey[255] = '\0';
+            snprintf(rkey, 255, "%s%s", timeout_args[0], timeout_args[3]);
+
+            timeout_key(key, OS_FLSIZE, timeout_args);
+            if ((timeout_entry = (timeout_data *) OSHash_Get(timeout_hash, key))) {
                 /* Means we executed this command before
                  * and we don't need to add it again
                  */
-                added_before = 1;
-
-                /* Update the timeout */
-                list_entry->time_of_addition = curr_time;
-
-                if (repeated_offenders_timeout[0] != 0 &&
-                        repeated_hash != NULL &&
-                        strncmp(timeout_args[3], "-", 1) != 0) {
-                    char *ntimes = NULL;
-                    char rkey[256];
-                    rkey[255] = '\0';
-                    snprintf(rkey, 255, "%s%s", list_entry->command[0],
-                             timeout_args[3]);
-
-                    if ((ntimes = (char *) OSHash_Get(repeated_hash, rkey))) {
-                        int ntimes_int = 0;
-                        int i2 = 0;
-                        int new_timeout = 0;
-                        ntimes_int = atoi(ntimes);
-                        while (repeated_offenders_timeout[i2] != 0) {
-                            i2++;
-                        }
-                        if (ntimes_int >= i2) {
-                            new_timeout = repeated_offenders_timeout[i2 - 1] * 60;
-                        } else {
-                            free(ntimes);       /* In hash_op.c, data belongs to caller */
-                            os_calloc(10, sizeof(char), ntimes);
-                            new_timeout = repeated_offenders_timeout[ntimes_int] * 60;
-                            ntimes_int++;
-                            snprintf(ntimes, 9, "%d", ntimes_int);
-                            OSHash_Update(repeated_hash, rkey, ntimes);
-                        }
-                        list_entry->time_to_block = new_timeout;
-                    }
+                timeout_entry->time_of_addition = curr_time;
+
+                if (repeated_hash != NULL &&
+                        strncmp(timeout_args[3], "-", 1) != 0 &&
+                        OSHash_Get(repeated_hash, rkey)) {
+                    timeout_entry->time_to_block =
+                        repeated_timeout(rkey, timeout_entry->time_to_block);
                 }
-                break;
-            }
 
-            /* Continue with the next entry in timeout list*/
-            timeout_node = OSList_GetNextNode(timeout_list);
+                timeout_update(timeout_entry);
+            }
         }
 
         /* If it wasn't added before, do it now */
-        if (!added_before) {
+        if (!timeout_entry && timeout_args[2] && timeout_args[3]) {
             /* Execute command */
-            ExecCmd(cmd_args);
+            childcount += exec_run(cmd_args, curr_time);
 
             /* We don't need to add to the list if the timeout_value == 0 */
             if (timeout_value) {
-                char *ntimes;
-                char rkey[256];
-                rkey[255] = '\0';
-                snprintf(rkey, 255, "%s%s", timeout_args[0],
-                         timeout_args[3]);
-
                 if (repeated_hash != NULL) {
-                    if ((ntimes = (char *) OSHash_Get(repeated_hash, rkey))) {
-                        int ntimes_int = 0;
-                        int i2 = 0;
-                        int new_timeout = 0;
-
-                        ntimes_int = atoi(ntimes);
-                        while (repeated_offenders_timeout[i2] != 0) {
-                            i2++;
-                        }
-                        if (ntimes_int >= i2) {
-                            new_timeout = repeated_offenders_timeout[i2 - 1] * 60;
-                        } else {
-                            os_calloc(10, sizeof(char), ntimes);
-                            new_timeout = repeated_offenders_timeout[ntimes_int] * 60;
-                            ntimes_int++;
-                            snprintf(ntimes, 9, "%d", ntimes_int);
-                            OSHash_Update(repeated_hash, rkey, ntimes);
-                        }
-                        timeout_value = new_timeout;
-                    } else {
-                        /* Add to the repeat offenders list */
-                        OSHash_Add(repeated_hash,
-                                   rkey, strdup("0"));
-                    }
+                    timeout_value = repeated_timeout(rkey, timeout_value);
                 }
 
                 /* Create the timeout entry */
@@ -489,29 +738,18 @@ static void ExecdStart(int q)
                 timeout_entry->time_of_addition = curr_time;
                 timeout_entry->time_to_block = timeout_value;
 
-                /* Add command to the timeout list */
-                if (!OSList_AddData(timeout_list, timeout_entry)) {
+                /* Add command to the timeouts */
+                if (timeout_add(timeout_entry) < 0) {
                     merror(LIST_ADD_ERROR, ARGV0);
                     FreeTimeoutEntry(timeout_entry);
                 }
-            }
 
-            /* If no timeout, we still need to free it in here */
-            else {
-                char **ss_ta = timeout_args;
-                while (*timeout_args) {
-                    os_free(*timeout_args);
-                    *timeout_args = NULL;
-                    timeout_args++;
-                }
-                os_free(ss_ta);
+                timeout_args = NULL;
             }
-
-            childcount++;
         }
 
-        /* We didn't add it to the timeout list */
-        else {
+        /* We didn't add it to the timeouts */
+        if (timeout_args) {
             char **ss_ta = timeout_args;
 
             /* Clear the timeout arguments */
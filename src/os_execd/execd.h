@@ -27,6 +27,9 @@
 /* Execd select timeout -- in seconds */
 #define EXECD_TIMEOUT   90
 
+/* Argument of the commands taking their operations in batches */
+#define BATCH_ENTRY     "batch"
+
 extern int repeated_offenders_timeout[];
 
 /** Function prototypes **/
@@ -34,6 +37,7 @@ extern int repeated_offenders_timeout[];
 void WinExecdRun(char *exec_msg);
 int ReadExecConfig(void);
 char *GetCommandbyName(const char *name, int *timeout) __attribute__((nonnull));
+int GetCommandBatch(const char *command) __attribute__((nonnull));
 void ExecCmd(char *const *cmd) __attribute__((nonnull));
 void ExecCmd_Win32(char *cmd);
 int ExecdConfig(const char *cfgfile) __attribute__((nonnull));
@@ -45,8 +49,12 @@ typedef struct _timeout_data {
     time_t time_of_addition;
     int time_to_block;
     char **command;
+    unsigned int heap_index;    /* Position in the heap of timeouts */
 } timeout_data;
 
+/* Time when the command of a timeout is run */
+#define TIMEOUT_EXPIRY(x) ((x)->time_of_addition + (x)->time_to_block)
+
 void FreeTimeoutEntry(timeout_data *timeout_entry);
 
 #endif
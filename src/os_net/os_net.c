@@ -11,12 +11,17 @@
  * APIs for many network operations
  */
 
+/* recvmmsg/sendmmsg are GNU extensions */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <errno.h>
 #include "shared.h"
 #include "os_net.h"
 
 /* Prototypes */
-static int OS_Bindport(u_int16_t _port, unsigned int _proto, const char *_ip, int ipv6);
+static int OS_Bindport(u_int16_t _port, unsigned int _proto, const char *_ip, int ipv6, int reuseport);
 static int OS_Connect(u_int16_t _port, unsigned int protocol, const char *_ip, int ipv6);
 
 /* Unix socket -- not for windows */
@@ -39,8 +44,11 @@ static socklen_t us_l = sizeof(n_us);
 #endif /* WIN32*/
 
 
-/* Bind a specific port */
-static int OS_Bindport(u_int16_t _port, unsigned int _proto, const char *_ip, int ipv6)
+/* Bind a specific port
+ * If reuseport is set, other sockets may bind to the same port
+ * (and the kernel balances the peers among them)
+ */
+static int OS_Bindport(u_int16_t _port, unsigned int _proto, const char *_ip, int ipv6, int reuseport)
 {
     int ossock;
     struct sockaddr_in server;
@@ -70,6 +78,20 @@ static int OS_Bindport(u_int16_t _port, unsigned int _proto, const char *_ip, in
         return (OS_INVALID);
     }
 
+    if (reuseport) {
+#ifdef SO_REUSEPORT
+        int flag = 1;
+        if (setsockopt(ossock, SOL_SOCKET, SO_REUSEPORT,
+                       (char *)&flag,  sizeof(flag)) < 0) {
+            OS_CloseSocket(ossock);
+            return (OS_SOCKTERR);
+        }
+#else
+        OS_CloseSocket(ossock);
+        return (OS_INVALID);
+#endif
+    }
+
     if (ipv6) {
 #ifndef WIN32
         memset(&server6, 0, sizeof(server6));
@@ -112,13 +134,21 @@ static int OS_Bindport(u_int16_t _port, unsigned int _proto, const char *_ip, in
 /* Bind a TCP port, using the OS_Bindport */
 int OS_Bindporttcp(u_int16_t _port, const char *_ip, int ipv6)
 {
-    return (OS_Bindport(_port, IPPROTO_TCP, _ip, ipv6));
+    return (OS_Bindport(_port, IPPROTO_TCP, _ip, ipv6, 0));
 }
 
 /* Bind a UDP port, using the OS_Bindport */
 int OS_Bindportudp(u_int16_t _port, const char *_ip, int ipv6)
 {
-    return (OS_Bindport(_port, IPPROTO_UDP, _ip, ipv6));
+    return (OS_Bindport(_port, IPPROTO_UDP, _ip, ipv6, 0));
+}
+
+/* Bind a UDP port that can be shared by several sockets (SO_REUSEPORT)
+ * Returns OS_INVALID if the system does not support it
+ */
+int OS_BindportudpShared(u_int16_t _port, const char *_ip, int ipv6)
+{
+    return (OS_Bindport(_port, IPPROTO_UDP, _ip, ipv6, 1));
 }
 
 #ifndef WIN32
@@ -169,6 +199,67 @@ int OS_BindUnixDomain(const char *path, mode_t mode, int max_msg_size)
     return (ossock);
 }
 
+/* Bind a Unix domain stream socket to "path", using the "mode"
+ * permissions, and start listening on it.
+ * Uses a local address so it can be called from any thread.
+ */
+int OS_BindUnixStream(const char *path, mode_t mode)
+{
+    int ossock = 0;
+    struct sockaddr_un addr;
+
+    /* Make sure the path isn't there */
+    unlink(path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    if ((ossock = socket(PF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return (OS_SOCKTERR);
+    }
+
+    if (bind(ossock, (struct sockaddr *)&addr, SUN_LEN(&addr)) < 0) {
+        OS_CloseSocket(ossock);
+        return (OS_SOCKTERR);
+    }
+
+    /* Change permissions */
+    if (chmod(path, mode) < 0) {
+        OS_CloseSocket(ossock);
+        return (OS_SOCKTERR);
+    }
+
+    if (listen(ossock, 32) < 0) {
+        OS_CloseSocket(ossock);
+        return (OS_SOCKTERR);
+    }
+
+    return (ossock);
+}
+
+/* Open a client Unix domain stream socket */
+int OS_ConnectUnixStream(const char *path)
+{
+    int ossock = 0;
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    if ((ossock = socket(PF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return (OS_SOCKTERR);
+    }
+
+    if (connect(ossock, (struct sockaddr *)&addr, SUN_LEN(&addr)) < 0) {
+        OS_CloseSocket(ossock);
+        return (OS_SOCKTERR);
+    }
+
+    return (ossock);
+}
+
 /* Open a client Unix domain socket
  * ("/tmp/lala-socket",0666));
  */
@@ -458,6 +549,154 @@ int OS_SendUnix(int socket, const char *msg, int size)
 
     return (OS_SUCCESS);
 }
+
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define OS_HAVE_MMSG
+#endif
+
+/* Receive a batch of datagrams (blocks for the first one only) */
+int OS_RecvUDPBatch(int socket, OSDgram *dgrams, unsigned int count)
+{
+    unsigned int i;
+
+    if (count == 0) {
+        return (0);
+    }
+    if (count > OS_DGRAM_BATCH) {
+        count = OS_DGRAM_BATCH;
+    }
+
+#ifdef OS_HAVE_MMSG
+    {
+        struct mmsghdr msgs[OS_DGRAM_BATCH];
+        struct iovec iov[OS_DGRAM_BATCH];
+        int recvd;
+
+        memset(msgs, 0, sizeof(struct mmsghdr) * count);
+        for (i = 0; i < count; i++) {
+            iov[i].iov_base = dgrams[i].buf;
+            iov[i].iov_len = dgrams[i].size - 1;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &dgrams[i].peer;
+            msgs[i].msg_hdr.msg_namelen = sizeof(dgrams[i].peer);
+        }
+
+        recvd = recvmmsg(socket, msgs, count, MSG_WAITFORONE, NULL);
+
+        /* Old kernels have the symbol but not the system call */
+        if (recvd >= 0 || errno != ENOSYS) {
+            for (i = 0; recvd > 0 && i < (unsigned int)recvd; i++) {
+                dgrams[i].len = msgs[i].msg_len;
+                dgrams[i].peer_len = msgs[i].msg_hdr.msg_namelen;
+                dgrams[i].buf[dgrams[i].len] = '\0';
+            }
+            return (recvd);
+        }
+    }
+#endif
+
+    for (i = 0; i < count; i++) {
+        ssize_t recvd;
+
+        dgrams[i].peer_len = sizeof(dgrams[i].peer);
+        recvd = recvfrom(socket, dgrams[i].buf, dgrams[i].size - 1,
+                         i == 0 ? 0 : MSG_DONTWAIT,
+                         (struct sockaddr *)&dgrams[i].peer,
+                         &dgrams[i].peer_len);
+        if (recvd < 0) {
+            return (i == 0 ? -1 : (int)i);
+        }
+
+        dgrams[i].len = (size_t)recvd;
+        dgrams[i].buf[recvd] = '\0';
+    }
+
+    return ((int)count);
+}
+
+/* Send a batch of datagrams.
+ * A datagram that fails is skipped; ENOBUFS is retried like
+ * OS_SendUDPbySize does.
+ */
+int OS_SendUDPBatch(int socket, OSDgram *dgrams, unsigned int count)
+{
+    unsigned int i = 0;
+    unsigned int sent = 0;
+    unsigned int attempts = 0;
+
+#ifdef OS_HAVE_MMSG
+    struct mmsghdr msgs[OS_DGRAM_BATCH];
+    struct iovec iov[OS_DGRAM_BATCH];
+
+    while (i < count) {
+        unsigned int n = count - i;
+        unsigned int j;
+        int ret;
+
+        if (n > OS_DGRAM_BATCH) {
+            n = OS_DGRAM_BATCH;
+        }
+
+        memset(msgs, 0, sizeof(struct mmsghdr) * n);
+        for (j = 0; j < n; j++) {
+            iov[j].iov_base = dgrams[i + j].buf;
+            iov[j].iov_len = dgrams[i + j].len;
+            msgs[j].msg_hdr.msg_iov = &iov[j];
+            msgs[j].msg_hdr.msg_iovlen = 1;
+            if (dgrams[i + j].peer_len) {
+                msgs[j].msg_hdr.msg_name = &dgrams[i + j].peer;
+                msgs[j].msg_hdr.msg_namelen = dgrams[i + j].peer_len;
+            }
+        }
+
+        ret = sendmmsg(socket, msgs, n, 0);
+        if (ret > 0) {
+            i += (unsigned int)ret;
+            sent += (unsigned int)ret;
+            attempts = 0;
+            continue;
+        }
+
+        if (ret < 0 && errno == ENOSYS) {
+            break;
+        }
+        if (ret < 0 && errno == ENOBUFS && attempts < 5) {
+            attempts++;
+            merror("%s: INFO: Remote socket busy, waiting %u s.", __local_name, attempts);
+            sleep(attempts);
+            continue;
+        }
+
+        /* Skip the datagram that failed */
+        attempts = 0;
+        i++;
+    }
+#endif
+
+    for (; i < count; i++) {
+        ssize_t ret;
+
+        attempts = 0;
+        while ((ret = sendto(socket, dgrams[i].buf, dgrams[i].len, 0,
+                             dgrams[i].peer_len ? (struct sockaddr *)&dgrams[i].peer : NULL,
+                             dgrams[i].peer_len)) < 0) {
+            if (errno != ENOBUFS || attempts >= 5) {
+                break;
+            }
+
+            attempts++;
+            merror("%s: INFO: Remote socket busy, waiting %u s.", __local_name, attempts);
+            sleep(attempts);
+        }
+
+        if (ret >= 0) {
+            sent++;
+        }
+    }
+
+    return (count && sent == 0 ? -1 : (int)sent);
+}
 #endif
 
 /* Calls gethostbyname (tries x attempts) */
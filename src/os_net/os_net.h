@@ -22,6 +22,12 @@
 int OS_Bindporttcp(u_int16_t _port, const char *_ip, int ipv6);
 int OS_Bindportudp(u_int16_t _port, const char *_ip, int ipv6);
 
+/* OS_BindportudpShared
+ * Same as OS_Bindportudp, but the port can be bound again by other
+ * sockets (SO_REUSEPORT). Returns OS_INVALID if not supported.
+ */
+int OS_BindportudpShared(u_int16_t _port, const char *_ip, int ipv6);
+
 /* OS_BindUnixDomain
  * Bind to a specific file, using the "mode" permissions in
  * a Unix Domain socket.
@@ -30,6 +36,12 @@ int OS_BindUnixDomain(const char *path, mode_t mode, int max_msg_size) __attribu
 int OS_ConnectUnixDomain(const char *path, int max_msg_size) __attribute__((nonnull));
 int OS_getsocketsize(int ossock);
 
+/* OS_BindUnixStream / OS_ConnectUnixStream
+ * Unix domain stream sockets (listening and client side).
+ */
+int OS_BindUnixStream(const char *path, mode_t mode) __attribute__((nonnull));
+int OS_ConnectUnixStream(const char *path) __attribute__((nonnull));
+
 /* OS_Connect
  * Connect to a TCP/UDP socket
  */
@@ -64,6 +76,37 @@ int OS_SendUnix(int socket, const char *msg, int size) __attribute__((nonnull));
 
 int OS_SendUDPbySize(int socket, int size, const char *msg) __attribute__((nonnull));
 
+#ifndef WIN32
+#include <sys/socket.h>
+
+/* Datagram for the batched UDP calls.
+ * Receive: buf holds size bytes, len and peer are filled in.
+ * Send: buf holds len bytes, sent to peer if peer_len is set
+ * (otherwise the socket must be connected).
+ */
+typedef struct _OSDgram {
+    char *buf;
+    size_t size;
+    size_t len;
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+} OSDgram;
+
+/* Maximum number of datagrams moved by one batched call */
+#define OS_DGRAM_BATCH  64
+
+/* OS_RecvUDPBatch
+ * Wait for at least one datagram and return as many as are already
+ * queued (up to count). Returns the number received or -1 on error.
+ */
+int OS_RecvUDPBatch(int socket, OSDgram *dgrams, unsigned int count) __attribute__((nonnull));
+
+/* OS_SendUDPBatch
+ * Send count datagrams. Returns the number sent or -1 if none could be.
+ */
+int OS_SendUDPBatch(int socket, OSDgram *dgrams, unsigned int count) __attribute__((nonnull));
+#endif
+
 /* OS_GetHost
  * Calls gethostbyname
  */
@@ -7,38 +7,172 @@
  * Foundation
  */
 
+#include <string.h>
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
 #include "os_zlib.h"
 
 #include "../external/zlib-1.2.8/zlib.h"
 
+/* Messages are short: a small window and hash table are enough, and
+ * much cheaper to reset between messages
+ */
+#define ZLIB_WINDOW_BITS    13
+#define ZLIB_MEM_LEVEL      5
+
+/* Compression level and preset dictionary */
+static int zlib_level = Z_BEST_COMPRESSION;
+static const Bytef *zlib_dict = NULL;
+static uInt zlib_dict_size = 0;
+static int zlib_dict_compress = 0;
+
+#ifndef WIN32
+/* The deflate state is kept between calls: setting it up (and clearing
+ * its tables) costs more than compressing a short message.
+ */
+static z_stream zlib_deflate;
+static int zlib_deflate_ready = 0;
+static pthread_mutex_t zlib_deflate_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+/* Set the compression level (1 to 9) */
+void os_zlib_setlevel(int level)
+{
+    if (level < Z_BEST_SPEED || level > Z_BEST_COMPRESSION) {
+        return;
+    }
+
+#ifndef WIN32
+    pthread_mutex_lock(&zlib_deflate_mutex);
+    if (zlib_deflate_ready && level != zlib_level) {
+        deflateEnd(&zlib_deflate);
+        zlib_deflate_ready = 0;
+    }
+#endif
+
+    zlib_level = level;
+
+#ifndef WIN32
+    pthread_mutex_unlock(&zlib_deflate_mutex);
+#endif
+}
+
+/* Set the preset dictionary */
+void os_zlib_setdict(const char *dict, unsigned int dict_size, int compress)
+{
+#ifndef WIN32
+    pthread_mutex_lock(&zlib_deflate_mutex);
+#endif
+
+    zlib_dict = (const Bytef *)dict;
+    zlib_dict_size = dict ? dict_size : 0;
+    zlib_dict_compress = dict ? compress : 0;
+
+#ifndef WIN32
+    pthread_mutex_unlock(&zlib_deflate_mutex);
+#endif
+}
+
 unsigned long int os_zlib_compress(const char *src, char *dst,
                                    unsigned long int src_size,
                                    unsigned long int dst_size)
 {
-    if (compress2((Bytef *)dst,
-                  &dst_size,
-                  (const Bytef *)src,
-                  src_size,
-                  Z_BEST_COMPRESSION) == Z_OK) {
-        dst[dst_size] = '\0';
-        return (dst_size);
+    z_stream *strm;
+    unsigned long int out = 0;
+#ifdef WIN32
+    z_stream local_strm;
+#endif
+
+    if (!src || !dst || dst_size == 0) {
+        return (0);
+    }
+
+#ifndef WIN32
+    pthread_mutex_lock(&zlib_deflate_mutex);
+    strm = &zlib_deflate;
+
+    if (!zlib_deflate_ready) {
+        memset(strm, 0, sizeof(z_stream));
+        if (deflateInit2(strm, zlib_level, Z_DEFLATED, ZLIB_WINDOW_BITS,
+                         ZLIB_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+            pthread_mutex_unlock(&zlib_deflate_mutex);
+            return (0);
+        }
+        zlib_deflate_ready = 1;
+    } else if (deflateReset(strm) != Z_OK) {
+        pthread_mutex_unlock(&zlib_deflate_mutex);
+        return (0);
+    }
+#else
+    strm = &local_strm;
+    memset(strm, 0, sizeof(z_stream));
+    if (deflateInit2(strm, zlib_level, Z_DEFLATED, ZLIB_WINDOW_BITS,
+                         ZLIB_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return (0);
     }
+#endif
 
-    return (0);
+    if (!zlib_dict_compress ||
+            deflateSetDictionary(strm, zlib_dict, zlib_dict_size) == Z_OK) {
+        strm->next_in = (Bytef *)src;
+        strm->avail_in = (uInt)src_size;
+        strm->next_out = (Bytef *)dst;
+        strm->avail_out = (uInt)dst_size;
+
+        if (deflate(strm, Z_FINISH) == Z_STREAM_END) {
+            out = strm->total_out;
+            dst[out] = '\0';
+        }
+    }
+
+#ifndef WIN32
+    pthread_mutex_unlock(&zlib_deflate_mutex);
+#else
+    deflateEnd(strm);
+#endif
+
+    return (out);
 }
 
 unsigned long int os_zlib_uncompress(const char *src, char *dst,
                                      unsigned long int src_size,
                                      unsigned long int dst_size)
 {
-    if (uncompress((Bytef *)dst,
-                   &dst_size,
-                   (const Bytef *)src,
-                   src_size) == Z_OK) {
-        dst[dst_size] = '\0';
-        return (dst_size);
+    z_stream strm;
+    unsigned long int out = 0;
+    int ret;
+
+    if (!src || !dst || src_size == 0 || dst_size == 0) {
+        return (0);
     }
 
-    return (0);
-}
+    memset(&strm, 0, sizeof(z_stream));
+    strm.next_in = (Bytef *)src;
+    strm.avail_in = (uInt)src_size;
+    strm.next_out = (Bytef *)dst;
+    strm.avail_out = (uInt)dst_size;
+
+    if (inflateInit(&strm) != Z_OK) {
+        return (0);
+    }
+
+    ret = inflate(&strm, Z_FINISH);
+
+    /* Compressed with the preset dictionary (checked by zlib) */
+    if (ret == Z_NEED_DICT && zlib_dict &&
+            inflateSetDictionary(&strm, zlib_dict, zlib_dict_size) == Z_OK) {
+        ret = inflate(&strm, Z_FINISH);
+    }
+
+    if (ret == Z_STREAM_END) {
+        out = strm.total_out;
+        dst[out] = '\0';
+    }
 
+    inflateEnd(&strm);
+
+    return (out);
+}
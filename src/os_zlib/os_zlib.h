@@ -34,5 +34,15 @@ unsigned long int os_zlib_uncompress(const char *src, char *dst,
                                      unsigned long int src_size,
                                      unsigned long int dst_size);
 
+/* Set the compression level of os_zlib_compress (1 to 9, 9 by default) */
+void os_zlib_setlevel(int level);
+
+/* Set a preset dictionary. os_zlib_uncompress uses it for the messages
+ * that were compressed with it; os_zlib_compress only if compress is set
+ * (the other end must know the same dictionary).
+ * The dictionary is not copied.
+ */
+void os_zlib_setdict(const char *dict, unsigned int dict_size, int compress);
+
 #endif /* __OS_ZLIB_H */
 
@@ -7,12 +7,285 @@
  * Foundation
  */
 
+/* Active response forwarding
+ *
+ * AR_Forward reads the active responses from analysisd and queues them.
+ * A pool of senders (remoted.ar_threads) sends them: a response to all
+ * the agents is split in chunks of OS_DGRAM_BATCH agents, sent with one
+ * system call each, and the keys are only locked while a chunk is sent.
+ * A response equal to one still queued or being sent (same command, user
+ * and source ip to the same agents) is dropped.
+ */
+
 #include <pthread.h>
 
 #include "shared.h"
 #include "remoted.h"
 #include "os_net/os_net.h"
 
+/* Active response queued */
+typedef struct _ar_job {
+    char key[OS_SIZE_2048 + 1]; /* Target and command (in-flight hash) */
+    char msg[OS_SIZE_1024 + 1];
+    char target[KEYSIZE + 1];   /* Agent id, or empty for all the agents */
+    unsigned int next;          /* Next agent to send to (all the agents) */
+    unsigned int total;         /* Agents when it was queued */
+    unsigned int running;       /* Senders working on it */
+    unsigned int sent;
+    unsigned int skipped;       /* Agents not connected */
+    unsigned int failed;
+    struct _ar_job *next_job;
+} ar_job;
+
+/* Prototypes */
+static int ar_parse(char *msg, int *ar_location, char **location, char **agent_id, char **command);
+static void ar_key(char *key, size_t size, const char *target, const char *msg);
+static void ar_queue(const char *target, const char *msg);
+static void ar_finish(ar_job *job);
+static void ar_send(ar_job *job, unsigned int first, unsigned int last);
+static void *ar_sender(void *none) __attribute__((noreturn));
+
+/* Global vars */
+static ar_job *ar_first = NULL;
+static ar_job **ar_last = &ar_first;
+static OSHash *ar_inflight = NULL;
+static unsigned long ar_dropped = 0;
+static pthread_mutex_t ar_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ar_available = PTHREAD_COND_INITIALIZER;
+static os_metric *metric_ar_sent;
+static os_metric *metric_ar_dropped;
+
+
+/* Split an active response: "(location) srcip <ar location> <agent id> <command>"
+ * Returns 0 on success or -1 if it is invalid
+ */
+static int ar_parse(char *msg, int *ar_location, char **location, char **agent_id, char **command)
+{
+    char *tmp_str;
+
+    *ar_location = 0;
+
+    /* Location is going to be the agent name */
+    if (*msg != '(' || (tmp_str = strchr(msg, ')')) == NULL || tmp_str[1] == '\0') {
+        return (-1);
+    }
+    *tmp_str = '\0';
+    *location = msg + 1;
+
+    /* Skip the source IP */
+    if ((tmp_str = strchr(tmp_str + 2, ' ')) == NULL) {
+        return (-1);
+    }
+    tmp_str++;
+
+    /* Active response location: three flags */
+    if (strlen(tmp_str) < 4 || tmp_str[3] != ' ') {
+        return (-1);
+    }
+
+    if (tmp_str[0] == ALL_AGENTS_C) {
+        *ar_location |= ALL_AGENTS;
+    }
+    if (tmp_str[1] == REMOTE_AGENT_C) {
+        *ar_location |= REMOTE_AGENT;
+    } else if (tmp_str[1] == NO_AR_C) {
+        *ar_location |= NO_AR_MSG;
+    }
+    if (tmp_str[2] == SPECIFIC_AGENT_C) {
+        *ar_location |= SPECIFIC_AGENT;
+    }
+
+    /* Agent id and command */
+    *agent_id = tmp_str + 4;
+    if ((tmp_str = strchr(*agent_id, ' ')) == NULL) {
+        return (-1);
+    }
+    *tmp_str = '\0';
+    *command = tmp_str + 1;
+
+    return (0);
+}
+
+/* Key of a response in flight: "<target> <header><command> <user> <srcip>".
+ * The rest of the message (time, alert id, rule, location) changes with
+ * every alert; execd keys its timeouts on the command and source ip too.
+ */
+static void ar_key(char *key, size_t size, const char *target, const char *msg)
+{
+    const char *end = msg;
+    int fields = 3;
+
+    /* The headers tell a response from a control message */
+    if (strncmp(end, CONTROL_HEADER, strlen(CONTROL_HEADER)) == 0) {
+        end += strlen(CONTROL_HEADER);
+    }
+    if (strncmp(end, EXECD_HEADER, strlen(EXECD_HEADER)) == 0) {
+        end += strlen(EXECD_HEADER);
+    }
+
+    while (*end && (*end != ' ' || --fields > 0)) {
+        end++;
+    }
+
+    snprintf(key, size, "%s %.*s", target[0] ? target : "*", (int)(end - msg), msg);
+}
+
+/* Queue a response for the senders, unless it is in flight already */
+static void ar_queue(const char *target, const char *msg)
+{
+    ar_job *job;
+
+    os_calloc(1, sizeof(ar_job), job);
+    ar_key(job->key, OS_SIZE_2048, target, msg);
+    strncpy(job->msg, msg, OS_SIZE_1024);
+    strncpy(job->target, target, KEYSIZE);
+
+    if (!target[0]) {
+        key_rdlock();
+        job->total = keys.keysize;
+        key_unlock();
+    }
+
+    pthread_mutex_lock(&ar_mutex);
+
+    if (OSHash_Add(ar_inflight, job->key, job) != 2) {
+        ar_dropped++;
+        pthread_mutex_unlock(&ar_mutex);
+        OS_MetricAdd(metric_ar_dropped, 1);
+
+        debug1("%s: DEBUG: Active response already in flight (%lu dropped): %s",
+               ARGV0, ar_dropped, job->key);
+        free(job);
+        return;
+    }
+
+    *ar_last = job;
+    ar_last = &job->next_job;
+
+    pthread_cond_signal(&ar_available);
+    pthread_mutex_unlock(&ar_mutex);
+}
+
+/* Forget a response once sent (ar_mutex locked) */
+static void ar_finish(ar_job *job)
+{
+    OSHash_Delete(ar_inflight, job->key);
+
+    if (job->target[0]) {
+        debug1("%s: DEBUG: Active response to agent %s: %s.", ARGV0, job->target,
+               job->sent ? "sent" : job->skipped ? "not connected" : "failed");
+    } else {
+        debug1("%s: DEBUG: Active response to all the agents: %u sent, "
+               "%u not connected, %u failed.", ARGV0, job->sent, job->skipped,
+               job->failed);
+    }
+
+    if (job->failed) {
+        merror("%s: ERROR: Unable to send an active response to %u agent(s).",
+               ARGV0, job->failed);
+    }
+
+    free(job);
+}
+
+/* Send a response to the agents from first to last (excluded), or to its
+ * agent. The keys are locked for this chunk only.
+ */
+static void ar_send(ar_job *job, unsigned int first, unsigned int last)
+{
+    unsigned int agentids[OS_DGRAM_BATCH];
+    unsigned int count = 0;
+    unsigned int skipped = 0;
+    unsigned int failed = 0;
+    unsigned int i;
+    time_t connected = time(0) - (2 * NOTIFY_TIME);
+    int agent_id;
+    int sent;
+
+    key_rdlock();
+
+    if (job->target[0]) {
+        if ((agent_id = OS_IsAllowedID(&keys, job->target)) < 0) {
+            merror(AR_NOAGENT_ERROR, ARGV0, job->target);
+            failed++;
+        } else {
+            first = (unsigned int)agent_id;
+            last = first + 1;
+        }
+    }
+
+    for (i = first; i < last && i < keys.keysize && !failed; i++) {
+        if (keys.keyentries[i]->rcvd < connected) {
+            status_ar(i, AR_SKIPPED);
+            skipped++;
+            continue;
+        }
+
+        agentids[count++] = i;
+    }
+
+    /* The datagrams go in order: the first ones were sent */
+    if (count > 0) {
+        sent = send_msg_batch(logr.sock, agentids, count, job->msg);
+        sent = sent > 0 ? sent : 0;
+
+        for (i = 0; i < count; i++) {
+            status_ar(agentids[i], i < (unsigned int)sent ? AR_SENT : AR_FAILED);
+        }
+
+        failed += count - (unsigned int)sent;
+        count = (unsigned int)sent;
+    }
+
+    key_unlock();
+
+    pthread_mutex_lock(&ar_mutex);
+    job->sent += count;
+    job->skipped += skipped;
+    job->failed += failed;
+    pthread_mutex_unlock(&ar_mutex);
+
+    OS_MetricAdd(metric_ar_sent, count);
+}
+
+/* Sender of the pool */
+static void *ar_sender(__attribute__((unused)) void *none)
+{
+    ar_job *job;
+    unsigned int first;
+    unsigned int last;
+
+    while (1) {
+        pthread_mutex_lock(&ar_mutex);
+
+        while (!ar_first) {
+            pthread_cond_wait(&ar_available, &ar_mutex);
+        }
+
+        job = ar_first;
+        first = job->next;
+        last = job->target[0] ? 1 : first + OS_DGRAM_BATCH;
+        job->next = last;
+        job->running++;
+
+        /* The last chunk: the other senders go on with the next response */
+        if (job->target[0] || last >= job->total) {
+            if ((ar_first = job->next_job) == NULL) {
+                ar_last = &ar_first;
+            }
+        }
+
+        pthread_mutex_unlock(&ar_mutex);
+
+        ar_send(job, first, last);
+
+        pthread_mutex_lock(&ar_mutex);
+        if (--job->running == 0 && job->next >= (job->target[0] ? 1 : job->total)) {
+            ar_finish(job);
+        }
+        pthread_mutex_unlock(&ar_mutex);
+    }
+}
 
 /* Start of a new thread. Only returns on unrecoverable errors. */
 void *AR_Forward(__attribute__((unused)) void *arg)
@@ -20,139 +293,88 @@ void *AR_Forward(__attribute__((unused)) void *arg)
     int arq = 0;
     int agent_id = 0;
     int ar_location = 0;
+    int threads;
+    int i;
 
     char msg_to_send[OS_SIZE_1024 + 1];
 
     char msg[OS_SIZE_1024 + 1];
     char *location = NULL;
-    char *ar_location_str = NULL;
     char *ar_agent_id = NULL;
-    char *tmp_str = NULL;
+    char *command = NULL;
 
     /* Create the unix queue */
     if ((arq = StartMQ(ARQUEUE, READ)) < 0) {
         ErrorExit(QUEUE_ERROR, ARGV0, ARQUEUE, strerror(errno));
     }
 
+    if ((ar_inflight = OSHash_Create()) == NULL) {
+        ErrorExit(MEM_ERROR, ARGV0, errno, strerror(errno));
+    }
+
+    metric_ar_sent = OS_MetricCounter("remoted_ar_sent_total",
+                                      "Active responses sent (per agent).");
+    metric_ar_dropped = OS_MetricCounter("remoted_ar_dropped_total",
+                                         "Active responses dropped (already in flight).");
+
+    /* Senders */
+    threads = getDefine_Int("remoted", "ar_threads", 1, 32);
+    for (i = 0; i < threads; i++) {
+        if (CreateThread(ar_sender, (void *)NULL) != 0) {
+            ErrorExit(THREAD_ERROR, ARGV0);
+        }
+    }
+
     memset(msg, '\0', OS_SIZE_1024 + 1);
 
     /* Daemon loop */
     while (1) {
         if (OS_RecvUnix(arq, OS_SIZE_1024, msg)) {
-            /* Always zero the location */
-            ar_location = 0;
-
-            /* Get the location */
-            location = msg;
-
-            /* Location is going to be the agent name */
-            tmp_str = strchr(msg, ')');
-            if (!tmp_str) {
-                merror(EXECD_INV_MSG, ARGV0, msg);
-                continue;
-            }
-            *tmp_str = '\0';
-
-            /* Going after the ')' and space */
-            tmp_str += 2;
-
-            /* Extract the source IP */
-            tmp_str = strchr(tmp_str, ' ');
-            if (!tmp_str) {
-                merror(EXECD_INV_MSG, ARGV0, msg);
-                continue;
-            }
-            tmp_str++;
-            location++;
-
-            /* Set ar_location */
-            ar_location_str = tmp_str;
-            if (*tmp_str == ALL_AGENTS_C) {
-                ar_location |= ALL_AGENTS;
-            }
-            tmp_str++;
-            if (*tmp_str == REMOTE_AGENT_C) {
-                ar_location |= REMOTE_AGENT;
-            } else if (*tmp_str == NO_AR_C) {
-                ar_location |= NO_AR_MSG;
-            }
-            tmp_str++;
-            if (*tmp_str == SPECIFIC_AGENT_C) {
-                ar_location |= SPECIFIC_AGENT;
-            }
-
-            /* Extract the active response location */
-            tmp_str = strchr(ar_location_str, ' ');
-            if (!tmp_str) {
-                merror(EXECD_INV_MSG, ARGV0, msg);
-                continue;
-            }
-            *tmp_str = '\0';
-            tmp_str++;
-
-            /* Extract the agent id */
-            ar_agent_id = tmp_str;
-            tmp_str = strchr(tmp_str, ' ');
-            if (!tmp_str) {
+            if (ar_parse(msg, &ar_location, &location, &ar_agent_id, &command) < 0) {
                 merror(EXECD_INV_MSG, ARGV0, msg);
                 continue;
             }
-            *tmp_str = '\0';
-            tmp_str++;
 
             /* Create the new message */
             if (ar_location & NO_AR_MSG) {
                 snprintf(msg_to_send, OS_SIZE_1024, "%s%s",
                          CONTROL_HEADER,
-                         tmp_str);
+                         command);
             } else {
                 snprintf(msg_to_send, OS_SIZE_1024, "%s%s%s",
                          CONTROL_HEADER,
                          EXECD_HEADER,
-                         tmp_str);
+                         command);
             }
 
-            /* Lock use of keys */
-            key_lock();
-
             /* Send to ALL agents */
             if (ar_location & ALL_AGENTS) {
-                unsigned int i;
-                for (i = 0; i < keys.keysize; i++) {
-                    send_msg(i, msg_to_send);
-                }
+                ar_queue("", msg_to_send);
             }
 
             /* Send to the remote agent that generated the event */
-            else if ((ar_location & REMOTE_AGENT) && (location != NULL)) {
-                agent_id = OS_IsAllowedName(&keys, location);
+            else if (ar_location & REMOTE_AGENT) {
+                char id[KEYSIZE + 1];
+
+                key_rdlock();
+                if ((agent_id = OS_IsAllowedName(&keys, location)) >= 0) {
+                    strncpy(id, keys.keyentries[agent_id]->id, KEYSIZE);
+                    id[KEYSIZE] = '\0';
+                }
+                key_unlock();
+
                 if (agent_id < 0) {
-                    key_unlock();
                     merror(AR_NOAGENT_ERROR, ARGV0, location);
                     continue;
                 }
 
-                send_msg((unsigned)agent_id, msg_to_send);
+                ar_queue(id, msg_to_send);
             }
 
             /* Send to a pre-defined agent */
             else if (ar_location & SPECIFIC_AGENT) {
-                ar_location++;
-
-                agent_id = OS_IsAllowedID(&keys, ar_agent_id);
-
-                if (agent_id < 0) {
-                    key_unlock();
-                    merror(AR_NOAGENT_ERROR, ARGV0, ar_agent_id);
-                    continue;
-                }
-
-                send_msg((unsigned)agent_id, msg_to_send);
+                ar_queue(ar_agent_id, msg_to_send);
             }
-
-            /* Lock use of keys */
-            key_unlock();
         }
     }
 }
-
@@ -9,28 +9,118 @@
 
 #include "shared.h"
 #include "remoted.h"
+#include "os_crypto/md5/md5.h"
 #include "os_crypto/md5/md5_op.h"
 #include "os_net/os_net.h"
 #include <pthread.h>
+#include <sys/time.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#define SHARED_INOTIFY
+#endif
+
+/* Bytes of the file contents sent in a message */
+#define SHARED_CHUNK        900
+
+/* Bytes of the blocks looked up in the previous versions (deltas) */
+#define SHARED_BLOCK        512
+
+/* Previous versions of the merged file kept to send deltas from */
+#define SHARED_VERSIONS     4
+
+/* Messages per second sent to an agent (no flood) */
+#define SHARED_AGENT_RATE   30
+
+/* Milliseconds between the rounds of the transfers */
+#define SHARED_TICK         100
+
+/* Seconds without changes in the directory before merging the files */
+#define SHARED_SETTLE       1
 
 /* Internal structures */
 typedef struct _file_sum {
     int mark;
     char *name;
     os_md5 sum;
+    time_t mtime;
+    off_t size;
 } file_sum;
 
+/* Piece of a transfer: data of the file, or data copied by the agent
+ * from the version it has (delta transfers)
+ */
+typedef struct _shared_op {
+    int copy;
+    size_t offset;              /* In the file, or in the version of the agent */
+    size_t len;
+} shared_op;
+
+/* Contents of a file sent to the agents */
+typedef struct _shared_data {
+    char *name;
+    char *data;
+    size_t size;
+    os_md5 sum;
+    unsigned int refs;
+
+    /* From this version to the current one (NULL if not worth it) */
+    shared_op *delta;
+    unsigned int n_delta;
+} shared_data;
+
+/* File transfer to an agent */
+typedef struct _shared_transfer {
+    shared_data *file;
+    char header[OS_SIZE_256];
+    shared_op *ops;
+    unsigned int n_ops;
+    int op;                     /* -1: header, n_ops: close */
+    size_t done;                /* Bytes of the current op sent */
+    struct _shared_transfer *next;
+} shared_transfer;
+
 /* Internal functions prototypes */
 static void read_controlmsg(unsigned int agentid, char *msg);
-static int send_file_toagent(unsigned int agentid, const char *name, const char *sum);
-static void f_files(void);
-static void c_files(void);
+static void f_files(file_sum **list);
+static int c_files(int force);
+static shared_data *shared_load(const char *path, const char *name);
+static void shared_release(shared_data *file);
+static void shared_delta(shared_data *base, const shared_data *file);
+static void shared_push(shared_data *file);
+static void send_file_toagent(unsigned int agentid, shared_data *file, shared_data *base);
+static int transfer_send(unsigned int agentid, shared_transfer *transfer);
+static void send_transfers(void);
 
 /* Global vars */
 static file_sum **f_sum;
 static time_t _ctime;
 static time_t _stime;
 
+/* Merged file: the current version first, then the previous ones */
+static shared_data *bundles[SHARED_VERSIONS];
+
+/* Transfers (queued by agent) */
+static shared_transfer *transfers[MAX_AGENTS + 1];
+static unsigned int n_transfers;
+static time_t transfer_second[MAX_AGENTS + 1];
+static unsigned int transfer_count[MAX_AGENTS + 1];
+
+/* Bandwidth of all the transfers (bytes per second, 0 for no limit) */
+static long shared_rate;
+static long shared_budget;
+static struct timeval shared_fill;
+
+/* Agents that accept deltas, and the version of the last delta sent */
+static char delta_agents[MAX_AGENTS + 1];
+static os_md5 delta_base[MAX_AGENTS + 1];
+
+/* Changes in the shared directory */
+static time_t shared_dirty;
+#ifdef SHARED_INOTIFY
+static int shared_watch = -1;
+#endif
+
 /* For the last message tracking */
 static char *_msg[MAX_AGENTS + 1];
 static char *_keep_alive[MAX_AGENTS + 1];
@@ -45,34 +135,47 @@ static pthread_cond_t awake_mutex;
 /* Save a control message received from an agent
  * read_contromsg (other thread) is going to deal with it
  * (only if message changed)
+ * Returns the capabilities (AGENT_CAP_*) asked for on an agent startup.
  */
-void save_controlmsg(unsigned int agentid, char *r_msg)
+int save_controlmsg(unsigned int agentid, char *r_msg)
 {
-    char msg_ack[OS_FLSIZE + 1];
+    /* The ACK to the agent is sent by the receiver (see send_msg_batch) */
 
-    /* Reply to the agent */
-    snprintf(msg_ack, OS_FLSIZE, "%s%s", CONTROL_HEADER, HC_ACK);
-    send_msg(agentid, msg_ack);
-
-    /* Check if there is a keep alive already for this agent */
+    /* Check if there is a keep alive already for this agent
+     * (kept in the status table)
+     */
     if (_keep_alive[agentid] && _msg[agentid] &&
             (strcmp(_msg[agentid], r_msg) == 0)) {
-        utimes(_keep_alive[agentid], NULL);
+        status_keepalive(agentid, NULL);
     }
 
-    else if (strcmp(r_msg, HC_STARTUP) == 0) {
-        return;
+    else if (strncmp(r_msg, HC_STARTUP, strlen(HC_STARTUP)) == 0) {
+        int caps = 0;
+
+        r_msg += strlen(HC_STARTUP);
+        if (os_hasword(r_msg, HC_BATCH)) {
+            caps |= AGENT_CAP_BATCH;
+        }
+        if (os_hasword(r_msg, HC_ZDICT)) {
+            caps |= AGENT_CAP_ZDICT;
+        }
+
+        /* Only used by the manager (nothing to acknowledge) */
+        delta_agents[agentid] = (char) os_hasword(r_msg, HC_DELTA);
+
+        return (caps);
     }
 
     else {
         FILE *fp;
         char *uname = r_msg;
         char *random_leftovers;
+        int changed = status_keepalive(agentid, r_msg);
 
         /* Lock mutex */
         if (pthread_mutex_lock(&lastmsg_mutex) != 0) {
             merror(MUTEX_ERROR, ARGV0);
-            return;
+            return (0);
         }
 
         /* Update rmsg */
@@ -84,7 +187,7 @@ void save_controlmsg(unsigned int agentid, char *r_msg)
         /* Unlock mutex */
         if (pthread_mutex_unlock(&lastmsg_mutex) != 0) {
             merror(MUTEX_ERROR, ARGV0);
-            return;
+            return (0);
         }
 
         r_msg = strchr(r_msg, '\n');
@@ -92,7 +195,7 @@ void save_controlmsg(unsigned int agentid, char *r_msg)
             merror("%s: WARN: Invalid message from agent id: '%d'(uname)",
                    ARGV0,
                    agentid);
-            return;
+            return (0);
         }
 
         *r_msg = '\0';
@@ -114,18 +217,20 @@ void save_controlmsg(unsigned int agentid, char *r_msg)
             os_strdup(agent_file, _keep_alive[agentid]);
         }
 
-        /* Write to the file */
-        fp = fopen(_keep_alive[agentid], "w");
-        if (fp) {
-            fprintf(fp, "%s\n", uname);
-            fclose(fp);
+        /* Write to the file (only if the uname changed) */
+        if (changed || access(_keep_alive[agentid], F_OK) < 0) {
+            fp = fopen(_keep_alive[agentid], "w");
+            if (fp) {
+                fprintf(fp, "%s\n", uname);
+                fclose(fp);
+            }
         }
     }
 
     /* Lock now to notify of change */
     if (pthread_mutex_lock(&lastmsg_mutex) != 0) {
         merror(MUTEX_ERROR, ARGV0);
-        return;
+        return (0);
     }
 
     /* Assign new values */
@@ -138,54 +243,63 @@ void save_controlmsg(unsigned int agentid, char *r_msg)
     /* Unlock mutex */
     if (pthread_mutex_unlock(&lastmsg_mutex) != 0) {
         merror(MUTEX_ERROR, ARGV0);
-        return;
+        return (0);
     }
 
-    return;
+    return (0);
 }
 
 /* Free the files memory */
-static void f_files()
+static void f_files(file_sum **list)
 {
     int i;
-    if (!f_sum) {
+    if (!list) {
         return;
     }
     for (i = 0;; i++) {
-        if (f_sum[i] == NULL) {
+        if (list[i] == NULL) {
             break;
         }
 
-        if (f_sum[i]->name) {
-            free(f_sum[i]->name);
+        if (list[i]->name) {
+            free(list[i]->name);
         }
 
-        free(f_sum[i]);
-        f_sum[i] = NULL;
+        free(list[i]);
+        list[i] = NULL;
     }
 
-    free(f_sum);
-    f_sum = NULL;
+    free(list);
 }
 
-/* Create the structure with the files and checksums */
-static void c_files()
+/* Compare two file names (the merged file keeps them in order) */
+static int cmp_names(const void *a, const void *b)
+{
+    return (strcmp(*(char * const *)a, *(char * const *)b));
+}
+
+/* Create the structure with the files and checksums. The checksum of a
+ * file is only computed again if its size or time changed (or if asked
+ * to), and the merged file is only rebuilt if a file changed.
+ * Returns 1 if the merged file changed.
+ */
+static int c_files(int force)
 {
     DIR *dp;
     struct dirent *entry;
+    struct stat statbuf;
     os_md5 md5sum;
-    unsigned int f_size = 0;
-
-    f_sum = NULL;
-
-    /* Create merged file */
-    os_realloc(f_sum, (f_size + 2) * sizeof(file_sum *), f_sum);
-    os_calloc(1, sizeof(file_sum), f_sum[f_size]);
-    f_sum[f_size]->mark = 0;
-    f_sum[f_size]->name = NULL;
-    f_sum[f_size]->sum[0] = '\0';
-    MergeAppendFile(SHAREDCFG_FILE, NULL);
-    f_size++;
+    char tmp_dir[512];
+    char **names = NULL;
+    unsigned int n_names = 0;
+    unsigned int f_size = 1;
+    unsigned int n_old = 0;
+    unsigned int i, j;
+    file_sum **old = f_sum;
+    file_sum **list;
+    file_sum *prev;
+    shared_data *bundle;
+    int changed = force || !old;
 
     /* Open directory */
     dp = opendir(SHAREDCFG_DIR);
@@ -194,123 +308,564 @@ static void c_files()
                ARGV0,
                SHAREDCFG_DIR,
                strerror(errno));
-        return;
+        return (0);
     }
 
     /* Read directory */
     while ((entry = readdir(dp)) != NULL) {
-        char tmp_dir[512];
-
-        /* Ignore . and ..  */
+        /* Ignore . and .. and the shared config file */
         if ((strcmp(entry->d_name, ".") == 0) ||
-                (strcmp(entry->d_name, "..") == 0)) {
+                (strcmp(entry->d_name, "..") == 0) ||
+                (strcmp(entry->d_name, SHAREDCFG_FILENAME) == 0)) {
             continue;
         }
 
-        snprintf(tmp_dir, 512, "%s/%s", SHAREDCFG_DIR, entry->d_name);
+        os_realloc(names, (n_names + 1) * sizeof(char *), names);
+        os_strdup(entry->d_name, names[n_names]);
+        n_names++;
+    }
+
+    closedir(dp);
+
+    if (n_names > 1) {
+        qsort(names, n_names, sizeof(char *), cmp_names);
+    }
+
+    /* First entry for the merged file */
+    os_calloc(n_names + 2, sizeof(file_sum *), list);
+    os_calloc(1, sizeof(file_sum), list[0]);
 
-        /* Leave the shared config file for later */
-        if (strcmp(tmp_dir, SHAREDCFG_FILE) == 0) {
+    while (old && old[n_old]) {
+        n_old++;
+    }
+
+    for (i = 0; i < n_names; i++) {
+        snprintf(tmp_dir, 512, "%s/%s", SHAREDCFG_DIR, names[i]);
+
+        if (stat(tmp_dir, &statbuf) < 0) {
+            merror("%s: Error accessing file '%s'", ARGV0, tmp_dir);
+            free(names[i]);
             continue;
         }
 
-        if (OS_MD5_File(tmp_dir, md5sum) != 0) {
+        prev = NULL;
+        for (j = 1; j < n_old; j++) {
+            if (strcmp(old[j]->name, names[i]) == 0) {
+                prev = old[j];
+                break;
+            }
+        }
+
+        if (!force && prev && prev->mtime == statbuf.st_mtime &&
+                prev->size == statbuf.st_size) {
+            strncpy(md5sum, prev->sum, 33);
+        } else if (OS_MD5_File(tmp_dir, md5sum) != 0) {
             merror("%s: Error accessing file '%s'", ARGV0, tmp_dir);
+            free(names[i]);
             continue;
+        } else if (!prev || strcmp(prev->sum, md5sum) != 0) {
+            changed = 1;
+        }
+
+        os_calloc(1, sizeof(file_sum), list[f_size]);
+        strncpy(list[f_size]->sum, md5sum, 32);
+        list[f_size]->name = names[i];
+        list[f_size]->mtime = statbuf.st_mtime;
+        list[f_size]->size = statbuf.st_size;
+        f_size++;
+    }
+
+    free(names);
+
+    /* Files removed */
+    if (f_size != n_old) {
+        changed = 1;
+    }
+
+    if (!changed) {
+        list[0]->name = old[0]->name;
+        strncpy(list[0]->sum, old[0]->sum, 32);
+        old[0]->name = NULL;
+
+        f_sum = list;
+        f_files(old);
+        return (0);
+    }
+
+    /* Create merged file */
+    MergeAppendFile(SHAREDCFG_FILE, NULL);
+    for (i = 1; i < f_size; i++) {
+        snprintf(tmp_dir, 512, "%s/%s", SHAREDCFG_DIR, list[i]->name);
+        MergeAppendFile(SHAREDCFG_FILE, tmp_dir);
+    }
+
+    if ((bundle = shared_load(SHAREDCFG_FILE, SHAREDCFG_FILENAME)) == NULL) {
+        list[0]->sum[0] = '\0';
+    } else {
+        strncpy(list[0]->sum, bundle->sum, 32);
+        shared_push(bundle);
+    }
+
+    os_strdup(SHAREDCFG_FILENAME, list[0]->name);
+
+    f_sum = list;
+    f_files(old);
+
+    debug1("%s: DEBUG: Shared files merged (%u files, sum %s).", ARGV0,
+           f_size - 1, f_sum[0]->sum);
+
+    return (1);
+}
+
+/* Load a file to be sent to the agents. Returns NULL on error */
+static shared_data *shared_load(const char *path, const char *name)
+{
+    FILE *fp;
+    struct stat statbuf;
+    shared_data *file;
+    struct MD5Context ctx;
+    unsigned char digest[16];
+    int i;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        merror(FOPEN_ERROR, ARGV0, path, errno, strerror(errno));
+        return (NULL);
+    }
+
+    if (fstat(fileno(fp), &statbuf) < 0) {
+        merror("%s: Error accessing file '%s'", ARGV0, path);
+        fclose(fp);
+        return (NULL);
+    }
+
+    os_calloc(1, sizeof(shared_data), file);
+    os_strdup(name, file->name);
+    os_malloc((size_t)statbuf.st_size + 1, file->data);
+
+    file->size = fread(file->data, 1, (size_t)statbuf.st_size, fp);
+    file->data[file->size] = '\0';
+    file->refs = 1;
+    fclose(fp);
+
+    MD5Init(&ctx);
+    MD5Update(&ctx, (unsigned char *)file->data, (unsigned)file->size);
+    MD5Final(digest, &ctx);
+
+    for (i = 0; i < 16; i++) {
+        snprintf(file->sum + i * 2, 3, "%02x", digest[i]);
+    }
+
+    return (file);
+}
+
+/* Release a file (freed when not used anymore) */
+static void shared_release(shared_data *file)
+{
+    if (!file || --file->refs > 0) {
+        return;
+    }
+
+    free(file->name);
+    free(file->data);
+    free(file->delta);
+    free(file);
+}
+
+/* Add a piece to a list of ops (joined to the previous one if it follows) */
+static void shared_op_add(shared_op **ops, unsigned int *n_ops, size_t *max_ops,
+                          int copy, size_t offset, size_t len)
+{
+    shared_op *last = *n_ops ? &(*ops)[*n_ops - 1] : NULL;
+
+    if (len == 0) {
+        return;
+    }
+
+    if (last && last->copy == copy && last->offset + last->len == offset) {
+        last->len += len;
+        return;
+    }
+
+    if (*n_ops == *max_ops) {
+        *max_ops = *max_ops ? *max_ops * 2 : 64;
+        os_realloc(*ops, *max_ops * sizeof(shared_op), *ops);
+    }
+
+    (*ops)[*n_ops].copy = copy;
+    (*ops)[*n_ops].offset = offset;
+    (*ops)[*n_ops].len = len;
+    (*n_ops)++;
+}
+
+/* Compute the pieces to build a file from a previous version: the blocks
+ * of the previous version are looked up in the file with a rolling
+ * checksum, and only what is not found is sent. The delta is dropped
+ * if it is not worth it.
+ */
+static void shared_delta(shared_data *base, const shared_data *file)
+{
+    const unsigned char *old = (const unsigned char *)base->data;
+    const unsigned char *new = (const unsigned char *)file->data;
+    size_t n_blocks = base->size / SHARED_BLOCK;
+    size_t n_buckets = 1;
+    size_t max_ops = 0;
+    size_t pos = 0;
+    size_t literal = 0;
+    size_t sent = 0;
+    size_t i;
+    unsigned int *heads;
+    unsigned int *chain;
+    unsigned int a = 0;
+    unsigned int b = 0;
+    unsigned int n_ops = 0;
+    shared_op *ops = NULL;
+
+    free(base->delta);
+    base->delta = NULL;
+    base->n_delta = 0;
+
+    if (n_blocks == 0 || file->size < SHARED_BLOCK) {
+        return;
+    }
+
+    while (n_buckets < n_blocks * 2) {
+        n_buckets <<= 1;
+    }
+
+    /* Blocks of the previous version by checksum */
+    os_calloc(n_buckets, sizeof(unsigned int), heads);
+    os_calloc(n_blocks, sizeof(unsigned int), chain);
+
+    for (i = 0; i < n_blocks; i++) {
+        unsigned int sa = 0, sb = 0, h;
+        size_t k;
+
+        for (k = 0; k < SHARED_BLOCK; k++) {
+            sa += old[i * SHARED_BLOCK + k];
+            sb += sa;
+        }
+
+        h = ((sa & 0xffff) | (sb << 16)) & (unsigned int)(n_buckets - 1);
+        chain[i] = heads[h];
+        heads[h] = (unsigned int)i + 1;
+    }
+
+    for (i = 0; i < SHARED_BLOCK; i++) {
+        a += new[i];
+        b += a;
+    }
+
+    while (pos + SHARED_BLOCK <= file->size) {
+        unsigned int h = ((a & 0xffff) | (b << 16)) & (unsigned int)(n_buckets - 1);
+        unsigned int block;
+        size_t len = 0;
+
+        for (block = heads[h]; block; block = chain[block - 1]) {
+            if (memcmp(old + (block - 1) * SHARED_BLOCK, new + pos, SHARED_BLOCK) == 0) {
+                break;
+            }
         }
 
-        f_sum = (file_sum **)realloc(f_sum, (f_size + 2) * sizeof(file_sum *));
-        if (!f_sum) {
-            ErrorExit(MEM_ERROR, ARGV0, errno, strerror(errno));
+        if (block) {
+            size_t from = (block - 1) * (size_t)SHARED_BLOCK;
+
+            /* Extend the match as far as it goes */
+            len = SHARED_BLOCK;
+            while (pos + len < file->size && from + len < base->size &&
+                    new[pos + len] == old[from + len]) {
+                len++;
+            }
+
+            shared_op_add(&ops, &n_ops, &max_ops, 0, literal, pos - literal);
+            shared_op_add(&ops, &n_ops, &max_ops, 1, from, len);
+            sent += pos - literal;
+            pos += len;
+            literal = pos;
+
+            if (pos + SHARED_BLOCK > file->size) {
+                break;
+            }
+
+            a = b = 0;
+            for (i = 0; i < SHARED_BLOCK; i++) {
+                a += new[pos + i];
+                b += a;
+            }
+            continue;
         }
 
-        f_sum[f_size] = (file_sum *) calloc(1, sizeof(file_sum));
-        if (!f_sum[f_size]) {
-            ErrorExit(MEM_ERROR, ARGV0, errno, strerror(errno));
+        /* Roll the checksum one byte */
+        if (pos + SHARED_BLOCK < file->size) {
+            a = a - new[pos] + new[pos + SHARED_BLOCK];
+            b = b - SHARED_BLOCK * (unsigned int)new[pos] + a;
         }
+        pos++;
+    }
 
-        strncpy(f_sum[f_size]->sum, md5sum, 32);
-        os_strdup(entry->d_name, f_sum[f_size]->name);
-        f_sum[f_size]->mark = 0;
+    shared_op_add(&ops, &n_ops, &max_ops, 0, literal, file->size - literal);
+    sent += file->size - literal;
 
-        MergeAppendFile(SHAREDCFG_FILE, tmp_dir);
-        f_size++;
+    free(heads);
+    free(chain);
+
+    /* Not worth it: most of the file changed */
+    if (sent + n_ops * 32 >= file->size - file->size / 4) {
+        free(ops);
+        return;
+    }
+
+    base->delta = ops;
+    base->n_delta = n_ops;
+}
+
+/* Make a file the current version of the merged file */
+static void shared_push(shared_data *file)
+{
+    int i;
+
+    if (bundles[0] && strcmp(bundles[0]->sum, file->sum) == 0) {
+        shared_release(file);
+        return;
     }
 
-    if (f_sum != NULL) {
-        f_sum[f_size] = NULL;
+    shared_release(bundles[SHARED_VERSIONS - 1]);
+    for (i = SHARED_VERSIONS - 1; i > 0; i--) {
+        bundles[i] = bundles[i - 1];
     }
+    bundles[0] = file;
 
-    closedir(dp);
+    for (i = 1; i < SHARED_VERSIONS && bundles[i]; i++) {
+        shared_delta(bundles[i], file);
 
-    if (OS_MD5_File(SHAREDCFG_FILE, md5sum) != 0) {
-        merror("%s: Error accessing file '%s'", ARGV0, SHAREDCFG_FILE);
-        f_sum[0]->sum[0] = '\0';
+        debug1("%s: DEBUG: Delta of the merged file from '%s': %s.", ARGV0,
+               bundles[i]->sum, bundles[i]->delta ? "yes" : "no");
     }
-    strncpy(f_sum[0]->sum, md5sum, 32);
+}
 
-    os_strdup(SHAREDCFG_FILENAME, f_sum[0]->name);
+/* Queue a file to be sent to an agent (as a delta from base, if set) */
+static void send_file_toagent(unsigned int agentid, shared_data *file, shared_data *base)
+{
+    shared_transfer *transfer;
+    shared_transfer **last;
+
+    os_calloc(1, sizeof(shared_transfer), transfer);
+    transfer->file = file;
+    transfer->op = -1;
+    file->refs++;
+
+    if (base && base->delta) {
+        snprintf(transfer->header, OS_SIZE_256, "%s%s%s %s %s\n",
+                 CONTROL_HEADER, FILE_DELTA_HEADER, file->sum, base->sum, file->name);
+
+        os_calloc(base->n_delta, sizeof(shared_op), transfer->ops);
+        memcpy(transfer->ops, base->delta, base->n_delta * sizeof(shared_op));
+        transfer->n_ops = base->n_delta;
+    } else {
+        snprintf(transfer->header, OS_SIZE_256, "%s%s%s %s\n",
+                 CONTROL_HEADER, FILE_UPDATE_HEADER, file->sum, file->name);
+
+        os_calloc(1, sizeof(shared_op), transfer->ops);
+        transfer->ops[0].offset = 0;
+        transfer->ops[0].len = file->size;
+        transfer->n_ops = file->size ? 1 : 0;
+    }
 
-    return;
+    for (last = &transfers[agentid]; *last; last = &(*last)->next);
+    *last = transfer;
+    n_transfers++;
+}
+
+/* Check if a file is being sent to an agent */
+static int transfer_running(unsigned int agentid, const shared_data *file)
+{
+    shared_transfer *transfer;
+
+    for (transfer = transfers[agentid]; transfer; transfer = transfer->next) {
+        if (strcmp(transfer->file->name, file->name) == 0 &&
+                strcmp(transfer->file->sum, file->sum) == 0) {
+            return (1);
+        }
+    }
+
+    return (0);
 }
 
-/* Send a file to the agent
- * Returns -1 on error
+/* Send the next message of a transfer
+ * Returns the bytes sent, 0 when it is complete or -1 on error
  */
-static int send_file_toagent(unsigned int agentid, const char *name, const char *sum)
+static int transfer_send(unsigned int agentid, shared_transfer *transfer)
 {
-    int i = 0;
-    size_t n = 0;
-    char file[OS_SIZE_1024 + 1];
     char buf[OS_SIZE_1024 + 1];
-    FILE *fp;
+    shared_op *op;
 
-    snprintf(file, OS_SIZE_1024, "%s/%s", SHAREDCFG_DIR, name);
-    fp = fopen(file, "r");
-    if (!fp) {
-        merror(FOPEN_ERROR, ARGV0, file, errno, strerror(errno));
-        return (-1);
+    if (transfer->op < 0) {
+        strncpy(buf, transfer->header, OS_SIZE_1024);
+        buf[OS_SIZE_1024] = '\0';
+        transfer->op = 0;
+    }
+
+    else if (transfer->op < (int)transfer->n_ops) {
+        op = &transfer->ops[transfer->op];
+
+        if (op->copy) {
+            snprintf(buf, OS_SIZE_1024, "%s%s%lu %lu", CONTROL_HEADER,
+                     FILE_COPY_HEADER, (unsigned long)op->offset,
+                     (unsigned long)op->len);
+            transfer->op++;
+        } else {
+            size_t n = op->len - transfer->done;
+
+            if (n > SHARED_CHUNK) {
+                n = SHARED_CHUNK;
+            }
+
+            memcpy(buf, transfer->file->data + op->offset + transfer->done, n);
+            buf[n] = '\0';
+
+            if ((transfer->done += n) >= op->len) {
+                transfer->done = 0;
+                transfer->op++;
+            }
+        }
+    }
+
+    else if (transfer->op == (int)transfer->n_ops) {
+        /* Send the message to close the file */
+        snprintf(buf, OS_SIZE_1024, "%s%s", CONTROL_HEADER, FILE_CLOSE_HEADER);
+        transfer->op++;
+    }
+
+    else {
+        return (0);
     }
 
-    /* Send the file name first */
-    snprintf(buf, OS_SIZE_1024, "%s%s%s %s\n",
-             CONTROL_HEADER, FILE_UPDATE_HEADER, sum, name);
     if (send_msg(agentid, buf) == -1) {
         merror(SEC_ERROR, ARGV0);
-        fclose(fp);
         return (-1);
     }
 
-    /* Send the file contents */
-    while ((n = fread(buf, 1, 900, fp)) > 0) {
-        buf[n] = '\0';
+    return ((int)strlen(buf) + 1);
+}
 
-        if (send_msg(agentid, buf) == -1) {
-            merror(SEC_ERROR, ARGV0);
-            fclose(fp);
-            return (-1);
+/* Send the transfers, in turns, up to the bandwidth allowed */
+static void send_transfers()
+{
+    static unsigned int first = 0;
+    struct timeval now;
+    shared_transfer *transfer;
+    unsigned int i;
+    unsigned int id;
+    long elapsed;
+    int sent;
+    int n;
+
+    gettimeofday(&now, NULL);
+
+    if (shared_rate) {
+        elapsed = (now.tv_sec - shared_fill.tv_sec) * 1000 +
+                  (now.tv_usec - shared_fill.tv_usec) / 1000;
+
+        /* Up to a second of budget */
+        if (elapsed > 1000 || elapsed < 0) {
+            elapsed = 1000;
         }
 
-        /* Sleep 1 every 30 messages -- no flood */
-        if (i > 30) {
-            sleep(1);
-            i = 0;
+        shared_budget += shared_rate * elapsed / 1000;
+        if (shared_budget > shared_rate) {
+            shared_budget = shared_rate;
         }
-        i++;
+    } else {
+        shared_budget = LONG_MAX;
     }
 
-    /* Send the message to close the file */
-    snprintf(buf, OS_SIZE_1024, "%s%s", CONTROL_HEADER, FILE_CLOSE_HEADER);
-    if (send_msg(agentid, buf) == -1) {
-        merror(SEC_ERROR, ARGV0);
-        fclose(fp);
-        return (-1);
+    shared_fill = now;
+
+    do {
+        sent = 0;
+
+        for (i = 0; i < MAX_AGENTS + 1 && shared_budget > 0 && n_transfers; i++) {
+            id = (first + i) % (MAX_AGENTS + 1);
+
+            if ((transfer = transfers[id]) == NULL) {
+                continue;
+            }
+
+            if (transfer_second[id] != now.tv_sec) {
+                transfer_second[id] = now.tv_sec;
+                transfer_count[id] = 0;
+            }
+
+            if (transfer_count[id] >= SHARED_AGENT_RATE) {
+                continue;
+            }
+
+            if ((n = transfer_send(id, transfer)) > 0) {
+                transfer_count[id]++;
+                shared_budget -= n;
+                sent = 1;
+                continue;
+            }
+
+            if (n < 0) {
+                merror("%s: ERROR: Unable to send file '%s' to agent.",
+                       ARGV0, transfer->file->name);
+            }
+
+            /* Next transfer to this agent */
+            transfers[id] = transfer->next;
+            shared_release(transfer->file);
+            free(transfer->ops);
+            free(transfer);
+            n_transfers--;
+        }
+    } while (sent && shared_budget > 0 && n_transfers);
+
+    first = (first + 1) % (MAX_AGENTS + 1);
+}
+
+#ifdef SHARED_INOTIFY
+/* Watch the changes in the shared directory */
+static void shared_watch_init()
+{
+    if ((shared_watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        merror("%s: WARN: Unable to watch '%s': %s", ARGV0, SHAREDCFG_DIR,
+               strerror(errno));
+        return;
     }
 
-    fclose(fp);
+    if (inotify_add_watch(shared_watch, SHAREDCFG_DIR, IN_CLOSE_WRITE |
+                          IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ATTRIB) < 0) {
+        merror("%s: WARN: Unable to watch '%s': %s", ARGV0, SHAREDCFG_DIR,
+               strerror(errno));
+        close(shared_watch);
+        shared_watch = -1;
+    }
+}
 
-    return (0);
+/* Check if a shared file changed (the merged file is ours) */
+static int shared_watch_read()
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    ssize_t len;
+    char *pt;
+    int changed = 0;
+
+    while ((len = read(shared_watch, buf, sizeof(buf))) > 0) {
+        for (pt = buf; pt < buf + len; pt += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)pt;
+
+            if (event->len && strcmp(event->name, SHAREDCFG_FILENAME) == 0) {
+                continue;
+            }
+
+            changed = 1;
+        }
+    }
+
+    return (changed);
 }
+#endif
 
 /* Read the available control message from the agent */
 static void read_controlmsg(unsigned int agentid, char *msg)
@@ -327,7 +882,7 @@ static void read_controlmsg(unsigned int agentid, char *msg)
     *msg = '\0';
     msg++;
 
-    if (!f_sum) {
+    if (!f_sum || !bundles[0]) {
         /* Nothing to share with agent */
         return;
     }
@@ -364,14 +919,31 @@ static void read_controlmsg(unsigned int agentid, char *msg)
 
         /* New agents only have merged.mg */
         if (strcmp(file, SHAREDCFG_FILENAME) == 0) {
-            if (strcmp(f_sum[0]->sum, md5) != 0) {
-                debug1("%s: DEBUG Sending file '%s' to agent.", ARGV0,
-                       f_sum[0]->name);
-                if (send_file_toagent(agentid, f_sum[0]->name, f_sum[0]->sum) < 0) {
-                    merror("%s: ERROR: Unable to send file '%s' to agent.",
-                           ARGV0,
-                           f_sum[0]->name);
+            if (strcmp(bundles[0]->sum, md5) != 0 &&
+                    !transfer_running(agentid, bundles[0])) {
+                shared_data *base = NULL;
+
+                /* A delta from the version it has, unless the last one
+                 * sent from it failed
+                 */
+                if (delta_agents[agentid] && strcmp(delta_base[agentid], md5) != 0) {
+                    for (i = 1; i < SHARED_VERSIONS && bundles[i]; i++) {
+                        if (strcmp(bundles[i]->sum, md5) == 0) {
+                            base = bundles[i]->delta ? bundles[i] : NULL;
+                            break;
+                        }
+                    }
+                }
+
+                if (base) {
+                    strncpy(delta_base[agentid], md5, 32);
+                } else {
+                    delta_base[agentid][0] = '\0';
                 }
+
+                debug1("%s: DEBUG Sending file '%s' to agent%s.", ARGV0,
+                       bundles[0]->name, base ? " (delta)" : "");
+                send_file_toagent(agentid, bundles[0], base);
             }
 
             i = 0;
@@ -411,12 +983,21 @@ static void read_controlmsg(unsigned int agentid, char *msg)
 
         if ((f_sum[i]->mark == 1) ||
                 (f_sum[i]->mark == 0)) {
+            char path[OS_SIZE_1024 + 1];
+            shared_data *data;
+
+            snprintf(path, OS_SIZE_1024, "%s/%s", SHAREDCFG_DIR, f_sum[i]->name);
 
             debug1("%s: Sending file '%s' to agent.", ARGV0, f_sum[i]->name);
-            if (send_file_toagent(agentid, f_sum[i]->name, f_sum[i]->sum) < 0) {
+            if ((data = shared_load(path, f_sum[i]->name)) == NULL) {
                 merror("%s: Error sending file '%s' to agent.",
                        ARGV0,
                        f_sum[i]->name);
+            } else {
+                if (!transfer_running(agentid, data)) {
+                    send_file_toagent(agentid, data, NULL);
+                }
+                shared_release(data);
             }
         }
 
@@ -440,15 +1021,31 @@ void *wait_for_msgs(__attribute__((unused)) void *none)
     /* Should never leave this loop */
     while (1) {
         unsigned int i;
-        /* Every NOTIFY * 30 minutes, re-read the files
-         * If something changed, notify all agents
+        long timeout = 0;
+
+        /* Merge the files again once the changes settle. Every
+         * NOTIFY * 30 minutes, check them anyway.
          */
         _ctime = time(0);
-        if ((_ctime - _stime) > (NOTIFY_TIME * 30)) {
-            f_files();
-            c_files();
-
+#ifdef SHARED_INOTIFY
+        if (shared_watch >= 0) {
+            if (shared_watch_read()) {
+                shared_dirty = _ctime;
+            }
+            timeout = 1000;
+        }
+#endif
+        if (shared_dirty && (_ctime - shared_dirty) >= SHARED_SETTLE) {
+            c_files(1);
+            shared_dirty = 0;
             _stime = _ctime;
+        } else if ((_ctime - _stime) > (NOTIFY_TIME * 30)) {
+            c_files(0);
+            _stime = _ctime;
+        }
+
+        if (n_transfers > 0) {
+            timeout = SHARED_TICK;
         }
 
         /* Lock mutex */
@@ -457,9 +1054,24 @@ void *wait_for_msgs(__attribute__((unused)) void *none)
             return (NULL);
         }
 
-        /* If no agent changed, wait for signal */
+        /* If no agent changed, wait for signal (or the next round) */
         if (modified_agentid == -1) {
-            pthread_cond_wait(&awake_mutex, &lastmsg_mutex);
+            if (timeout) {
+                struct timeval now;
+                struct timespec until;
+
+                gettimeofday(&now, NULL);
+                until.tv_sec = now.tv_sec + timeout / 1000;
+                until.tv_nsec = (now.tv_usec + (timeout % 1000) * 1000) * 1000;
+                if (until.tv_nsec >= 1000000000) {
+                    until.tv_sec++;
+                    until.tv_nsec -= 1000000000;
+                }
+
+                pthread_cond_timedwait(&awake_mutex, &lastmsg_mutex, &until);
+            } else {
+                pthread_cond_wait(&awake_mutex, &lastmsg_mutex);
+            }
         }
 
         /* Unlock mutex */
@@ -502,9 +1114,20 @@ void *wait_for_msgs(__attribute__((unused)) void *none)
             }
 
             if (id) {
-                read_controlmsg(i, msg);
+                key_rdlock();
+                if (i < keys.keysize) {
+                    read_controlmsg(i, msg);
+                }
+                key_unlock();
             }
         }
+
+        /* Send the files queued */
+        if (n_transfers > 0) {
+            key_rdlock();
+            send_transfers();
+            key_unlock();
+        }
     }
 
     return (NULL);
@@ -517,8 +1140,16 @@ void manager_init(int isUpdate)
 
     _stime = time(0);
 
-    f_files();
-    c_files();
+    /* Bandwidth for the shared files (KB/s) */
+    shared_rate = (long) getDefine_Int("remoted", "shared_rate", 0, 1048576) * 1024;
+
+    c_files(1);
+
+#ifdef SHARED_INOTIFY
+    if (isUpdate == 0) {
+        shared_watch_init();
+    }
+#endif
 
     debug1("%s: DEBUG: Running manager_init", ARGV0);
 
@@ -47,7 +47,42 @@ void HandleRemote(int position, int uid)
         }
     } else {
         /* Using UDP. Fast, unreliable... perfect */
-        if ((logr.sock =
+        if (logr.conn[position] == SECURE_CONN) {
+            logr.recv_threads = getDefine_Int("remoted", "receiver_threads", 1, 64);
+        }
+
+        /* The secure receivers get one socket each, sharing the port.
+         * Peers are spread among them by the kernel, keeping all the
+         * messages of an agent on the same socket (and thread).
+         */
+        if (logr.recv_threads > 1) {
+            int i;
+
+            os_calloc(logr.recv_threads, sizeof(int), logr.recv_socks);
+
+            for (i = 0; i < logr.recv_threads; i++) {
+                logr.recv_socks[i] = OS_BindportudpShared(logr.port[position],
+                                     logr.lip[position], logr.ipv6[position]);
+                if (logr.recv_socks[i] < 0) {
+                    break;
+                }
+            }
+
+            if (i < logr.recv_threads) {
+                merror("%s: WARN: Unable to share port '%d' among %d receivers. "
+                       "Using a single one.", ARGV0, logr.port[position],
+                       logr.recv_threads);
+
+                while (i-- > 0) {
+                    close(logr.recv_socks[i]);
+                }
+                logr.recv_threads = 1;
+            }
+        }
+
+        if (logr.recv_threads > 1) {
+            logr.sock = logr.recv_socks[0];
+        } else if ((logr.sock =
                     OS_Bindportudp(logr.port[position], logr.lip[position], logr.ipv6[position])) < 0) {
             ErrorExit(BIND_ERROR, ARGV0, logr.port[position]);
         }
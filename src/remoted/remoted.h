@@ -43,12 +43,44 @@ void manager_init(int isUpdate);
 /* Wait for messages from the agent to analyze */
 void *wait_for_msgs(void *none);
 
+/* Capabilities an agent can ask for on startup */
+#define AGENT_CAP_BATCH     0x1     /* HC_BATCH */
+#define AGENT_CAP_ZDICT     0x2     /* HC_ZDICT */
+#define AGENT_CAPS          4       /* Number of combinations */
+
 /* Save control messages */
-void save_controlmsg(unsigned int agentid, char *msg);
+int save_controlmsg(unsigned int agentid, char *msg);
+
+/* Start the agent status table (and the control socket) */
+void status_init(void);
+
+/* Account the messages of an agent (keys locked) */
+void status_message(unsigned int agentid, time_t now);
+
+/* Account a control message of an agent (keys locked)
+ * Returns 1 if the uname changed
+ */
+int status_keepalive(unsigned int agentid, const char *msg);
+
+/* Account an active response to an agent (keys locked) */
+#define AR_SENT             1
+#define AR_SKIPPED          0       /* Not connected */
+#define AR_FAILED           -1
+
+void status_ar(unsigned int agentid, int result);
+
+/* Print the events, drops and queue of each agent (keys locked) */
+void flow_print(FILE *fp);
 
 /* Send message to agent */
 int send_msg(unsigned int agentid, const char *msg);
 
+/* Send the same message to several agents (keys locked for reading) */
+int send_msg_batch(int sock, const unsigned int *agentids, unsigned int count, const char *msg);
+
+/* Save the address of an agent (keys locked for reading) */
+void send_msg_peer(unsigned int agentid, const struct sockaddr_in *peer);
+
 /* Initializing send_msg */
 void send_msg_init(void);
 
@@ -56,6 +88,8 @@ int check_keyupdate(void);
 
 void key_lock(void);
 
+void key_rdlock(void);
+
 void key_unlock(void);
 
 void keyupdate_init(void);
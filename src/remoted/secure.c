@@ -7,23 +7,114 @@
  * Foundation
  */
 
+#include <pthread.h>
+
 #include "shared.h"
 #include "os_net/os_net.h"
 #include "remoted.h"
 
 
+/* Agent locks (by agent id). ReadSecMSG checks and updates the
+ * message counters of the agent, so two receivers must not work on
+ * the same agent at once.
+ */
+#define AGENT_LOCKS 64
+static pthread_mutex_t agent_locks[AGENT_LOCKS];
+
+/* Datagrams read (and ACKs sent) by one system call */
+#define SECURE_BATCH 32
+
+/* Seconds an agent keeps slowed down after a request */
+#define FLOW_PERIOD 10
+
+/* Seconds between the reports of the agents slowed down */
+#define FLOW_REPORT 60
+
+/* Bytes an agent may forward in each round of the fair queue. Any
+ * event fits in one round.
+ */
+#define FLOW_QUANTUM OS_MAXSTR
+
+/* Event waiting in the fair queue: the message and its srcmsg */
+typedef struct _flow_event {
+    struct _flow_event *next;
+    char *srcmsg;
+    char msg[1];
+} flow_event;
+
+/* Flow control state and counters of an agent (by agent id). The
+ * datagrams of an agent may reach any receiver (it may change its
+ * address or port), so the state is shared: the counters are updated
+ * atomically and the rest under flow_mutex.
+ *
+ * While the queue to analysisd is congested the events are not sent by
+ * the receivers but kept in a queue per agent (up to flow_queue events,
+ * the rest are dropped). FlowForwarder sends them with deficit round
+ * robin: each agent with events waiting gets up to FLOW_QUANTUM bytes
+ * per round, so a noisy agent cannot take the queue from the rest.
+ */
+typedef struct _flow_agent {
+    char id[KEYSIZE + 1];       /* Agent of the entry (the keys may change) */
+    mq_bucket bucket;           /* Rate while congested (flow_mutex) */
+    time_t notified;            /* Last slow down sent */
+    time_t reported;            /* Last report */
+    unsigned int requests;      /* Slow downs sent since the report */
+    unsigned long events;       /* Events received */
+    unsigned long bytes;
+    unsigned long drops;        /* Events dropped (queue full) */
+    unsigned long dropped;      /* Events dropped since the report */
+    unsigned long slowdowns;    /* Slow downs sent */
+
+    /* Fair queue (flow_mutex) */
+    flow_event *first;
+    flow_event **last;
+    unsigned int queued;
+    size_t deficit;
+    struct _flow_agent *next_active;
+    int active;
+} flow_agent;
+
+static flow_agent flow[MAX_AGENTS + 1];
+
+/* Agents with events waiting, in round robin order (flow_mutex) */
+static flow_agent *flow_active = NULL;
+static flow_agent **flow_active_last = &flow_active;
+static int flow_queueing = 0;
+static pthread_mutex_t flow_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flow_available = PTHREAD_COND_INITIALIZER;
+
+/* Metrics */
+static os_metric *metric_messages;
+static os_metric *metric_bytes;
+static os_metric *metric_invalid;
+static os_metric *metric_control;
+static os_metric *metric_events;
+static os_metric *metric_dropped;
+static os_metric *metric_slowdowns;
+static os_metric *metric_decrypt;
+
+/* Flow control options */
+static int flow_high;
+static unsigned int flow_rate;
+static unsigned int flow_queue;
+
+/* Prototypes */
+static void *SecureReceiver(void *sock_pt);
+static void HandleSecureLoop(int sock) __attribute__((noreturn));
+static void ForwardMSG(int *m_queue, const char *msg, const char *srcmsg);
+static void FlowAgent(unsigned int agentid);
+static int FlowCheck(int load, int agentid, const char *srcmsg);
+static void FlowEvent(int *m_queue, int agentid, const char *msg,
+                      const char *srcmsg, const char *msg_slow);
+static void FlowQueue(flow_agent *agent, const char *msg, const char *srcmsg);
+static void *FlowForwarder(void *none) __attribute__((noreturn));
+static void SlowDown(unsigned int agentid, const char *msg);
+
+
 /* Handle secure connections */
 void HandleSecure()
 {
-    int agentid;
-    char buffer[OS_MAXSTR + 1];
-    char cleartext_msg[OS_MAXSTR + 1];
-    char srcip[IPSIZE + 1];
-    char *tmp_msg;
-    char srcmsg[OS_FLSIZE + 1];
-    ssize_t recv_b;
-    struct sockaddr_in peer_info;
-    socklen_t peer_size;
+    int i;
 
     /* Send msg init */
     send_msg_init();
@@ -31,9 +122,37 @@ void HandleSecure()
     /* Initialize key mutex */
     keyupdate_init();
 
+    for (i = 0; i < AGENT_LOCKS; i++) {
+        pthread_mutex_init(&agent_locks[i], NULL);
+    }
+
     /* Initialize manager */
     manager_init(0);
 
+    /* Metrics (served on the control socket) */
+    metric_messages = OS_MetricCounter("remoted_messages_total", "Messages received from the agents.");
+    metric_bytes = OS_MetricCounter("remoted_bytes_total", "Bytes received from the agents.");
+    metric_invalid = OS_MetricCounter("remoted_invalid_total",
+                                      "Messages that could not be decrypted (or duplicated).");
+    metric_control = OS_MetricCounter("remoted_control_total", "Control messages of the agents.");
+    metric_events = OS_MetricCounter("remoted_events_total", "Events of the agents.");
+    metric_dropped = OS_MetricCounter("remoted_dropped_total",
+                                      "Events dropped (queue of the agent full).");
+    metric_slowdowns = OS_MetricCounter("remoted_slowdowns_total",
+                                        "Agents asked to slow down.");
+    metric_decrypt = OS_MetricHistogram("remoted_decrypt_microseconds",
+                                        "Time to decrypt and decompress a message.");
+
+    /* Flow control towards analysisd */
+    flow_high = getDefine_Int("remoted", "flow_high", 0, 100);
+    flow_rate = (unsigned int) getDefine_Int("remoted", "flow_rate", 1, 1000000);
+    flow_queue = (unsigned int) getDefine_Int("remoted", "flow_queue", 0, 1000000);
+
+    if (flow_high > 0 && flow_queue > 0 &&
+            CreateThread(FlowForwarder, (void *)NULL) != 0) {
+        ErrorExit(THREAD_ERROR, ARGV0);
+    }
+
     /* Create Active Response forwarder thread */
     if (CreateThread(AR_Forward, (void *)NULL) != 0) {
         ErrorExit(THREAD_ERROR, ARGV0);
@@ -44,13 +163,6 @@ void HandleSecure()
         ErrorExit(THREAD_ERROR, ARGV0);
     }
 
-    /* Connect to the message queue
-     * Exit if it fails.
-     */
-    if ((logr.m_queue = StartMQ(DEFAULTQUEUE, WRITE)) < 0) {
-        ErrorExit(QUEUE_FATAL, ARGV0, DEFAULTQUEUE);
-    }
-
     verbose(AG_AX_AGENTS, ARGV0, MAX_AGENTS);
 
     /* Read authentication keys */
@@ -62,116 +174,523 @@ void HandleSecure()
     OS_StartCounter(&keys);
     debug1("%s: DEBUG: OS_StartCounter completed.", ARGV0);
 
+    /* Agent status table */
+    status_init();
+
     /* Set up peer size */
-    peer_size = sizeof(peer_info);
-    logr.peer_size = sizeof(peer_info);
+    logr.peer_size = sizeof(struct sockaddr_in);
+
+    /* Start the other receivers (one per shared socket) */
+    if (logr.recv_threads > 1) {
+        verbose("%s: INFO: Using %d receiver threads.", ARGV0, logr.recv_threads);
+
+        for (i = 1; i < logr.recv_threads; i++) {
+            if (CreateThread(SecureReceiver, (void *)&logr.recv_socks[i]) != 0) {
+                ErrorExit(THREAD_ERROR, ARGV0);
+            }
+        }
+    }
+
+    HandleSecureLoop(logr.sock);
+}
+
+static void *SecureReceiver(void *sock_pt)
+{
+    HandleSecureLoop(*(int *)sock_pt);
+}
+
+/* Send an agent event to analysisd.
+ * If we can't send the message, try to connect to the
+ * socket again. If it not exit.
+ */
+static void ForwardMSG(int *m_queue, const char *msg, const char *srcmsg)
+{
+    if (SendMSG(*m_queue, msg, srcmsg, SECURE_MQ) < 0) {
+        merror(QUEUE_ERROR, ARGV0, DEFAULTQUEUE, strerror(errno));
+
+        if ((*m_queue = StartMQ(DEFAULTQUEUE, WRITE)) < 0) {
+            ErrorExit(QUEUE_FATAL, ARGV0, DEFAULTQUEUE);
+        }
+    }
+}
+
+/* Reset the entry of an agent if another one got its position
+ * (the keys must be locked)
+ */
+static void FlowAgent(unsigned int agentid)
+{
+    flow_agent *agent = &flow[agentid];
+
+    if (strcmp(agent->id, keys.keyentries[agentid]->id) != 0) {
+        pthread_mutex_lock(&flow_mutex);
+
+        strncpy(agent->id, keys.keyentries[agentid]->id, KEYSIZE);
+        memset(&agent->bucket, 0, sizeof(mq_bucket));
+        agent->notified = 0;
+        agent->reported = 0;
+        agent->requests = 0;
+        agent->events = 0;
+        agent->bytes = 0;
+        agent->drops = 0;
+        agent->dropped = 0;
+        agent->slowdowns = 0;
+
+        pthread_mutex_unlock(&flow_mutex);
+    }
+}
+
+/* Flow control. While the queue is congested (load) each agent may send
+ * up to flow_rate events per second. The agents over it are asked to
+ * slow down (once per second) and keep the rest of their events.
+ * Returns 1 if the agent is to be asked to slow down.
+ */
+static int FlowCheck(int load, int agentid, const char *srcmsg)
+{
+    flow_agent *agent = &flow[agentid];
+    time_t now = time(0);
+    unsigned int requests = 0;
+    unsigned long dropped = 0;
+    int report = 0;
+
+    pthread_mutex_lock(&flow_mutex);
+
+    if (MQ_BucketTake(&agent->bucket, flow_rate, now) || agent->notified == now) {
+        pthread_mutex_unlock(&flow_mutex);
+        return (0);
+    }
+
+    agent->notified = now;
+    agent->requests++;
+    agent->slowdowns++;
+
+    if (now - agent->reported >= FLOW_REPORT) {
+        requests = agent->requests;
+        dropped = agent->dropped;
+        report = 1;
+        agent->reported = now;
+        agent->requests = 0;
+        agent->dropped = 0;
+    }
+
+    pthread_mutex_unlock(&flow_mutex);
+
+    OS_MetricAdd(metric_slowdowns, 1);
+
+    if (report) {
+        merror("%s: WARN: Queue congested (%d%% full). Agent '%s' over %u "
+               "events per second asked to slow down (%u times, %lu events "
+               "dropped).", ARGV0, load, srcmsg, flow_rate, requests, dropped);
+    }
+
+    return (1);
+}
+
+/* Forward an event of an agent: right away, or through the fair queue
+ * while the queue to analysisd is congested
+ */
+static void FlowEvent(int *m_queue, int agentid, const char *msg,
+                      const char *srcmsg, const char *msg_slow)
+{
+    flow_agent *agent;
+    int load;
+
+    OS_MetricAdd(metric_events, 1);
+
+    if (agentid > MAX_AGENTS) {
+        ForwardMSG(m_queue, msg, srcmsg);
+        return;
+    }
+
+    agent = &flow[agentid];
+    __sync_fetch_and_add(&agent->events, 1);
+    __sync_fetch_and_add(&agent->bytes, strlen(msg));
+
+    if (flow_high == 0) {
+        ForwardMSG(m_queue, msg, srcmsg);
+        return;
+    }
+
+    if ((load = MQ_ShmLoad(*m_queue)) >= flow_high && FlowCheck(load, agentid, srcmsg)) {
+        SlowDown((unsigned)agentid, msg_slow);
+    }
+
+    if (flow_queue > 0 && (flow_queueing || load >= flow_high)) {
+        FlowQueue(agent, msg, srcmsg);
+    } else {
+        ForwardMSG(m_queue, msg, srcmsg);
+    }
+}
+
+/* Add an event to the queue of its agent, or drop it if it is full */
+static void FlowQueue(flow_agent *agent, const char *msg, const char *srcmsg)
+{
+    flow_event *event;
+    size_t msg_size = strlen(msg);
+    size_t srcmsg_size = strlen(srcmsg);
+
+    pthread_mutex_lock(&flow_mutex);
+
+    if (agent->queued >= flow_queue) {
+        agent->drops++;
+        agent->dropped++;
+        pthread_mutex_unlock(&flow_mutex);
+        OS_MetricAdd(metric_dropped, 1);
+        return;
+    }
+
+    os_malloc(sizeof(flow_event) + msg_size + srcmsg_size + 1, event);
+    memcpy(event->msg, msg, msg_size + 1);
+    event->srcmsg = event->msg + msg_size + 1;
+    memcpy(event->srcmsg, srcmsg, srcmsg_size + 1);
+    event->next = NULL;
+
+    if (!agent->first) {
+        agent->last = &agent->first;
+    }
+    *agent->last = event;
+    agent->last = &event->next;
+    agent->queued++;
+
+    if (!agent->active) {
+        agent->active = 1;
+        agent->deficit = 0;
+        agent->next_active = NULL;
+        *flow_active_last = agent;
+        flow_active_last = &agent->next_active;
+    }
+
+    flow_queueing = 1;
+    pthread_cond_signal(&flow_available);
+    pthread_mutex_unlock(&flow_mutex);
+}
+
+/* Send the events of the fair queue to analysisd, a round of each agent
+ * at a time. Only this thread waits for room in the queue meanwhile.
+ */
+static void *FlowForwarder(__attribute__((unused)) void *none)
+{
+    int m_queue;
+    flow_agent *agent;
+    flow_event *events;
+    flow_event **last;
+    flow_event *event;
+
+    if ((m_queue = StartMQ(DEFAULTQUEUE, WRITE)) < 0) {
+        ErrorExit(QUEUE_FATAL, ARGV0, DEFAULTQUEUE);
+    }
+
+    while (1) {
+        pthread_mutex_lock(&flow_mutex);
+
+        /* Back to forwarding from the receivers */
+        if (!flow_active) {
+            flow_queueing = 0;
+        }
+
+        while (!flow_active) {
+            pthread_cond_wait(&flow_available, &flow_mutex);
+        }
+
+        /* A round of the first agent */
+        agent = flow_active;
+        if ((flow_active = agent->next_active) == NULL) {
+            flow_active_last = &flow_active;
+        }
+
+        agent->deficit += FLOW_QUANTUM;
+        events = NULL;
+        last = &events;
+
+        while ((event = agent->first) && strlen(event->msg) <= agent->deficit) {
+            agent->deficit -= strlen(event->msg);
+            agent->first = event->next;
+            agent->queued--;
+
+            *last = event;
+            last = &event->next;
+        }
+        *last = NULL;
+
+        /* Events left: to the end of the round */
+        if (agent->first) {
+            agent->next_active = NULL;
+            *flow_active_last = agent;
+            flow_active_last = &agent->next_active;
+        } else {
+            agent->active = 0;
+            agent->deficit = 0;
+        }
+
+        pthread_mutex_unlock(&flow_mutex);
+
+        while ((event = events)) {
+            events = event->next;
+            ForwardMSG(&m_queue, event->msg, event->srcmsg);
+            free(event);
+        }
+    }
+}
+
+/* Print the flow of the agents, a line each:
+ * "<id> <name> <events> <bytes> <drops> <slow downs> <queued>"
+ * The keys must be locked.
+ */
+void flow_print(FILE *fp)
+{
+    unsigned int i;
+    flow_agent *agent;
+
+    fprintf(fp, "# flow %ld\n", (long)time(0));
+
+    pthread_mutex_lock(&flow_mutex);
+
+    for (i = 0; i < keys.keysize && i <= MAX_AGENTS; i++) {
+        agent = &flow[i];
+
+        if (strcmp(agent->id, keys.keyentries[i]->id) != 0 || agent->events == 0) {
+            continue;
+        }
+
+        fprintf(fp, "%s %s %lu %lu %lu %lu %u\n", agent->id,
+                keys.keyentries[i]->name, agent->events, agent->bytes,
+                agent->drops, agent->slowdowns, agent->queued);
+    }
+
+    pthread_mutex_unlock(&flow_mutex);
+}
+
+/* Ask an agent to slow down. It is done right away (not with the ACKs
+ * at the end of the batch) to stop the agent as soon as possible.
+ */
+static void SlowDown(unsigned int agentid, const char *msg)
+{
+    key_rdlock();
+    if (agentid < keys.keysize) {
+        send_msg(agentid, msg);
+    }
+    key_unlock();
+}
+
+/* Receive, decrypt and forward the messages from one socket.
+ * The datagrams are read in batches and the control messages of a
+ * batch are acknowledged together at the end of it.
+ */
+static void HandleSecureLoop(int sock)
+{
+    int agentid;
+    int m_queue;
+    int recvd;
+    int i;
+    char cleartext_msg[OS_MAXSTR + 1];
+    char srcip[IPSIZE + 1];
+    char msg_ack[AGENT_CAPS][OS_FLSIZE + 1];
+    char *buffer;
+    char *tmp_msg;
+    char srcmsg[OS_FLSIZE + 1];
+    ssize_t recv_b;
+    struct sockaddr_in *peer_info;
+    pthread_mutex_t *agent_lock;
+    OSDgram dgrams[SECURE_BATCH];
+    unsigned int ack_ids[AGENT_CAPS][SECURE_BATCH];
+    unsigned int acks[AGENT_CAPS];
+    char msg_slow[OS_FLSIZE + 1];
+    int caps;
+    unsigned long started;
+
+    /* Connect to the message queue (one per receiver)
+     * Exit if it fails.
+     */
+    if ((m_queue = StartMQ(DEFAULTQUEUE, WRITE)) < 0) {
+        ErrorExit(QUEUE_FATAL, ARGV0, DEFAULTQUEUE);
+    }
 
     /* Initialize some variables */
-    memset(buffer, '\0', OS_MAXSTR + 1);
+    memset(dgrams, 0, sizeof(dgrams));
+    for (i = 0; i < SECURE_BATCH; i++) {
+        os_calloc(OS_MAXSTR + 1, sizeof(char), dgrams[i].buf);
+        dgrams[i].size = OS_MAXSTR + 1;
+    }
+
     memset(cleartext_msg, '\0', OS_MAXSTR + 1);
     memset(srcmsg, '\0', OS_FLSIZE + 1);
+    /* The ACK to a startup lists the capabilities accepted */
+    for (caps = 0; caps < AGENT_CAPS; caps++) {
+        snprintf(msg_ack[caps], OS_FLSIZE, "%s%s%s%s%s", CONTROL_HEADER, HC_ACK,
+                 caps & AGENT_CAP_BATCH ? HC_BATCH : "",
+                 caps == (AGENT_CAP_BATCH | AGENT_CAP_ZDICT) ? " " : "",
+                 caps & AGENT_CAP_ZDICT ? HC_ZDICT : "");
+    }
+    snprintf(msg_slow, OS_FLSIZE, "%s%s%u %d", CONTROL_HEADER, HC_SLOWDOWN,
+             flow_rate, FLOW_PERIOD);
     tmp_msg = NULL;
 
     while (1) {
-        /* Receive message  */
-        recv_b = recvfrom(logr.sock, buffer, OS_MAXSTR, 0,
-                          (struct sockaddr *)&peer_info, &peer_size);
+        /* Receive messages */
+        recvd = OS_RecvUDPBatch(sock, dgrams, SECURE_BATCH);
 
         /* Nothing received */
-        if (recv_b <= 0) {
+        if (recvd <= 0) {
             continue;
         }
 
-        /* Set the source IP */
-        strncpy(srcip, inet_ntoa(peer_info.sin_addr), IPSIZE);
-        srcip[IPSIZE] = '\0';
+        memset(acks, 0, sizeof(acks));
+        OS_MetricAdd(metric_messages, (unsigned long)recvd);
 
-        /* Get a valid agent id */
-        if (buffer[0] == '!') {
-            tmp_msg = buffer;
-            tmp_msg++;
+        for (i = 0; i < recvd; i++) {
+            buffer = dgrams[i].buf;
+            recv_b = (ssize_t)dgrams[i].len;
+            peer_info = (struct sockaddr_in *)&dgrams[i].peer;
 
-            /* We need to make sure that we have a valid id
-             * and that we reduce the recv buffer size
-             */
-            while (isdigit((int)*tmp_msg)) {
-                tmp_msg++;
-                recv_b--;
+            if (recv_b <= 0) {
+                continue;
             }
 
-            if (*tmp_msg != '!') {
-                merror(ENCFORMAT_ERROR, __local_name, srcip);
+            OS_MetricAdd(metric_bytes, (unsigned long)recv_b);
+
+            /* Set the source IP */
+            if (!inet_ntop(AF_INET, &peer_info->sin_addr, srcip, sizeof(srcip))) {
                 continue;
             }
 
-            *tmp_msg = '\0';
-            tmp_msg++;
-            recv_b -= 2;
+            /* Get a valid agent id */
+            if (buffer[0] == '!') {
+                tmp_msg = buffer;
+                tmp_msg++;
+
+                /* We need to make sure that we have a valid id
+                 * and that we reduce the recv buffer size
+                 */
+                while (isdigit((int)*tmp_msg)) {
+                    tmp_msg++;
+                    recv_b--;
+                }
+
+                if (*tmp_msg != '!') {
+                    merror(ENCFORMAT_ERROR, __local_name, srcip);
+                    continue;
+                }
 
-            agentid = OS_IsAllowedDynamicID(&keys, buffer + 1, srcip);
-            if (agentid == -1) {
-                if (check_keyupdate()) {
-                    agentid = OS_IsAllowedDynamicID(&keys, buffer + 1, srcip);
-                    if (agentid == -1) {
+                *tmp_msg = '\0';
+                tmp_msg++;
+                recv_b -= 2;
+
+                key_rdlock();
+                agentid = OS_IsAllowedDynamicID(&keys, buffer + 1, srcip);
+                if (agentid == -1) {
+                    key_unlock();
+                    if (check_keyupdate()) {
+                        key_rdlock();
+                        agentid = OS_IsAllowedDynamicID(&keys, buffer + 1, srcip);
+                        if (agentid == -1) {
+                            key_unlock();
+                            merror(ENC_IP_ERROR, ARGV0, srcip);
+                            continue;
+                        }
+                    } else {
                         merror(ENC_IP_ERROR, ARGV0, srcip);
                         continue;
                     }
-                } else {
-                    merror(ENC_IP_ERROR, ARGV0, srcip);
-                    continue;
                 }
-            }
-        } else {
-            agentid = OS_IsAllowedIP(&keys, srcip);
-            if (agentid < 0) {
-                if (check_keyupdate()) {
-                    agentid = OS_IsAllowedIP(&keys, srcip);
-                    if (agentid == -1) {
+            } else {
+                key_rdlock();
+                agentid = OS_IsAllowedIP(&keys, srcip);
+                if (agentid < 0) {
+                    key_unlock();
+                    if (check_keyupdate()) {
+                        key_rdlock();
+                        agentid = OS_IsAllowedIP(&keys, srcip);
+                        if (agentid == -1) {
+                            key_unlock();
+                            merror(DENYIP_WARN, ARGV0, srcip);
+                            continue;
+                        }
+                    } else {
                         merror(DENYIP_WARN, ARGV0, srcip);
                         continue;
                     }
-                } else {
-                    merror(DENYIP_WARN, ARGV0, srcip);
-                    continue;
                 }
+                tmp_msg = buffer;
             }
-            tmp_msg = buffer;
-        }
 
-        /* Decrypt the message */
-        tmp_msg = ReadSecMSG(&keys, tmp_msg, cleartext_msg,
-                             agentid, recv_b - 1);
-        if (tmp_msg == NULL) {
-            /* If duplicated, a warning was already generated */
-            continue;
-        }
+            /* The keys are locked (for reading) from here on */
 
-        /* Check if it is a control message */
-        if (IsValidHeader(tmp_msg)) {
-            /* We need to save the peerinfo if it is a control msg */
-            memcpy(&keys.keyentries[agentid]->peer_info, &peer_info, peer_size);
-            keys.keyentries[agentid]->rcvd = time(0);
+            /* Decrypt the message */
+            agent_lock = &agent_locks[agentid % AGENT_LOCKS];
+            if (pthread_mutex_lock(agent_lock) != 0) {
+                merror(MUTEX_ERROR, ARGV0);
+                key_unlock();
+                continue;
+            }
 
-            save_controlmsg((unsigned)agentid, tmp_msg);
+            started = OS_MetricNow();
+            tmp_msg = ReadSecMSG(&keys, tmp_msg, cleartext_msg,
+                                 agentid, recv_b - 1);
+            OS_MetricObserve(metric_decrypt, OS_MetricNow() - started);
+            if (tmp_msg) {
+                status_message((unsigned)agentid, time(0));
 
-            continue;
-        }
+                if (agentid <= MAX_AGENTS) {
+                    FlowAgent((unsigned)agentid);
+                }
+            }
+
+            if (pthread_mutex_unlock(agent_lock) != 0) {
+                merror(MUTEX_ERROR, ARGV0);
+            }
+
+            if (tmp_msg == NULL) {
+                /* If duplicated, a warning was already generated */
+                key_unlock();
+                OS_MetricAdd(metric_invalid, 1);
+                continue;
+            }
+
+            /* Check if it is a control message */
+            if (IsValidHeader(tmp_msg)) {
+                /* We need to save the peerinfo if it is a control msg */
+                send_msg_peer((unsigned)agentid, peer_info);
+
+                /* Agents asking for capabilities get a different ACK */
+                caps = save_controlmsg((unsigned)agentid, tmp_msg);
+                ack_ids[caps][acks[caps]++] = (unsigned)agentid;
 
-        /* Generate srcmsg */
-        snprintf(srcmsg, OS_FLSIZE, "(%s) %s", keys.keyentries[agentid]->name,
-                 keys.keyentries[agentid]->ip->ip);
+                key_unlock();
+                OS_MetricAdd(metric_control, 1);
+                continue;
+            }
+
+            /* Generate srcmsg */
+            snprintf(srcmsg, OS_FLSIZE, "(%s) %s", keys.keyentries[agentid]->name,
+                     keys.keyentries[agentid]->ip->ip);
+
+            key_unlock();
 
-        /* If we can't send the message, try to connect to the
-         * socket again. If it not exit.
-         */
-        if (SendMSG(logr.m_queue, tmp_msg, srcmsg,
-                    SECURE_MQ) < 0) {
-            merror(QUEUE_ERROR, ARGV0, DEFAULTQUEUE, strerror(errno));
+            /* Several events in one frame */
+            if (strncmp(tmp_msg, BATCH_HEADER, strlen(BATCH_HEADER)) == 0) {
+                char *frame_end = tmp_msg + strlen(tmp_msg);
+                char *event;
 
-            if ((logr.m_queue = StartMQ(DEFAULTQUEUE, WRITE)) < 0) {
-                ErrorExit(QUEUE_FATAL, ARGV0, DEFAULTQUEUE);
+                tmp_msg += strlen(BATCH_HEADER);
+                while ((event = ReadSecBatch(&tmp_msg, frame_end)) != NULL) {
+                    FlowEvent(&m_queue, agentid, event, srcmsg, msg_slow);
+                }
+
+                if (tmp_msg < frame_end) {
+                    merror(ENCFORMAT_ERROR, ARGV0, srcip);
+                }
+                continue;
+            }
+
+            FlowEvent(&m_queue, agentid, tmp_msg, srcmsg, msg_slow);
+        }
+
+        /* Reply to the control messages of this batch */
+        for (caps = 0; caps < AGENT_CAPS; caps++) {
+            if (acks[caps] > 0) {
+                key_rdlock();
+                send_msg_batch(sock, ack_ids[caps], acks[caps], msg_ack[caps]);
+                key_unlock();
             }
         }
     }
 }
-
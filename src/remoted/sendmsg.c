@@ -16,69 +16,183 @@
 /* pthread send_msg mutex */
 static pthread_mutex_t sendmsg_mutex;
 
-/* pthread key update mutex */
-static pthread_mutex_t keyupdate_mutex;
+/* Encrypted messages of send_msg_batch (protected by sendmsg_mutex) */
+static OSDgram send_dgrams[OS_DGRAM_BATCH];
+
+/* pthread key update lock. The keys are read by every receiver and
+ * only replaced on updates. The gate keeps an update from waiting
+ * forever behind a steady flow of readers.
+ */
+static pthread_rwlock_t keyupdate_rwlock;
+static pthread_mutex_t keyupdate_gate;
+
+/* Only one thread reads the keys file at a time */
+static pthread_mutex_t keyreload_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Metrics */
+static os_metric *metric_messages;
+static os_metric *metric_bytes;
+static os_metric *metric_errors;
+static os_metric *metric_encrypt;
+
+static size_t send_encrypt(unsigned int agentid, const char *msg, char *crypt_msg);
+static int send_dgrams_flush(int sock, unsigned int queued);
 
 
 /* Initializes mutex */
 void keyupdate_init()
 {
     /* Initialize mutex */
-    pthread_mutex_init(&keyupdate_mutex, NULL);
+    pthread_rwlock_init(&keyupdate_rwlock, NULL);
+    pthread_mutex_init(&keyupdate_gate, NULL);
+}
+
+/* Lock the keys for reading (shared) */
+void key_rdlock()
+{
+    if (pthread_mutex_lock(&keyupdate_gate) != 0) {
+        merror(MUTEX_ERROR, ARGV0);
+        return;
+    }
+
+    if (pthread_rwlock_rdlock(&keyupdate_rwlock) != 0) {
+        merror(MUTEX_ERROR, ARGV0);
+    }
+
+    if (pthread_mutex_unlock(&keyupdate_gate) != 0) {
+        merror(MUTEX_ERROR, ARGV0);
+    }
 }
 
+/* Lock the keys for updating (exclusive) */
 void key_lock()
 {
-    if (pthread_mutex_lock(&keyupdate_mutex) != 0) {
+    if (pthread_mutex_lock(&keyupdate_gate) != 0) {
+        merror(MUTEX_ERROR, ARGV0);
+        return;
+    }
+
+    if (pthread_rwlock_wrlock(&keyupdate_rwlock) != 0) {
+        merror(MUTEX_ERROR, ARGV0);
+    }
+
+    if (pthread_mutex_unlock(&keyupdate_gate) != 0) {
         merror(MUTEX_ERROR, ARGV0);
     }
 }
 
 void key_unlock()
 {
-    if (pthread_mutex_unlock(&keyupdate_mutex) != 0) {
+    if (pthread_rwlock_unlock(&keyupdate_rwlock) != 0) {
         merror(MUTEX_ERROR, ARGV0);
     }
 }
 
-/* Check for key updates */
+/* Check for key updates. The new keys are read while the receivers go
+ * on with the current ones; they only wait for the swap of pointers.
+ */
 int check_keyupdate()
 {
+    keystore update;
+    int changes;
+
     /* Check key for updates */
     if (!OS_CheckUpdateKeys(&keys)) {
         return (0);
     }
 
+    /* One update at a time: the others use the keys they have */
+    if (pthread_mutex_trylock(&keyreload_mutex) != 0) {
+        return (0);
+    }
+
+    if (!OS_CheckUpdateKeys(&keys)) {
+        pthread_mutex_unlock(&keyreload_mutex);
+        return (0);
+    }
+
+    merror(ENCFILE_CHANGED, ARGV0);
+
+    if ((changes = OS_DiffKeys(&keys, &update)) <= 0) {
+        keys.file_change = update.file_change;
+        pthread_mutex_unlock(&keyreload_mutex);
+        return (0);
+    }
+
     key_lock();
 
     /* Lock before using */
     if (pthread_mutex_lock(&sendmsg_mutex) != 0) {
-        key_unlock();
         merror(MUTEX_ERROR, ARGV0);
-        return (0);
     }
 
-    if (OS_UpdateKeys(&keys)) {
-        if (pthread_mutex_unlock(&sendmsg_mutex) != 0) {
-            merror(MUTEX_ERROR, ARGV0);
-        }
-        key_unlock();
-        return (1);
-    }
+    OS_SwapKeys(&keys, &update);
 
     if (pthread_mutex_unlock(&sendmsg_mutex) != 0) {
         merror(MUTEX_ERROR, ARGV0);
     }
     key_unlock();
 
-    return (0);
+    /* Nobody can be using the previous entries now */
+    OS_ReleaseKeys(&keys, &update);
+
+    verbose("%s: INFO: Authentication keys updated (%d changes, %u agents).",
+            ARGV0, changes, keys.keysize);
+
+    pthread_mutex_unlock(&keyreload_mutex);
+
+    return (1);
 }
 
 /* Initialize send_msg */
 void send_msg_init()
 {
+    int i;
+
     /* Initialize mutex */
     pthread_mutex_init(&sendmsg_mutex, NULL);
+
+    for (i = 0; i < OS_DGRAM_BATCH; i++) {
+        os_calloc(OS_MAXSTR + 1, sizeof(char), send_dgrams[i].buf);
+        send_dgrams[i].size = OS_MAXSTR + 1;
+    }
+
+    metric_messages = OS_MetricCounter("remoted_sent_messages_total", "Messages sent to the agents.");
+    metric_bytes = OS_MetricCounter("remoted_sent_bytes_total", "Bytes sent to the agents.");
+    metric_errors = OS_MetricCounter("remoted_send_errors_total",
+                                     "Messages to the agents that could not be sent.");
+    metric_encrypt = OS_MetricHistogram("remoted_encrypt_microseconds",
+                                        "Time to compress and encrypt a message to an agent.");
+}
+
+/* Encrypt a message to an agent (timed) */
+static size_t send_encrypt(unsigned int agentid, const char *msg, char *crypt_msg)
+{
+    unsigned long started = OS_MetricNow();
+    size_t msg_size;
+
+    msg_size = CreateSecMSG(&keys, msg, crypt_msg, agentid);
+    OS_MetricObserve(metric_encrypt, OS_MetricNow() - started);
+
+    return (msg_size);
+}
+
+/* Save the address of an agent. It is copied under the send_msg lock,
+ * so the senders never read a half written address.
+ */
+void send_msg_peer(unsigned int agentid, const struct sockaddr_in *peer)
+{
+    if (pthread_mutex_lock(&sendmsg_mutex) != 0) {
+        merror(MUTEX_ERROR, ARGV0);
+        return;
+    }
+
+    memcpy(&keys.keyentries[agentid]->peer_info, peer, logr.peer_size);
+    keys.keyentries[agentid]->rcvd = time(0);
+
+    if (pthread_mutex_unlock(&sendmsg_mutex) != 0) {
+        merror(MUTEX_ERROR, ARGV0);
+    }
 }
 
 /* Send message to an agent
@@ -90,19 +204,23 @@ int send_msg(unsigned int agentid, const char *msg)
     char crypt_msg[OS_MAXSTR + 1];
 
     /* If we don't have the agent id, ignore it */
-    if (keys.keyentries[agentid]->rcvd < (time(0) - (2 * NOTIFY_TIME))) {
+    if (agentid >= keys.keysize ||
+            keys.keyentries[agentid]->rcvd < (time(0) - (2 * NOTIFY_TIME))) {
         return (-1);
     }
 
-    msg_size = CreateSecMSG(&keys, msg, crypt_msg, agentid);
-    if (msg_size == 0) {
-        merror(SEC_ERROR, ARGV0);
+    /* Lock before using (the sender counter too) */
+    if (pthread_mutex_lock(&sendmsg_mutex) != 0) {
+        merror(MUTEX_ERROR, ARGV0);
         return (-1);
     }
 
-    /* Lock before using */
-    if (pthread_mutex_lock(&sendmsg_mutex) != 0) {
-        merror(MUTEX_ERROR, ARGV0);
+    msg_size = send_encrypt(agentid, msg, crypt_msg);
+    if (msg_size == 0) {
+        merror(SEC_ERROR, ARGV0);
+        if (pthread_mutex_unlock(&sendmsg_mutex) != 0) {
+            merror(MUTEX_ERROR, ARGV0);
+        }
         return (-1);
     }
 
@@ -111,6 +229,10 @@ int send_msg(unsigned int agentid, const char *msg)
                (struct sockaddr *)&keys.keyentries[agentid]->peer_info,
                logr.peer_size) < 0) {
         merror(SEND_ERROR, ARGV0, keys.keyentries[agentid]->id);
+        OS_MetricAdd(metric_errors, 1);
+    } else {
+        OS_MetricAdd(metric_messages, 1);
+        OS_MetricAdd(metric_bytes, msg_size);
     }
 
     /* Unlock mutex */
@@ -122,3 +244,81 @@ int send_msg(unsigned int agentid, const char *msg)
     return (0);
 }
 
+
+/* Send the queued messages of send_dgrams (sendmsg_mutex locked)
+ * Returns the number of messages sent
+ */
+static int send_dgrams_flush(int sock, unsigned int queued)
+{
+    unsigned long bytes = 0;
+    int sent;
+    int i;
+
+    if ((sent = OS_SendUDPBatch(sock, send_dgrams, queued)) < (int)queued) {
+        merror(SEND_ERROR, ARGV0, "(batch)");
+        sent = sent > 0 ? sent : 0;
+        OS_MetricAdd(metric_errors, queued - (unsigned int)sent);
+    }
+
+    for (i = 0; i < sent; i++) {
+        bytes += send_dgrams[i].len;
+    }
+
+    OS_MetricAdd(metric_messages, (unsigned long)sent);
+    OS_MetricAdd(metric_bytes, bytes);
+
+    return (sent);
+}
+
+/* Send the same message to several agents, with as few system calls
+ * as possible. The keys must be locked (for reading).
+ * Returns the number of messages sent or -1 on error
+ */
+int send_msg_batch(int sock, const unsigned int *agentids, unsigned int count, const char *msg)
+{
+    unsigned int i;
+    unsigned int queued = 0;
+    int sent = 0;
+
+    /* Lock before using (the sender counter too) */
+    if (pthread_mutex_lock(&sendmsg_mutex) != 0) {
+        merror(MUTEX_ERROR, ARGV0);
+        return (-1);
+    }
+
+    for (i = 0; i < count; i++) {
+        keyentry *entry;
+
+        /* The keys may have been reloaded since the id was taken */
+        if (agentids[i] >= keys.keysize) {
+            continue;
+        }
+        entry = keys.keyentries[agentids[i]];
+
+        send_dgrams[queued].len = send_encrypt(agentids[i], msg, send_dgrams[queued].buf);
+        if (send_dgrams[queued].len == 0) {
+            merror(SEC_ERROR, ARGV0);
+            continue;
+        }
+
+        memcpy(&send_dgrams[queued].peer, &entry->peer_info, logr.peer_size);
+        send_dgrams[queued].peer_len = logr.peer_size;
+
+        if (++queued == OS_DGRAM_BATCH) {
+            sent += send_dgrams_flush(sock, queued);
+            queued = 0;
+        }
+    }
+
+    if (queued > 0) {
+        sent += send_dgrams_flush(sock, queued);
+    }
+
+    /* Unlock mutex */
+    if (pthread_mutex_unlock(&sendmsg_mutex) != 0) {
+        merror(MUTEX_ERROR, ARGV0);
+        return (-1);
+    }
+
+    return (sent);
+}
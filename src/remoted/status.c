@@ -0,0 +1,360 @@
+/* Copyright (C) 2009 Trend Micro Inc.
+ * All right reserved.
+ *
+ * This program is a free software; you can redistribute it
+ * and/or modify it under the terms of the GNU General Public
+ * License (version 2) as published by the FSF - Free Software
+ * Foundation
+ */
+
+/* Agent status table
+ *
+ * The status of the agents (last keepalive and message, uname, sum of the
+ * merged file and counters) is kept in memory, indexed like the keys.
+ * It is written to AGENTSTATUS_FILE every few seconds and served on the
+ * control socket ("agents"), so the tools do not have to read the
+ * agent-info files. The active responses sent to each agent are served
+ * as well ("ar"), and the events of each agent ("flow", see secure.c).
+ */
+
+#include "shared.h"
+#include "remoted.h"
+#include "os_crypto/md5/md5_op.h"
+#include <pthread.h>
+
+/* Status of an agent */
+typedef struct _agent_status {
+    char id[KEYSIZE + 1];       /* Agent of the entry (the keys may change) */
+    time_t keepalive;           /* Last control message */
+    time_t seen;                /* Last message */
+    unsigned long messages;
+    unsigned long keepalives;
+    os_md5 merged_sum;
+    char *uname;
+    unsigned long ar_sent;      /* Active responses sent */
+    unsigned long ar_skipped;   /* Active responses while not connected */
+    unsigned long ar_failed;    /* Active responses not sent */
+    time_t ar_last;             /* Last active response sent */
+} agent_status;
+
+/* Prototypes */
+static agent_status *status_entry(unsigned int agentid);
+static void status_print(FILE *fp, const char *id);
+static void status_print_ar(FILE *fp);
+static int status_load(void);
+static int status_save(void);
+static void *status_thread(void *none) __attribute__((noreturn));
+static void status_control(const char *command, FILE *reply);
+
+/* Global vars */
+static agent_status status[MAX_AGENTS + 1];
+static pthread_mutex_t status_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int status_interval;
+
+
+/* Get the entry of an agent (the keys must be locked) */
+static agent_status *status_entry(unsigned int agentid)
+{
+    agent_status *entry = &status[agentid];
+
+    /* Another agent got this position */
+    if (strcmp(entry->id, keys.keyentries[agentid]->id) != 0) {
+        pthread_mutex_lock(&status_mutex);
+
+        free(entry->uname);
+        memset(entry, 0, sizeof(agent_status));
+        strncpy(entry->id, keys.keyentries[agentid]->id, KEYSIZE);
+
+        pthread_mutex_unlock(&status_mutex);
+    }
+
+    return (entry);
+}
+
+/* Account a message from an agent (the keys must be locked). Any
+ * receiver may do it, so the entry is updated atomically.
+ */
+void status_message(unsigned int agentid, time_t now)
+{
+    agent_status *entry = status_entry(agentid);
+
+    __sync_lock_test_and_set(&entry->seen, now);
+    __sync_fetch_and_add(&entry->messages, 1);
+}
+
+/* Account a control message from an agent (the keys must be locked):
+ * the uname, then a "<sum> <file>" line per shared file
+ * Returns 1 if the uname changed
+ */
+int status_keepalive(unsigned int agentid, const char *msg)
+{
+    agent_status *entry = status_entry(agentid);
+    const char *end;
+    const char *line;
+    size_t len;
+    int changed = 0;
+
+    __sync_lock_test_and_set(&entry->keepalive, time(0));
+    __sync_fetch_and_add(&entry->keepalives, 1);
+
+    if (!msg) {
+        return (0);
+    }
+
+    if ((end = strchr(msg, '\n')) == NULL) {
+        end = msg + strlen(msg);
+    }
+    len = (size_t)(end - msg);
+
+    pthread_mutex_lock(&status_mutex);
+
+    if (!entry->uname || strncmp(entry->uname, msg, len) != 0 ||
+            entry->uname[len] != '\0') {
+        free(entry->uname);
+        os_calloc(len + 1, sizeof(char), entry->uname);
+        memcpy(entry->uname, msg, len);
+        changed = 1;
+    }
+
+    /* Sum of the merged file */
+    for (line = end; *line == '\n'; line = end) {
+        line++;
+        if ((end = strchr(line, '\n')) == NULL) {
+            end = line + strlen(line);
+        }
+
+        len = strlen(SHAREDCFG_FILENAME);
+        if (end - line == 32 + 1 + (long)len && line[32] == ' ' &&
+                strncmp(line + 33, SHAREDCFG_FILENAME, len) == 0) {
+            memcpy(entry->merged_sum, line, 32);
+            entry->merged_sum[32] = '\0';
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&status_mutex);
+
+    return (changed);
+}
+
+/* Account an active response to an agent (the keys must be locked) */
+void status_ar(unsigned int agentid, int result)
+{
+    agent_status *entry = status_entry(agentid);
+
+    pthread_mutex_lock(&status_mutex);
+
+    if (result == AR_SENT) {
+        entry->ar_sent++;
+        entry->ar_last = time(0);
+    } else if (result == AR_SKIPPED) {
+        entry->ar_skipped++;
+    } else {
+        entry->ar_failed++;
+    }
+
+    pthread_mutex_unlock(&status_mutex);
+}
+
+/* Print the status of the agents (or of one), a line each:
+ * "<id> <name> <ip> <keepalive> <seen> <messages> <keepalives> <merged sum> <uname>"
+ * The keys and the table must be locked.
+ */
+static void status_print(FILE *fp, const char *id)
+{
+    unsigned int i;
+    agent_status *entry;
+
+    fprintf(fp, "# agents %ld\n", (long)time(0));
+
+    for (i = 0; i < keys.keysize; i++) {
+        entry = &status[i];
+
+        if (strcmp(entry->id, keys.keyentries[i]->id) != 0 ||
+                (id && strcmp(id, entry->id) != 0)) {
+            continue;
+        }
+
+        fprintf(fp, "%s %s %s %ld %ld %lu %lu %s %s\n", entry->id,
+                keys.keyentries[i]->name, keys.keyentries[i]->ip->ip,
+                (long)entry->keepalive, (long)entry->seen, entry->messages,
+                entry->keepalives, entry->merged_sum[0] ? entry->merged_sum : "-",
+                entry->uname ? entry->uname : "");
+    }
+}
+
+/* Print the active responses of the agents, a line each:
+ * "<id> <name> <sent> <not connected> <failed> <last sent>"
+ * The keys and the table must be locked.
+ */
+static void status_print_ar(FILE *fp)
+{
+    unsigned int i;
+    agent_status *entry;
+
+    fprintf(fp, "# ar %ld\n", (long)time(0));
+
+    for (i = 0; i < keys.keysize; i++) {
+        entry = &status[i];
+
+        if (strcmp(entry->id, keys.keyentries[i]->id) != 0 ||
+                (entry->ar_sent == 0 && entry->ar_skipped == 0 && entry->ar_failed == 0)) {
+            continue;
+        }
+
+        fprintf(fp, "%s %s %lu %lu %lu %ld\n", entry->id, keys.keyentries[i]->name,
+                entry->ar_sent, entry->ar_skipped, entry->ar_failed, (long)entry->ar_last);
+    }
+}
+
+/* Load the last snapshot. Returns the number of agents */
+static int status_load()
+{
+    FILE *fp;
+    char buf[OS_MAXSTR + 1];
+    char id[KEYSIZE + 1];
+    char sum[33];
+    long keepalive;
+    long seen;
+    unsigned long messages;
+    unsigned long keepalives;
+    agent_status *entry;
+    int agentid;
+    int uname;
+    int count = 0;
+
+    if ((fp = fopen(AGENTSTATUS_FILE, "r")) == NULL) {
+        return (0);
+    }
+
+    while (fgets(buf, OS_MAXSTR, fp)) {
+        char *nl;
+
+        if ((nl = strchr(buf, '\n')) != NULL) {
+            *nl = '\0';
+        }
+
+        uname = 0;
+        if (buf[0] == '#' ||
+                sscanf(buf, "%128s %*s %*s %ld %ld %lu %lu %32s %n",
+                       id, &keepalive, &seen, &messages, &keepalives, sum, &uname) < 6 ||
+                uname == 0) {
+            continue;
+        }
+
+        if ((agentid = OS_IsAllowedID(&keys, id)) < 0) {
+            continue;
+        }
+
+        entry = status_entry((unsigned int)agentid);
+        entry->keepalive = (time_t)keepalive;
+        entry->seen = (time_t)seen;
+        entry->messages = messages;
+        entry->keepalives = keepalives;
+        if (strcmp(sum, "-") != 0) {
+            snprintf(entry->merged_sum, sizeof(entry->merged_sum), "%s", sum);
+        }
+        os_strdup(buf + uname, entry->uname);
+        count++;
+    }
+
+    fclose(fp);
+    return (count);
+}
+
+/* Write a snapshot of the table. Returns -1 on error */
+static int status_save()
+{
+    FILE *fp;
+    int ret = 0;
+
+    if ((fp = fopen(AGENTSTATUS_FILE ".tmp", "w")) == NULL) {
+        merror(FOPEN_ERROR, ARGV0, AGENTSTATUS_FILE ".tmp", errno, strerror(errno));
+        return (-1);
+    }
+
+    key_rdlock();
+    pthread_mutex_lock(&status_mutex);
+
+    status_print(fp, NULL);
+
+    pthread_mutex_unlock(&status_mutex);
+    key_unlock();
+
+    if (fclose(fp) != 0) {
+        ret = -1;
+    } else if (rename(AGENTSTATUS_FILE ".tmp", AGENTSTATUS_FILE) < 0) {
+        merror(RENAME_ERROR, ARGV0, AGENTSTATUS_FILE ".tmp", AGENTSTATUS_FILE,
+               errno, strerror(errno));
+        ret = -1;
+    }
+
+    return (ret);
+}
+
+/* Write the snapshots */
+static void *status_thread(__attribute__((unused)) void *none)
+{
+    while (1) {
+        sleep((unsigned int)status_interval);
+        status_save();
+    }
+}
+
+/* Commands of the control socket */
+static void status_control(const char *command, FILE *reply)
+{
+    if (strcmp(command, "agents") == 0 ||
+            strncmp(command, "agent ", 6) == 0) {
+        key_rdlock();
+        pthread_mutex_lock(&status_mutex);
+
+        status_print(reply, command[5] == ' ' ? command + 6 : NULL);
+
+        pthread_mutex_unlock(&status_mutex);
+        key_unlock();
+        return;
+    }
+
+    if (strcmp(command, "ar") == 0) {
+        key_rdlock();
+        pthread_mutex_lock(&status_mutex);
+
+        status_print_ar(reply);
+
+        pthread_mutex_unlock(&status_mutex);
+        key_unlock();
+        return;
+    }
+
+    if (strcmp(command, "flow") == 0) {
+        key_rdlock();
+        flow_print(reply);
+        key_unlock();
+        return;
+    }
+
+    fprintf(reply, "Unknown command '%s'. Available: agents, agent <id>, ar, flow, metrics.\n", command);
+}
+
+/* Start the status table (the keys must be loaded) */
+void status_init()
+{
+    int count;
+
+    status_interval = getDefine_Int("remoted", "status_interval", 1, 3600);
+
+    key_rdlock();
+    count = status_load();
+    key_unlock();
+
+    debug1("%s: DEBUG: Status of %d agents loaded.", ARGV0, count);
+
+    if (OS_StartControl(CONTROL_DIR "/" ARGV0, status_control) < 0) {
+        merror("%s: ERROR: Unable to start the control socket.", ARGV0);
+    }
+
+    if (CreateThread(status_thread, (void *)NULL) != 0) {
+        merror(THREAD_ERROR, ARGV0);
+    }
+}
@@ -11,8 +11,46 @@
 #include "os_net/os_net.h"
 #include "remoted.h"
 
+#include <sys/uio.h>
+
+/* Datagrams received per call */
+#define SYSLOG_BATCH        OS_DGRAM_BATCH
+
+/* Receive buffer asked for the syslog socket (the kernel may cap it) */
+#define SYSLOG_RCVBUF       (8 * 1024 * 1024)
+
+/* Seconds between the source reports */
+#define SYSLOG_REPORT       60
+
+/* Size of a message for the queue: "<queue>:<srcip>:<message>" */
+#define SYSLOG_QMSG_SIZE    (OS_SIZE_1024 + IPSIZE + 4)
+
+/* Maximum number of sources accounted */
+#define SYSLOG_MAX_SOURCES  65536
+
+/* Messages received from a source */
+typedef struct _syslog_source {
+    time_t second;              /* Second being counted */
+    unsigned int count;         /* Messages in that second */
+    unsigned int dropped;       /* Over the rate limit, since the last report */
+    unsigned int denied;        /* Not allowed, since the last report */
+    unsigned int total;         /* Messages since the last report */
+} syslog_source;
+
 /* Prototypes */
 static int OS_IPNotAllowed(const char *srcip);
+static int SyslogNotAllowed(const OSDgram *dgram, const char *srcip);
+static syslog_source *GetSource(const char *srcip);
+static int ReportSource(char *srcip, syslog_source *source);
+
+/* Compiled allow/deny lists (NULL if not compiled) */
+static os_iptree *allow_tree = NULL;
+static os_iptree *deny_tree = NULL;
+
+/* Sources */
+static OSHash *sources = NULL;
+static unsigned int n_sources = 0;
+static unsigned int rate_limit = 0;
 
 
 /* Check if an IP is not allowed */
@@ -33,21 +71,127 @@ static int OS_IPNotAllowed(const char *srcip)
     return (1);
 }
 
+/* Check if the sender of a datagram is not allowed */
+static int SyslogNotAllowed(const OSDgram *dgram, const char *srcip)
+{
+    unsigned int addr;
+
+    if (dgram->peer.ss_family != AF_INET ||
+            (logr.denyips && !deny_tree) || (logr.allowips && !allow_tree)) {
+        return (OS_IPNotAllowed(srcip));
+    }
+
+    addr = ((const struct sockaddr_in *)&dgram->peer)->sin_addr.s_addr;
+
+    if (deny_tree && OS_IPTreeFound(deny_tree, addr)) {
+        return (1);
+    }
+    if (allow_tree && OS_IPTreeFound(allow_tree, addr)) {
+        return (0);
+    }
+
+    return (1);
+}
+
+/* Get (or create) the entry of a source. NULL if there are too many */
+static syslog_source *GetSource(const char *srcip)
+{
+    syslog_source *source;
+
+    if ((source = (syslog_source *) OSHash_Get(sources, srcip)) != NULL) {
+        return (source);
+    }
+
+    if (n_sources >= SYSLOG_MAX_SOURCES) {
+        return (NULL);
+    }
+
+    os_calloc(1, sizeof(syslog_source), source);
+    if (OSHash_Add(sources, srcip, source) != 2) {
+        free(source);
+        return (NULL);
+    }
+
+    n_sources++;
+    return (source);
+}
+
+/* Report the messages dropped from a source and forget the idle ones */
+static int ReportSource(char *srcip, syslog_source *source)
+{
+    if (source->dropped) {
+        merror("%s: WARN: Syslog rate limit (%u msgs/sec) exceeded by '%s'. "
+               "%u of %u messages dropped in the last %d seconds.", ARGV0,
+               rate_limit, srcip, source->dropped, source->total, SYSLOG_REPORT);
+    }
+
+    if (source->denied) {
+        merror(DENYIP_WARN " (%u messages)", ARGV0, srcip, source->denied);
+    }
+
+    debug1("%s: DEBUG: Syslog source '%s': %u messages.", ARGV0, srcip, source->total);
+
+    if (source->total == 0 && source->denied == 0) {
+        free(srcip);
+        free(source);
+        n_sources--;
+        return (-1);
+    }
+
+    source->dropped = 0;
+    source->denied = 0;
+    source->total = 0;
+    return (0);
+}
+
 /* Handle syslog connections */
 void HandleSyslog()
 {
-    char buffer[OS_SIZE_1024 + 2];
+    OSDgram dgrams[SYSLOG_BATCH];
+    OSDgram qmsgs[SYSLOG_BATCH];
+    unsigned int n_qmsgs;
     char srcip[IPSIZE + 1];
+    char *buffer;
     char *buffer_pt = NULL;
-    ssize_t recv_b;
-    struct sockaddr_in peer_info;
-    socklen_t peer_size;
+    syslog_source *source;
+    time_t now;
+    time_t last_report;
+    int recv_b;
+    int rcvbuf = SYSLOG_RCVBUF;
+    int count;
+    int i;
+
+    rate_limit = (unsigned int) getDefine_Int("remoted", "syslog_rate_limit", 0, 1000000);
+
+    /* Compile the allow and deny lists. If a list has a netmask that
+     * is not a prefix, it is checked one entry at a time.
+     */
+    if (logr.allowips && !(allow_tree = OS_IPTreeCompile(logr.allowips))) {
+        verbose("%s: INFO: Allowed syslog IPs can not be compiled.", ARGV0);
+    }
+    if (logr.denyips && !(deny_tree = OS_IPTreeCompile(logr.denyips))) {
+        verbose("%s: INFO: Denied syslog IPs can not be compiled.", ARGV0);
+    }
 
-    /* Set peer size */
-    peer_size = sizeof(peer_info);
+    if ((sources = OSHash_Create()) == NULL) {
+        ErrorExit(MEM_ERROR, ARGV0, errno, strerror(errno));
+    }
+
+    /* Make room for bursts */
+    if (setsockopt(logr.sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0) {
+        merror("%s: WARN: Unable to set the syslog receive buffer: %s",
+               ARGV0, strerror(errno));
+    }
 
-    /* Initialize some variables */
-    memset(buffer, '\0', OS_SIZE_1024 + 2);
+    memset(dgrams, 0, sizeof(dgrams));
+    memset(qmsgs, 0, sizeof(qmsgs));
+
+    for (i = 0; i < SYSLOG_BATCH; i++) {
+        os_malloc(OS_SIZE_1024 + 2, dgrams[i].buf);
+        dgrams[i].size = OS_SIZE_1024;
+        os_malloc(SYSLOG_QMSG_SIZE, qmsgs[i].buf);
+        qmsgs[i].size = SYSLOG_QMSG_SIZE;
+    }
 
     /* Connect to the message queue
      * Exit if it fails.
@@ -56,53 +200,128 @@ void HandleSyslog()
         ErrorExit(QUEUE_FATAL, ARGV0, DEFAULTQUEUE);
     }
 
+    last_report = time(NULL);
+
     /* Infinite loop */
     while (1) {
-        /* Receive message */
-        recv_b = recvfrom(logr.sock, buffer, OS_SIZE_1024, 0,
-                          (struct sockaddr *)&peer_info, &peer_size);
-
-        /* Nothing received */
-        if (recv_b <= 0) {
+        /* Receive messages */
+        if ((count = OS_RecvUDPBatch(logr.sock, dgrams, SYSLOG_BATCH)) <= 0) {
             continue;
         }
 
-        /* Null-terminate the message */
-        buffer[recv_b] = '\0';
+        now = time(NULL);
+        n_qmsgs = 0;
 
-        /* Remove newline */
-        if (buffer[recv_b - 1] == '\n') {
-            buffer[recv_b - 1] = '\0';
-        }
+        for (i = 0; i < count; i++) {
+            buffer = dgrams[i].buf;
+            recv_b = (int)dgrams[i].len;
+
+            /* Nothing received */
+            if (recv_b <= 0) {
+                continue;
+            }
+
+            /* Null-terminate the message */
+            buffer[recv_b] = '\0';
+
+            /* Remove newline */
+            if (buffer[recv_b - 1] == '\n') {
+                buffer[recv_b - 1] = '\0';
+            }
+
+            /* Set the source IP */
+            if (dgrams[i].peer.ss_family == AF_INET6) {
+                if (!inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&dgrams[i].peer)->sin6_addr,
+                               srcip, sizeof(srcip))) {
+                    continue;
+                }
+            } else if (!inet_ntop(AF_INET, &((struct sockaddr_in *)&dgrams[i].peer)->sin_addr,
+                                  srcip, sizeof(srcip))) {
+                continue;
+            }
+
+            source = GetSource(srcip);
+
+            /* Check if IP is allowed here */
+            if (SyslogNotAllowed(&dgrams[i], srcip)) {
+                if (!source || source->denied++ == 0) {
+                    merror(DENYIP_WARN, ARGV0, srcip);
+                }
+                continue;
+            }
+
+            /* Rate accounting */
+            if (source) {
+                source->total++;
 
-        /* Set the source IP */
-        strncpy(srcip, inet_ntoa(peer_info.sin_addr), IPSIZE);
-        srcip[IPSIZE] = '\0';
+                if (source->second != now) {
+                    source->second = now;
+                    source->count = 0;
+                }
 
-        /* Remove syslog header */
-        if (buffer[0] == '<') {
-            buffer_pt = strchr(buffer + 1, '>');
-            if (buffer_pt) {
-                buffer_pt++;
+                if (rate_limit && ++source->count > rate_limit) {
+                    source->dropped++;
+                    continue;
+                }
+            }
+
+            /* Remove syslog header */
+            if (buffer[0] == '<') {
+                buffer_pt = strchr(buffer + 1, '>');
+                if (buffer_pt) {
+                    buffer_pt++;
+                } else {
+                    buffer_pt = buffer;
+                }
             } else {
                 buffer_pt = buffer;
             }
-        } else {
-            buffer_pt = buffer;
-        }
 
-        /* Check if IP is allowed here */
-        if (OS_IPNotAllowed(srcip)) {
-            merror(DENYIP_WARN, ARGV0, srcip);
+            /* Same format as SendMSG */
+            qmsgs[n_qmsgs].len = (size_t)snprintf(qmsgs[n_qmsgs].buf, SYSLOG_QMSG_SIZE,
+                                                  "%c:%s:%s", SYSLOG_MQ, srcip, buffer_pt) + 1;
+            if (qmsgs[n_qmsgs].len > SYSLOG_QMSG_SIZE) {
+                qmsgs[n_qmsgs].len = SYSLOG_QMSG_SIZE;
+            }
+            n_qmsgs++;
         }
 
-        else if (SendMSG(logr.m_queue, buffer_pt, srcip,
-                         SYSLOG_MQ) < 0) {
-            merror(QUEUE_ERROR, ARGV0, DEFAULTQUEUE, strerror(errno));
-            if ((logr.m_queue = StartMQ(DEFAULTQUEUE, READ)) < 0) {
-                ErrorExit(QUEUE_FATAL, ARGV0, DEFAULTQUEUE);
+        /* Send all the messages to the queue at once */
+        if (n_qmsgs > 0) {
+            unsigned int sent = 0;
+
+            os_wait();
+
+            /* Shared memory ring. It does not wait for room: once it is
+             * full (or gone) the rest of the batch goes to the socket.
+             */
+            if (MQ_ShmAttached(logr.m_queue)) {
+                while (sent < n_qmsgs) {
+                    struct iovec iov;
+
+                    iov.iov_base = qmsgs[sent].buf;
+                    iov.iov_len = qmsgs[sent].len - 1;
+                    if (MQ_ShmSend(logr.m_queue, &iov, 1, 0) != 0) {
+                        break;
+                    }
+                    sent++;
+                }
             }
+
+            if (sent < n_qmsgs &&
+                    OS_SendUDPBatch(logr.m_queue, qmsgs + sent, n_qmsgs - sent) < 0) {
+                merror(QUEUE_ERROR, ARGV0, DEFAULTQUEUE, strerror(errno));
+                MQ_ShmDetach(logr.m_queue);
+                close(logr.m_queue);
+                if ((logr.m_queue = StartMQ(DEFAULTQUEUE, WRITE)) < 0) {
+                    ErrorExit(QUEUE_FATAL, ARGV0, DEFAULTQUEUE);
+                }
+            }
+        }
+
+        if (now - last_report >= SYSLOG_REPORT) {
+            OSHash_ForEach(sources, (OSHash_Function) &ReportSource);
+            last_report = now;
         }
     }
 }
-
@@ -7,13 +7,80 @@
  * Foundation
  */
 
+/* Syslog TCP server
+ * All the clients are handled by a single process, waiting for events
+ * with epoll (poll on other systems). Each client has its own buffer
+ * and the messages may be framed by newlines or by octet counting
+ * (RFC 6587), as found in the first frame of the connection. When
+ * analysisd is not keeping up, we stop reading from the clients until
+ * the queue has room again. The frames left by a client that went away
+ * are forwarded from the loop too, before it is freed.
+ */
+
 #include "shared.h"
 #include "os_net/os_net.h"
 #include "remoted.h"
 
+#include <poll.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#define SYSLOG_EPOLL
+#endif
+
+/* Size of the buffer of each client */
+#define SYSLOG_TCP_BUFFER   (OS_MAXSTR * 2)
+
+/* Events handled per wait */
+#define SYSLOG_TCP_EVENTS   64
+
+/* How long to wait for the queue when it is full (milliseconds) */
+#define SYSLOG_TCP_QWAIT    100
+
+/* Framing of the messages of a client */
+#define SYSLOG_FRAME_UNKNOWN    0
+#define SYSLOG_FRAME_NEWLINE    1
+#define SYSLOG_FRAME_OCTET      2
+
+/* Syslog TCP client */
+typedef struct _syslog_client {
+    int sock;                   /* -1 once the connection is closed */
+    unsigned int slot;          /* Position in the client list */
+    int framing;
+    char srcip[IPSIZE + 1];
+    char *buffer;               /* Data received and not forwarded yet */
+    size_t start;               /* First byte to be processed */
+    size_t len;                 /* Bytes in the buffer */
+} syslog_client;
+
+/* Clients connected */
+static syslog_client **clients = NULL;
+static unsigned int max_clients = 0;
+static unsigned int n_clients = 0;
+
+#ifdef SYSLOG_EPOLL
+static int epoll_fd = -1;
+#else
+static struct pollfd *poll_fds = NULL;
+#endif
+
+static int OS_IPNotAllowed(const char *srcip);
+static int AddClient(int sock, const char *srcip);
+static void CloseClient(syslog_client *client);
+static void RemoveClient(syslog_client *client);
+static void AcceptClients(void);
+static int ReadClient(syslog_client *client);
+static int OctetCount(const char *data, size_t size, size_t *msg_len);
+static int FrameType(const char *data, size_t size);
+static int ForwardFrames(syslog_client *client);
+static int ForwardMessage(char *msg, const char *srcip, int framing);
+static int DrainClient(syslog_client *client);
+static int FlushClients(void);
+static void WaitQueue(void);
+
 
 /* Checks if an IP is not allowed */
-static int OS_IPNotAllowed(char *srcip)
+static int OS_IPNotAllowed(const char *srcip)
 {
     if (logr.denyips != NULL) {
         if (OS_IPFoundList(srcip, logr.denyips)) {
@@ -30,119 +97,391 @@ static int OS_IPNotAllowed(char *srcip)
     return (1);
 }
 
-/* Handle each client */
-static void HandleClient(int client_socket, char *srcip)
+/* Set a socket in non-blocking mode */
+static int SetNonBlock(int sock)
 {
-    int sb_size = OS_MAXSTR;
-    int r_sz = 0;
+    int flags;
+
+    if ((flags = fcntl(sock, F_GETFL, 0)) < 0) {
+        return (-1);
+    }
 
-    char buffer[OS_MAXSTR + 2];
-    char storage_buffer[OS_MAXSTR + 2];
-    char tmp_buffer[OS_MAXSTR + 2];
+    return (fcntl(sock, F_SETFL, flags | O_NONBLOCK));
+}
 
-    char *buffer_pt = NULL;
+/* Add a client to the list. Returns 0 on success or -1 on error */
+static int AddClient(int sock, const char *srcip)
+{
+    unsigned int i;
+    syslog_client *client;
 
-    /* Create PID file */
-    if (CreatePID(ARGV0, getpid()) < 0) {
-        ErrorExit(PID_ERROR, ARGV0);
+    if (n_clients >= max_clients) {
+        merror("%s: WARN: Too many syslog TCP clients (%u). "
+               "Rejecting '%s'.", ARGV0, max_clients, srcip);
+        return (-1);
     }
 
-    /* Initialize some variables */
-    memset(buffer, '\0', OS_MAXSTR + 2);
-    memset(storage_buffer, '\0', OS_MAXSTR + 2);
-    memset(tmp_buffer, '\0', OS_MAXSTR + 2);
+    if (SetNonBlock(sock) < 0) {
+        merror("%s: ERROR: Unable to set socket of '%s' non-blocking: %s",
+               ARGV0, srcip, strerror(errno));
+        return (-1);
+    }
 
+    for (i = 0; clients[i]; i++);
 
-    while (1) {
-        /* If we fail, we need to return and close the socket */
-        if ((r_sz = OS_RecvTCPBuffer(client_socket, buffer, OS_MAXSTR - 2)) < 0) {
-            close(client_socket);
-            DeletePID(ARGV0);
-            return;
+    os_calloc(1, sizeof(syslog_client), client);
+    os_malloc(SYSLOG_TCP_BUFFER + 1, client->buffer);
+    client->sock = sock;
+    client->slot = i;
+    snprintf(client->srcip, sizeof(client->srcip), "%s", srcip);
+
+#ifdef SYSLOG_EPOLL
+    {
+        struct epoll_event event;
+
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = client;
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &event) < 0) {
+            merror("%s: ERROR: epoll_ctl failed for '%s': %s",
+                   ARGV0, srcip, strerror(errno));
+            free(client->buffer);
+            free(client);
+            return (-1);
         }
+    }
+#else
+    /* Slot 0 is the listening socket */
+    poll_fds[i + 1].fd = sock;
+    poll_fds[i + 1].events = POLLIN;
+#endif
 
-        /* We must have a new line at the end */
-        buffer_pt = strchr(buffer, '\n');
-        if (!buffer_pt) {
-            /* Buffer is full */
-            if ((sb_size - r_sz) <= 2) {
-                merror("%s: Full buffer receiving from: '%s'", ARGV0, srcip);
-                sb_size = OS_MAXSTR;
-                storage_buffer[0] = '\0';
-                continue;
+    clients[i] = client;
+    n_clients++;
+
+    debug1("%s: DEBUG: New syslog TCP client '%s' (%u connected).",
+           ARGV0, srcip, n_clients);
+    return (0);
+}
+
+/* Close a client connection. Its frames are kept to be forwarded */
+static void CloseClient(syslog_client *client)
+{
+    if (client->sock < 0) {
+        return;
+    }
+
+#ifdef SYSLOG_EPOLL
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->sock, NULL);
+#else
+    poll_fds[client->slot + 1].fd = -1;
+#endif
+
+    close(client->sock);
+    client->sock = -1;
+}
+
+/* Close a client connection and free it */
+static void RemoveClient(syslog_client *client)
+{
+    CloseClient(client);
+    clients[client->slot] = NULL;
+    n_clients--;
+
+    debug1("%s: DEBUG: Syslog TCP client '%s' disconnected.",
+           ARGV0, client->srcip);
+
+    free(client->buffer);
+    free(client);
+}
+
+/* Accept all the pending connections */
+static void AcceptClients()
+{
+    char srcip[IPSIZE + 1];
+    int client_socket;
+
+    while (1) {
+        if ((client_socket = OS_AcceptTCP(logr.sock, srcip, IPSIZE)) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                merror("%s: WARN: Accepting tcp connection from client failed.", ARGV0);
             }
+            return;
+        }
 
-            strncat(storage_buffer, buffer, sb_size);
-            sb_size -= r_sz;
+        /* Check if IP is allowed here */
+        if (OS_IPNotAllowed(srcip)) {
+            merror(DENYIP_WARN, ARGV0, srcip);
+            close(client_socket);
             continue;
         }
 
-        /* See if we received more than just one message */
-        if (*(buffer_pt + 1) != '\0') {
-            *buffer_pt = '\0';
-            buffer_pt++;
-            strncpy(tmp_buffer, buffer_pt, OS_MAXSTR);
+        if (AddClient(client_socket, srcip) < 0) {
+            close(client_socket);
         }
+    }
+}
 
-        /* Store everything in the storage_buffer
-         * Check if buffer will be full
-         */
-        if ((sb_size - r_sz) <= 2) {
-            merror("%s: Full buffer receiving from: '%s'.", ARGV0, srcip);
-            sb_size = OS_MAXSTR;
-            storage_buffer[0] = '\0';
-            tmp_buffer[0] = '\0';
-            continue;
+/* Read from a client. Returns -1 if the connection must be closed */
+static int ReadClient(syslog_client *client)
+{
+    ssize_t r_sz;
+
+    if (client->len - client->start >= SYSLOG_TCP_BUFFER) {
+        return (0);
+    }
+
+    /* Move the pending data to the beginning of the buffer */
+    if (client->start > 0) {
+        client->len -= client->start;
+        memmove(client->buffer, client->buffer + client->start, client->len);
+        client->start = 0;
+    }
+
+    r_sz = recv(client->sock, client->buffer + client->len,
+                SYSLOG_TCP_BUFFER - client->len, 0);
+
+    if (r_sz < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return (0);
         }
+        return (-1);
+    } else if (r_sz == 0) {
+        return (-1);
+    }
+
+    client->len += (size_t)r_sz;
+    return (0);
+}
 
-        strncat(storage_buffer, buffer, sb_size);
+/* Framing of a connection, from its first frame: octet counting if
+ * it starts with a length and a syslog message ("<length> <PRI>...")
+ * and newlines otherwise. Returns SYSLOG_FRAME_UNKNOWN if more data
+ * is needed.
+ */
+static int FrameType(const char *data, size_t size)
+{
+    size_t msg_len;
+    int hdr;
 
-        /* Remove carriage returns too */
-        buffer_pt = strchr(storage_buffer, '\r');
-        if (buffer_pt) {
-            *buffer_pt = '\0';
+    if ((hdr = OctetCount(data, size, &msg_len)) < 0) {
+        return (SYSLOG_FRAME_NEWLINE);
+    } else if (hdr == 0 || size <= (size_t)hdr) {
+        return (memchr(data, '\n', size) ? SYSLOG_FRAME_NEWLINE : SYSLOG_FRAME_UNKNOWN);
+    }
+
+    return (data[hdr] == '<' ? SYSLOG_FRAME_OCTET : SYSLOG_FRAME_NEWLINE);
+}
+
+/* Get the length of an octet-counted frame (RFC 6587): "<length> <msg>"
+ * Returns the length of the header (including the space) and sets
+ * msg_len, 0 if more data is needed or -1 if this is not a valid header.
+ */
+static int OctetCount(const char *data, size_t size, size_t *msg_len)
+{
+    size_t i;
+    size_t count = 0;
+
+    if (data[0] < '1' || data[0] > '9') {
+        return (-1);
+    }
+
+    for (i = 0; i < size && i < 6; i++) {
+        if (data[i] == ' ') {
+            if (count > OS_MAXSTR) {
+                return (-1);
+            }
+
+            *msg_len = count;
+            return ((int)i + 1);
+        } else if (!isdigit((int)data[i])) {
+            return (-1);
         }
 
-        /* Remove syslog header */
-        if (storage_buffer[0] == '<') {
-            buffer_pt = strchr(storage_buffer + 1, '>');
-            if (buffer_pt) {
-                buffer_pt++;
-            } else {
-                buffer_pt = storage_buffer;
+        count = count * 10 + (size_t)(data[i] - '0');
+    }
+
+    return (i < 6 ? 0 : -1);
+}
+
+/* Forward the complete frames of a client to the queue
+ * Returns 1 if the queue is full (the frame is kept) and 0 otherwise.
+ */
+static int ForwardFrames(syslog_client *client)
+{
+    char *data;
+    char *end;
+    char saved;
+    size_t size;
+    size_t msg_len = 0;
+    int hdr;
+    int rc;
+
+    while (client->start < client->len) {
+        data = client->buffer + client->start;
+        size = client->len - client->start;
+
+        if (client->framing == SYSLOG_FRAME_UNKNOWN &&
+                (client->framing = FrameType(data, size)) == SYSLOG_FRAME_UNKNOWN) {
+            break;
+        }
+
+        /* Octet counting */
+        if (client->framing == SYSLOG_FRAME_OCTET) {
+            if ((hdr = OctetCount(data, size, &msg_len)) < 0) {
+                merror("%s: WARN: Invalid octet counting from '%s'. Closing the connection.",
+                       ARGV0, client->srcip);
+                client->start = client->len = 0;
+                CloseClient(client);
+                break;
+            } else if (hdr == 0 || size < (size_t)hdr + msg_len) {
+                break;
             }
-        } else {
-            buffer_pt = storage_buffer;
+
+            end = data + hdr + msg_len;
+            data += hdr;
         }
 
-        /* Send to the queue */
-        if (SendMSG(logr.m_queue, buffer_pt, srcip, SYSLOG_MQ) < 0) {
-            merror(QUEUE_ERROR, ARGV0, DEFAULTQUEUE, strerror(errno));
-            if ((logr.m_queue = StartMQ(DEFAULTQUEUE, WRITE)) < 0) {
-                ErrorExit(QUEUE_FATAL, ARGV0, DEFAULTQUEUE);
+        /* Newline framing */
+        else {
+            hdr = 0;
+            if ((end = (char *) memchr(data, '\n', size)) == NULL) {
+                if (size >= OS_MAXSTR) {
+                    merror("%s: Full buffer receiving from: '%s'", ARGV0, client->srcip);
+                    client->start = client->len = 0;
+                }
+                break;
             }
         }
 
-        /* Clean up the buffers */
-        if (tmp_buffer[0] != '\0') {
-            strncpy(storage_buffer, tmp_buffer, OS_MAXSTR);
-            sb_size = OS_MAXSTR - (strlen(storage_buffer) + 1);
-            tmp_buffer[0] = '\0';
-        } else {
-            storage_buffer[0] = '\0';
-            sb_size = OS_MAXSTR;
+        /* The buffer has room for the terminator after the last byte */
+        saved = *end;
+        *end = '\0';
+        rc = ForwardMessage(data, client->srcip, client->framing);
+        *end = saved;
+
+        if (rc == 1) {
+            return (1);
         }
+
+        client->start = (size_t)(end - client->buffer) + (hdr > 0 ? 0 : 1);
+    }
+
+    if (client->start == client->len) {
+        client->start = client->len = 0;
+    }
+
+    return (0);
+}
+
+/* Send a syslog message to the queue
+ * Returns 1 if the queue is full and 0 otherwise.
+ */
+static int ForwardMessage(char *msg, const char *srcip, int framing)
+{
+    char *pt;
+    size_t len;
+    int rc;
+
+    if (framing == SYSLOG_FRAME_OCTET) {
+        /* The message may span several lines (a stack trace): keep them
+         * all, on one line
+         */
+        len = strlen(msg);
+        while (len > 0 && (msg[len - 1] == '\r' || msg[len - 1] == '\n')) {
+            msg[--len] = '\0';
+        }
+
+        for (pt = msg; (pt = strpbrk(pt, "\r\n")) != NULL; pt++) {
+            *pt = ' ';
+        }
+    }
+
+    /* Remove carriage returns too */
+    else if ((pt = strpbrk(msg, "\r\n")) != NULL) {
+        *pt = '\0';
+    }
+
+    /* Remove syslog header */
+    if (msg[0] == '<') {
+        if ((pt = strchr(msg + 1, '>')) != NULL) {
+            msg = pt + 1;
+        }
+    }
+
+    if ((rc = TrySendMSG(logr.m_queue, msg, srcip, SYSLOG_MQ)) < 0) {
+        merror(QUEUE_ERROR, ARGV0, DEFAULTQUEUE, strerror(errno));
+        MQ_ShmDetach(logr.m_queue);
+        close(logr.m_queue);
+        if ((logr.m_queue = StartMQ(DEFAULTQUEUE, WRITE)) < 0) {
+            ErrorExit(QUEUE_FATAL, ARGV0, DEFAULTQUEUE);
+        }
+        return (0);
+    }
+
+    return (rc);
+}
+
+/* Forward the frames of a client, and free it once a closed client
+ * has nothing left. Returns 1 if the queue is full.
+ */
+static int DrainClient(syslog_client *client)
+{
+    if (ForwardFrames(client)) {
+        return (1);
+    }
+
+    if (client->sock < 0) {
+        RemoveClient(client);
+    }
+
+    return (0);
+}
+
+/* Forward the frames pending on all the clients
+ * Returns 1 if the queue is still full.
+ */
+static int FlushClients()
+{
+    unsigned int i;
+
+    for (i = 0; i < max_clients; i++) {
+        if (clients[i] && (clients[i]->len > 0 || clients[i]->sock < 0) &&
+                DrainClient(clients[i])) {
+            return (1);
+        }
+    }
+
+    return (0);
+}
+
+/* Wait until the queue can take more messages (or a timeout) */
+static void WaitQueue()
+{
+    struct pollfd pfd;
+
+    if (MQ_ShmWait(logr.m_queue, SYSLOG_TCP_QWAIT) == 0) {
+        return;
     }
+
+    pfd.fd = logr.m_queue;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+
+    poll(&pfd, 1, SYSLOG_TCP_QWAIT);
 }
 
 /* Handle syslog TCP connections */
 void HandleSyslogTCP()
 {
-    int childcount = 0;
-    char srcip[IPSIZE + 1];
+    syslog_client *client;
+    int queue_full = 0;
+    int n_events;
+    int i;
 
-    /* Initialize some variables */
-    memset(srcip, '\0', IPSIZE + 1);
+    max_clients = (unsigned int) getDefine_Int("remoted", "syslog_tcp_clients", 1, 65536);
+    os_calloc(max_clients, sizeof(syslog_client *), clients);
 
     /* Connecting to the message queue
      * Exit if it fails.
@@ -151,48 +490,99 @@ void HandleSyslogTCP()
         ErrorExit(QUEUE_FATAL, ARGV0, DEFAULTQUEUE);
     }
 
-    while (1) {
-        /* Wait for the children */
-        while (childcount) {
-            int wp;
-            wp = waitpid((pid_t) - 1, NULL, WNOHANG);
-            if (wp < 0) {
-                merror(WAITPID_ERROR, ARGV0, errno, strerror(errno));
-            }
+    if (SetNonBlock(logr.sock) < 0) {
+        ErrorExit("%s: ERROR: Unable to set the syslog socket non-blocking: %s",
+                  ARGV0, strerror(errno));
+    }
 
-            /* if = 0, we still need to wait for the child process */
-            else if (wp == 0) {
-                break;
-            } else {
-                childcount--;
-            }
+#ifdef SYSLOG_EPOLL
+    {
+        struct epoll_event event;
+
+        if ((epoll_fd = epoll_create(SYSLOG_TCP_EVENTS)) < 0) {
+            ErrorExit("%s: ERROR: epoll_create failed: %s", ARGV0, strerror(errno));
         }
 
-        /* Accept new connections */
-        int client_socket = OS_AcceptTCP(logr.sock, srcip, IPSIZE);
-        if (client_socket < 0) {
-            merror("%s: WARN: Accepting tcp connection from client failed.", ARGV0);
-            continue;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, logr.sock, &event) < 0) {
+            ErrorExit("%s: ERROR: epoll_ctl failed: %s", ARGV0, strerror(errno));
         }
+    }
+#else
+    os_calloc(max_clients + 1, sizeof(struct pollfd), poll_fds);
 
-        /* Check if IP is allowed here */
-        if (OS_IPNotAllowed(srcip)) {
-            merror(DENYIP_WARN, ARGV0, srcip);
-            close(client_socket);
+    poll_fds[0].fd = logr.sock;
+    poll_fds[0].events = POLLIN;
+    for (i = 1; i <= (int)max_clients; i++) {
+        poll_fds[i].fd = -1;
+    }
+#endif
+
+    while (1) {
+#ifdef SYSLOG_EPOLL
+        struct epoll_event events[SYSLOG_TCP_EVENTS];
+#endif
+
+        /* Do not read anything else while analysisd is full */
+        if (queue_full) {
+            WaitQueue();
+            queue_full = FlushClients();
             continue;
         }
 
-        /* Fork to deal with new client */
-        if (fork() == 0) {
-            HandleClient(client_socket, srcip);
-            exit(0);
-        } else {
-            childcount++;
+#ifdef SYSLOG_EPOLL
+        n_events = epoll_wait(epoll_fd, events, SYSLOG_TCP_EVENTS, -1);
+#else
+        n_events = poll(poll_fds, max_clients + 1, -1);
+#endif
 
-            /* Close client socket, since the child is handling it */
-            close(client_socket);
+        if (n_events < 0) {
+            if (errno != EINTR) {
+                merror("%s: ERROR: Waiting for syslog TCP events: %s",
+                       ARGV0, strerror(errno));
+                sleep(1);
+            }
             continue;
         }
+
+#ifdef SYSLOG_EPOLL
+        for (i = 0; i < n_events; i++) {
+            if ((client = (syslog_client *) events[i].data.ptr) == NULL) {
+                AcceptClients();
+                continue;
+            }
+
+            /* A closed client is freed once its frames are forwarded */
+            if (ReadClient(client) < 0) {
+                CloseClient(client);
+            }
+
+            if (!queue_full) {
+                queue_full = DrainClient(client);
+            }
+        }
+#else
+        if (poll_fds[0].revents) {
+            AcceptClients();
+        }
+
+        for (i = 0; i < (int)max_clients; i++) {
+            if (!poll_fds[i + 1].revents || (client = clients[i]) == NULL) {
+                continue;
+            }
+
+            /* A closed client is freed once its frames are forwarded */
+            if (ReadClient(client) < 0) {
+                CloseClient(client);
+            }
+
+            if (!queue_full) {
+                queue_full = DrainClient(client);
+            }
+        }
+#endif
     }
 }
-
@@ -0,0 +1,179 @@
+/* Copyright (C) 2009 Trend Micro Inc.
+ * All rights reserved.
+ *
+ * This program is a free software; you can redistribute it
+ * and/or modify it under the terms of the GNU General Public
+ * License (version 2) as published by the FSF - Free Software
+ * Foundation.
+ */
+
+/* Local control sockets */
+
+#ifndef WIN32
+
+#include "shared.h"
+#include "os_net/os_net.h"
+
+typedef struct _OSControl {
+    int sock;
+    OSControl_Handler handler;
+} OSControl;
+
+static void *_control_thread(void *arg) __attribute__((nonnull));
+static int _control_readcmd(int sock, char *buf, size_t size) __attribute__((nonnull));
+
+
+/* Read a single command line from the peer
+ * Returns 0 on success or -1 on error/timeout
+ */
+static int _control_readcmd(int sock, char *buf, size_t size)
+{
+    size_t len = 0;
+    ssize_t r;
+    char *nl;
+
+    while (len < size - 1) {
+        r = recv(sock, buf + len, size - 1 - len, 0);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            break;
+        }
+
+        len += (size_t)r;
+        buf[len] = '\0';
+
+        if ((nl = strchr(buf, '\n'))) {
+            *nl = '\0';
+            return (0);
+        }
+    }
+
+    buf[len] = '\0';
+    return (len ? 0 : -1);
+}
+
+static void *_control_thread(void *arg)
+{
+    OSControl *ctl = (OSControl *)arg;
+    char command[OS_CONTROL_MAXCMD + 1];
+    struct timeval timeout;
+    FILE *reply;
+    int peer;
+
+    timeout.tv_sec = 5;
+    timeout.tv_usec = 0;
+
+    while (1) {
+        if ((peer = accept(ctl->sock, NULL, NULL)) < 0) {
+            if (errno != EINTR) {
+                merror("%s: ERROR: Control socket accept failed: %s",
+                       __local_name, strerror(errno));
+                sleep(1);
+            }
+            continue;
+        }
+
+        setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(peer, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        if (_control_readcmd(peer, command, sizeof(command)) < 0) {
+            close(peer);
+            continue;
+        }
+
+        if (!(reply = fdopen(peer, "w"))) {
+            close(peer);
+            continue;
+        }
+
+        debug1("%s: DEBUG: Control command: '%s'", __local_name, command);
+
+        /* Every daemon serves its metrics */
+        if (strcmp(command, "metrics") == 0) {
+            OS_MetricsPrint(reply);
+        } else {
+            ctl->handler(command, reply);
+        }
+        fclose(reply);
+    }
+
+    return (NULL);
+}
+
+int OS_StartControl(const char *path, OSControl_Handler handler)
+{
+    OSControl *ctl;
+    int sock;
+
+    if ((sock = OS_BindUnixStream(path, 0660)) < 0) {
+        merror(QUEUE_ERROR, __local_name, path, strerror(errno));
+        return (-1);
+    }
+
+    os_calloc(1, sizeof(OSControl), ctl);
+    ctl->sock = sock;
+    ctl->handler = handler;
+
+    if (CreateThread(_control_thread, (void *)ctl) != 0) {
+        close(sock);
+        free(ctl);
+        return (-1);
+    }
+
+    return (0);
+}
+
+int OS_ControlRequest(const char *path, const char *command, FILE *out)
+{
+    char buf[OS_MAXSTR + 1];
+    ssize_t r;
+    size_t len;
+    int sock;
+
+    if ((sock = OS_ConnectUnixStream(path)) < 0) {
+        return (-1);
+    }
+
+    len = strlen(command);
+    if (send(sock, command, len, 0) != (ssize_t)len ||
+            send(sock, "\n", 1, 0) != 1) {
+        close(sock);
+        return (-1);
+    }
+
+    while ((r = recv(sock, buf, sizeof(buf) - 1, 0)) > 0) {
+        fwrite(buf, 1, (size_t)r, out);
+    }
+
+    close(sock);
+    return (r < 0 ? -1 : 0);
+}
+
+FILE *OS_ControlOpen(const char *path, const char *command)
+{
+    struct timeval timeout;
+    size_t len;
+    FILE *fp;
+    int sock;
+
+    if ((sock = OS_ConnectUnixStream(path)) < 0) {
+        return (NULL);
+    }
+
+    timeout.tv_sec = 5;
+    timeout.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    len = strlen(command);
+    if (send(sock, command, len, 0) != (ssize_t)len ||
+            send(sock, "\n", 1, 0) != 1 || !(fp = fdopen(sock, "r"))) {
+        close(sock);
+        return (NULL);
+    }
+
+    return (fp);
+}
+
+#endif /* !WIN32 */
@@ -134,6 +134,19 @@ static unsigned int _os_genhash(const OSHash *self, const char *key)
     return (hash_key);
 }
 
+/* Generates a 64-bit FNV-1a hash for data (keys are not required) */
+u_int64_t OSHash_Hash64(const void *data, size_t size, u_int64_t hash)
+{
+    const unsigned char *pt = (const unsigned char *)data;
+
+    while (size--) {
+        hash ^= (u_int64_t)(*pt++);
+        hash *= 0x100000001b3ULL;
+    }
+
+    return (hash);
+}
+
 /* Set new size for hash
  * Returns 0 on error (out of memory)
  */
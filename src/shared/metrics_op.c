@@ -0,0 +1,259 @@
+/* Copyright (C) 2009 Trend Micro Inc.
+ * All rights reserved.
+ *
+ * This program is a free software; you can redistribute it
+ * and/or modify it under the terms of the GNU General Public
+ * License (version 2) as published by the FSF - Free Software
+ * Foundation.
+ */
+
+/* Daemon metrics */
+
+#include "shared.h"
+
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
+
+/* Prototypes */
+static os_metric *_metric_new(const char *name, const char *help, os_metric_type type, size_t size);
+static unsigned long *_metric_cell(const os_metric *metric);
+static unsigned long _metric_sum(const os_metric *metric, size_t index);
+
+/* Registered metrics */
+static os_metric *metrics[OS_METRIC_MAX];
+static unsigned int metric_count = 0;
+
+/* Cell of each thread */
+static unsigned int metric_threads = 0;
+static __thread int metric_slot = -1;
+
+static time_t metric_start = 0;
+
+
+/* Register a metric with cells of size bytes (rounded to a cache line) */
+static os_metric *_metric_new(const char *name, const char *help, os_metric_type type, size_t size)
+{
+    os_metric *metric;
+    unsigned int index;
+    char *cells;
+
+    if ((index = __sync_fetch_and_add(&metric_count, 1)) >= OS_METRIC_MAX) {
+        merror("%s: ERROR: Too many metrics (%s not registered).", __local_name, name);
+        return (NULL);
+    }
+
+    if (!metric_start) {
+        metric_start = time(0);
+    }
+
+    os_calloc(1, sizeof(os_metric), metric);
+    os_calloc(strlen(name) + 7, sizeof(char), metric->name);
+    snprintf(metric->name, strlen(name) + 7, "ossec_%s", name);
+    os_strdup(help, metric->help);
+    metric->type = type;
+
+    /* The cells of two threads must not share a cache line */
+    if (size > 0) {
+        metric->cell_size = (size + 63) & ~(size_t)63;
+        os_calloc(OS_METRIC_THREADS * metric->cell_size + 64, sizeof(char), cells);
+        metric->cells = (char *)(((size_t)cells + 63) & ~(size_t)63);
+    }
+
+    metrics[index] = metric;
+    return (metric);
+}
+
+os_metric *OS_MetricCounter(const char *name, const char *help)
+{
+    return (_metric_new(name, help, OS_METRIC_COUNTER, sizeof(unsigned long)));
+}
+
+os_metric *OS_MetricGauge(const char *name, const char *help, OSMetric_Read read)
+{
+    os_metric *metric;
+
+    if ((metric = _metric_new(name, help, OS_METRIC_GAUGE, 0))) {
+        metric->read = read;
+    }
+
+    return (metric);
+}
+
+/* Histogram cells: the count, the sum and the buckets */
+os_metric *OS_MetricHistogram(const char *name, const char *help)
+{
+    return (_metric_new(name, help, OS_METRIC_HISTOGRAM,
+                        (2 + OS_METRIC_BUCKETS) * sizeof(unsigned long)));
+}
+
+/* Cell of the calling thread. The threads past OS_METRIC_THREADS share
+ * the last one, so the cells are always updated with atomic adds.
+ */
+static unsigned long *_metric_cell(const os_metric *metric)
+{
+    if (metric_slot < 0) {
+        metric_slot = (int)__sync_fetch_and_add(&metric_threads, 1);
+        if (metric_slot >= OS_METRIC_THREADS) {
+            metric_slot = OS_METRIC_THREADS - 1;
+        }
+    }
+
+    return ((unsigned long *)(metric->cells + (size_t)metric_slot * metric->cell_size));
+}
+
+/* Sum of a value (index) of the cells */
+static unsigned long _metric_sum(const os_metric *metric, size_t index)
+{
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 0; i < OS_METRIC_THREADS; i++) {
+        sum += ((volatile unsigned long *)(metric->cells + (size_t)i * metric->cell_size))[index];
+    }
+
+    return (sum);
+}
+
+void OS_MetricAdd(os_metric *metric, unsigned long value)
+{
+    if (metric) {
+        __sync_fetch_and_add(_metric_cell(metric), value);
+    }
+}
+
+/* The bucket of a value is the first power of two not below it */
+void OS_MetricObserve(os_metric *metric, unsigned long value)
+{
+    unsigned long *cell;
+    unsigned long bound = 1;
+    size_t bucket = 0;
+
+    if (!metric) {
+        return;
+    }
+
+    while (bound < value && bucket < OS_METRIC_BUCKETS - 1) {
+        bound <<= 1;
+        bucket++;
+    }
+
+    cell = _metric_cell(metric);
+    __sync_fetch_and_add(&cell[0], 1);
+    __sync_fetch_and_add(&cell[1], value);
+    __sync_fetch_and_add(&cell[2 + bucket], 1);
+}
+
+unsigned long OS_MetricNow()
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        return ((unsigned long)ts.tv_sec * 1000000UL + (unsigned long)ts.tv_nsec / 1000UL);
+    }
+#endif
+    {
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return ((unsigned long)tv.tv_sec * 1000000UL + (unsigned long)tv.tv_usec);
+    }
+}
+
+void OS_MetricsPrint(FILE *fp)
+{
+    unsigned int count = metric_count < OS_METRIC_MAX ? metric_count : OS_METRIC_MAX;
+    unsigned long cumulative;
+    os_metric *metric;
+    unsigned int i;
+    size_t j;
+
+    for (i = 0; i < count; i++) {
+        if ((metric = metrics[i]) == NULL) {
+            continue;
+        }
+
+        fprintf(fp, "# HELP %s %s\n", metric->name, metric->help);
+
+        switch (metric->type) {
+            case OS_METRIC_COUNTER:
+                fprintf(fp, "# TYPE %s counter\n%s %lu\n", metric->name,
+                        metric->name, _metric_sum(metric, 0));
+                break;
+
+            case OS_METRIC_GAUGE:
+                fprintf(fp, "# TYPE %s gauge\n%s %ld\n", metric->name, metric->name,
+                        metric->read ? metric->read() : 0);
+                break;
+
+            case OS_METRIC_HISTOGRAM:
+                fprintf(fp, "# TYPE %s histogram\n", metric->name);
+
+                for (j = 0, cumulative = 0; j < OS_METRIC_BUCKETS - 1; j++) {
+                    cumulative += _metric_sum(metric, 2 + j);
+                    fprintf(fp, "%s_bucket{le=\"%lu\"} %lu\n", metric->name,
+                            1UL << j, cumulative);
+                }
+
+                fprintf(fp, "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %lu\n%s_count %lu\n",
+                        metric->name, _metric_sum(metric, 0), metric->name,
+                        _metric_sum(metric, 1), metric->name, _metric_sum(metric, 0));
+                break;
+        }
+    }
+
+#ifndef WIN32
+    {
+        struct rusage usage;
+
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+            fprintf(fp, "# HELP ossec_process_cpu_seconds_total CPU time used (user and system).\n"
+                    "# TYPE ossec_process_cpu_seconds_total counter\n"
+                    "ossec_process_cpu_seconds_total %.3f\n",
+                    (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+                    (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0);
+            fprintf(fp, "# HELP ossec_process_max_resident_kb Peak resident memory.\n"
+                    "# TYPE ossec_process_max_resident_kb gauge\n"
+                    "ossec_process_max_resident_kb %ld\n", (long)usage.ru_maxrss);
+        }
+    }
+#endif
+
+    fprintf(fp, "# HELP ossec_process_start_time_seconds Start time (since the epoch).\n"
+            "# TYPE ossec_process_start_time_seconds gauge\n"
+            "ossec_process_start_time_seconds %ld\n", (long)metric_start);
+}
+
+#ifndef WIN32
+
+void OS_MetricsControl(const char *command, FILE *reply)
+{
+    if (strcmp(command, "metrics") == 0) {
+        OS_MetricsPrint(reply);
+        return;
+    }
+
+    fprintf(reply, "ERROR: Unknown command '%s'. Available: metrics.\n", command);
+}
+
+int OS_StartMetrics()
+{
+    char path[PATH_MAX + 1];
+
+    if (!metric_start) {
+        metric_start = time(0);
+    }
+
+    snprintf(path, PATH_MAX, "%s/%s", isChroot() ? CONTROL_DIR : CONTROL_DIR_PATH,
+             __local_name);
+
+    if (OS_StartControl(path, OS_MetricsControl) < 0) {
+        merror("%s: ERROR: Unable to start the control socket.", __local_name);
+        return (-1);
+    }
+
+    return (0);
+}
+
+#endif /* !WIN32 */
@@ -13,6 +13,11 @@
 
 #ifndef WIN32
 
+#include <sys/uio.h>
+
+static int SendShmMSG(int queue, const char *message, const char *locmsg,
+                      char loc, const char *sep, int block) __attribute__((nonnull));
+
 /* Start the Message Queue. type: WRITE||READ */
 int StartMQ(const char *path, short int type)
 {
@@ -53,14 +58,46 @@ int StartMQ(const char *path, short int type)
         }
 
         debug1(MSG_SOCKET_SIZE, __local_name, OS_getsocketsize(rc));
+
+        /* Use the shared memory ring of the reader, if available. A ring
+         * left by a socket closed without detaching goes away first.
+         */
+        MQ_ShmDetach(rc);
+        MQ_ShmAttach(rc, path);
+
         return (rc);
     }
 }
 
+/* Write a message ("<loc>:<locmsg><sep><message>") to the shared memory
+ * ring of the queue. Same return values as MQ_ShmSend.
+ */
+static int SendShmMSG(int queue, const char *message, const char *locmsg,
+                      char loc, const char *sep, int block)
+{
+    struct iovec iov[4];
+    char loc_str[2];
+
+    loc_str[0] = loc;
+    loc_str[1] = ':';
+
+    iov[0].iov_base = loc_str;
+    iov[0].iov_len = 2;
+    iov[1].iov_base = (void *) locmsg;
+    iov[1].iov_len = strlen(locmsg);
+    iov[2].iov_base = (void *) sep;
+    iov[2].iov_len = strlen(sep);
+    iov[3].iov_base = (void *) message;
+    iov[3].iov_len = strlen(message);
+
+    return (MQ_ShmSend(queue, iov, 4, block));
+}
+
 /* Send a message to the queue */
 int SendMSG(int queue, const char *message, const char *locmsg, char loc)
 {
     int __mq_rcode;
+    const char *sep = ":";
     char tmpstr[OS_MAXSTR + 1];
 
     tmpstr[OS_MAXSTR] = '\0';
@@ -82,9 +119,7 @@ int SendMSG(int queue, const char *message, const char *locmsg, char loc)
             return (0);
         }
 
-        snprintf(tmpstr, OS_MAXSTR, "%c:%s->%s", loc, locmsg, message);
-    } else {
-        snprintf(tmpstr, OS_MAXSTR, "%c:%s:%s", loc, locmsg, message);
+        sep = "->";
     }
 
     /* Queue not available */
@@ -92,6 +127,18 @@ int SendMSG(int queue, const char *message, const char *locmsg, char loc)
         return (-1);
     }
 
+    /* Shared memory ring. It waits for room instead of retrying */
+    if ((__mq_rcode = SendShmMSG(queue, message, locmsg, loc, sep, 1)) == 0) {
+        return (0);
+    } else if (__mq_rcode == 1) {
+        merror("%s: Queue full, message lost.", __local_name);
+        MQ_ShmDetach(queue);
+        close(queue);
+        return (-1);
+    }
+
+    snprintf(tmpstr, OS_MAXSTR, "%c:%s%s%s", loc, locmsg, sep, message);
+
     /* We attempt 5 times to send the message if
      * the receiver socket is busy.
      * After the first error, we wait 1 second.
@@ -140,4 +187,62 @@ int SendMSG(int queue, const char *message, const char *locmsg, char loc)
     return (0);
 }
 
+/* Try to send a message to the queue without blocking
+ * Returns 0 on success, 1 if the queue is full (try again later)
+ * or -1 on error.
+ */
+int TrySendMSG(int queue, const char *message, const char *locmsg, char loc)
+{
+    int flags = 0;
+    int size;
+    char tmpstr[OS_MAXSTR + 1];
+
+    if (queue < 0) {
+        return (-1);
+    }
+
+    if ((size = SendShmMSG(queue, message, locmsg, loc, ":", 0)) >= 0) {
+        return (size);
+    }
+
+    size = snprintf(tmpstr, OS_MAXSTR, "%c:%s:%s", loc, locmsg, message);
+    if (size < 0) {
+        return (-1);
+    } else if (size >= OS_MAXSTR) {
+        size = OS_MAXSTR - 1;
+    }
+
+#ifdef MSG_DONTWAIT
+    flags = MSG_DONTWAIT;
+#endif
+
+    if (send(queue, tmpstr, (size_t)size + 1, flags) < size + 1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+            return (1);
+        }
+
+        return (-1);
+    }
+
+    return (0);
+}
+
+/* Take a token from a bucket of rate messages per second. The bucket
+ * is refilled every second and does not save the unused tokens.
+ */
+int MQ_BucketTake(mq_bucket *bucket, unsigned int rate, time_t now)
+{
+    if (bucket->second != now) {
+        bucket->second = now;
+        bucket->tokens = rate;
+    }
+
+    if (bucket->tokens == 0) {
+        return (0);
+    }
+
+    bucket->tokens--;
+    return (1);
+}
+
 #endif /* !WIN32 */
@@ -0,0 +1,766 @@
+/* Copyright (C) 2009 Trend Micro Inc.
+ * All rights reserved.
+ *
+ * This program is a free software; you can redistribute it
+ * and/or modify it under the terms of the GNU General Public
+ * License (version 2) as published by the FSF - Free Software
+ * Foundation
+ */
+
+/* Shared memory transport for the local message queues
+ *
+ * The reader (analysisd) maps a ring buffer at <queue path>.shm and the
+ * writers attach to it when they connect to the queue (StartMQ). Writers
+ * copy the messages straight into the ring, under a process-shared mutex,
+ * and wait on a condition when it is full. The reader consumes the ring
+ * in batches, taking the lock once per batch.
+ *
+ * The unix socket is still used: messages from writers without the ring
+ * arrive there, and it is how the reader sleeps. Before sleeping the
+ * reader flags itself as waiting, and the next writer sends it an empty
+ * datagram (the doorbell).
+ */
+
+#include "shared.h"
+#include "os_net/os_net.h"
+
+#ifndef WIN32
+
+#include <sys/uio.h>
+
+#ifdef MQ_SHM_ENABLED
+
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <pthread.h>
+
+#define MQ_SHM_MAGIC    0x4f534d51  /* "OSMQ" */
+#define MQ_SHM_WRAP     0xffffffffU /* The next message is at the start */
+#define MQ_SHM_ALIGN(x) (((x) + 7) & ~((size_t)7))
+#define MQ_SHM_MIN      65536       /* Minimum ring size */
+#define MQ_SHM_GROW     8           /* Registry slots added at a time */
+#define MQ_SHM_BATCH    64          /* Messages read between tail updates */
+#define MQ_SHM_WAIT     20          /* Seconds a writer waits for room */
+
+/* Shared header, followed by the ring */
+typedef struct _mq_shm_header {
+    unsigned int magic;
+    unsigned int header_size;
+    u_int64_t size;                 /* Bytes in the ring (power of 2) */
+
+    pthread_mutex_t lock;
+    pthread_cond_t room;            /* The reader freed some space */
+
+    u_int64_t head;                 /* Next byte to write */
+    u_int64_t tail;                 /* Next byte to read */
+    u_int64_t messages;             /* Messages in the ring */
+    u_int64_t total;                /* Messages written */
+    u_int64_t full;                 /* Times a writer found it full */
+    u_int64_t dropped;              /* Messages lost waiting for room */
+
+    unsigned int writers_waiting;
+    int reader_waiting;             /* The reader wants a doorbell */
+    int abandoned;                  /* Replaced by a new ring */
+} mq_shm_header;
+
+/* Ring mapped by this process */
+typedef struct _mq_shm {
+    int queue;                      /* Socket of the queue */
+    int reader;
+    int doorbell;                   /* Socket to wake up the reader */
+    struct sockaddr_un addr;        /* Address of the reader */
+    mq_shm_header *hdr;
+    char *data;
+    size_t map_size;
+    unsigned int refs;              /* Registry plus callers using it */
+
+    /* Reader state */
+    u_int64_t r_head;
+    u_int64_t r_tail;
+    unsigned int r_count;           /* Messages read since the last update */
+} mq_shm;
+
+/* Rings mapped by this process. The threads of a process (one queue
+ * socket per remoted receiver) share the registry, so it is guarded by
+ * a mutex, and each ring is reference counted: it is only unmapped once
+ * it is out of the registry and no caller is using it.
+ */
+static pthread_mutex_t mq_shm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static mq_shm **mq_shm_list = NULL;
+static unsigned int mq_shm_slots = 0;
+
+static mq_shm *mq_get(int queue);
+static void mq_put(mq_shm *mq);
+static void mq_register(mq_shm *mq);
+static void mq_remove(mq_shm *mq);
+static void mq_unmap(mq_shm *mq);
+static void mq_lock(mq_shm_header *hdr);
+static void mq_publish(mq_shm *mq);
+
+
+/* Find the ring of a queue and hold it. Release it with mq_put */
+static mq_shm *mq_get(int queue)
+{
+    mq_shm *mq = NULL;
+    unsigned int i;
+
+    pthread_mutex_lock(&mq_shm_mutex);
+    for (i = 0; i < mq_shm_slots; i++) {
+        if (mq_shm_list[i] && mq_shm_list[i]->queue == queue) {
+            mq = mq_shm_list[i];
+            mq->refs++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mq_shm_mutex);
+
+    return (mq);
+}
+
+static void mq_put(mq_shm *mq)
+{
+    unsigned int refs;
+
+    pthread_mutex_lock(&mq_shm_mutex);
+    refs = --mq->refs;
+    pthread_mutex_unlock(&mq_shm_mutex);
+
+    if (refs == 0) {
+        mq_unmap(mq);
+    }
+}
+
+/* Add a ring to the registry (replacing any other for the same socket) */
+static void mq_register(mq_shm *mq)
+{
+    mq_shm *old = NULL;
+    unsigned int slot = mq_shm_slots;
+    unsigned int i;
+
+    mq->refs = 1;
+
+    pthread_mutex_lock(&mq_shm_mutex);
+
+    for (i = 0; i < mq_shm_slots; i++) {
+        if (!mq_shm_list[i]) {
+            if (slot == mq_shm_slots) {
+                slot = i;
+            }
+        } else if (mq_shm_list[i]->queue == mq->queue) {
+            old = mq_shm_list[i];
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot == mq_shm_slots) {
+        os_realloc(mq_shm_list, (mq_shm_slots + MQ_SHM_GROW) * sizeof(mq_shm *), mq_shm_list);
+        memset(mq_shm_list + mq_shm_slots, 0, MQ_SHM_GROW * sizeof(mq_shm *));
+        mq_shm_slots += MQ_SHM_GROW;
+    }
+
+    mq_shm_list[slot] = mq;
+
+    pthread_mutex_unlock(&mq_shm_mutex);
+
+    if (old) {
+        mq_put(old);
+    }
+}
+
+/* Take a ring out of the registry, if it is still there */
+static void mq_remove(mq_shm *mq)
+{
+    int found = 0;
+    unsigned int i;
+
+    pthread_mutex_lock(&mq_shm_mutex);
+    for (i = 0; i < mq_shm_slots; i++) {
+        if (mq_shm_list[i] == mq) {
+            mq_shm_list[i] = NULL;
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mq_shm_mutex);
+
+    if (found) {
+        mq_put(mq);
+    }
+}
+
+static void mq_unmap(mq_shm *mq)
+{
+    if (mq->doorbell >= 0) {
+        close(mq->doorbell);
+    }
+    munmap(mq->hdr, mq->map_size);
+    free(mq);
+}
+
+/* Lock the ring, recovering the mutex if its owner died */
+static void mq_lock(mq_shm_header *hdr)
+{
+    if (pthread_mutex_lock(&hdr->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&hdr->lock);
+    }
+}
+
+/* Map the ring file. Returns NULL if it is not a valid ring */
+static mq_shm *mq_map(int fd, size_t file_size)
+{
+    mq_shm *mq;
+    void *map;
+
+    if (file_size <= sizeof(mq_shm_header)) {
+        return (NULL);
+    }
+
+    map = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return (NULL);
+    }
+
+    os_calloc(1, sizeof(mq_shm), mq);
+    mq->hdr = (mq_shm_header *) map;
+    mq->data = (char *) map + sizeof(mq_shm_header);
+    mq->map_size = file_size;
+    mq->doorbell = -1;
+
+    if (mq->hdr->magic != MQ_SHM_MAGIC ||
+            mq->hdr->header_size != sizeof(mq_shm_header) ||
+            mq->hdr->size + sizeof(mq_shm_header) != file_size) {
+        mq_unmap(mq);
+        return (NULL);
+    }
+
+    return (mq);
+}
+
+/* Create (or reuse) the ring of a queue. Called by the reader */
+int MQ_ShmCreate(int queue, const char *path, size_t size)
+{
+    char file[PATH_MAX + 1];
+    struct stat st;
+    mq_shm *mq = NULL;
+    size_t ring_size = MQ_SHM_MIN;
+    int fd;
+
+    while (ring_size < size) {
+        ring_size <<= 1;
+    }
+
+    snprintf(file, PATH_MAX, "%s.shm", path);
+
+    /* Reuse the ring left by a previous reader (keeping its messages) */
+    if ((fd = open(file, O_RDWR)) >= 0) {
+        if (fstat(fd, &st) == 0 && (mq = mq_map(fd, (size_t)st.st_size)) != NULL) {
+            if (mq->hdr->size != ring_size || mq->hdr->abandoned) {
+                /* Tell the writers to drop it */
+                mq_lock(mq->hdr);
+                mq->hdr->abandoned = 1;
+                pthread_cond_broadcast(&mq->hdr->room);
+                pthread_mutex_unlock(&mq->hdr->lock);
+                mq_unmap(mq);
+                mq = NULL;
+            }
+        }
+        close(fd);
+    }
+
+    if (!mq) {
+        pthread_mutexattr_t m_attr;
+        pthread_condattr_t c_attr;
+        mq_shm_header *hdr;
+
+        /* Writers may still map the old file, so it is never resized */
+        unlink(file);
+
+        if ((fd = open(file, O_RDWR | O_CREAT | O_EXCL, 0660)) < 0) {
+            merror(FOPEN_ERROR, __local_name, file, errno, strerror(errno));
+            return (-1);
+        }
+
+        if (fchmod(fd, 0660) < 0 ||
+                ftruncate(fd, (off_t)(sizeof(mq_shm_header) + ring_size)) < 0) {
+            merror("%s: ERROR: Unable to size '%s': %s", __local_name, file, strerror(errno));
+            close(fd);
+            unlink(file);
+            return (-1);
+        }
+
+        hdr = (mq_shm_header *) mmap(NULL, sizeof(mq_shm_header) + ring_size,
+                                     PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (hdr == MAP_FAILED) {
+            merror("%s: ERROR: Unable to map '%s': %s", __local_name, file, strerror(errno));
+            unlink(file);
+            return (-1);
+        }
+
+        memset(hdr, 0, sizeof(mq_shm_header));
+        hdr->header_size = sizeof(mq_shm_header);
+        hdr->size = ring_size;
+
+        pthread_mutexattr_init(&m_attr);
+        pthread_mutexattr_setpshared(&m_attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&m_attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&hdr->lock, &m_attr);
+        pthread_mutexattr_destroy(&m_attr);
+
+        pthread_condattr_init(&c_attr);
+        pthread_condattr_setpshared(&c_attr, PTHREAD_PROCESS_SHARED);
+        pthread_cond_init(&hdr->room, &c_attr);
+        pthread_condattr_destroy(&c_attr);
+
+        /* Writers only attach once the magic is set */
+        __sync_synchronize();
+        hdr->magic = MQ_SHM_MAGIC;
+
+        os_calloc(1, sizeof(mq_shm), mq);
+        mq->hdr = hdr;
+        mq->data = (char *) hdr + sizeof(mq_shm_header);
+        mq->map_size = sizeof(mq_shm_header) + ring_size;
+        mq->doorbell = -1;
+    }
+
+    mq->queue = queue;
+    mq->reader = 1;
+
+    mq_lock(mq->hdr);
+    mq->hdr->reader_waiting = 0;
+    mq->r_tail = mq->r_head = mq->hdr->tail;
+    pthread_mutex_unlock(&mq->hdr->lock);
+
+    mq_register(mq);
+
+    debug1("%s: DEBUG: Shared memory queue '%s' (%lu bytes, %lu messages pending).",
+           __local_name, file, (unsigned long)ring_size,
+           (unsigned long)mq->hdr->messages);
+    return (0);
+}
+
+/* Attach a writer to the ring of a queue, if there is one */
+int MQ_ShmAttach(int queue, const char *path)
+{
+    char file[PATH_MAX + 1];
+    struct stat st;
+    mq_shm *mq;
+    int fd;
+
+    snprintf(file, PATH_MAX, "%s.shm", path);
+
+    if ((fd = open(file, O_RDWR)) < 0) {
+        return (-1);
+    }
+
+    if (fstat(fd, &st) < 0 || (mq = mq_map(fd, (size_t)st.st_size)) == NULL) {
+        close(fd);
+        return (-1);
+    }
+    close(fd);
+
+    if (mq->hdr->abandoned || strlen(path) >= sizeof(mq->addr.sun_path)) {
+        mq_unmap(mq);
+        return (-1);
+    }
+
+    if ((mq->doorbell = socket(PF_UNIX, SOCK_DGRAM, 0)) < 0) {
+        merror("%s: ERROR: Unable to use the shared memory queue '%s': %s",
+               __local_name, file, strerror(errno));
+        mq_unmap(mq);
+        return (-1);
+    }
+
+    mq->queue = queue;
+    mq->addr.sun_family = AF_UNIX;
+    strncpy(mq->addr.sun_path, path, sizeof(mq->addr.sun_path) - 1);
+
+    mq_register(mq);
+
+    debug1("%s: DEBUG: Using the shared memory queue '%s'.", __local_name, file);
+    return (0);
+}
+
+/* Stop using the ring of a queue */
+void MQ_ShmDetach(int queue)
+{
+    mq_shm *mq;
+
+    if ((mq = mq_get(queue)) != NULL) {
+        mq_remove(mq);
+        mq_put(mq);
+    }
+}
+
+int MQ_ShmAttached(int queue)
+{
+    mq_shm *mq;
+
+    if ((mq = mq_get(queue)) == NULL) {
+        return (0);
+    }
+
+    mq_put(mq);
+    return (1);
+}
+
+/* Write a message (the iov pieces, plus a '\0') to the ring
+ * Returns 0 on success, 1 if the ring is full (after waiting if block
+ * is set) or -1 if the queue has no ring.
+ */
+int MQ_ShmSend(int queue, const struct iovec *iov, int iovcnt, int block)
+{
+    mq_shm *mq;
+    mq_shm_header *hdr;
+    u_int64_t mask;
+    u_int64_t idx;
+    u_int64_t pad;
+    size_t len = 1;
+    size_t need;
+    size_t copied = 0;
+    time_t deadline = 0;
+    int wake;
+    int i;
+
+    if ((mq = mq_get(queue)) == NULL) {
+        return (-1);
+    } else if (mq->reader) {
+        mq_put(mq);
+        return (-1);
+    }
+
+    hdr = mq->hdr;
+    mask = hdr->size - 1;
+
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    if (len > OS_MAXSTR) {
+        len = OS_MAXSTR;
+    }
+    need = MQ_SHM_ALIGN(sizeof(u_int32_t) + len);
+
+    mq_lock(hdr);
+
+    while (1) {
+        if (hdr->abandoned) {
+            pthread_mutex_unlock(&hdr->lock);
+            mq_remove(mq);
+            mq_put(mq);
+            return (-1);
+        }
+
+        idx = hdr->head & mask;
+        pad = (idx + need > hdr->size) ? hdr->size - idx : 0;
+
+        if (hdr->size - (hdr->head - hdr->tail) >= pad + need) {
+            break;
+        }
+
+        if (!deadline) {
+            hdr->full++;
+            deadline = time(NULL) + MQ_SHM_WAIT;
+        }
+
+        if (!block || time(NULL) >= deadline) {
+            if (block) {
+                hdr->dropped++;
+            }
+            pthread_mutex_unlock(&hdr->lock);
+            mq_put(mq);
+            return (1);
+        } else {
+            struct timespec ts;
+
+            ts.tv_sec = time(NULL) + 1;
+            ts.tv_nsec = 0;
+
+            hdr->writers_waiting++;
+            if (pthread_cond_timedwait(&hdr->room, &hdr->lock, &ts) == EOWNERDEAD) {
+                pthread_mutex_consistent(&hdr->lock);
+            }
+            hdr->writers_waiting--;
+        }
+    }
+
+    if (pad) {
+        *(u_int32_t *)(mq->data + idx) = MQ_SHM_WRAP;
+        hdr->head += pad;
+        idx = 0;
+    }
+
+    *(u_int32_t *)(mq->data + idx) = (u_int32_t)len;
+    idx += sizeof(u_int32_t);
+
+    for (i = 0; i < iovcnt && copied < len - 1; i++) {
+        size_t n = iov[i].iov_len;
+
+        if (n > len - 1 - copied) {
+            n = len - 1 - copied;
+        }
+        memcpy(mq->data + idx + copied, iov[i].iov_base, n);
+        copied += n;
+    }
+    mq->data[idx + copied] = '\0';
+
+    hdr->head += need;
+    hdr->messages++;
+    hdr->total++;
+
+    wake = hdr->reader_waiting;
+    hdr->reader_waiting = 0;
+
+    pthread_mutex_unlock(&hdr->lock);
+
+    /* The reader is asleep on the socket */
+    if (wake) {
+        sendto(mq->doorbell, "", 0, MSG_DONTWAIT,
+               (struct sockaddr *)&mq->addr, sizeof(mq->addr));
+    }
+
+    mq_put(mq);
+    return (0);
+}
+
+/* Wait up to msecs for the reader to free some space
+ * Returns 0 (woken or timed out) or -1 if the queue has no ring.
+ */
+int MQ_ShmWait(int queue, int msecs)
+{
+    mq_shm *mq;
+    struct timespec ts;
+
+    if ((mq = mq_get(queue)) == NULL) {
+        return (-1);
+    } else if (mq->reader) {
+        mq_put(mq);
+        return (-1);
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += msecs / 1000;
+    ts.tv_nsec += (long)(msecs % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    mq_lock(mq->hdr);
+    mq->hdr->writers_waiting++;
+    if (pthread_cond_timedwait(&mq->hdr->room, &mq->hdr->lock, &ts) == EOWNERDEAD) {
+        pthread_mutex_consistent(&mq->hdr->lock);
+    }
+    mq->hdr->writers_waiting--;
+    pthread_mutex_unlock(&mq->hdr->lock);
+
+    mq_put(mq);
+    return (0);
+}
+
+/* Hand the space read back to the writers and look for new messages */
+static void mq_publish(mq_shm *mq)
+{
+    mq_shm_header *hdr = mq->hdr;
+
+    mq_lock(hdr);
+
+    hdr->messages -= mq->r_count;
+    hdr->tail = mq->r_tail;
+    if (hdr->writers_waiting) {
+        pthread_cond_broadcast(&hdr->room);
+    }
+
+    mq->r_head = hdr->head;
+    if (mq->r_head == mq->r_tail) {
+        hdr->reader_waiting = 1;
+    }
+
+    pthread_mutex_unlock(&hdr->lock);
+    mq->r_count = 0;
+}
+
+/* Read a message from the ring of the reader, or from its socket */
+static int mq_recv(mq_shm *mq, int queue, char *buffer, int size)
+{
+    ssize_t ret;
+
+    while (1) {
+        u_int64_t idx;
+        u_int32_t len;
+
+        if (mq->r_count >= MQ_SHM_BATCH) {
+            mq_publish(mq);
+
+            /* Do not starve the writers using the socket */
+            if ((ret = recv(queue, buffer, (size_t)size - 1, MSG_DONTWAIT)) > 0) {
+                buffer[ret] = '\0';
+                return ((int)ret);
+            }
+        }
+
+        if (mq->r_tail == mq->r_head) {
+            mq_publish(mq);
+
+            /* Nothing in the ring: sleep on the socket */
+            if (mq->r_tail == mq->r_head) {
+                if ((ret = recv(queue, buffer, (size_t)size - 1, 0)) > 0) {
+                    buffer[ret] = '\0';
+                    return ((int)ret);
+                } else if (ret < 0 && errno != EINTR) {
+                    return (0);
+                }
+                continue;
+            }
+        }
+
+        idx = mq->r_tail & (mq->hdr->size - 1);
+        len = *(u_int32_t *)(mq->data + idx);
+
+        if (len == MQ_SHM_WRAP) {
+            mq->r_tail += mq->hdr->size - idx;
+            continue;
+        }
+
+        mq->r_tail += MQ_SHM_ALIGN(sizeof(u_int32_t) + len);
+        mq->r_count++;
+
+        if (len >= (u_int32_t)size) {
+            len = (u_int32_t)size - 1;
+            buffer[len] = '\0';
+        }
+        memcpy(buffer, mq->data + idx + sizeof(u_int32_t), len);
+
+        return ((int)len);
+    }
+}
+
+/* Read a message from the queue (ring or socket)
+ * Returns the size of the message (with its '\0'), like OS_RecvUnix,
+ * or 0 on error.
+ */
+int RecvMSG(int queue, char *buffer, int size)
+{
+    mq_shm *mq;
+    int ret;
+
+    if ((mq = mq_get(queue)) == NULL) {
+        return (OS_RecvUnix(queue, size, buffer));
+    } else if (!mq->reader) {
+        mq_put(mq);
+        return (OS_RecvUnix(queue, size, buffer));
+    }
+
+    ret = mq_recv(mq, queue, buffer, size);
+    mq_put(mq);
+
+    return (ret);
+}
+
+/* Get the state of the ring of a queue. Returns -1 if it has no ring */
+int MQ_ShmStatus(int queue, mq_shm_status *status)
+{
+    mq_shm *mq;
+
+    if ((mq = mq_get(queue)) == NULL) {
+        return (-1);
+    }
+
+    mq_lock(mq->hdr);
+    status->size = (size_t)mq->hdr->size;
+    status->used = (size_t)(mq->hdr->head - mq->hdr->tail);
+    status->messages = (unsigned long)mq->hdr->messages;
+
+    /* The reader knows about the messages read since the last update */
+    if (mq->reader) {
+        status->used = (size_t)(mq->hdr->head - mq->r_tail);
+        status->messages -= mq->r_count;
+    }
+
+    status->total = (unsigned long)mq->hdr->total;
+    status->full = (unsigned long)mq->hdr->full;
+    status->dropped = (unsigned long)mq->hdr->dropped;
+    pthread_mutex_unlock(&mq->hdr->lock);
+
+    mq_put(mq);
+    return (0);
+}
+
+/* Percentage of the ring in use (the credit left to the writers is
+ * the rest). It is read without the lock: it is only a hint.
+ * Returns -1 if the queue has no ring.
+ */
+int MQ_ShmLoad(int queue)
+{
+    mq_shm *mq;
+    u_int64_t head;
+    u_int64_t tail;
+    int load = 0;
+
+    if ((mq = mq_get(queue)) == NULL) {
+        return (-1);
+    }
+
+    head = *(volatile u_int64_t *)&mq->hdr->head;
+    tail = mq->reader ? mq->r_tail : *(volatile u_int64_t *)&mq->hdr->tail;
+
+    if (head > tail) {
+        load = (int)(((head - tail) * 100) / mq->hdr->size);
+    }
+
+    mq_put(mq);
+    return (load);
+}
+
+#else /* !MQ_SHM_ENABLED */
+
+int MQ_ShmCreate(__attribute__((unused)) int queue, __attribute__((unused)) const char *path,
+                 __attribute__((unused)) size_t size)
+{
+    return (-1);
+}
+
+int MQ_ShmAttach(__attribute__((unused)) int queue, __attribute__((unused)) const char *path)
+{
+    return (-1);
+}
+
+void MQ_ShmDetach(__attribute__((unused)) int queue)
+{
+}
+
+int MQ_ShmAttached(__attribute__((unused)) int queue)
+{
+    return (0);
+}
+
+int MQ_ShmSend(__attribute__((unused)) int queue, __attribute__((unused)) const struct iovec *iov,
+               __attribute__((unused)) int iovcnt, __attribute__((unused)) int block)
+{
+    return (-1);
+}
+
+int MQ_ShmWait(__attribute__((unused)) int queue, __attribute__((unused)) int msecs)
+{
+    return (-1);
+}
+
+int RecvMSG(int queue, char *buffer, int size)
+{
+    return (OS_RecvUnix(queue, size, buffer));
+}
+
+int MQ_ShmStatus(__attribute__((unused)) int queue, __attribute__((unused)) mq_shm_status *status)
+{
+    return (-1);
+}
+
+int MQ_ShmLoad(__attribute__((unused)) int queue)
+{
+    return (-1);
+}
+
+#endif /* MQ_SHM_ENABLED */
+
+#endif /* !WIN32 */
@@ -25,6 +25,26 @@ static int _do_print_rootcheck(FILE *fp, int resolved, time_t time_last_scan,
 static int _get_time_rkscan(const char *agent_name, const char *agent_ip, agent_info *agt_info) __attribute__((nonnull(2, 3)));
 static char *_get_agent_keepalive(const char *agent_name, const char *agent_ip) __attribute__((nonnull(2)));
 static int _get_agent_os(const char *agent_name, const char *agent_ip, agent_info *agt_info) __attribute__((nonnull(2, 3)));
+static char **_add_agent(char **f_files, size_t f_size, const char *name, int flag, int status) __attribute__((nonnull(3)));
+
+#ifndef WIN32
+/* Status of an agent, as kept by remoted */
+typedef struct _agent_state {
+    char *name;                 /* "<name>-<ip>", like the agent-info files */
+    time_t keepalive;
+    char *uname;
+} agent_state;
+
+static int _load_agents_state(void);
+static agent_state *_get_agent_state(const char *agent_name, const char *agent_ip) __attribute__((nonnull));
+
+/* Agents from remoted (or its last snapshot) */
+static agent_state *_states = NULL;
+static unsigned int _n_states = 0;
+static OSHash *_states_hash = NULL;
+static time_t _states_time = 0;
+static int _states_loaded = 0;
+#endif /* !WIN32 */
 
 
 /* Free the agent list in memory */
@@ -882,6 +902,102 @@ int connect_to_remoted()
     return (arq);
 }
 
+/* Load the status of the agents from remoted, or from its last snapshot
+ * if it is not running. It is loaded again after a second.
+ * Returns 0 on success or -1 if not available (use the agent-info files)
+ */
+static int _load_agents_state()
+{
+    FILE *fp;
+    char buf[OS_MAXSTR + 1];
+    char name[OS_SIZE_256 + 1];
+    char ip[OS_SIZE_128 + 1];
+    char *pt;
+    long keepalive;
+    int uname;
+    unsigned int i;
+
+    if (_states_time == time(0)) {
+        return (_states_loaded ? 0 : -1);
+    }
+
+    for (i = 0; i < _n_states; i++) {
+        free(_states[i].name);
+        free(_states[i].uname);
+    }
+    free(_states);
+    _states = NULL;
+    _n_states = 0;
+
+    if (_states_hash) {
+        OSHash_Free(_states_hash);
+        _states_hash = NULL;
+    }
+
+    _states_time = time(0);
+    _states_loaded = 0;
+
+    if ((fp = OS_ControlOpen(CONTROL_DIR "/ossec-remoted", "agents")) == NULL &&
+            (fp = fopen(AGENTSTATUS_FILE, "r")) == NULL) {
+        return (-1);
+    }
+
+    if (!fgets(buf, OS_MAXSTR, fp) || strncmp(buf, "# agents ", 9) != 0 ||
+            (_states_hash = OSHash_Create()) == NULL) {
+        fclose(fp);
+        return (-1);
+    }
+
+    /* "<id> <name> <ip> <keepalive> <seen> <messages> <keepalives> <sum> <uname>" */
+    while (fgets(buf, OS_MAXSTR, fp)) {
+        if ((pt = strchr(buf, '\n')) != NULL) {
+            *pt = '\0';
+        }
+
+        uname = 0;
+        if (sscanf(buf, "%*s %256s %128s %ld %*s %*s %*s %*s %n",
+                   name, ip, &keepalive, &uname) < 3 || uname == 0 || keepalive == 0) {
+            continue;
+        }
+
+        /* The agent-info files have no netmask */
+        if ((pt = strchr(ip, '/')) != NULL) {
+            *pt = '\0';
+        }
+
+        os_realloc(_states, (_n_states + 1) * sizeof(agent_state), _states);
+        os_calloc(strlen(name) + strlen(ip) + 2, sizeof(char), _states[_n_states].name);
+        sprintf(_states[_n_states].name, "%s-%s", name, ip);
+        os_strdup(buf + uname, _states[_n_states].uname);
+        _states[_n_states].keepalive = (time_t)keepalive;
+        _n_states++;
+    }
+
+    fclose(fp);
+
+    /* The entries do not move anymore */
+    for (i = 0; i < _n_states; i++) {
+        OSHash_Add(_states_hash, _states[i].name, &_states[i]);
+    }
+
+    _states_loaded = 1;
+    return (0);
+}
+
+/* Get the status of an agent (NULL if it never connected) */
+static agent_state *_get_agent_state(const char *agent_name, const char *agent_ip)
+{
+    char name[OS_SIZE_1024 + 1];
+    char *pt;
+
+    snprintf(name, OS_SIZE_1024, "%s-%s", agent_name, agent_ip);
+    if ((pt = strchr(name, '/')) != NULL) {
+        *pt = '\0';
+    }
+
+    return ((agent_state *) OSHash_Get(_states_hash, name));
+}
+
 #endif /* !WIN32 */
 
 /* Internal funtion. Extract last time of scan from rootcheck/syscheck. */
@@ -1017,6 +1133,14 @@ static char *_get_agent_keepalive(const char *agent_name, const char *agent_ip)
         return (strdup("Not available"));
     }
 
+#ifndef WIN32
+    if (_load_agents_state() == 0) {
+        agent_state *state = _get_agent_state(agent_name, agent_ip);
+
+        return (strdup(state ? ctime(&state->keepalive) : "Unknown"));
+    }
+#endif
+
     snprintf(buf, 1024, "%s/%s-%s", AGENTINFO_DIR, agent_name, agent_ip);
     if (stat(buf, &file_status) < 0) {
         return (strdup("Unknown"));
@@ -1030,6 +1154,7 @@ static int _get_agent_os(const char *agent_name, const char *agent_ip, agent_inf
 {
     FILE *fp;
     char buf[1024 + 1];
+    int from_remoted = 0;
 
     /* Get server info */
     if (!agent_name) {
@@ -1051,15 +1176,35 @@ static int _get_agent_os(const char *agent_name, const char *agent_ip, agent_inf
         return (0);
     }
 
-    snprintf(buf, 1024, "%s/%s-%s", AGENTINFO_DIR, agent_name, agent_ip);
-    fp = fopen(buf, "r");
-    if (!fp) {
-        os_strdup("Unknown", agt_info->os);
-        os_strdup("Unknown", agt_info->version);
-        return (0);
+    buf[0] = '\0';
+
+#ifndef WIN32
+    /* Kept by remoted */
+    if (_load_agents_state() == 0) {
+        agent_state *state = _get_agent_state(agent_name, agent_ip);
+
+        if (state) {
+            strncpy(buf, state->uname, 1024);
+            buf[1024] = '\0';
+        }
+        from_remoted = 1;
     }
+#endif
 
-    if (fgets(buf, 1024, fp)) {
+    if (!from_remoted) {
+        snprintf(buf, 1024, "%s/%s-%s", AGENTINFO_DIR, agent_name, agent_ip);
+        fp = fopen(buf, "r");
+        buf[0] = '\0';
+
+        if (fp) {
+            if (!fgets(buf, 1024, fp)) {
+                buf[0] = '\0';
+            }
+            fclose(fp);
+        }
+    }
+
+    if (buf[0]) {
         char *ossec_version = NULL;
 
         /* Remove newline */
@@ -1078,13 +1223,10 @@ static int _get_agent_os(const char *agent_name, const char *agent_ip, agent_inf
         }
 
         os_strdup(buf, agt_info->os);
-        fclose(fp);
 
         return (1);
     }
 
-    fclose(fp);
-
     os_strdup("Unknown", agt_info->os);
     os_strdup("Unknown", agt_info->version);
 
@@ -1149,6 +1291,23 @@ int get_agent_status(const char *agent_name, const char *agent_ip)
         return (GA_STATUS_ACTIVE);
     }
 
+#ifndef WIN32
+    /* Kept by remoted */
+    if (_load_agents_state() == 0) {
+        agent_state *state = _get_agent_state(agent_name, agent_ip);
+
+        if (!state) {
+            return (GA_STATUS_INV);
+        }
+
+        if (state->keepalive > (time(0) - (3 * NOTIFY_TIME + 30))) {
+            return (GA_STATUS_ACTIVE);
+        }
+
+        return (GA_STATUS_NACTIVE);
+    }
+#endif
+
     /* Remove the  "/", since it is not present on the file */
     if ((agent_ip_pt = strchr(agent_ip, '/'))) {
         *agent_ip_pt = '\0';
@@ -1172,6 +1331,31 @@ int get_agent_status(const char *agent_name, const char *agent_ip)
     return (GA_STATUS_NACTIVE);
 }
 
+/* Add an agent to a list ("<name>-<ip>", and its status if asked) */
+static char **_add_agent(char **f_files, size_t f_size, const char *name, int flag, int status)
+{
+    f_files = (char **)realloc(f_files, (f_size + 2) * sizeof(char *));
+    if (!f_files) {
+        ErrorExit(MEM_ERROR, __local_name, errno, strerror(errno));
+    }
+
+    /* Add agent entry */
+    if (flag == GA_ALL_WSTATUS) {
+        char agt_stat[512];
+
+        snprintf(agt_stat, sizeof(agt_stat) - 1, "%s %s",
+                 name, status == 1 ? "active" : "disconnected");
+
+        os_strdup(agt_stat, f_files[f_size]);
+    } else {
+        os_strdup(name, f_files[f_size]);
+    }
+
+    f_files[f_size + 1] = NULL;
+
+    return (f_files);
+}
+
 /* List available agents */
 char **get_agents(int flag)
 {
@@ -1180,6 +1364,25 @@ char **get_agents(int flag)
     DIR *dp;
     struct dirent *entry;
 
+#ifndef WIN32
+    /* Kept by remoted */
+    if (_load_agents_state() == 0) {
+        unsigned int i;
+
+        for (i = 0; i < _n_states; i++) {
+            int status = _states[i].keepalive > (time(0) - (3 * NOTIFY_TIME + 30));
+
+            if ((flag == GA_NOTACTIVE && status) || (flag == GA_ACTIVE && !status)) {
+                continue;
+            }
+
+            f_files = _add_agent(f_files, f_size++, _states[i].name, flag, status);
+        }
+
+        return (f_files);
+    }
+#endif
+
     /* Open the directory */
     dp = opendir(AGENTINFO_DIR);
     if (!dp) {
@@ -1196,9 +1399,8 @@ char **get_agents(int flag)
         char tmp_file[513];
         tmp_file[512] = '\0';
 
-        /* Ignore . and ..  */
-        if ((strcmp(entry->d_name, ".") == 0) ||
-                (strcmp(entry->d_name, "..") == 0)) {
+        /* Ignore . and .. (and the status snapshot) */
+        if (entry->d_name[0] == '.') {
             continue;
         }
 
@@ -1223,25 +1425,7 @@ char **get_agents(int flag)
             }
         }
 
-        f_files = (char **)realloc(f_files, (f_size + 2) * sizeof(char *));
-        if (!f_files) {
-            ErrorExit(MEM_ERROR, __local_name, errno, strerror(errno));
-        }
-
-        /* Add agent entry */
-        if (flag == GA_ALL_WSTATUS) {
-            char agt_stat[512];
-
-            snprintf(agt_stat, sizeof(agt_stat) - 1, "%s %s",
-                     entry->d_name, status == 1 ? "active" : "disconnected");
-
-            os_strdup(agt_stat, f_files[f_size]);
-        } else {
-            os_strdup(entry->d_name, f_files[f_size]);
-        }
-
-        f_files[f_size + 1] = NULL;
-
+        f_files = _add_agent(f_files, f_size, entry->d_name, flag, status);
         f_size++;
     }
 
@@ -124,3 +124,26 @@ char *os_shell_escape(const char *src)
     return escaped_string;
 }
 
+
+/* Check if word is one of the space-separated words of str */
+int os_hasword(const char *str, const char *word)
+{
+    size_t len = strlen(word);
+
+    while (*str) {
+        while (*str == ' ') {
+            str++;
+        }
+
+        if (len && strncmp(str, word, len) == 0 &&
+                (str[len] == ' ' || str[len] == '\0')) {
+            return (1);
+        }
+
+        while (*str && *str != ' ') {
+            str++;
+        }
+    }
+
+    return (0);
+}
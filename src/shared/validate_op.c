@@ -274,6 +274,119 @@ int OS_IPFoundList(const char *ip_address, os_ip **list_of_ips)
     return (!_true);
 }
 
+/* Node of a compiled IP list. The path from the root is the prefix
+ * and first is the position of the first entry with that prefix.
+ */
+typedef struct _os_iptree_node {
+    int child[2];
+    int first;
+} os_iptree_node;
+
+struct _os_iptree {
+    os_iptree_node *nodes;
+    int size;
+    int *negated;           /* negated[i]: any '!' entry up to i */
+    int negate_all;         /* Result when nothing matches */
+};
+
+/* Compile a list of IPs (as used by OS_IPFoundList) into a prefix tree
+ * Returns NULL if the list has a netmask that is not a prefix.
+ */
+os_iptree *OS_IPTreeCompile(os_ip **list_of_ips)
+{
+    os_iptree *tree;
+    int count;
+    int neg = 0;
+    int i;
+
+    for (count = 0; list_of_ips[count]; count++) {
+        unsigned int mask = ntohl(list_of_ips[count]->netmask);
+
+        /* The mask must be a run of ones followed by zeros */
+        if (mask & (~mask >> 1)) {
+            return (NULL);
+        }
+    }
+
+    os_calloc(1, sizeof(os_iptree), tree);
+    os_calloc(count + 1, sizeof(int), tree->negated);
+    os_calloc(1 + (count * 32), sizeof(os_iptree_node), tree->nodes);
+    tree->nodes[0].first = -1;
+    tree->size = 1;
+
+    for (i = 0; i < count; i++) {
+        unsigned int addr = ntohl(list_of_ips[i]->ip_address);
+        unsigned int mask = ntohl(list_of_ips[i]->netmask);
+        int node = 0;
+        int bit;
+
+        if (list_of_ips[i]->ip[0] == '!') {
+            neg = 1;
+        }
+        tree->negated[i] = neg;
+
+        for (bit = 31; bit >= 0 && (mask & (1U << bit)); bit--) {
+            int b = (addr >> bit) & 1;
+
+            if (!tree->nodes[node].child[b]) {
+                tree->nodes[tree->size].first = -1;
+                tree->nodes[node].child[b] = tree->size++;
+            }
+            node = tree->nodes[node].child[b];
+        }
+
+        if (tree->nodes[node].first < 0) {
+            tree->nodes[node].first = i;
+        }
+    }
+
+    tree->negate_all = neg;
+    return (tree);
+}
+
+/* Same as OS_IPFoundList, for a compiled list and an address in network
+ * byte order. Returns 1 on success or 0 on failure
+ */
+int OS_IPTreeFound(const os_iptree *tree, unsigned int ip_address)
+{
+    unsigned int addr = ntohl(ip_address);
+    int node = 0;
+    int first = -1;
+    int bit = 31;
+
+    if (ip_address == 0) {
+        return (0);
+    }
+
+    while (1) {
+        int n_first = tree->nodes[node].first;
+
+        if (n_first >= 0 && (first < 0 || n_first < first)) {
+            first = n_first;
+        }
+
+        if (bit < 0 || !(node = tree->nodes[node].child[(addr >> bit) & 1])) {
+            break;
+        }
+        bit--;
+    }
+
+    if (first < 0) {
+        return (tree->negate_all);
+    }
+
+    return (!tree->negated[first]);
+}
+
+void OS_IPTreeFree(os_iptree *tree)
+{
+    if (tree) {
+        free(tree->nodes);
+        free(tree->negated);
+        free(tree);
+    }
+}
+
 /* Validate if an IP address is in the right format
  * Returns 0 if doesn't match or 1 if it is an IP or 2 an IP with CIDR.
  * WARNING: On success this function may modify the value of ip_address
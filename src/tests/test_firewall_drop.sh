@@ -0,0 +1,142 @@
+#!/bin/sh
+# Tests of firewall-drop.sh (single and batch modes) with stubs in place
+# of iptables, iptables-save, iptables-restore and ipset.
+# Usage: tests/test_firewall_drop.sh (from src)
+
+SCRIPT="`pwd`/../active-response/firewall-drop.sh"
+DIR=`mktemp -d /tmp/test_firewall_drop.XXXXXX` || exit 1
+FAILED=0
+
+trap 'rm -rf ${DIR}' EXIT
+
+if [ "X`uname`" != "XLinux" ]; then
+    echo "Skipping firewall-drop.sh tests (not linux)"
+    exit 0
+fi
+
+mkdir -p ${DIR}/active-response/bin ${DIR}/logs ${DIR}/bin
+cp ${SCRIPT} ${DIR}/active-response/bin/firewall-drop.sh
+cd ${DIR}
+
+# Stubs: each call is logged to calls, iptables-save prints rules.iptables,
+# the input of iptables-restore and ipset restore is kept in input.<name>
+cat > ${DIR}/bin/stub <<EOF
+#!/bin/sh
+N=\`basename \$0\`
+echo "\$N \$*" >> ${DIR}/calls
+case "\$N \$*" in
+    *-save\ * ) cat ${DIR}/rules.\${N%-save} 2>/dev/null;;
+    *-restore\ *|ipset\ restore* ) cat >> ${DIR}/input.\$N;;
+    *" -C "* ) exit 1;;
+esac
+exit 0
+EOF
+chmod +x ${DIR}/bin/stub
+
+for i in iptables ip6tables; do
+    ln -s ${DIR}/bin/stub ${DIR}/bin/$i
+    ln -s ${DIR}/bin/stub ${DIR}/bin/$i-save
+    ln -s ${DIR}/bin/stub ${DIR}/bin/$i-restore
+done
+ln -s ${DIR}/bin/stub ${DIR}/bin/ipset
+
+# Run the script: <ipset> <arguments>
+run()
+{
+    rm -f ${DIR}/calls ${DIR}/input.*
+    IP4TABLES=${DIR}/bin/iptables IP6TABLES=${DIR}/bin/ip6tables IPSET=$1 \
+        sh ${DIR}/active-response/bin/firewall-drop.sh $2 $3 $4
+}
+
+# The file has the line: <file> <line>
+check()
+{
+    if ! grep -qxF -- "$2" ${DIR}/$1 2>/dev/null; then
+        echo "FAIL: '$2' not in $1"
+        FAILED=1
+    fi
+}
+
+# The file has no line with the text: <file> <text>
+check_not()
+{
+    if grep -qF -- "$2" ${DIR}/$1 2>/dev/null; then
+        echo "FAIL: '$2' in $1"
+        FAILED=1
+    fi
+}
+
+# Number of stubs run
+check_count()
+{
+    if [ "`wc -l < ${DIR}/calls`" -ne "$1" ]; then
+        echo "FAIL: $1 calls expected:"
+        cat ${DIR}/calls
+        FAILED=1
+    fi
+}
+
+# Single mode: an iptables call per chain
+run ${DIR}/bin/none add - 10.0.0.5
+check calls "iptables -I INPUT -s 10.0.0.5 -j DROP"
+check calls "iptables -I FORWARD -s 10.0.0.5 -j DROP"
+check_count 2
+
+# Batch mode with iptables-restore: a save and a restore per family
+printf -- '-A INPUT -s 10.0.0.4/32 -j DROP\n-A FORWARD -s 10.0.0.4/32 -j DROP\n' > ${DIR}/rules.iptables
+run ${DIR}/bin/none batch <<EOF
+add - 10.0.0.1 100 5712
+add - 2001:db8::1 101 5712
+add - 10.0.0.1 102 5712
+delete - 10.0.0.3 103 5712
+delete - 10.0.0.4 104 5712
+add - 10.0.0.4 105 5712
+add - 10.0.0.6;reboot 106 5712
+drop - 10.0.0.7 107 5712
+EOF
+check calls "iptables-save -t filter"
+check calls "iptables-restore --noflush"
+check calls "ip6tables-save -t filter"
+check calls "ip6tables-restore --noflush"
+check_count 4
+check input.iptables-restore "-I INPUT -s 10.0.0.1 -j DROP"
+check input.iptables-restore "-I FORWARD -s 10.0.0.1 -j DROP"
+check input.iptables-restore "-D INPUT -s 10.0.0.4/32 -j DROP"
+check input.iptables-restore "-D FORWARD -s 10.0.0.4/32 -j DROP"
+check input.iptables-restore "-I INPUT -s 10.0.0.4 -j DROP"
+check input.iptables-restore "COMMIT"
+check input.ip6tables-restore "-I INPUT -s 2001:db8::1 -j DROP"
+check_not input.iptables-restore "10.0.0.3"
+check_not input.iptables-restore "10.0.0.6"
+check_not input.iptables-restore "10.0.0.7"
+if [ "`grep -c 10.0.0.1 ${DIR}/input.iptables-restore`" != "2" ]; then
+    echo "FAIL: 10.0.0.1 added twice"
+    FAILED=1
+fi
+check_not logs/active-responses.log "invalid IP: '10.0.0.1'"
+if ! grep -qF "invalid IP: '10.0.0.6;reboot'" ${DIR}/logs/active-responses.log; then
+    echo "FAIL: invalid IP not logged"
+    FAILED=1
+fi
+
+# Batch mode with ipset: a restore, and the rules matching the sets
+run ${DIR}/bin/ipset batch <<EOF
+add - 10.0.0.1 100 5712
+delete - 10.0.0.4 104 5712
+EOF
+check calls "ipset restore -exist"
+check calls "iptables -I INPUT -m set --match-set ossec-drop src -j DROP"
+check calls "iptables -I FORWARD -m set --match-set ossec-drop src -j DROP"
+check input.ipset "create ossec-drop hash:net family inet"
+check input.ipset "add ossec-drop 10.0.0.1"
+check input.ipset "del ossec-drop 10.0.0.4"
+check_not calls "ip6tables"
+check_not calls "iptables-restore"
+
+if [ "${FAILED}" != "0" ]; then
+    echo "firewall-drop.sh tests failed"
+    exit 1
+fi
+
+echo "firewall-drop.sh tests passed"
+exit 0
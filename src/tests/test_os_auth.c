@@ -0,0 +1,223 @@
+/* Copyright (C) 2014 Trend Micro Inc.
+ * All rights reserved.
+ *
+ * This program is a free software; you can redistribute it
+ * and/or modify it under the terms of the GNU General Public
+ * License (version 2) as published by the FSF - Free Software
+ * Foundation
+ */
+
+#include <check.h>
+#include <stdlib.h>
+
+#include "../headers/shared.h"
+
+/* The keys of ossec-authd, with their static functions, on a
+ * temporary client.keys
+ */
+static char keys_path[] = "/tmp/test_authkeys-XXXXXX";
+
+#undef KEYSFILE_PATH
+#define KEYSFILE_PATH keys_path
+
+#include "../os_auth/auth_keys.c"
+
+Suite *test_suite(void);
+
+
+#ifdef LIBOPENSSL_ENABLED
+/* Write client.keys and index it, starting the writer the first time */
+static void authkeys_start(const char *data)
+{
+    static int started = 0;
+    char *copy;
+    FILE *fp;
+
+    ck_assert_ptr_ne((fp = fopen(keys_path, "w")), NULL);
+    fputs(data, fp);
+    fclose(fp);
+
+    if (!started) {
+        ck_assert_int_eq(AuthKeys_Init(), 0);
+        started = 1;
+        return;
+    }
+
+    os_strdup(data, copy);
+    pthread_mutex_lock(&auth_mutex);
+    ck_assert_int_eq(auth_load(copy, strlen(copy)), 0);
+    pthread_mutex_unlock(&auth_mutex);
+}
+
+/* Key of a new agent, checking the start of its line */
+static void authkeys_add(const char *name, const char *line)
+{
+    char key[OS_SIZE_2048 + 1];
+
+    ck_assert_int_eq(AuthKeys_Add(name, NULL, key, sizeof(key)), 0);
+    ck_assert_int_eq(strncmp(key, line, strlen(line)), 0);
+}
+
+/* A key queued to be written */
+static auth_entry *authkeys_queue(const char *id, const char *name)
+{
+    auth_entry *entry;
+
+    os_calloc(1, sizeof(auth_entry), entry);
+    snprintf(entry->id, sizeof(entry->id), "%s", id);
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
+    snprintf(entry->line, sizeof(entry->line), "%s %s any key", id, name);
+
+    auth_index(entry->line);
+    *auth_last = entry;
+    auth_last = &entry->next;
+
+    return (entry);
+}
+#endif
+
+/* The ids in use (removed agents too) are skipped, and the names in
+ * use get a number
+ */
+START_TEST(test_authkeys_add)
+{
+#ifdef LIBOPENSSL_ENABLED
+    char key[OS_SIZE_2048 + 1];
+    char buf[OS_SIZE_256 + 1];
+    char *data;
+    size_t len = 0;
+    int i;
+
+    authkeys_start("1024 agent1 any key\n"
+                   "1025 #*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#* removed\n"
+                   "1027 agent3 10.0.0.3 key\n");
+    ck_assert_uint_eq(auth_agents, 2);
+
+    authkeys_add("new", "1026 new any ");
+    authkeys_add("agent1", "1028 agent12 any ");
+    authkeys_add("agent1", "1029 agent13 any ");
+
+    /* Written to the file */
+    data = auth_read(&len);
+    ck_assert_ptr_ne(data, NULL);
+    ck_assert_ptr_ne(strstr(data, "\n1026 new any "), NULL);
+    ck_assert_ptr_ne(strstr(data, "\n1029 agent13 any "), NULL);
+    free(data);
+
+    /* name, name2... name256 in use */
+    os_calloc(300 * 32, sizeof(char), data);
+    len = (size_t)sprintf(data, "2000 dup any key\n");
+    for (i = 2; i <= 256; i++) {
+        len += (size_t)sprintf(data + len, "%d dup%d any key\n", 2000 + i, i);
+    }
+    authkeys_start(data);
+    free(data);
+
+    ck_assert_int_eq(AuthKeys_Add("dup", NULL, key, sizeof(key)), AUTH_DUPLICATED);
+    snprintf(buf, sizeof(buf), "%d dup257 any ", (int)auth_next_id);
+    authkeys_add("dup257", buf);
+#endif
+}
+END_TEST
+
+/* The last id is given, and then there are no more */
+START_TEST(test_authkeys_full)
+{
+#ifdef LIBOPENSSL_ENABLED
+    char key[OS_SIZE_2048 + 1];
+
+    authkeys_start("99997 agent1 any key\n"
+                   "99998 #*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#*#* removed\n");
+
+    pthread_mutex_lock(&auth_mutex);
+    auth_next_id = 99997;
+    pthread_mutex_unlock(&auth_mutex);
+
+    authkeys_add("last", "99999 last any ");
+    ck_assert_int_eq(AuthKeys_Add("more", NULL, key, sizeof(key)), AUTH_FULL);
+#endif
+}
+END_TEST
+
+/* client.keys changed by someone else: the queued keys using an id or
+ * a name of the file fail, the rest stay queued
+ */
+START_TEST(test_authkeys_reload)
+{
+#ifdef LIBOPENSSL_ENABLED
+    const char *file = "3000 agent1 any key\n";
+    const char *changed = "3000 agent1 any key\n"
+                          "3001 other any key\n"
+                          "3010 taken any key\n";
+    auth_entry *same_id;
+    auth_entry *same_name;
+    auth_entry *kept;
+    char *data;
+
+    os_strdup(file, data);
+    pthread_mutex_lock(&auth_mutex);
+    ck_assert_int_eq(auth_load(data, strlen(data)), 0);
+
+    same_id = authkeys_queue("3001", "agent2");
+    same_name = authkeys_queue("3002", "taken");
+    kept = authkeys_queue("3003", "agent4");
+    ck_assert_uint_eq(auth_agents, 4);
+
+    os_strdup(changed, data);
+    ck_assert_int_eq(auth_load(data, strlen(data)), 0);
+
+    ck_assert_int_eq(same_id->status, -1);
+    ck_assert_int_eq(same_name->status, -1);
+    ck_assert_int_eq(kept->status, 0);
+    ck_assert_ptr_eq(auth_pending, kept);
+    ck_assert_ptr_eq(auth_last, &kept->next);
+
+    ck_assert_ptr_ne(OSHash_Get(auth_ids, "3003"), NULL);
+    ck_assert_ptr_ne(OSHash_Get(auth_names, "agent4"), NULL);
+    ck_assert_ptr_eq(OSHash_Get(auth_names, "agent2"), NULL);
+    ck_assert_ptr_eq(OSHash_Get(auth_ids, "3002"), NULL);
+    ck_assert_uint_eq(auth_agents, 4);
+
+    auth_pending = NULL;
+    auth_last = &auth_pending;
+    pthread_mutex_unlock(&auth_mutex);
+
+    free(same_id);
+    free(same_name);
+    free(kept);
+#endif
+}
+END_TEST
+
+Suite *test_suite(void)
+{
+    Suite *s = suite_create("os_auth");
+
+    TCase *tc_authkeys = tcase_create("authkeys");
+    tcase_add_test(tc_authkeys, test_authkeys_add);
+    tcase_add_test(tc_authkeys, test_authkeys_full);
+    tcase_add_test(tc_authkeys, test_authkeys_reload);
+
+    suite_add_tcase(s, tc_authkeys);
+
+    return (s);
+}
+
+int main(void)
+{
+    int fd = mkstemp(keys_path);
+    Suite *s = test_suite();
+    SRunner *sr = srunner_create(s);
+
+    if (fd < 0) {
+        return (EXIT_FAILURE);
+    }
+    close(fd);
+
+    srunner_run_all(sr, CK_NORMAL);
+    int number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    unlink(keys_path);
+
+    return ((number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
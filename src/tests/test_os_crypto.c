@@ -7,14 +7,21 @@
  * Foundation
  */
 
+/* Before shared.h, which asks for the large file interfaces */
+#include "../external/zlib-1.2.8/zlib.h"
+
 #include <check.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/time.h>
 
+#include "../headers/shared.h"
+#include "../headers/sec.h"
 #include "../os_crypto/blowfish/bf_op.h"
 #include "../os_crypto/md5/md5_op.h"
 #include "../os_crypto/sha1/sha1_op.h"
 #include "../os_crypto/md5_sha1/md5_sha1_op.h"
+#include "../os_zlib/os_zlib.h"
 
 Suite *test_suite(void);
 
@@ -157,6 +164,384 @@ START_TEST(test_md5sha1cmdfile_fail)
 }
 END_TEST
 
+START_TEST(test_batchframe)
+{
+    char frame[64];
+    char *cursor;
+    char *frame_end;
+    size_t len;
+
+    len = AppendSecBatch(frame, 0, sizeof(frame), "1:a:first");
+    ck_assert_int_ne(len, 0);
+    len = AppendSecBatch(frame, len, sizeof(frame), "1:b:second\nline");
+    ck_assert_int_ne(len, 0);
+    ck_assert_str_eq(frame, BATCH_HEADER "9:1:a:first\n15:1:b:second\nline\n");
+
+    /* Does not fit */
+    ck_assert_int_eq(AppendSecBatch(frame, len, sizeof(frame),
+                                    "1:c:this event is too long for the frame"), 0);
+
+    cursor = frame + strlen(BATCH_HEADER);
+    frame_end = frame + len;
+    ck_assert_str_eq(ReadSecBatch(&cursor, frame_end), "1:a:first");
+    ck_assert_str_eq(ReadSecBatch(&cursor, frame_end), "1:b:second\nline");
+    ck_assert_ptr_eq(ReadSecBatch(&cursor, frame_end), NULL);
+}
+END_TEST
+
+START_TEST(test_batchframe_invalid)
+{
+    char frame[] = "40:1:a:truncated\n";
+    char *cursor = frame;
+
+    ck_assert_ptr_eq(ReadSecBatch(&cursor, frame + strlen(frame)), NULL);
+}
+END_TEST
+
+/* Keys for the counters table: agents "001".. and the sender counter */
+static keystore *rids_keys(unsigned int count)
+{
+    keystore *keys;
+    unsigned int i;
+    char id[16];
+
+    os_calloc(1, sizeof(keystore), keys);
+    os_calloc(count + 1, sizeof(keyentry *), keys->keyentries);
+    keys->keysize = count;
+
+    for (i = 0; i <= count; i++) {
+        os_calloc(1, sizeof(keyentry), keys->keyentries[i]);
+        snprintf(id, sizeof(id), "%03u", i + 1);
+        os_strdup(id, keys->keyentries[i]->id);
+    }
+
+    return (keys);
+}
+
+static void rids_keys_free(keystore *keys)
+{
+    unsigned int i;
+
+    for (i = 0; i <= keys->keysize; i++) {
+        free(keys->keyentries[i]->id);
+        free(keys->keyentries[i]);
+    }
+    free(keys->keyentries);
+    free(keys);
+}
+
+/* Change the first byte of a copy of the counters (found by its value) */
+static void rids_tear(const char *path, unsigned int global)
+{
+    struct stat st;
+    char *table;
+    char *value = NULL;
+    off_t i;
+    int fd;
+
+    ck_assert_int_ge((fd = open(path, O_RDWR)), 0);
+    ck_assert_int_eq(fstat(fd, &st), 0);
+    os_malloc((size_t)st.st_size, table);
+    ck_assert_int_eq(read(fd, table, (size_t)st.st_size), st.st_size);
+
+    for (i = 0; i + (off_t)sizeof(global) <= st.st_size && !value; i += 4) {
+        if (memcmp(table + i, &global, sizeof(global)) == 0) {
+            value = table + i;
+        }
+    }
+    ck_assert_ptr_ne(value, NULL);
+    value[0] ^= 0x55;
+
+    ck_assert_int_eq(pwrite(fd, table, (size_t)st.st_size, 0), st.st_size);
+    close(fd);
+    free(table);
+}
+
+/* The counters survive a restart. An update cut in the middle (a torn
+ * copy) leaves the previous counters.
+ */
+START_TEST(test_rids)
+{
+    char path[] = "/tmp/test_rids-XXXXXX";
+    keystore *keys;
+    int slot;
+
+    ck_assert_int_ge(mkstemp(path), 0);
+    OS_RidsFile(path, 3600);
+
+    keys = rids_keys(3);
+    ck_assert_int_eq(OS_RidsLoad(keys), 0);
+    ck_assert_uint_eq(keys->keyentries[1]->global, 0);
+    ck_assert_uint_eq(keys->keyentries[1]->local, 0);
+    ck_assert_int_ne(keys->keyentries[0]->slot, keys->keyentries[1]->slot);
+    ck_assert_int_ne(keys->keyentries[1]->slot, keys->keyentries[3]->slot);
+
+    slot = keys->keyentries[1]->slot;
+    OS_RidsStore(slot, 10, 20);
+    OS_RidsStore(slot, 0x5eed0001, 30);
+    OS_RidsStore(keys->keyentries[3]->slot, 7, 8);
+    rids_keys_free(keys);
+
+    /* Restart */
+    OS_RidsFile(path, 3600);
+    keys = rids_keys(3);
+    ck_assert_int_eq(OS_RidsLoad(keys), 0);
+    ck_assert_int_eq(keys->keyentries[1]->slot, slot);
+    ck_assert_uint_eq(keys->keyentries[1]->global, 0x5eed0001);
+    ck_assert_uint_eq(keys->keyentries[1]->local, 30);
+    ck_assert_uint_eq(keys->keyentries[3]->global, 7);
+    ck_assert_uint_eq(keys->keyentries[3]->local, 8);
+    rids_keys_free(keys);
+
+    /* The last update is torn: the copy before it is used */
+    OS_RidsFile(path, 3600);
+    rids_tear(path, 0x5eed0001);
+    keys = rids_keys(3);
+    ck_assert_int_eq(OS_RidsLoad(keys), 0);
+    ck_assert_uint_eq(keys->keyentries[1]->global, 10);
+    ck_assert_uint_eq(keys->keyentries[1]->local, 20);
+
+    /* The next update goes over the torn copy */
+    OS_RidsStore(keys->keyentries[1]->slot, 0x5eed0002, 40);
+    rids_keys_free(keys);
+
+    OS_RidsFile(path, 3600);
+    keys = rids_keys(3);
+    ck_assert_int_eq(OS_RidsLoad(keys), 0);
+    ck_assert_uint_eq(keys->keyentries[1]->global, 0x5eed0002);
+    ck_assert_uint_eq(keys->keyentries[1]->local, 40);
+    rids_keys_free(keys);
+
+    /* A removed agent starts again */
+    OS_RidsRemove("002");
+    OS_RidsFile(path, 3600);
+    keys = rids_keys(3);
+    ck_assert_int_eq(OS_RidsLoad(keys), 0);
+    ck_assert_uint_eq(keys->keyentries[1]->global, 0);
+    ck_assert_uint_eq(keys->keyentries[3]->global, 7);
+    rids_keys_free(keys);
+
+    OS_RidsFile(RIDS_TABLE, 0);
+    unlink(path);
+}
+END_TEST
+
+/* The table grows past its first size, keeping the counters */
+START_TEST(test_rids_grow)
+{
+    char path[] = "/tmp/test_rids-XXXXXX";
+    keystore *keys;
+    unsigned int count = 300;
+    unsigned int i;
+    int grown = 0;
+
+    ck_assert_int_ge(mkstemp(path), 0);
+    OS_RidsFile(path, 3600);
+
+    keys = rids_keys(count);
+    ck_assert_int_eq(OS_RidsLoad(keys), 0);
+    for (i = 0; i <= count; i++) {
+        OS_RidsStore(keys->keyentries[i]->slot, i, i * 2);
+        if (keys->keyentries[i]->slot >= 64) {
+            grown = 1;
+        }
+    }
+    ck_assert_int_eq(grown, 1);
+    rids_keys_free(keys);
+
+    OS_RidsFile(path, 3600);
+    keys = rids_keys(count);
+    ck_assert_int_eq(OS_RidsLoad(keys), 0);
+    for (i = 0; i <= count; i++) {
+        ck_assert_uint_eq(keys->keyentries[i]->global, i);
+        ck_assert_uint_eq(keys->keyentries[i]->local, i * 2);
+    }
+    rids_keys_free(keys);
+
+    OS_RidsFile(RIDS_TABLE, 0);
+    unlink(path);
+}
+END_TEST
+
+/* Number of messages of the secure message benchmark */
+#define BENCH_MESSAGES 20000
+
+static double bench_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (tv.tv_sec + tv.tv_usec / 1000000.0);
+}
+
+/* Micro-benchmark of the agent/manager message path (CreateSecMSG and
+ * ReadSecMSG, one core). Prints the messages per second, without and
+ * with the cached key schedule.
+ */
+static void bench_secmsg(int cached)
+{
+    const char *msg = "1:/var/log/secure:Oct 18 10:00:00 myhost sshd[1000]: "
+                      "Failed password for invalid user alice from 10.0.254.93 port 64866 ssh2";
+    keystore keys;
+    keyentry entries[2];
+    keyentry *entries_pt[2] = { &entries[0], &entries[1] };
+    os_ip ip;
+    char key[] = "5bfec3b4e25ef8a5f2a21b3b8a3b7ff8a2b8edcaa6c64a4a";
+    char id[] = "001";
+    char name[] = "agent1";
+    char encrypted[OS_MAXSTR + 1];
+    char buffer[OS_MAXSTR + 1];
+    char cleartext[OS_MAXSTR + 1];
+    size_t size = 0;
+    char *ret = NULL;
+    double start;
+    double create_secs;
+    double read_secs = 0;
+    int i;
+
+    memset(&keys, 0, sizeof(keys));
+    memset(entries, 0, sizeof(entries));
+    ck_assert_int_eq(OS_IsValidIP("127.0.0.1", &ip), 1);
+
+    entries[0].id = id;
+    entries[0].name = name;
+    entries[0].key = key;
+    entries[0].ip = &ip;
+    /* No entry in the counters table */
+    entries[0].slot = -1;
+    entries[1].slot = -1;
+    entries[0].bf_key = cached ? OS_BF_KeyInit(key) : NULL;
+    keys.keyentries = entries_pt;
+    keys.keysize = 1;
+
+    start = bench_now();
+    for (i = 0; i < BENCH_MESSAGES; i++) {
+        size = CreateSecMSG(&keys, msg, encrypted, 0);
+    }
+    create_secs = bench_now() - start;
+    ck_assert_uint_ne(size, 0);
+
+    /* Decrypt new messages (the counters must increase) */
+    entries[0].global = 0;
+    entries[0].local = 0;
+    for (i = 0; i < BENCH_MESSAGES; i++) {
+        size = CreateSecMSG(&keys, msg, encrypted, 0);
+        memcpy(buffer, encrypted, size);
+
+        start = bench_now();
+        ret = ReadSecMSG(&keys, buffer, cleartext, 0, (unsigned int)size - 1);
+        read_secs += bench_now() - start;
+
+        ck_assert_ptr_ne(ret, NULL);
+    }
+    ck_assert_str_eq(ret, msg);
+
+    printf("%s key schedule: CreateSecMSG: %.0f msg/s, ReadSecMSG: %.0f msg/s (%d messages)\n",
+           cached ? "Cached" : "Per-message", BENCH_MESSAGES / create_secs,
+           BENCH_MESSAGES / read_secs, BENCH_MESSAGES);
+
+    OS_BF_KeyFree(entries[0].bf_key);
+    free(ip.ip);
+}
+
+START_TEST(test_bench_secmsg)
+{
+    bench_secmsg(0);
+    bench_secmsg(1);
+}
+END_TEST
+
+/* Compression benchmark: one message of each kind (syslog, dpkg and
+ * syscheck lines), made different by the counters
+ */
+static int bench_message(char *msg, size_t size, int i)
+{
+    switch (i % 3) {
+        case 0:
+            return (snprintf(msg, size, "%05d%010d:%04d:1:/var/log/auth.log:Oct 18 10:%02d:%02d "
+                             "myhost sshd[%d]: Failed password for invalid user user%d from "
+                             "10.0.%d.%d port %d ssh2", i % 100000, i, i % 10000, i / 60 % 60,
+                             i % 60, 1000 + i % 30000, i % 500, i / 256 % 256, i % 256,
+                             1024 + i % 60000));
+        case 1:
+            return (snprintf(msg, size, "%05d%010d:%04d:1:/var/log/dpkg.log:2026-10-18 10:%02d:%02d "
+                             "status installed libpackage%d:amd64 1.%d.%d-%dubuntu%d",
+                             i % 100000, i, i % 10000, i / 60 % 60, i % 60, i % 700, i % 13,
+                             i % 31, i % 7, i % 3));
+        default:
+            return (snprintf(msg, size, "%05d%010d:%04d:8:syscheck:%d:33188:0:0:%08x%08x%08x%08x:"
+                             "%08x%08x%08x%08x%08x /etc/app%d/config%d.conf", i % 100000, i,
+                             i % 10000, 1000 + i % 90000, i * 2654435761U, i * 40503U,
+                             i * 2246822519U, i * 3266489917U, i * 668265263U, i * 374761393U,
+                             i * 2654435761U, i * 40503U, i * 97U, i % 50, i % 20));
+    }
+}
+
+/* Micro-benchmark of the message compression (one core). Prints the
+ * time per message and the compressed size for compress2 at level 9
+ * with a new state each time (as it was done before), for the reused
+ * deflate state, and for the reused state with the preset dictionary.
+ */
+START_TEST(test_bench_compress)
+{
+    static const char *names[] = {"compress2 level 9 (old)", "persistent state, level 6",
+                                  "persistent + dictionary"
+                                 };
+    char msg[OS_MAXSTR + 1];
+    char compressed[OS_MAXSTR + 1];
+    char uncompressed[OS_MAXSTR + 1];
+    unsigned long in_bytes = 0;
+    unsigned long out_bytes;
+    unsigned long size;
+    uLongf dest_size;
+    double start;
+    double secs;
+    int mode;
+    int len;
+    int i;
+
+    for (mode = 0; mode < 3; mode++) {
+        os_zlib_setlevel(6);
+        OS_SecDictionary(mode == 2);
+        in_bytes = 0;
+        out_bytes = 0;
+        secs = 0;
+
+        for (i = 0; i < BENCH_MESSAGES; i++) {
+            len = bench_message(msg, sizeof(msg), i);
+            in_bytes += (unsigned long)len;
+
+            start = bench_now();
+            if (mode == 0) {
+                dest_size = OS_MAXSTR;
+                ck_assert_int_eq(compress2((Bytef *)compressed, &dest_size, (const Bytef *)msg,
+                                           (uLong)len, Z_BEST_COMPRESSION), Z_OK);
+                size = dest_size;
+            } else {
+                size = os_zlib_compress(msg, compressed, (unsigned long)len, OS_MAXSTR);
+            }
+            secs += bench_now() - start;
+
+            ck_assert_uint_ne(size, 0);
+            out_bytes += size;
+
+            /* Every message must come back the same */
+            if (i % 100 == 0) {
+                size = os_zlib_uncompress(compressed, uncompressed, size, OS_MAXSTR);
+                ck_assert_uint_ne(size, 0);
+                ck_assert_str_eq(uncompressed, msg);
+            }
+        }
+
+        printf("%s: %.1f us/msg, %.1f%% of the input size (%d messages)\n", names[mode],
+               secs * 1000000.0 / BENCH_MESSAGES, out_bytes * 100.0 / in_bytes,
+               BENCH_MESSAGES);
+    }
+
+    OS_SecDictionary(0);
+}
+END_TEST
+
 Suite *test_suite(void)
 {
     Suite *s = suite_create("os_crypto");
@@ -179,10 +564,26 @@ Suite *test_suite(void)
     tcase_add_test(tc_md5sha1, test_md5sha1cmdfile_fail);
     tcase_set_timeout(tc_md5sha1, 7);
 
+    TCase *tc_batch = tcase_create("batch");
+    tcase_add_test(tc_batch, test_batchframe);
+    tcase_add_test(tc_batch, test_batchframe_invalid);
+
+    TCase *tc_rids = tcase_create("rids");
+    tcase_add_test(tc_rids, test_rids);
+    tcase_add_test(tc_rids, test_rids_grow);
+
     suite_add_tcase(s, tc_blowfish);
     suite_add_tcase(s, tc_md5);
     suite_add_tcase(s, tc_sha1);
     suite_add_tcase(s, tc_md5sha1);
+    suite_add_tcase(s, tc_batch);
+    suite_add_tcase(s, tc_rids);
+
+    TCase *tc_bench = tcase_create("benchmark");
+    tcase_add_test(tc_bench, test_bench_secmsg);
+    tcase_add_test(tc_bench, test_bench_compress);
+    tcase_set_timeout(tc_bench, 60);
+    suite_add_tcase(s, tc_bench);
 
     return (s);
 }
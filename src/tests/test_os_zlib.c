@@ -119,6 +119,48 @@ START_TEST(test_failuncompress4)
 }
 END_TEST
 
+START_TEST(test_dictionary)
+{
+    const char *dict = "Hello World!";
+    char buffer[BUFFER_LENGTH];
+    char buffer2[BUFFER_LENGTH];
+    unsigned long int i1;
+    unsigned long int i2;
+
+    /* Compressed with the dictionary */
+    os_zlib_setdict(dict, strlen(dict), 1);
+    i1 = os_zlib_compress(TEST_STRING_1, buffer, strlen(TEST_STRING_1), BUFFER_LENGTH);
+    ck_assert_uint_ne(i1, 0);
+
+    i2 = os_zlib_uncompress(buffer, buffer2, i1, BUFFER_LENGTH);
+    ck_assert_uint_ne(i2, 0);
+    ck_assert_str_eq(buffer2, TEST_STRING_1);
+
+    /* The receiver does not know it */
+    os_zlib_setdict(NULL, 0, 0);
+    i2 = os_zlib_uncompress(buffer, buffer2, i1, BUFFER_LENGTH);
+    ck_assert_uint_eq(i2, 0);
+}
+END_TEST
+
+START_TEST(test_level)
+{
+    char buffer[BUFFER_LENGTH];
+    char buffer2[BUFFER_LENGTH];
+    unsigned long int i1;
+    unsigned long int i2;
+
+    os_zlib_setlevel(1);
+    i1 = os_zlib_compress(TEST_STRING_2, buffer, strlen(TEST_STRING_2), BUFFER_LENGTH);
+    ck_assert_uint_ne(i1, 0);
+
+    i2 = os_zlib_uncompress(buffer, buffer2, i1, BUFFER_LENGTH);
+    ck_assert_uint_ne(i2, 0);
+    ck_assert_str_eq(buffer2, TEST_STRING_2);
+    os_zlib_setlevel(9);
+}
+END_TEST
+
 
 Suite *test_suite(void)
 {
@@ -135,6 +177,8 @@ Suite *test_suite(void)
     tcase_add_test(tc_core, test_failuncompress2);
     tcase_add_test(tc_core, test_failuncompress3);
     tcase_add_test(tc_core, test_failuncompress4);
+    tcase_add_test(tc_core, test_dictionary);
+    tcase_add_test(tc_core, test_level);
     suite_add_tcase(s, tc_core);
 
     return (s);
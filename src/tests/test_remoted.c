@@ -0,0 +1,162 @@
+/* Copyright (C) 2014 Trend Micro Inc.
+ * All rights reserved.
+ *
+ * This program is a free software; you can redistribute it
+ * and/or modify it under the terms of the GNU General Public
+ * License (version 2) as published by the FSF - Free Software
+ * Foundation
+ */
+
+#include <check.h>
+#include <stdlib.h>
+
+#include "../headers/shared.h"
+
+/* The active response forwarder of ossec-remoted, with its static
+ * functions, sending to fake agents
+ */
+#include "../remoted/ar-forward.c"
+
+remoted logr;
+keystore keys;
+
+/* Results of status_ar and datagrams send_msg_batch gets out */
+static int ar_results[8];
+static int batch_sent;
+
+Suite *test_suite(void);
+
+
+void key_rdlock()
+{
+}
+
+void key_unlock()
+{
+}
+
+int send_msg_batch(__attribute__((unused)) int sock, __attribute__((unused)) const unsigned int *agentids,
+                   unsigned int count, __attribute__((unused)) const char *msg)
+{
+    return (batch_sent < (int)count ? batch_sent : (int)count);
+}
+
+void status_ar(unsigned int agentid, int result)
+{
+    ar_results[agentid] = result;
+}
+
+/* Take the queued responses out. Returns how many there were */
+static int ar_drain(void)
+{
+    ar_job *job;
+    int count = 0;
+
+    while ((job = ar_first)) {
+        ar_first = job->next_job;
+        OSHash_Delete(ar_inflight, job->key);
+        free(job);
+        count++;
+    }
+    ar_last = &ar_first;
+
+    return (count);
+}
+
+/* Alerts differing only in their time and alert id are the same response */
+START_TEST(test_ar_dedup)
+{
+    const char *alert1 = "#!-execd firewall-drop600 - 10.0.0.1 1400000000.1234 5712 (a) 10.0.0.5->/var/log/secure -";
+    const char *alert2 = "#!-execd firewall-drop600 - 10.0.0.1 1400000001.5678 5712 (a) 10.0.0.5->/var/log/secure -";
+    const char *other_ip = "#!-execd firewall-drop600 - 10.0.0.2 1400000001.5678 5712 (a) 10.0.0.5->/var/log/secure -";
+    const char *other_user = "#!-execd disable-account0 root 10.0.0.1 1400000001.5678 5712 (a) 10.0.0.5->/var/log/secure -";
+    const char *control = "#!-firewall-drop600 - 10.0.0.1 1400000001.5678 5712 (a) 10.0.0.5->/var/log/secure -";
+    char key[OS_SIZE_2048 + 1];
+
+    ar_key(key, sizeof(key), "001", alert1);
+    ck_assert_str_eq(key, "001 #!-execd firewall-drop600 - 10.0.0.1");
+    ar_key(key, sizeof(key), "", "#!-restart-ossec0");
+    ck_assert_str_eq(key, "* #!-restart-ossec0");
+
+    ck_assert_ptr_ne((ar_inflight = OSHash_Create()), NULL);
+    ar_dropped = 0;
+
+    ar_queue("001", alert1);
+    ar_queue("001", alert2);
+    ck_assert_uint_eq(ar_dropped, 1);
+    ck_assert_str_eq(ar_first->msg, alert1);
+
+    ar_queue("002", alert2);
+    ar_queue("001", other_ip);
+    ar_queue("001", other_user);
+    ar_queue("001", control);
+    ck_assert_uint_eq(ar_dropped, 1);
+
+    ck_assert_int_eq(ar_drain(), 5);
+
+    /* Sent: the next alert is a new response */
+    ar_queue("001", alert2);
+    ck_assert_uint_eq(ar_dropped, 1);
+    ck_assert_int_eq(ar_drain(), 1);
+}
+END_TEST
+
+/* Only the agents the batch got to are accounted as sent */
+START_TEST(test_ar_send_failed)
+{
+    keyentry entries[4];
+    keyentry *entry_list[4];
+    ar_job job;
+    int i;
+
+    memset(entries, 0, sizeof(entries));
+    for (i = 0; i < 4; i++) {
+        entries[i].rcvd = i == 1 ? 0 : time(0);
+        entry_list[i] = &entries[i];
+        ar_results[i] = 2;
+    }
+    keys.keyentries = entry_list;
+    keys.keysize = 4;
+
+    memset(&job, 0, sizeof(job));
+    job.total = 4;
+    batch_sent = 1;
+
+    ar_send(&job, 0, 4);
+
+    ck_assert_uint_eq(job.sent, 1);
+    ck_assert_uint_eq(job.skipped, 1);
+    ck_assert_uint_eq(job.failed, 2);
+    ck_assert_int_eq(ar_results[0], AR_SENT);
+    ck_assert_int_eq(ar_results[1], AR_SKIPPED);
+    ck_assert_int_eq(ar_results[2], AR_FAILED);
+    ck_assert_int_eq(ar_results[3], AR_FAILED);
+
+    keys.keyentries = NULL;
+    keys.keysize = 0;
+}
+END_TEST
+
+Suite *test_suite(void)
+{
+    Suite *s = suite_create("remoted");
+
+    TCase *tc_ar = tcase_create("ar");
+    tcase_add_test(tc_ar, test_ar_dedup);
+    tcase_add_test(tc_ar, test_ar_send_failed);
+
+    suite_add_tcase(s, tc_ar);
+
+    return (s);
+}
+
+int main(void)
+{
+    Suite *s = test_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    int number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return ((number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -9,7 +9,10 @@
 
 #include <check.h>
 #include <stdlib.h>
+#include <sys/uio.h>
+#include <pthread.h>
 
+#include "../headers/shared.h"
 #include "../headers/custom_output_search.h"
 
 Suite *test_suite(void);
@@ -42,6 +45,371 @@ START_TEST(test_searchAndReplace)
 }
 END_TEST
 
+START_TEST(test_hash64)
+{
+    ck_assert(OSHash_Hash64("", 0, OS_HASH64_INIT) == 0xcbf29ce484222325ULL);
+    ck_assert(OSHash_Hash64("a", 1, OS_HASH64_INIT) == 0xaf63dc4c8601ec8cULL);
+    ck_assert(OSHash_Hash64("foobar", 6, OS_HASH64_INIT) == 0x85944171f73967e8ULL);
+
+    /* Chained hashes must match the hash of the whole buffer */
+    ck_assert(OSHash_Hash64("bar", 3, OSHash_Hash64("foo", 3, OS_HASH64_INIT)) ==
+              OSHash_Hash64("foobar", 6, OS_HASH64_INIT));
+}
+END_TEST
+
+/* The compiled lists must give the same answers as OS_IPFoundList */
+START_TEST(test_iptree)
+{
+    const char *lists[][5] = {
+        {"10.0.0.0/8", "192.168.1.5", "!10.1.0.0/16", NULL},
+        {"!192.168.0.0/16", "192.168.1.0/24", NULL},
+        {"192.168.1.0/24", "!192.168.0.0/16", NULL},
+        {"any", NULL},
+        {"10.2.3.4", "10.2.3.0/24", "10.0.0.0/8", "0.0.0.0/0", NULL},
+        {NULL}
+    };
+    const char *ips[] = {
+        "10.0.0.1", "10.1.2.3", "10.2.3.4", "10.2.3.5", "192.168.1.5",
+        "192.168.1.6", "192.168.2.1", "172.16.0.1", "255.255.255.255",
+        "1.2.3.4", NULL
+    };
+    int i;
+    int j;
+
+    for (i = 0; lists[i][0]; i++) {
+        os_ip *entries[5];
+        os_iptree *tree;
+
+        memset(entries, 0, sizeof(entries));
+        for (j = 0; lists[i][j]; j++) {
+            char ip[IPSIZE + 1];
+
+            strncpy(ip, lists[i][j], IPSIZE);
+            ip[IPSIZE] = '\0';
+            os_calloc(1, sizeof(os_ip), entries[j]);
+            ck_assert_int_ne(OS_IsValidIP(ip, entries[j]), 0);
+        }
+
+        tree = OS_IPTreeCompile(entries);
+        ck_assert_ptr_ne(tree, NULL);
+
+        for (j = 0; ips[j]; j++) {
+            ck_assert_msg(OS_IPTreeFound(tree, inet_addr(ips[j])) ==
+                          OS_IPFoundList(ips[j], entries),
+                          "list %d, ip %s", i, ips[j]);
+        }
+
+        OS_IPTreeFree(tree);
+        for (j = 0; entries[j]; j++) {
+            free(entries[j]->ip);
+            free(entries[j]);
+        }
+    }
+}
+END_TEST
+
+/* Messages must come out of the shared memory ring in order, through
+ * wrap-arounds, and writers must see it full
+ */
+START_TEST(test_mqshm)
+{
+#ifdef MQ_SHM_ENABLED
+    char path[] = "/tmp/test_mqshm-XXXXXX";
+    char shm_path[64];
+    char msg[OS_MAXSTR + 1];
+    char expected[OS_MAXSTR + 1];
+    mq_shm_status status;
+    struct iovec iov;
+    int reader;
+    int writer;
+    int sent = 0;
+    int small = 0;
+    int i;
+
+    ck_assert_int_ge(mkstemp(path), 0);
+    unlink(path);
+    snprintf(shm_path, sizeof(shm_path), "%s.shm", path);
+
+    ck_assert_int_ge((reader = StartMQ(path, READ)), 0);
+    ck_assert_int_eq(MQ_ShmCreate(reader, path, 65536), 0);
+    ck_assert_int_ge((writer = StartMQ(path, WRITE)), 0);
+    ck_assert_int_eq(MQ_ShmAttached(writer), 1);
+
+    /* Several times the size of the ring */
+    for (i = 0; i < 2000; i++) {
+        snprintf(expected, sizeof(expected), "event number %d", i);
+        ck_assert_int_eq(SendMSG(writer, expected, "location", LOCALFILE_MQ), 0);
+        snprintf(expected, sizeof(expected), "1:location:event number %d", i);
+        ck_assert_int_eq(RecvMSG(reader, msg, OS_MAXSTR), (int)strlen(expected) + 1);
+        ck_assert_str_eq(msg, expected);
+    }
+
+    /* Fill it up without blocking */
+    memset(expected, 'a', 1000);
+    expected[1000] = '\0';
+    iov.iov_base = expected;
+    iov.iov_len = 1000;
+    while (MQ_ShmSend(writer, &iov, 1, 0) == 0) {
+        sent++;
+    }
+    ck_assert_int_gt(sent, 50);
+    while (TrySendMSG(writer, "event", "location", LOCALFILE_MQ) == 0) {
+        small++;
+    }
+
+    ck_assert_int_eq(MQ_ShmStatus(reader, &status), 0);
+    ck_assert_uint_eq(status.messages, (unsigned int)(sent + small));
+    ck_assert_uint_ge(status.full, 2);
+    ck_assert_int_ge(MQ_ShmLoad(reader), 95);
+    ck_assert_int_ge(MQ_ShmLoad(writer), 95);
+
+    for (i = 0; i < sent; i++) {
+        ck_assert_int_eq(RecvMSG(reader, msg, OS_MAXSTR), 1001);
+        ck_assert_str_eq(msg, expected);
+    }
+    for (i = 0; i < small; i++) {
+        ck_assert_int_gt(RecvMSG(reader, msg, OS_MAXSTR), 0);
+        ck_assert_str_eq(msg, "1:location:event");
+    }
+    ck_assert_int_eq(MQ_ShmLoad(reader), 0);
+
+    /* Messages through the socket still arrive */
+    MQ_ShmDetach(writer);
+    ck_assert_int_eq(SendMSG(writer, "socket event", "location", LOCALFILE_MQ), 0);
+    ck_assert_int_gt(RecvMSG(reader, msg, OS_MAXSTR), 0);
+    ck_assert_str_eq(msg, "1:location:socket event");
+
+    MQ_ShmDetach(reader);
+    close(writer);
+    close(reader);
+    unlink(path);
+    unlink(shm_path);
+#endif
+}
+END_TEST
+
+#ifdef MQ_SHM_ENABLED
+#define MQSHM_THREADS   64
+#define MQSHM_MESSAGES  200
+
+/* Writer thread: its own queue socket, like a remoted receiver */
+static void *mqshm_writer(void *arg)
+{
+    const char *path = (const char *)arg;
+    long ok = 0;
+    int queue;
+    int i;
+
+    if ((queue = StartMQ(path, WRITE)) < 0) {
+        return ((void *)0);
+    }
+
+    if (MQ_ShmAttached(queue) && MQ_ShmLoad(queue) >= 0) {
+        ok = 1;
+        for (i = 0; i < MQSHM_MESSAGES; i++) {
+            if (SendMSG(queue, "event", "location", LOCALFILE_MQ) != 0) {
+                ok = 0;
+            }
+        }
+    }
+
+    MQ_ShmDetach(queue);
+    close(queue);
+    return ((void *)ok);
+}
+#endif
+
+/* Many threads attach, write and detach at the same time */
+START_TEST(test_mqshm_threads)
+{
+#ifdef MQ_SHM_ENABLED
+    char path[] = "/tmp/test_mqshm-XXXXXX";
+    char shm_path[64];
+    char msg[OS_MAXSTR + 1];
+    pthread_t threads[MQSHM_THREADS];
+    void *ok;
+    int reader;
+    int i;
+
+    ck_assert_int_ge(mkstemp(path), 0);
+    unlink(path);
+    snprintf(shm_path, sizeof(shm_path), "%s.shm", path);
+
+    ck_assert_int_ge((reader = StartMQ(path, READ)), 0);
+    ck_assert_int_eq(MQ_ShmCreate(reader, path, 65536), 0);
+
+    for (i = 0; i < MQSHM_THREADS; i++) {
+        ck_assert_int_eq(pthread_create(&threads[i], NULL, mqshm_writer, path), 0);
+    }
+
+    for (i = 0; i < MQSHM_THREADS * MQSHM_MESSAGES; i++) {
+        ck_assert_int_gt(RecvMSG(reader, msg, OS_MAXSTR), 0);
+        ck_assert_str_eq(msg, "1:location:event");
+    }
+
+    for (i = 0; i < MQSHM_THREADS; i++) {
+        ck_assert_int_eq(pthread_join(threads[i], &ok), 0);
+        ck_assert_ptr_ne(ok, NULL);
+    }
+    ck_assert_int_eq(MQ_ShmLoad(reader), 0);
+
+    MQ_ShmDetach(reader);
+    close(reader);
+    unlink(path);
+    unlink(shm_path);
+#endif
+}
+END_TEST
+
+START_TEST(test_bucket)
+{
+    mq_bucket bucket;
+    int i;
+
+    memset(&bucket, 0, sizeof(bucket));
+
+    for (i = 0; i < 10; i++) {
+        ck_assert_int_eq(MQ_BucketTake(&bucket, 10, 100), 1);
+    }
+    ck_assert_int_eq(MQ_BucketTake(&bucket, 10, 100), 0);
+
+    /* Refilled the next second, without saving the unused tokens */
+    ck_assert_int_eq(MQ_BucketTake(&bucket, 10, 101), 1);
+    bucket.tokens = 0;
+    ck_assert_int_eq(MQ_BucketTake(&bucket, 10, 105), 1);
+    ck_assert_uint_eq(bucket.tokens, 9);
+}
+END_TEST
+
+/* Threads adding to a counter: more than OS_METRIC_THREADS, the last
+ * ones sharing a cell
+ */
+#define METRIC_THREADS  (OS_METRIC_THREADS + 16)
+#define METRIC_ADDS     10000
+
+static os_metric *metric_threads_total;
+
+static void *metric_adder(__attribute__((unused)) void *arg)
+{
+    int i;
+
+    for (i = 0; i < METRIC_ADDS; i++) {
+        OS_MetricAdd(metric_threads_total, 1);
+    }
+
+    return (NULL);
+}
+
+/* Text of OS_MetricsPrint */
+static char *metrics_text(void)
+{
+    char *text;
+    long size;
+    FILE *fp;
+
+    ck_assert_ptr_ne((fp = tmpfile()), NULL);
+    OS_MetricsPrint(fp);
+    ck_assert_int_gt((size = ftell(fp)), 0);
+    rewind(fp);
+
+    os_calloc((size_t)size + 2, sizeof(char), text);
+    text[0] = '\n';
+    ck_assert_uint_eq(fread(text + 1, 1, (size_t)size, fp), (size_t)size);
+    fclose(fp);
+
+    return (text);
+}
+
+/* A whole line of the metrics */
+static void metrics_line(const char *text, const char *line)
+{
+    char buf[OS_SIZE_256 + 1];
+
+    snprintf(buf, sizeof(buf), "\n%s\n", line);
+    ck_assert_msg(strstr(text, buf) != NULL, "Missing metric line: %s", line);
+}
+
+START_TEST(test_metric_threads)
+{
+    pthread_t threads[METRIC_THREADS];
+    char line[OS_SIZE_256 + 1];
+    char *text;
+    int i;
+
+    ck_assert_ptr_ne((metric_threads_total = OS_MetricCounter("test_threads_total", "Adds.")), NULL);
+
+    for (i = 0; i < METRIC_THREADS; i++) {
+        ck_assert_int_eq(pthread_create(&threads[i], NULL, metric_adder, NULL), 0);
+    }
+
+    for (i = 0; i < METRIC_THREADS; i++) {
+        ck_assert_int_eq(pthread_join(threads[i], NULL), 0);
+    }
+
+    text = metrics_text();
+    snprintf(line, sizeof(line), "ossec_test_threads_total %d", METRIC_THREADS * METRIC_ADDS);
+    metrics_line(text, line);
+    free(text);
+}
+END_TEST
+
+/* A value goes to the first bucket not below it, past 2^22 to +Inf only */
+START_TEST(test_metric_buckets)
+{
+    const unsigned long values[] = {0, 1, 2, 3, 1UL << 22, (1UL << 22) + 1, 1UL << 30};
+    os_metric *metric;
+    char *text;
+    size_t i;
+
+    ck_assert_ptr_ne((metric = OS_MetricHistogram("test_buckets", "Buckets.")), NULL);
+
+    for (i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        OS_MetricObserve(metric, values[i]);
+    }
+
+    text = metrics_text();
+    metrics_line(text, "ossec_test_buckets_bucket{le=\"1\"} 2");
+    metrics_line(text, "ossec_test_buckets_bucket{le=\"2\"} 3");
+    metrics_line(text, "ossec_test_buckets_bucket{le=\"4\"} 4");
+    metrics_line(text, "ossec_test_buckets_bucket{le=\"2097152\"} 4");
+    metrics_line(text, "ossec_test_buckets_bucket{le=\"4194304\"} 5");
+    metrics_line(text, "ossec_test_buckets_bucket{le=\"+Inf\"} 7");
+    metrics_line(text, "ossec_test_buckets_sum 1082130439");
+    metrics_line(text, "ossec_test_buckets_count 7");
+    ck_assert_ptr_eq(strstr(text, "ossec_test_buckets_bucket{le=\"8388608\"}"), NULL);
+    free(text);
+}
+END_TEST
+
+/* The text format: # HELP and # TYPE before the values */
+static long metric_gauge_read(void)
+{
+    return (-5);
+}
+
+START_TEST(test_metric_print)
+{
+    os_metric *metric;
+    char *text;
+
+    ck_assert_ptr_ne((metric = OS_MetricCounter("test_print_total", "Printed.")), NULL);
+    OS_MetricAdd(metric, 3);
+    ck_assert_ptr_ne(OS_MetricGauge("test_print_gauge", "Read.", metric_gauge_read), NULL);
+    OS_MetricAdd(NULL, 1);
+
+    text = metrics_text();
+    ck_assert_ptr_ne(strstr(text, "\n# HELP ossec_test_print_total Printed.\n"
+                            "# TYPE ossec_test_print_total counter\n"
+                            "ossec_test_print_total 3\n"), NULL);
+    ck_assert_ptr_ne(strstr(text, "\n# HELP ossec_test_print_gauge Read.\n"
+                            "# TYPE ossec_test_print_gauge gauge\n"
+                            "ossec_test_print_gauge -5\n"), NULL);
+    ck_assert_ptr_ne(strstr(text, "\n# TYPE ossec_process_start_time_seconds gauge\n"
+                            "ossec_process_start_time_seconds "), NULL);
+    free(text);
+}
+END_TEST
+
 Suite *test_suite(void)
 {
     Suite *s = suite_create("shared");
@@ -49,7 +417,30 @@ Suite *test_suite(void)
     TCase *tc_searchAndReplace = tcase_create("searchAndReplace");
     tcase_add_test(tc_searchAndReplace, test_searchAndReplace);
 
+    TCase *tc_hash64 = tcase_create("hash64");
+    tcase_add_test(tc_hash64, test_hash64);
+
+    TCase *tc_iptree = tcase_create("iptree");
+    tcase_add_test(tc_iptree, test_iptree);
+
     suite_add_tcase(s, tc_searchAndReplace);
+    suite_add_tcase(s, tc_hash64);
+    TCase *tc_mqshm = tcase_create("mqshm");
+    tcase_add_test(tc_mqshm, test_mqshm);
+    tcase_add_test(tc_mqshm, test_mqshm_threads);
+
+    suite_add_tcase(s, tc_iptree);
+    suite_add_tcase(s, tc_mqshm);
+
+    TCase *tc_bucket = tcase_create("bucket");
+    tcase_add_test(tc_bucket, test_bucket);
+    suite_add_tcase(s, tc_bucket);
+
+    TCase *tc_metrics = tcase_create("metrics");
+    tcase_add_test(tc_metrics, test_metric_threads);
+    tcase_add_test(tc_metrics, test_metric_buckets);
+    tcase_add_test(tc_metrics, test_metric_print);
+    suite_add_tcase(s, tc_metrics);
 
     return (s);
 }
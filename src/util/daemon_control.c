@@ -0,0 +1,63 @@
+/* Copyright (C) 2009 Trend Micro Inc.
+ * All right reserved.
+ *
+ * This program is a free software; you can redistribute it
+ * and/or modify it under the terms of the GNU General Public
+ * License (version 2) as published by the FSF - Free Software
+ * Foundation
+ */
+
+/* This tool sends a command to the control socket of a daemon */
+
+#include "shared.h"
+
+#undef ARGV0
+#define ARGV0 "daemon_control"
+
+/* Prototypes */
+static void helpmsg(void) __attribute__((noreturn));
+
+
+static void helpmsg()
+{
+    printf("\nOSSEC HIDS %s: Query a running daemon.\n", ARGV0);
+    printf("Usage: %s <daemon> <command>\n", ARGV0);
+    printf("\t<daemon>   Daemon name (e.g. analysisd or ossec-analysisd).\n");
+    printf("\t<command>  Command to send (e.g. metrics, profile, queue).\n\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    size_t len = 0;
+    char path[PATH_MAX + 1];
+    char command[OS_CONTROL_MAXCMD + 1];
+
+    /* Set the name */
+    OS_SetName(ARGV0);
+
+    /* User arguments */
+    if (argc < 3 || strcmp(argv[1], "-h") == 0) {
+        helpmsg();
+    }
+
+    snprintf(path, PATH_MAX, "%s/%s%s", CONTROL_DIR_PATH,
+             strncmp(argv[1], "ossec-", 6) == 0 ? "" : "ossec-", argv[1]);
+
+    /* The remaining arguments are the command */
+    command[0] = '\0';
+    for (i = 2; i < argc; i++) {
+        len += (size_t)snprintf(command + len, sizeof(command) - len, "%s%s",
+                                i > 2 ? " " : "", argv[i]);
+        if (len >= sizeof(command)) {
+            ErrorExit("%s: ERROR: Command too long.", ARGV0);
+        }
+    }
+
+    if (OS_ControlRequest(path, command, stdout) < 0) {
+        ErrorExit("%s: ERROR: Unable to query '%s': %s.", ARGV0, path, strerror(errno));
+    }
+
+    return (0);
+}